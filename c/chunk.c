@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
@@ -8,14 +9,23 @@ void initChunk(Chunk *chunk) {
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = NULL;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
   chunk->lines = NULL;
   initValueArray(&chunk->constants);
+  chunk->constantIndex = NULL;
+  chunk->constantIndexCapacity = 0;
+  chunk->cacheCount = 0;
+  chunk->cacheCapacity = 0;
+  chunk->caches = NULL;
 }
 
 void freeChunk(Chunk *chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity); // reallocate(chunk->code, sizeof(uint8_t) * (chunk->capacity), 0)
-  FREE_ARRAY(int, chunk->lines, chunk->capacity); // reallocate(chunk->lines, sizeof(int) * (chunk->capacity), 0)
+  FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
   freeValueArray(&chunk->constants);
+  freeConstantIndex(chunk);
+  FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
   initChunk(chunk);
 }
 
@@ -26,17 +36,341 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
     int oldCapacity = chunk->capacity;
     chunk->capacity = GROW_CAPACITY(oldCapacity);
     chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
   }
 
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
   chunk->count++;
+
+  // 直前の命令と同じ行なら行番号表はそのまま
+  if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) {
+    return;
+  }
+
+  if (chunk->lineCapacity < chunk->lineCount + 1) {
+    int oldCapacity = chunk->lineCapacity;
+    chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->lines = GROW_ARRAY(LineStart, chunk->lines,
+                              oldCapacity, chunk->lineCapacity);
+  }
+
+  LineStart *lineStart = &chunk->lines[chunk->lineCount++];
+  lineStart->offset = chunk->count - 1;
+  lineStart->line = line;
+}
+
+void truncateChunk(Chunk *chunk, int count) {
+  chunk->count = count;
+  while (chunk->lineCount > 0 &&
+         chunk->lines[chunk->lineCount - 1].offset >= count) {
+    chunk->lineCount--;
+  }
+}
+
+int getLine(Chunk *chunk, int offset) {
+  if (chunk->lineCount == 0) return 0;
+
+  // offset 以下で最後に始まる項目を二分探索する
+  int start = 0;
+  int end = chunk->lineCount - 1;
+  for (;;) {
+    int mid = (start + end) / 2;
+    LineStart *line = &chunk->lines[mid];
+    if (offset < line->offset) {
+      end = mid - 1;
+    } else if (mid == chunk->lineCount - 1 ||
+               offset < chunk->lines[mid + 1].offset) {
+      return line->line;
+    } else {
+      start = mid + 1;
+    }
+  }
+}
+
+// sameConstant は二つの定数が区別できないときに真を返す.
+// valuesEqual と違い, 数値はビット列で比べる (0 と -0 は別の定数, NaN 同士は同じ定数).
+static bool sameConstant(Value a, Value b) {
+#ifdef NAN_BOXING
+  return a == b;
+#else
+  if (a.type != b.type) return false;
+  if (IS_NUMBER(a)) {
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+  return valuesEqual(a, b);
+#endif
+}
+
+// constantHash は sameConstant で同じになる定数に同じ値を返す.
+static uint32_t constantHash(Value value) {
+  uint64_t bits;
+#ifdef NAN_BOXING
+  bits = value;
+#else
+  if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    memcpy(&bits, &number, sizeof(double));
+  } else if (IS_OBJ(value)) {
+    bits = (uint64_t) (uintptr_t) AS_OBJ(value);
+  } else if (IS_BOOL(value)) {
+    bits = AS_BOOL(value) ? 1 : 0;
+  } else {
+    bits = 0;
+  }
+  bits ^= (uint64_t) value.type << 56;
+#endif
+  // 下位ビットだけでは数値もポインタも偏るので上位ビットを混ぜる
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  return (uint32_t) bits;
+}
+
+// findConstant は value か空きのある constantIndex の位置を返す.
+static int *findConstant(Chunk *chunk, Value value) {
+  uint32_t mask = (uint32_t) chunk->constantIndexCapacity - 1;
+  uint32_t index = constantHash(value) & mask;
+  for (;;) {
+    int *entry = &chunk->constantIndex[index];
+    if (*entry == -1 ||
+        sameConstant(chunk->constants.values[*entry], value)) {
+      return entry;
+    }
+    index = (index + 1) & mask;
+  }
 }
 
+// growConstantIndex は constantIndex を capacity に広げ, 定数表の全要素を入れ直す.
+static void growConstantIndex(Chunk *chunk, int capacity) {
+  FREE_ARRAY(int, chunk->constantIndex, chunk->constantIndexCapacity);
+  chunk->constantIndex = ALLOCATE(int, capacity);
+  chunk->constantIndexCapacity = capacity;
+  for (int i = 0; i < capacity; i++) chunk->constantIndex[i] = -1;
+  for (int i = 0; i < chunk->constants.count; i++) {
+    *findConstant(chunk, chunk->constants.values[i]) = i;
+  }
+}
+
+void freeConstantIndex(Chunk *chunk) {
+  FREE_ARRAY(int, chunk->constantIndex, chunk->constantIndexCapacity);
+  chunk->constantIndex = NULL;
+  chunk->constantIndexCapacity = 0;
+}
+
+// addConstant は定数表に value を加え, そのインデックスを返す.
+// 同じ定数がすでにあればそれを使い回す. 文字列はインターン化されているのでポインタの比較で済む.
+// 重複の検索は constantIndex で引くので, 定数が多くても挿入ごとの手間は一定.
 int addConstant(Chunk *chunk, Value value) {
+  // 表の確保で GC が走っても value が回収されないよう先に積んでおく
   push(value);
-  writeValueArray(&chunk->constants, value);
+  // 負荷率を 1/2 以下に保つ
+  if ((chunk->constants.count + 1) * 2 > chunk->constantIndexCapacity) {
+    int capacity = chunk->constantIndexCapacity < 8
+        ? 8 : chunk->constantIndexCapacity * 2;
+    while ((chunk->constants.count + 1) * 2 > capacity) capacity *= 2;
+    growConstantIndex(chunk, capacity);
+  }
+
+  int *entry = findConstant(chunk, value);
+  if (*entry == -1) {
+    writeValueArray(&chunk->constants, value);
+    *entry = chunk->constants.count - 1;
+  }
   pop();
-  return chunk->constants.count - 1;
+  return *entry;
+}
+
+// addInlineCache は空のインラインキャッシュを一つ確保し, そのインデックスを返す.
+int addInlineCache(Chunk *chunk) {
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    int oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity,
+                               chunk->cacheCapacity);
+  }
+
+  InlineCache *cache = &chunk->caches[chunk->cacheCount];
+  for (int i = 0; i < INLINE_CACHE_SIZE; i++) {
+    cache->entries[i].shape = NULL;
+    cache->entries[i].transition = NULL;
+    cache->entries[i].slot = -1;
+    cache->entries[i].method = NIL_VAL;
+  }
+  return chunk->cacheCount++;
+}
+
+// instructionLength は offset から始まる命令のオペランドを含めたバイト数を返す.
+// OP_WIDE の場合は接頭辞と後続の命令を合わせたバイト数を返す.
+int instructionLength(Chunk *chunk, int offset) {
+  static const int lengths[] = {
+#define OPCODE(name, length) length,
+#include "opcodes.h"
+#undef OPCODE
+  };
+
+  uint8_t instruction = chunk->code[offset];
+  if (instruction == OP_WIDE) {
+    instruction = chunk->code[offset + 1];
+    if (instruction == OP_CLOSURE || instruction == OP_SHARED_CLOSURE) {
+      int constant = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+      ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+      return 4 + function->upvalueCount * 3;
+    }
+    // インデックスオペランドが 1byte 広がる
+    return 1 + lengths[instruction] + 1;
+  }
+
+  if (instruction == OP_CLOSURE || instruction == OP_SHARED_CLOSURE) {
+    ObjFunction *function =
+        AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+    return 2 + function->upvalueCount * 2;
+  }
+  return lengths[instruction];
+}
+
+// stackEffect は offset の命令を実行した後のスタックの高さの変化を返す.
+// peak には命令の実行中に一時的に積む値の最大数 (実行前の高さからの増分) を入れる.
+static int stackEffect(Chunk *chunk, int offset, int *peak) {
+  bool wide = chunk->code[offset] == OP_WIDE;
+  uint8_t instruction = chunk->code[offset + (wide ? 1 : 0)];
+  // OP_INVOKE と OP_SUPER_INVOKE の引数の数はインデックスオペランドの直後にある
+  int argCountAt = offset + (wide ? 4 : 2);
+
+  int effect;
+  switch (instruction) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_OUTER:
+    case OP_CLOSURE:
+    case OP_SHARED_CLOSURE:
+    case OP_CLASS:
+    case OP_GET_LOCAL_PROPERTY:
+    case OP_GET_LOCAL_FIELD:
+      effect = 1;
+      break;
+    case OP_BUILD_LIST:
+      effect = 1 - chunk->code[offset + 1];
+      break;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_INHERIT:
+    case OP_METHOD:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_LESS_CONSTANT_JUMP:
+    case OP_GET_INDEX:
+      effect = -1;
+      break;
+    case OP_SET_INDEX:
+      effect = -2;
+      break;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      effect = -chunk->code[offset + 1];
+      break;
+    case OP_INVOKE:
+    case OP_INVOKE_METHOD:
+      effect = -chunk->code[argCountAt];
+      break;
+    case OP_SUPER_INVOKE:
+      effect = -chunk->code[argCountAt] - 1;
+      break;
+    default:
+      effect = 0;
+      break;
+  }
+
+  // superinstruction は数値以外のオペランドのとき, 元の命令のオペランドを積み直してから処理する
+  switch (instruction) {
+    case OP_ADD_CONSTANT:
+    case OP_SUBTRACT_CONSTANT:
+    case OP_LESS_CONSTANT:
+    case OP_EQUAL_CONSTANT:
+      *peak = 1;
+      break;
+    case OP_INCREMENT_LOCAL:
+      *peak = 2;
+      break;
+    default:
+      *peak = effect > 0 ? effect : 0;
+      break;
+  }
+  return effect;
+}
+
+// jumpTarget は offset の命令がジャンプ命令ならジャンプ先を, そうでなければ -1 を返す.
+static int jumpTarget(Chunk *chunk, int offset) {
+  int end = offset + instructionLength(chunk, offset);
+  uint8_t *code = chunk->code;
+  switch (code[offset]) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+      return end + ((code[offset + 1] << 8) | code[offset + 2]);
+    case OP_LESS_CONSTANT_JUMP:
+      return end + ((code[offset + 2] << 8) | code[offset + 3]);
+    case OP_LOOP:
+      return end - ((code[offset + 1] << 8) | code[offset + 2]);
+    default:
+      return -1;
+  }
+}
+
+int maxStackHeight(Chunk *chunk, int initial) {
+  // 各命令の直前の高さ. -1 はまだ辿っていない.
+  int *heights = ALLOCATE(int, chunk->count + 1);
+  int *pending = ALLOCATE(int, chunk->count + 1);
+  int pendingCount = 0;
+  for (int i = 0; i <= chunk->count; i++) heights[i] = -1;
+
+  int max = initial;
+  heights[0] = initial;
+  pending[pendingCount++] = 0;
+  while (pendingCount > 0) {
+    // ジャンプ先から, 無条件ジャンプか return か辿り済みの命令に着くまで順に進む
+    int offset = pending[--pendingCount];
+    int height = heights[offset];
+    while (offset < chunk->count) {
+      heights[offset] = height;
+      int peak;
+      int effect = stackEffect(chunk, offset, &peak);
+      if (height + peak > max) max = height + peak;
+      height += effect;
+
+      int target = jumpTarget(chunk, offset);
+      if (target >= 0 && target <= chunk->count && heights[target] == -1) {
+        heights[target] = height;
+        pending[pendingCount++] = target;
+      }
+
+      uint8_t instruction = chunk->code[offset];
+      if (instruction == OP_JUMP || instruction == OP_LOOP ||
+          instruction == OP_RETURN) {
+        break;
+      }
+      offset += instructionLength(chunk, offset);
+      if (heights[offset] != -1) break;
+    }
+  }
+
+  FREE_ARRAY(int, heights, chunk->count + 1);
+  FREE_ARRAY(int, pending, chunk->count + 1);
+  return max;
 }
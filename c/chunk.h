@@ -4,53 +4,56 @@
 #include "common.h"
 #include "value.h"
 
+// 命令の一覧は opcodes.h で管理している.
 typedef enum {
-  OP_CONSTANT,
-  OP_NIL,
-  OP_TRUE,
-  OP_FALSE,
-  OP_POP,
-  OP_GET_LOCAL,
-  OP_SET_LOCAL,
-  OP_GET_GLOBAL,
-  OP_DEFINE_GLOBAL,
-  OP_SET_GLOBAL,
-  OP_GET_UPVALUE,
-  OP_SET_UPVALUE,
-  OP_GET_PROPERTY,
-  OP_SET_PROPERTY,
-  OP_GET_SUPER,
-  OP_EQUAL,
-  OP_GREATER,
-  OP_LESS,
-  OP_ADD,
-  OP_SUBTRACT,
-  OP_MULTIPLY,
-  OP_DIVIDE,
-  OP_NOT,
-  OP_NEGATE,
-  OP_PRINT,
-  OP_JUMP,
-  OP_JUMP_IF_FALSE,
-  OP_LOOP,
-  OP_CALL,
-  OP_INVOKE,
-  OP_SUPER_INVOKE,
-  OP_CLOSURE,
-  OP_CLOSE_UPVALUE,
-  OP_RETURN,
-  OP_CLASS,
-  OP_INHERIT,
-  OP_METHOD
+#define OPCODE(name, length) OP_##name,
+#include "opcodes.h"
+#undef OPCODE
 } OpCode;
 
+// インラインキャッシュ1つが覚えておけるレシーバのクラスの数.
+// 1 なら単相(monomorphic)キャッシュ, 2以上なら小さな多相(polymorphic)キャッシュになる.
+#define INLINE_CACHE_SIZE 4
+
+// シェイプはクラスごとに別の木になっているので, シェイプが同じならクラスも同じになる.
+// したがってシェイプだけをキーにすればフィールドとメソッドのどちらの探索結果も覚えておける.
+typedef struct {
+  ObjShape *shape;      // レシーバのシェイプ. NULL なら未使用のエントリ.
+  ObjShape *transition; // OP_SET_PROPERTY でフィールドを追加する場合の遷移先のシェイプ
+  int slot;             // フィールドのスロット番号. -1 ならメソッド.
+  Value method;         // slot が -1 のとき, クラスの methods テーブルから引いた結果
+} InlineCacheEntry;
+
+// InlineCache はプロパティアクセスやメソッド呼び出しの命令ごとに一つ割り当てられ,
+// その命令で過去に見たレシーバのシェイプとプロパティ探索の結果を覚えておく.
+// 命令はオペランドとしてキャッシュのインデックスを持つ.
+typedef struct {
+  InlineCacheEntry entries[INLINE_CACHE_SIZE];
+} InlineCache;
+
+// LineStart は行番号表の一項目. offset の命令から次の項目の offset の手前までが line 行目に当たる.
+// 同じ行の命令は続けて出力されるので, バイトごとに行番号を持つより遥かに小さく済む.
+typedef struct {
+  int offset;
+  int line;
+} LineStart;
+
 // 命令列を表す
 typedef struct {
   int count;    // 実際に使用している容量
   int capacity; // 割り当てられている容量
   uint8_t *code;
-  int *lines;
+  int lineCount;
+  int lineCapacity;
+  LineStart *lines; // 行番号表. offset の昇順に並ぶ.
   ValueArray constants;
+  // constantIndex は定数から constants のインデックスを引く開番地法のハッシュ表. 空きは -1.
+  // コンパイル中の重複排除にだけ使うので, コンパイルが終われば捨てる.
+  int *constantIndex;
+  int constantIndexCapacity;
+  int cacheCount;
+  int cacheCapacity;
+  InlineCache *caches; // この Chunk の命令が使うインラインキャッシュ
 } Chunk;
 
 void initChunk(Chunk *chunk);
@@ -62,6 +65,24 @@ void writeChunk(Chunk* chunk, uint8_t byte);
 */
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 
+// truncateChunk は count 以降の命令を取り消す.
+void truncateChunk(Chunk *chunk, int count);
+
+// getLine は offset の命令が書かれていたソースの行番号を返す.
+int getLine(Chunk *chunk, int offset);
+
 int addConstant(Chunk *chunk, Value value);
 
+// freeConstantIndex は addConstant が重複排除に使うハッシュ表を解放する.
+// 後で addConstant を呼べば表は定数表から作り直される.
+void freeConstantIndex(Chunk *chunk);
+
+int addInlineCache(Chunk *chunk);
+
+int instructionLength(Chunk *chunk, int offset);
+
+// maxStackHeight は chunk を実行する間のスタックの高さの最大値を返す. initial は実行を始める時点の高さ.
+// ジャンプ先ではどの経路から来ても高さが同じになるようにコンパイラは命令を出力する.
+int maxStackHeight(Chunk *chunk, int initial);
+
 #endif
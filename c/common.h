@@ -13,6 +13,48 @@
 #define DEBUG_LOG_GC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+
+// 文字列のハッシュ値 (32bit FNV-1a) の定数. スキャナも字句を読みながら同じ値を求める.
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+// THREADED_DISPATCH が定義されていると run() は switch ではなく
+// GCC/Clang の labels-as-values (computed goto) で命令をディスパッチする.
+// 命令ごとに間接ジャンプが分散するため分岐予測が効きやすい.
+// 非対応のコンパイラや NO_THREADED_DISPATCH 指定時は移植性のある switch 版に戻る.
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    !defined(NO_THREADED_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
+// FORCE_INLINE を付けた関数は GCC/Clang では必ずインライン展開される.
+// run() と runRegister() の両方から呼ぶ, 呼び出しの速い経路上の小さな関数に使う.
+// 呼び出し元が二つになるとコンパイラはインライン展開を諦めることがあるため.
+#if defined(__GNUC__) || defined(__clang__)
+#define FORCE_INLINE inline __attribute__((always_inline))
+#else
+#define FORCE_INLINE inline
+#endif
+
+// THREAD_LOCAL を付けた変数はスレッドごとに別の実体を持つ.
+// vm やコンパイラの状態をこれで宣言しているので, スレッドごとに独立した VM を動かせる.
+// -std=c99 には _Thread_local がないので, GCC/Clang では拡張の __thread を使う.
+#if defined(__cplusplus)
+#define THREAD_LOCAL thread_local
+#elif defined(__GNUC__) || defined(__clang__)
+#define THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+// POOL_ALLOCATOR が定義されていると reallocate() は小さな領域をサイズクラスごとのプールから確保する.
+// AddressSanitizer などで malloc/free 単位の検査をしたいときは NO_POOL_ALLOCATOR を指定する.
+#ifndef NO_POOL_ALLOCATOR
+#define POOL_ALLOCATOR
+#endif
 
 #endif
 // In the book, we show them defined, but for working on them locally,
@@ -11,10 +11,15 @@
 #include "debug.h"
 #endif
 
+// 覗き穴最適化で融合を試みる直近の命令の数
+#define PEEPHOLE_WINDOW 3
+
 // Parser はパーサーを表す.
 typedef struct {
   Token current;  // 現在読み込んでいる字句
   Token previous; // 一つ前の字句
+  TokenArray tokens; // 先に読み込んでおいたソースコード全体の字句
+  int next;          // 次に current にする tokens の位置
   bool hadError;
   bool panicMode; // エラーの雪崩を回避するためのモード
 } Parser;
@@ -50,11 +55,15 @@ typedef struct {
   Token name; // ローカル変数名
   int depth;  // ローカル変数が宣言されたブロックのスコープ深度
   bool isCaptured; // クロージャ関数にキャプチャされているか？
+  // ローカル関数の宣言なら, その関数と OP_CLOSURE の位置. スコープを抜けるときのエスケープ解析に使う.
+  ObjFunction *function;
+  int closureStart;
+  bool escapes; // 呼び出す以外の用途 (代入, 引数や戻り値など) で参照されたか
 } Local;
 
 // Upvalue はクロージャにキャプチャされた変数を表す
 typedef struct {
-  uint8_t index; // 閉包された変数のlocalsインデックスを追跡する. そうすることで、コンパイラは、囲んでいる関数内のどの変数をキャプチャする必要があるかを認識する.
+  uint16_t index; // 閉包された変数のlocalsインデックスを追跡する. そうすることで、コンパイラは、囲んでいる関数内のどの変数をキャプチャする必要があるかを認識する.
   bool isLocal;
 } Upvalue;
 
@@ -76,12 +85,26 @@ typedef struct Compiler {
   ObjFunction *function; // コンパイルする関数オブジェクトへの参照
   FunctionType type;
 
-  // ローカル変数の指定に使えるオペランドが1byteであるため,
-  // 一つのブロックに登録できるローカル変数は UINT8_COUNT 個まで, という制限が生まれる.
-  Local locals[UINT8_COUNT];     // どのスタックスロットがどのローカル変数やテンポラリに関連付けられているかを追跡する.
+  // ローカル変数の指定に使えるオペランドは OP_WIDE を前置しても 2byte であるため,
+  // 一つの関数に登録できるローカル変数は UINT16_COUNT 個まで, という制限が生まれる.
+  // 普通の関数は数個しか使わないので, 配列は必要に応じて伸ばす.
+  Local *locals;                 // どのスタックスロットがどのローカル変数やテンポラリに関連付けられているかを追跡する.
   int localCount;                // スコープ内にローカル変数が何個があるか, つまりlocals配列がいくつ使用中であるかを示す変数.
-  Upvalue upvalues[UINT8_COUNT]; // 関数のボディで解決されたクロージャ変数を追跡するための配列.
+  int localCapacity;
+  Upvalue *upvalues;             // 関数のボディで解決されたクロージャ変数を追跡するための配列.
+  int upvalueCapacity;
   int scopeDepth;                // スコープの深さ, つまり現在コンパイル中のコードがいくつ {} で囲まれているかを示す.
+
+  // 覗き穴最適化のための状態.
+  // recent には直近に出力した命令の開始位置を新しい順に最大 PEEPHOLE_WINDOW 個保持する.
+  // 命令は emitByte でばらばらに書かれるので, 境界は必要になった時点で scanned から先を解読して求める.
+  // jumpTarget はジャンプ先になった最後の位置で, これより後ろの命令は前の命令と融合してはならない.
+  int recent[PEEPHOLE_WINDOW];
+  int recentCount;
+  int scanned;
+  int jumpTarget;
+  // unreachable は return や無限ループの直後で, 次のジャンプ先までのコードが実行されないことを示す.
+  bool unreachable;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -89,9 +112,10 @@ typedef struct ClassCompiler {
   bool hasSuperclass;
 } ClassCompiler;
 
-Parser parser; // パーサーはグローバル変数で管理.
-Compiler *current = NULL; // current は現在有効なCompiler構造体を示す.
-ClassCompiler *currentClass = NULL;
+// コンパイラの状態はスレッドごとのグローバル変数で管理. スレッドごとに別のソースをコンパイルできる.
+THREAD_LOCAL Parser parser; // パーサーはグローバル変数で管理.
+THREAD_LOCAL Compiler *current = NULL; // current は現在有効なCompiler構造体を示す.
+THREAD_LOCAL ClassCompiler *currentClass = NULL;
 
 /* Compiling Expressions compiling-chunk < Calls and Functions current-chunk
 Chunk* compilingChunk;
@@ -110,17 +134,17 @@ static void errorAt(Token *token, const char *message) {
   // すでに構文エラーが発生しているなら後続のエラーは無視する
   if (parser.panicMode) return;
   parser.panicMode = true; // 構文エラー発生フラグをON
-  fprintf(stderr, "[line %d] Error", token->line);
+  fprintf(vm.err, "[line %d] Error", token->line);
 
   if (token->type == TOKEN_EOF) {
-    fprintf(stderr, " at end");
+    fprintf(vm.err, " at end");
   } else if (token->type == TOKEN_ERROR) {
     // Nothing.
   } else {
-    fprintf(stderr, " at '%.*s'", token->length, token->start);
+    fprintf(vm.err, " at '%.*s'", token->length, token->start);
   }
 
-  fprintf(stderr, ": %s\n", message);
+  fprintf(vm.err, ": %s\n", message);
   parser.hadError = true;
 }
 
@@ -138,8 +162,9 @@ static void advance() {
   parser.previous = parser.current;
 
   for (;;) {
-    // スキャナを進め解析中の字句を更新する
-    parser.current = scanToken();
+    // 読み込んでおいた次の字句を解析中の字句にする. TOKEN_EOF からは先に進まない.
+    parser.current = parser.tokens.tokens[parser.next];
+    if (parser.next < parser.tokens.count - 1) parser.next++;
     // エラーでなければ抜ける
     if (parser.current.type != TOKEN_ERROR)
       break;
@@ -176,11 +201,77 @@ static void emitByte(uint8_t byte) {
   writeChunk(currentChunk(), byte, parser.previous.line);
 }
 
+// emitByteAt は行番号を指定してバイトを出力する.
+// 融合した命令では, 実行時エラーを起こしうる元の命令の行番号を引き継ぐために使う.
+static void emitByteAt(uint8_t byte, int line) {
+  writeChunk(currentChunk(), byte, line);
+}
+
 static void emitBytes(uint8_t byte1, uint8_t byte2) {
   emitByte(byte1);
   emitByte(byte2);
 }
 
+// emitIndexed はインデックスオペランドを一つ持つ命令を出力する.
+// オペランドが 1byte に収まらなければ OP_WIDE を前置して 2byte で出力する.
+static void emitIndexed(uint8_t instruction, int operand) {
+  if (operand <= UINT8_MAX) {
+    emitBytes(instruction, (uint8_t) operand);
+    return;
+  }
+
+  emitBytes(OP_WIDE, instruction);
+  emitByte((operand >> 8) & 0xff);
+  emitByte(operand & 0xff);
+}
+
+// scanRecent はまだ解読していない命令の境界を recent に取り込む.
+static void scanRecent() {
+  Chunk *chunk = currentChunk();
+  while (current->scanned < chunk->count) {
+    if (current->recentCount < PEEPHOLE_WINDOW) current->recentCount++;
+    for (int i = current->recentCount - 1; i > 0; i--) {
+      current->recent[i] = current->recent[i - 1];
+    }
+    current->recent[0] = current->scanned;
+    current->scanned += instructionLength(chunk, current->scanned);
+  }
+}
+
+// fusable は直近 count 個の命令が, これから出力する命令と融合できるならその先頭位置を返す.
+// 融合できない (命令が足りない, 途中にジャンプ先がある) 場合は -1 を返す.
+static int fusable(int count) {
+  scanRecent();
+  if (current->recentCount < count) return -1;
+  int start = current->recent[count - 1];
+  // 先頭の命令自体はジャンプ先でもよい. 融合後の命令も同じ位置から始まるので.
+  if (current->jumpTarget > start) return -1;
+  return start;
+}
+
+// recentByte は直近 index 番目(0 が最新)の命令の operand バイト目を返す. 0 なら命令自身.
+static uint8_t recentByte(int index, int operand) {
+  return currentChunk()->code[current->recent[index] + operand];
+}
+
+// truncateTo は start 以降に出力した命令を取り消す. 融合した命令はこの位置から書き直す.
+static void truncateTo(int start) {
+  truncateChunk(currentChunk(), start);
+  current->scanned = start;
+  int kept = 0;
+  for (int i = 0; i < current->recentCount; i++) {
+    if (current->recent[i] < start) current->recent[kept++] = current->recent[i];
+  }
+  current->recentCount = kept;
+}
+
+// markJumpTarget は次に出力する命令がジャンプ先になることを記録し, その位置を返す.
+static int markJumpTarget() {
+  current->jumpTarget = currentChunk()->count;
+  current->unreachable = false;
+  return current->jumpTarget;
+}
+
 static void emitLoop(int loopStart) {
   emitByte(OP_LOOP);
 
@@ -194,6 +285,20 @@ static void emitLoop(int loopStart) {
 
 // emitJump はジャンプ命令を出力する
 static int emitJump(uint8_t instruction) {
+  int start;
+  if (instruction == OP_POP_JUMP_IF_FALSE && (start = fusable(1)) != -1 &&
+      recentByte(0, 0) == OP_LESS_CONSTANT) {
+    // CONSTANT k; LESS; POP_JUMP_IF_FALSE => LESS_CONSTANT_JUMP k
+    uint8_t constant = recentByte(0, 1);
+    int line = getLine(currentChunk(), start);
+    truncateTo(start);
+    emitByteAt(OP_LESS_CONSTANT_JUMP, line);
+    emitByteAt(constant, line);
+    emitByteAt(0xff, line);
+    emitByteAt(0xff, line);
+    return currentChunk()->count - 2;
+  }
+
   emitByte(instruction);
   // ジャンプ先のアドレスは 0xffff で仮置きしておく.
   // 後ほど patchJump 関数で実際のオペランドの値に置換する必要がある.
@@ -215,18 +320,192 @@ static void emitReturn() {
   emitByte(OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value) {
+static int makeConstant(Value value) {
   int constant = addConstant(currentChunk(), value);
-  if (constant > UINT8_MAX) {
+  writeBarrier((Obj *) current->function);
+  if (constant > UINT16_MAX) {
     error("Too many constants in one chunk.");
     return 0;
   }
 
-  return (uint8_t)constant;
+  return constant;
+}
+
+// emitInlineCache は現在の Chunk にインラインキャッシュを一つ確保し,
+// そのインデックスを 2byte のオペランドとして出力する.
+static void emitInlineCache() {
+  int cache = addInlineCache(currentChunk());
+  if (cache > UINT16_MAX) {
+    error("Too many property accesses in one chunk.");
+  }
+
+  emitByte((cache >> 8) & 0xff);
+  emitByte(cache & 0xff);
 }
 
 static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+  emitIndexed(OP_CONSTANT, makeConstant(value));
+}
+
+// emitValue はリテラルの値を PUSH する命令を出力する.
+static void emitValue(Value value) {
+  if (IS_NIL(value)) {
+    emitByte(OP_NIL);
+  } else if (IS_BOOL(value)) {
+    emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else {
+    emitConstant(value);
+  }
+}
+
+// recentLiteral は直近 index 番目の命令がリテラルを PUSH するだけの命令なら, その値を value に入れて真を返す.
+static bool recentLiteral(int index, Value *value) {
+  switch (recentByte(index, 0)) {
+    case OP_CONSTANT:
+      *value = currentChunk()->constants.values[recentByte(index, 1)];
+      return true;
+    case OP_WIDE:
+      if (recentByte(index, 1) != OP_CONSTANT) return false;
+      *value = currentChunk()->constants.values[
+          (recentByte(index, 2) << 8) | recentByte(index, 3)];
+      return true;
+    case OP_NIL:   *value = NIL_VAL; return true;
+    case OP_TRUE:  *value = BOOL_VAL(true); return true;
+    case OP_FALSE: *value = BOOL_VAL(false); return true;
+    default:
+      return false;
+  }
+}
+
+static bool isFalseyLiteral(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// foldConstants はオペランドがすべてリテラルなら演算をコンパイル時に済ませ, 結果のリテラルに置き換える.
+// 実行時エラーになる組み合わせは畳み込まずに偽を返し, エラーの報告は VM に任せる.
+static bool foldConstants(OpCode instruction) {
+  int operands = instruction == OP_NOT || instruction == OP_NEGATE ? 1 : 2;
+  int start = fusable(operands);
+  Value a, b = NIL_VAL;
+  if (start == -1 || !recentLiteral(operands - 1, &a)) return false;
+  if (operands == 2 && !recentLiteral(0, &b)) return false;
+
+  Value result;
+  switch (instruction) {
+    case OP_NOT:
+      result = BOOL_VAL(isFalseyLiteral(a));
+      break;
+    case OP_NEGATE:
+      if (!IS_NUMBER(a)) return false;
+      result = NUMBER_VAL(-AS_NUMBER(a));
+      break;
+    case OP_EQUAL:
+      result = BOOL_VAL(valuesEqual(a, b));
+      break;
+    case OP_ADD:
+      if (IS_STRING(a) && IS_STRING(b)) {
+        result = OBJ_VAL(concatenateStrings(AS_STRING(a), AS_STRING(b)));
+        break;
+      }
+      // fallthrough
+    default: {
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+      double x = AS_NUMBER(a);
+      double y = AS_NUMBER(b);
+      switch (instruction) {
+        case OP_GREATER:  result = BOOL_VAL(x > y); break;
+        case OP_LESS:     result = BOOL_VAL(x < y); break;
+        case OP_ADD:      result = NUMBER_VAL(x + y); break;
+        case OP_SUBTRACT: result = NUMBER_VAL(x - y); break;
+        case OP_MULTIPLY: result = NUMBER_VAL(x * y); break;
+        case OP_DIVIDE:   result = NUMBER_VAL(x / y); break;
+        default:          return false;
+      }
+    }
+  }
+
+  truncateTo(start);
+  emitValue(result);
+  return true;
+}
+
+// emitOperation は単項/二項演算子の命令を出力する.
+// オペランドがリテラルだけなら畳み込み, 右オペランドだけが定数なら定数をオペランドに持つ fused 命令に置き換える.
+static void emitOperation(OpCode instruction) {
+  if (foldConstants(instruction)) return;
+
+  OpCode fused;
+  switch (instruction) {
+    case OP_ADD:      fused = OP_ADD_CONSTANT; break;
+    case OP_SUBTRACT: fused = OP_SUBTRACT_CONSTANT; break;
+    case OP_LESS:     fused = OP_LESS_CONSTANT; break;
+    case OP_EQUAL:    fused = OP_EQUAL_CONSTANT; break;
+    default:
+      emitByte(instruction);
+      return;
+  }
+
+  int start = fusable(1);
+  if (start != -1 && recentByte(0, 0) == OP_CONSTANT) {
+    uint8_t constant = recentByte(0, 1);
+    truncateTo(start);
+    emitBytes(fused, constant);
+    return;
+  }
+  emitByte(instruction);
+}
+
+// emitPop は式文の値を捨てる OP_POP を出力する.
+// `i = i + k;` の形はローカル変数を直接書き換える OP_INCREMENT_LOCAL にまとめる.
+// 副作用のない値を PUSH しただけの文は, PUSH ごと取り除く.
+static void emitPop() {
+  int start = fusable(3);
+  if (start != -1 &&
+      recentByte(2, 0) == OP_GET_LOCAL &&
+      recentByte(1, 0) == OP_ADD_CONSTANT &&
+      recentByte(0, 0) == OP_SET_LOCAL &&
+      recentByte(2, 1) == recentByte(0, 1)) {
+    uint8_t slot = recentByte(0, 1);
+    uint8_t constant = recentByte(1, 1);
+    int line = getLine(currentChunk(), current->recent[1]);
+    truncateTo(start);
+    emitByteAt(OP_INCREMENT_LOCAL, line);
+    emitByteAt(slot, line);
+    emitByteAt(constant, line);
+    return;
+  }
+
+  Value value;
+  start = fusable(1);
+  if (start != -1 &&
+      (recentLiteral(0, &value) || recentByte(0, 0) == OP_GET_LOCAL ||
+       recentByte(0, 0) == OP_GET_UPVALUE)) {
+    truncateTo(start);
+    return;
+  }
+  emitByte(OP_POP);
+}
+
+// constantCondition は直前にコンパイルした条件式がリテラルだけなら, それを取り除いて真を返す.
+// truthy には条件の真偽が入る.
+static bool constantCondition(bool *truthy) {
+  Value value;
+  int start = fusable(1);
+  if (start == -1 || !recentLiteral(0, &value)) return false;
+
+  truncateTo(start);
+  *truthy = !isFalseyLiteral(value);
+  return true;
+}
+
+// discardCode は start 以降に出力した到達できないコードを捨てる.
+// コードの解析自体は済んでいるので, 構文エラーは通常どおり報告される.
+// unreachable には捨てたコードの直後が到達できないかどうかを指定する.
+static void discardCode(int start, bool unreachable) {
+  truncateTo(start);
+  // 捨てたコードの中を指すジャンプ先は, 以降の融合を防ぐために start に寄せておく.
+  if (current->jumpTarget > start) current->jumpTarget = start;
+  current->unreachable = unreachable;
 }
 
 static void patchJump(int offset) {
@@ -238,31 +517,56 @@ static void patchJump(int offset) {
   if (jump > UINT16_MAX) {
     error("Too much code to jump over.");
   }
+  markJumpTarget();
 
   // 0xffff で仮置きしていたオペランドを実際のjump先に置換する
   currentChunk()->code[offset] = (jump >> 8) & 0xff;
   currentChunk()->code[offset + 1] = jump & 0xff;
 }
 
+// pushLocal は locals 配列の末尾を一つ確保して返す.
+static Local *pushLocal(Compiler *compiler) {
+  if (compiler->localCapacity < compiler->localCount + 1) {
+    int oldCapacity = compiler->localCapacity;
+    compiler->localCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->locals = GROW_ARRAY(Local, compiler->locals,
+                                  oldCapacity, compiler->localCapacity);
+  }
+
+  return &compiler->locals[compiler->localCount++];
+}
+
 // initCompiler はコンパイラ構造体を初期化する.
 static void initCompiler(Compiler *compiler, FunctionType type) {
   compiler->enclosing = current; // 現在使用されているCompiler構造体を退避
   compiler->function = NULL; // ガベージコレクション回避のためのパラノイア的操作.
   compiler->type = type;
+  compiler->locals = NULL;
   compiler->localCount = 0;
+  compiler->localCapacity = 0;
+  compiler->upvalues = NULL;
+  compiler->upvalueCapacity = 0;
   compiler->scopeDepth = 0;
+  compiler->recentCount = 0;
+  compiler->scanned = 0;
+  compiler->jumpTarget = 0;
+  compiler->unreachable = false;
   compiler->function = newFunction(); // コンパイルするための新しい関数オブジェクトを確保.
   current = compiler; // 現在コンパイルしている関数(Compiler)を更新する
   // 通常の関数定義の場合はここでコンパイルする関数名を取得する
   if (type != TYPE_SCRIPT) {
-    current->function->name = copyString(parser.previous.start,
-                                         parser.previous.length);
+    current->function->name = copyStringHashed(parser.previous.start,
+                                               parser.previous.length,
+                                               parser.previous.hash);
+    writeBarrier((Obj *) current->function);
   }
 
   // 以下の1行は locals[0] をVM内部で使用することを暗黙的に示している.
-  Local *local = &current->locals[current->localCount++];
+  Local *local = pushLocal(current);
   local->depth = 0; // ネスト数 0 はトップレベルコードである.
   local->isCaptured = false;
+  local->function = NULL;
+  local->escapes = false;
   if (type != TYPE_FUNCTION) {
     local->name.start = "this";
     local->name.length = 4;
@@ -270,11 +574,124 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
     local->name.start = "";  // ユーザーはVMのスタックスペースを指定できないように空文字列を与える.
     local->name.length = 0;
   }
+  local->name.hash = hashString(local->name.start, local->name.length);
+}
+
+// closureAt は offset の OP_CLOSURE (OP_WIDE 付きを含む) が作る関数を返す. OP_CLOSURE でなければ NULL.
+// captures には upvalue ごとの記述子 (isLocal, index) の先頭の位置を, wide にはインデックスが 2byte かを入れる.
+static ObjFunction *closureAt(Chunk *chunk, int offset, int *captures,
+                              bool *wide) {
+  if (offset + 2 > chunk->count) return NULL;
+  *wide = chunk->code[offset] == OP_WIDE;
+  int at = offset + (*wide ? 1 : 0);
+  if (chunk->code[at++] != OP_CLOSURE) return NULL;
+  int constant = chunk->code[at++];
+  if (*wide) constant = constant << 8 | chunk->code[at++];
+  if (constant >= chunk->constants.count ||
+      !IS_FUNCTION(chunk->constants.values[constant])) {
+    return NULL;
+  }
+  *captures = at;
+  return AS_FUNCTION(chunk->constants.values[constant]);
+}
+
+// captureAt は captures から始まる記述子の i 番目の捕捉する変数のインデックスを返す.
+static int captureAt(Chunk *chunk, int captures, bool wide, int i,
+                     bool *isLocal) {
+  uint8_t *capture = &chunk->code[captures + i * (wide ? 3 : 2)];
+  *isLocal = capture[0] != 0;
+  return wide ? capture[1] << 8 | capture[2] : capture[1];
+}
+
+// rewriteCaptures は function の upvalue の読み書きを, 外側のフレームのスロットの読み書きに書き換える.
+// 外側の関数の OP_CLOSURE の記述子が upvalue ごとのスロット番号を与える.
+// apply が偽なら書き換えられるかどうかだけを調べる.
+static bool rewriteCaptures(ObjFunction *function, Chunk *outer,
+                            int captures, bool outerWide, bool apply) {
+  Chunk *chunk = &function->chunk;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    bool wide = chunk->code[offset] == OP_WIDE;
+    int at = offset + (wide ? 1 : 0);
+    uint8_t instruction = chunk->code[at];
+
+    if (instruction == OP_CLOSURE) {
+      // 入れ子の関数が function の upvalue を引き継いでいたら, それは ObjUpvalue が必要
+      int nested;
+      bool nestedWide, isLocal;
+      ObjFunction *inner = closureAt(chunk, offset, &nested, &nestedWide);
+      for (int i = 0; i < inner->upvalueCount; i++) {
+        captureAt(chunk, nested, nestedWide, i, &isLocal);
+        if (!isLocal) return false;
+      }
+      continue;
+    }
+    if (instruction != OP_GET_UPVALUE && instruction != OP_SET_UPVALUE) {
+      continue;
+    }
+
+    int index = wide ? chunk->code[at + 1] << 8 | chunk->code[at + 2]
+                     : chunk->code[at + 1];
+    bool isLocal;
+    int slot = captureAt(outer, captures, outerWide, index, &isLocal);
+    if (!wide && slot > UINT8_MAX) return false;
+    if (!apply) continue;
+
+    chunk->code[at] = instruction == OP_GET_UPVALUE ? OP_GET_OUTER
+                                                   : OP_SET_OUTER;
+    if (wide) {
+      chunk->code[at + 1] = (slot >> 8) & 0xff;
+      chunk->code[at + 2] = slot & 0xff;
+    } else {
+      chunk->code[at + 1] = (uint8_t) slot;
+    }
+  }
+  return true;
+}
+
+// analyzeEscape はスコープを抜けるローカル変数 local がエスケープしないローカル関数かどうかを調べる.
+// 呼び出されるだけなら, その関数は宣言した関数のフレームから直接呼ばれる.
+// そこで upvalue を呼び出し元のフレームの読み書きに書き換え, ObjUpvalue とクロージャの確保をなくす.
+static void analyzeEscape(Local *local) {
+  if (local->function == NULL || local->escapes || local->isCaptured ||
+      parser.hadError) {
+    return;
+  }
+
+  Chunk *chunk = currentChunk();
+  int captures;
+  bool wide;
+  if (closureAt(chunk, local->closureStart, &captures, &wide) !=
+      local->function) {
+    return; // 到達できないコードとして捨てられた
+  }
+
+  ObjFunction *function = local->function;
+  for (int i = 0; i < function->upvalueCount; i++) {
+    bool isLocal;
+    captureAt(chunk, captures, wide, i, &isLocal);
+    if (!isLocal) return; // さらに外側の変数は呼び出し元のフレームにない
+  }
+  if (!rewriteCaptures(function, chunk, captures, wide, false)) return;
+  rewriteCaptures(function, chunk, captures, wide, true);
+  markNonEscaping(function);
+  chunk->code[local->closureStart + (wide ? 1 : 0)] = OP_SHARED_CLOSURE;
 }
 
 static ObjFunction *endCompiler() {
-  emitReturn(); // RETURN命令を追加する
+  // 関数の最も外側のスコープのローカル変数は endScope() を通らない
+  for (int i = current->localCount - 1; i >= 0; i--) {
+    analyzeEscape(&current->locals[i]);
+  }
+
+  // 末尾に到達できないなら暗黙の return は不要.
+  if (!current->unreachable) emitReturn(); // RETURN命令を追加する
   ObjFunction *function = current->function; // 現在コンパイル中の関数オブジェクト参照を取得.
+  freeConstantIndex(currentChunk()); // 以降は定数を足さないので重複排除の表は要らない
+  // 呼び出し時にはスタックに関数自身と引数が積まれている
+  if (!parser.hadError) {
+    function->maxStack = maxStackHeight(currentChunk(), function->arity + 1);
+  }
 
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
@@ -288,6 +705,13 @@ static ObjFunction *endCompiler() {
   return function; // 取得した関数を返す
 }
 
+// freeCompiler はコンパイラ構造体が確保した配列を解放する.
+// upvalues は OP_CLOSURE の出力に使うので, endCompiler の後で呼ぶこと.
+static void freeCompiler(Compiler *compiler) {
+  FREE_ARRAY(Local, compiler->locals, compiler->localCapacity);
+  FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalueCapacity);
+}
+
 // beginScope は現在のコンパイラ構造体のスコープ深度をインクリメントする
 static void beginScope() {
   current->scopeDepth++;
@@ -300,6 +724,7 @@ static void endScope() {
   // ローカル変数が存在する && 現在のスコープ深度よりローカル変数の深度が大きい場合(抜けたブロック内で定義されたローカル変数か？)
   while (current->localCount > 0 &&
          current->locals[current->localCount - 1].depth > current->scopeDepth) {
+    analyzeEscape(&current->locals[current->localCount - 1]);
     if (current->locals[current->localCount - 1].isCaptured) {
       // クロージャにキャプチャされた変数はスタックからの開放時にヒープに退避させる特別な命令を発行する.
       // なお命令発行時, 対象の変数はスタックトップにあるのでオペランドは不要.
@@ -323,12 +748,25 @@ static ParseRule *getRule(TokenType type);
 
 static void parsePrecedence(Precedence precedence);
 
-static uint8_t identifierConstant(Token *name) {
-  return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+static int identifierConstant(Token *name) {
+  return makeConstant(OBJ_VAL(copyStringHashed(name->start, name->length,
+                                               name->hash)));
+}
+
+// globalVariable はグローバル変数 name のスロット番号を返す.
+// グローバル変数の命令は名前の定数ではなくこの番号をオペランドに持つ.
+static int globalVariable(Token *name) {
+  int slot = globalSlot(copyStringHashed(name->start, name->length,
+                                         name->hash));
+  if (slot > UINT16_MAX) {
+    error("Too many global variables.");
+    return 0;
+  }
+  return slot;
 }
 
 static bool identifiersEqual(Token *a, Token *b) {
-  if (a->length != b->length) return false;
+  if (a->hash != b->hash || a->length != b->length) return false;
   return memcmp(a->start, b->start, a->length) == 0;
 }
 
@@ -356,7 +794,7 @@ static int resolveLocal(Compiler *compiler, Token *name) {
 
 // addUpvalue はクロージャで閉包された値(upvalue)を作成する.
 // isLocalフラグは外側関数の変数をキャプチャしているのかどうかを表す.
-static int addUpvalue(Compiler *compiler, uint8_t index,
+static int addUpvalue(Compiler *compiler, int index,
                       bool isLocal) {
   int upvalueCount = compiler->function->upvalueCount;
 
@@ -369,11 +807,18 @@ static int addUpvalue(Compiler *compiler, uint8_t index,
     }
   }
 
-  if (upvalueCount == UINT8_COUNT) {
+  if (upvalueCount == UINT16_COUNT) {
     error("Too many closure variables in function.");
     return 0;
   }
 
+  if (compiler->upvalueCapacity < upvalueCount + 1) {
+    int oldCapacity = compiler->upvalueCapacity;
+    compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues,
+                                    oldCapacity, compiler->upvalueCapacity);
+  }
+
   // 新しい upValue を登録する
   compiler->upvalues[upvalueCount].isLocal = isLocal;
   compiler->upvalues[upvalueCount].index = index;
@@ -392,7 +837,7 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
   if (local != -1) {
     compiler->enclosing->locals[local].isCaptured = true; // 変数がクロージャにキャプチャされたフラグをON.
     // 外側を囲んでいる関数なら isLocal=true で upvalue として登録 = 一つ外側にある変数である
-    return addUpvalue(compiler, (uint8_t) local, true);
+    return addUpvalue(compiler, local, true);
   }
 
   // 変数が見つかるまでさらに外側の関数のlocalsを再帰して検索していく.
@@ -402,7 +847,7 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
     // よって isLocal=false.
     // see: https://www.craftinginterpreters.com/closures.html#flattening-upvalues
     // see: https://www.craftinginterpreters.com/image/closures/linked-upvalues.png
-    return addUpvalue(compiler, (uint8_t) upvalue, false);
+    return addUpvalue(compiler, upvalue, false);
   }
 
   return -1;
@@ -410,16 +855,18 @@ static int resolveUpvalue(Compiler *compiler, Token *name) {
 
 // addLocal は現在のコンパイラ構造体にローカル変数`name`を追加する
 static void addLocal(Token name) {
-  if (current->localCount == UINT8_COUNT) {
+  if (current->localCount == UINT16_COUNT) {
     error("Too many local variables in function.");
     return;
   }
 
-  Local *local = &current->locals[current->localCount++]; // ローカル変数の保存アドレスを取得する
+  Local *local = pushLocal(current); // ローカル変数の保存アドレスを取得する
   // 取得したアドレスにローカル変数を保存する
   local->name = name;
   local->depth = -1; // depth = -1 は変数が未初期化の状態であることを示す.
   local->isCaptured = false;
+  local->function = NULL;
+  local->escapes = false;
 }
 
 // declareVariable は変数を宣言する.
@@ -450,7 +897,7 @@ static void declareVariable() {
 }
 
 // parseVariable は変数名を解析する
-static uint8_t parseVariable(const char *errorMessage) {
+static int parseVariable(const char *errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
 
   // 変数の宣言 -> コンパイラ構造体に変数を記録.
@@ -459,7 +906,7 @@ static uint8_t parseVariable(const char *errorMessage) {
   if (current->scopeDepth > 0)
     return 0;
 
-  return identifierConstant(&parser.previous);
+  return globalVariable(&parser.previous);
 }
 
 // markInitialized は現在解析中の宣言された変数を初期化済みとしてマークする
@@ -478,7 +925,7 @@ static void markInitialized() {
 // 変数定義のための特別なバイトコードはemitしない.
 // なぜならスタックの先頭にすでにローカル変数となる値がPUSHされているからである.
 // 引数globalはグローバル変数のときだけ使用される.
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
   // 非トップレベルの変数(ローカル変数)の場合
   if (current->scopeDepth > 0) {
     markInitialized();
@@ -486,7 +933,7 @@ static void defineVariable(uint8_t global) {
   }
 
   // グローバル変数の場合
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitIndexed(OP_DEFINE_GLOBAL, global);
 }
 
 // 関数の引数リストを解析する.
@@ -533,34 +980,37 @@ static void binary(bool canAssign) {
   // 最後に二項演算子に基づくバイトコードをPUSHする.
   switch (operatorType) {
     case TOKEN_BANG_EQUAL:
-      emitBytes(OP_EQUAL, OP_NOT);
+      emitOperation(OP_EQUAL);
+      emitOperation(OP_NOT);
       break;
     case TOKEN_EQUAL_EQUAL:
-      emitByte(OP_EQUAL);
+      emitOperation(OP_EQUAL);
       break;
     case TOKEN_GREATER:
-      emitByte(OP_GREATER);
+      emitOperation(OP_GREATER);
       break;
     case TOKEN_GREATER_EQUAL:
-      emitBytes(OP_LESS, OP_NOT);
+      emitOperation(OP_LESS);
+      emitOperation(OP_NOT);
       break;
     case TOKEN_LESS:
-      emitByte(OP_LESS);
+      emitOperation(OP_LESS);
       break;
     case TOKEN_LESS_EQUAL:
-      emitBytes(OP_GREATER, OP_NOT);
+      emitOperation(OP_GREATER);
+      emitOperation(OP_NOT);
       break;
     case TOKEN_PLUS:
-      emitByte(OP_ADD);
+      emitOperation(OP_ADD);
       break;
     case TOKEN_MINUS:
-      emitByte(OP_SUBTRACT);
+      emitOperation(OP_SUBTRACT);
       break;
     case TOKEN_STAR:
-      emitByte(OP_MULTIPLY);
+      emitOperation(OP_MULTIPLY);
       break;
     case TOKEN_SLASH:
-      emitByte(OP_DIVIDE);
+      emitOperation(OP_DIVIDE);
       break;
     default:
       return; // Unreachable.
@@ -575,20 +1025,62 @@ static void call(bool canAssign) {
 
 static void dot(bool canAssign) {
   consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-  uint8_t name = identifierConstant(&parser.previous);
+  int name = identifierConstant(&parser.previous);
 
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(OP_SET_PROPERTY, name);
+    emitIndexed(OP_SET_PROPERTY, name);
+    emitInlineCache();
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
-    emitBytes(OP_INVOKE, name);
+    emitIndexed(OP_INVOKE, name);
     emitByte(argCount);
+    emitInlineCache();
   } else {
-    emitBytes(OP_GET_PROPERTY, name);
+    int start = fusable(1);
+    if (start != -1 && recentByte(0, 0) == OP_GET_LOCAL && name <= UINT8_MAX) {
+      // GET_LOCAL slot; GET_PROPERTY name => GET_LOCAL_PROPERTY slot name
+      uint8_t slot = recentByte(0, 1);
+      truncateTo(start);
+      emitBytes(OP_GET_LOCAL_PROPERTY, slot);
+      emitByte(name);
+    } else {
+      emitIndexed(OP_GET_PROPERTY, name);
+    }
+    emitInlineCache();
   }
 }
 
+// index は `list[index]` の添字式. `[` は関数呼び出しの `(` と同じ優先順位の infix 演算子.
+static void index_(bool canAssign) {
+  expression();
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+  if (canAssign && match(TOKEN_EQUAL)) {
+    expression();
+    emitByte(OP_SET_INDEX);
+  } else {
+    emitByte(OP_GET_INDEX);
+  }
+}
+
+// list は `[a, b, c]` のリストリテラル. 要素をすべて積んでから一つのリストにまとめる.
+static void list(bool canAssign) {
+  int count = 0;
+  if (!check(TOKEN_RIGHT_BRACKET)) {
+    do {
+      if (check(TOKEN_RIGHT_BRACKET)) break; // 末尾のカンマ
+      expression();
+      if (count == 255) {
+        error("Can't have more than 255 elements in a list literal.");
+      }
+      count++;
+    } while (match(TOKEN_COMMA));
+  }
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+  emitBytes(OP_BUILD_LIST, (uint8_t) count);
+}
+
 static void literal(bool canAssign) {
   switch (parser.previous.type) {
     case TOKEN_FALSE:
@@ -605,9 +1097,54 @@ static void literal(bool canAssign) {
   }
 }
 
+// invokeGrouped は (a.b)(...) や (super.b)(...) のように括弧で囲んだプロパティをすぐに呼び出すなら,
+// 出力済みの取得命令を a.b(...) と同じ OP_INVOKE (OP_SUPER_INVOKE) に置き換える.
+// メソッドを ObjBoundMethod に束縛せずに済む.
+static void invokeGrouped() {
+  if (!check(TOKEN_LEFT_PAREN)) return;
+  int start = fusable(1);
+  if (start == -1) return;
+  Chunk *chunk = currentChunk();
+  bool wide = chunk->code[start] == OP_WIDE;
+  uint8_t instruction = chunk->code[start + (wide ? 1 : 0)];
+  int name = wide ? chunk->code[start + 2] << 8 | chunk->code[start + 3]
+                  : chunk->code[start + 1];
+
+  if (instruction == OP_GET_LOCAL_PROPERTY) {
+    // GET_LOCAL_PROPERTY slot name => GET_LOCAL slot; ... INVOKE name
+    uint8_t slot = chunk->code[start + 1];
+    name = chunk->code[start + 2];
+    truncateTo(start);
+    emitBytes(OP_GET_LOCAL, slot);
+    instruction = OP_GET_PROPERTY;
+  } else if (instruction == OP_GET_PROPERTY) {
+    truncateTo(start);
+  }
+
+  if (instruction == OP_GET_PROPERTY) {
+    advance();
+    uint8_t argCount = argumentList();
+    emitIndexed(OP_INVOKE, name);
+    emitByte(argCount);
+    emitInlineCache();
+  } else if (instruction == OP_GET_SUPER && (start = fusable(2)) != -1) {
+    // スーパークラスは引数の後に積み直す
+    uint8_t superclass[4];
+    int length = current->recent[0] - start;
+    memcpy(superclass, &chunk->code[start], length);
+    truncateTo(start);
+    advance();
+    uint8_t argCount = argumentList();
+    for (int i = 0; i < length; i++) emitByte(superclass[i]);
+    emitIndexed(OP_SUPER_INVOKE, name);
+    emitByte(argCount);
+  }
+}
+
 static void grouping(bool canAssign) {
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+  invokeGrouped();
 }
 
 static void number(bool canAssign) {
@@ -628,13 +1165,14 @@ static void or_(bool canAssign) {
 }
 
 static void string(bool canAssign) {
-  emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,
-                                  parser.previous.length - 2)));
+  emitConstant(OBJ_VAL(copyStringHashed(parser.previous.start + 1,
+                                        parser.previous.length - 2,
+                                        parser.previous.hash)));
 }
 
 // namedVariable は変数の値の設定・取得を行う
 static void namedVariable(Token name, bool canAssign) {
-  uint8_t getOp, setOp;
+  OpCode getOp, setOp;
   // arg はバイトコードにemitされるオペランド.
   // 値は指定されたコンパイラ構造体の locals配列のインデックス.
   int arg = resolveLocal(current, &name);
@@ -642,13 +1180,15 @@ static void namedVariable(Token name, bool canAssign) {
     // locals配列のidxが -1 ではないならローカル変数
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
+    // 直後に ( が続かなければ, 呼び出す以外の用途で値を使う
+    if (!check(TOKEN_LEFT_PAREN)) current->locals[arg].escapes = true;
   } else if ((arg = resolveUpvalue(current, &name)) != -1) {
     // クロージャ変数である可能性を考え, 外部ブロックの変数を探してキャプチャしにいく
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
     // -1 はローカル変数には登録されていない名前である = グローバル変数である
-    arg = identifierConstant(&name);
+    arg = globalVariable(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
@@ -657,9 +1197,9 @@ static void namedVariable(Token name, bool canAssign) {
   // なければ値参照(getter).
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(setOp, (uint8_t) arg);
+    emitIndexed(setOp, arg);
   } else {
-    emitBytes(getOp, (uint8_t) arg);
+    emitIndexed(getOp, arg);
   }
 }
 
@@ -672,6 +1212,7 @@ static Token syntheticToken(const char *text) {
   Token token;
   token.start = text;
   token.length = (int) strlen(text);
+  token.hash = hashString(text, token.length);
   return token;
 }
 
@@ -684,7 +1225,7 @@ static void super_(bool canAssign) {
 
   consume(TOKEN_DOT, "Expect '.' after 'super'.");
   consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-  uint8_t name = identifierConstant(&parser.previous);
+  int name = identifierConstant(&parser.previous);
 
   namedVariable(syntheticToken("this"), false);
 /* Superclasses super-get < Superclasses super-invoke
@@ -694,11 +1235,11 @@ static void super_(bool canAssign) {
   if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
     namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_SUPER_INVOKE, name);
+    emitIndexed(OP_SUPER_INVOKE, name);
     emitByte(argCount);
   } else {
     namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_GET_SUPER, name);
+    emitIndexed(OP_GET_SUPER, name);
   }
 }
 
@@ -723,10 +1264,10 @@ static void unary(bool canAssign) {
   // 最後に単項演算子のバイトコードをPUSH
   switch (operatorType) {
     case TOKEN_BANG:
-      emitByte(OP_NOT);
+      emitOperation(OP_NOT);
       break;
     case TOKEN_MINUS:
-      emitByte(OP_NEGATE);
+      emitOperation(OP_NEGATE);
       break;
     default:
       return; // Unreachable.
@@ -741,6 +1282,8 @@ ParseRule rules[] = {
     [TOKEN_RIGHT_PAREN]   = {NULL, NULL, PREC_NONE}, // )
     [TOKEN_LEFT_BRACE]    = {NULL, NULL, PREC_NONE}, // [big]
     [TOKEN_RIGHT_BRACE]   = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET]  = {list, index_, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA]         = {NULL, NULL, PREC_NONE},
 /* Compiling Expressions rules < Classes and Instances table-dot */
     [TOKEN_DOT]           = {NULL, dot, PREC_CALL},
@@ -843,8 +1386,8 @@ static void block() {
   consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-// function は関数をコンパイルする.
-static void function(FunctionType type) {
+// function は関数をコンパイルし, その OP_CLOSURE を出力する. コンパイルした関数を返す.
+static ObjFunction *function(FunctionType type) {
   Compiler compiler;
   initCompiler(&compiler, type);
   beginScope(); // [no-end-scope]
@@ -856,7 +1399,7 @@ static void function(FunctionType type) {
       if (current->function->arity > 255) {
         errorAtCurrent("Can't have more than 255 parameters.");
       }
-      uint8_t constant = parseVariable("Expect parameter name.");
+      int constant = parseVariable("Expect parameter name.");
       defineVariable(constant);
     } while (match(TOKEN_COMMA));
   }
@@ -869,17 +1412,33 @@ static void function(FunctionType type) {
   ObjFunction *function = endCompiler();
 
   // クロージャ関数シンボルを定数Chunkに登録してemit.
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
-  // 可変長のupValueオペランド(2*n Bytes)が続く
+  // 定数か upvalue のインデックスのどれかが 1byte に収まらなければ, すべて 2byte で出力する.
+  int constant = makeConstant(OBJ_VAL(function));
+  bool wide = constant > UINT8_MAX;
+  for (int i = 0; i < function->upvalueCount; i++) {
+    if (compiler.upvalues[i].index > UINT8_MAX) wide = true;
+  }
+
+  if (wide) {
+    emitBytes(OP_WIDE, OP_CLOSURE);
+    emitBytes((constant >> 8) & 0xff, constant & 0xff);
+  } else {
+    emitBytes(OP_CLOSURE, constant);
+  }
+  // 可変長のupValueオペランド(2*n Bytes, OP_WIDE 付きなら 3*n Bytes)が続く
   for (int i = 0; i < function->upvalueCount; i++) {
     emitByte(compiler.upvalues[i].isLocal ? 1 : 0); // isLocal かどうか
-    emitByte(compiler.upvalues[i].index);           // upValue の idx 値
+    int index = compiler.upvalues[i].index;         // upValue の idx 値
+    if (wide) emitByte((index >> 8) & 0xff);
+    emitByte(index & 0xff);
   }
+  freeCompiler(&compiler);
+  return function;
 }
 
 static void method() {
   consume(TOKEN_IDENTIFIER, "Expect method name.");
-  uint8_t constant = identifierConstant(&parser.previous);
+  int constant = identifierConstant(&parser.previous);
 
 /* Methods and Initializers method-body < Methods and Initializers method-type
   FunctionType type = TYPE_FUNCTION;
@@ -891,17 +1450,18 @@ static void method() {
   }
 
   function(type);
-  emitBytes(OP_METHOD, constant);
+  emitIndexed(OP_METHOD, constant);
 }
 
 static void classDeclaration() {
   consume(TOKEN_IDENTIFIER, "Expect class name.");
   Token className = parser.previous;
-  uint8_t nameConstant = identifierConstant(&parser.previous);
+  int nameConstant = identifierConstant(&parser.previous);
   declareVariable();
 
-  emitBytes(OP_CLASS, nameConstant);
-  defineVariable(nameConstant);
+  emitIndexed(OP_CLASS, nameConstant);
+  // OP_CLASS は名前の定数を, OP_DEFINE_GLOBAL はスロット番号をオペランドに持つ
+  defineVariable(current->scopeDepth > 0 ? 0 : globalVariable(&className));
 
   ClassCompiler classCompiler;
   classCompiler.hasSuperclass = false;
@@ -944,15 +1504,21 @@ static void classDeclaration() {
 static void funDeclaration() {
   // loxでは関数はファーストクラスの値なので, 関数宣言は変数を作成しその中に定義を格納するという処理になる.
   // トップレベルならグローバル変数, それ以外ならローカル変数に関数を格納する.
-  uint8_t global = parseVariable("Expect function name.");
+  int global = parseVariable("Expect function name.");
   markInitialized(); // 関数定義内で自分自身を参照(再起関数の定義)ができるように, 解析前に初期化済みフラグを付与しておく
-  function(TYPE_FUNCTION);
+  int closureStart = currentChunk()->count;
+  ObjFunction *compiled = function(TYPE_FUNCTION);
+  if (current->scopeDepth > 0) {
+    Local *local = &current->locals[current->localCount - 1];
+    local->function = compiled;
+    local->closureStart = closureStart;
+  }
   defineVariable(global);
 }
 
 // varDeclaration は変数宣言文を解析する
 static void varDeclaration() {
-  uint8_t global = parseVariable("Expect variable name.");
+  int global = parseVariable("Expect variable name.");
 
   // ここで emit されるバイトコード(の演算結果の値)がローカル変数を表すことになる
   if (match(TOKEN_EQUAL)) {
@@ -971,7 +1537,7 @@ static void varDeclaration() {
 static void expressionStatement() {
   expression();
   consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-  emitByte(OP_POP);
+  emitPop();
 }
 
 static void forStatement() {
@@ -988,24 +1554,31 @@ static void forStatement() {
     expressionStatement();
   }
 
-  int loopStart = currentChunk()->count;
+  bool wasUnreachable = current->unreachable;
+  int loopStart = markJumpTarget();
   int exitJump = -1;
+  // 条件式が常に偽ならループ全体が, 常に真ならループの後ろが到達できなくなる.
+  int deadStart = -1;
   // for(; `条件式`; ...) のコンパイル
   if (!match(TOKEN_SEMICOLON)) {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
-    // Jump out of the loop if the condition is false.
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP); // 条件式の結果は不要なのでPOPする
+    bool truthy;
+    if (!constantCondition(&truthy)) {
+      // Jump out of the loop if the condition is false.
+      exitJump = emitJump(OP_POP_JUMP_IF_FALSE);
+    } else if (!truthy) {
+      deadStart = currentChunk()->count;
+    }
   }
 
   // for(;;`更新式`) のコンパイル
   if (!match(TOKEN_RIGHT_PAREN)) {
     int bodyJump = emitJump(OP_JUMP);
-    int incrementStart = currentChunk()->count;
+    int incrementStart = markJumpTarget();
     expression();
-    emitByte(OP_POP);
+    emitPop();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
     emitLoop(loopStart);
@@ -1018,7 +1591,10 @@ static void forStatement() {
 
   if (exitJump != -1) {
     patchJump(exitJump);
-    emitByte(OP_POP); // Condition.
+  } else if (deadStart != -1) {
+    discardCode(deadStart, wasUnreachable);
+  } else {
+    current->unreachable = true; // ループを抜ける手段がない
   }
 
   endScope();
@@ -1031,21 +1607,38 @@ static void ifStatement() {
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition."); // [paren]
 
-  // 条件が偽の場合はif文の終了アドレスまでジャンプする
-  int thenJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP); // 条件式の結果はもういらないのでPOPする(真のとき)
-  statement(); // then節
-
-  // else節を実行してはいけないので else の後にJUMPする
-  int elseJump = emitJump(OP_JUMP);
+  // 条件がリテラルなら実行されない側の節はコードを捨てる.
+  bool truthy;
+  if (constantCondition(&truthy)) {
+    bool wasUnreachable = current->unreachable;
+    int deadStart = currentChunk()->count;
+    statement(); // then節
+    if (!truthy) discardCode(deadStart, wasUnreachable);
+
+    if (match(TOKEN_ELSE)) {
+      wasUnreachable = current->unreachable;
+      deadStart = currentChunk()->count;
+      statement();
+      if (truthy) discardCode(deadStart, wasUnreachable);
+    }
+    return;
+  }
 
-  patchJump(thenJump); // 仮置きしたオペランドを更新する
-  emitByte(OP_POP); // 条件式の結果はもういらないのでPOPする(偽のとき)
+  // 条件が偽の場合はif文の終了アドレスまでジャンプする.
+  // 条件式の結果は分岐と同時に POP される.
+  int thenJump = emitJump(OP_POP_JUMP_IF_FALSE);
+  statement(); // then節
 
   // else節があるなら再び文の解析に入る -> else | if (...) という流れで else if が実現できる.
-  if (match(TOKEN_ELSE)) statement();
-  // else を実行しなかった場合の飛び先はこちら
-  patchJump(elseJump);
+  if (match(TOKEN_ELSE)) {
+    // else節を実行してはいけないので then節の後に else の後ろまでJUMPする
+    int elseJump = emitJump(OP_JUMP);
+    patchJump(thenJump); // 仮置きしたオペランドを更新する
+    statement();
+    patchJump(elseJump);
+  } else {
+    patchJump(thenJump);
+  }
 }
 
 static void printStatement() {
@@ -1071,25 +1664,43 @@ static void returnStatement() {
     // 返り値のがある場合はそれをPUSHしたあとに0P_RETURN.
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+    // 返り値が関数呼び出しの結果そのものなら末尾呼び出しにする. OP_RETURN は残しておく.
+    if (fusable(1) != -1 && recentByte(0, 0) == OP_CALL) {
+      currentChunk()->code[current->recent[0]] = OP_TAIL_CALL;
+    }
     emitByte(OP_RETURN);
   }
+  current->unreachable = true;
 }
 
 static void whileStatement() {
-  int loopStart = currentChunk()->count; // 開始アドレスを取得しておく
+  bool wasUnreachable = current->unreachable;
+  int loopStart = markJumpTarget(); // 開始アドレスを取得しておく
   // while `(条件式)` のコンパイル
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+  bool truthy;
+  if (constantCondition(&truthy)) {
+    statement();
+    emitLoop(loopStart);
+    if (truthy) {
+      current->unreachable = true; // ループを抜ける手段がない
+    } else {
+      // 一度も実行されないループは丸ごと捨てる. ループの大きさの検査は済ませておく.
+      discardCode(loopStart, wasUnreachable);
+    }
+    return;
+  }
+
   // 条件式が偽なら終わりまでJUMP
-  int exitJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP); // 条件式の評価結果は不要なのでPOP(真の場合)
+  // 条件式の評価結果は分岐と同時に POP される
+  int exitJump = emitJump(OP_POP_JUMP_IF_FALSE);
   statement();
   emitLoop(loopStart); // 開始アドレスまで戻る
 
   patchJump(exitJump);
-  emitByte(OP_POP); // 条件式の評価結果は不要なのでPOP(偽の場合)
 }
 
 static void synchronize() {
@@ -1119,6 +1730,9 @@ static void synchronize() {
 // declaration は宣言をパースする.
 // 宣言はソースコードのトップレベルやブロック内で許可された文法を処理する.
 static void declaration() {
+  // return の後など到達できない宣言も, エラーを報告するために解析だけはしてコードを捨てる.
+  int deadStart = current->unreachable ? currentChunk()->count : -1;
+
   if (match(TOKEN_CLASS)) {
     classDeclaration();
   } else if (match(TOKEN_FUN)) {
@@ -1132,6 +1746,7 @@ static void declaration() {
     statement();
   }
 
+  if (deadStart != -1) discardCode(deadStart, true);
   if (parser.panicMode) synchronize();
 }
 
@@ -1158,7 +1773,8 @@ static void statement() {
 }
 
 ObjFunction *compile(const char *source) {
-  initScanner(source);
+  scanTokens(source, &parser.tokens);
+  parser.next = 0;
 /* Scanning on Demand dump-tokens < Compiling Expressions compile-chunk
   int line = -1;
   for (;;) {
@@ -1198,6 +1814,8 @@ ObjFunction *compile(const char *source) {
 
   // エラーがなければコンパイルした関数オブジェクトの参照を返す.
   ObjFunction *function = endCompiler();
+  freeCompiler(&compiler);
+  freeTokens(&parser.tokens);
   return parser.hadError ? NULL : function;
 }
 
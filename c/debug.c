@@ -2,7 +2,9 @@
 
 #include "debug.h"
 #include "object.h"
+#include "regcode.h"
 #include "value.h"
+#include "vm.h"
 
 void disassembleChunk(Chunk *chunk, const char *name) {
   printf("== %s ==\n", name); // ヘッダー
@@ -21,6 +23,15 @@ static int constantInstruction(const char *name, Chunk *chunk,
   return offset + 2;
 }
 
+// globalInstruction はグローバル変数のスロット番号をオペランドに持つ命令を表示する.
+static int globalInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  printf("%-16s %4d '", name, slot);
+  printValue(vm.globalNames.values[slot]);
+  printf("'\n");
+  return offset + 2;
+}
+
 static int invokeInstruction(const char *name, Chunk *chunk,
                              int offset) {
   uint8_t constant = chunk->code[offset + 1];
@@ -31,6 +42,134 @@ static int invokeInstruction(const char *name, Chunk *chunk,
   return offset + 3;
 }
 
+// cachedInvokeInstruction はインラインキャッシュのオペランドを持つ OP_INVOKE を表示する.
+static int cachedInvokeInstruction(const char *name, Chunk *chunk,
+                                   int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint8_t argCount = chunk->code[offset + 2];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+  cache |= chunk->code[offset + 4];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' ic %d\n", cache);
+  return offset + 5;
+}
+
+// cachedConstantInstruction は定数とインラインキャッシュのオペランドを持つ命令を表示する.
+static int cachedConstantInstruction(const char *name, Chunk *chunk,
+                                     int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+  cache |= chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' ic %d\n", cache);
+  return offset + 4;
+}
+
+// localPropertyInstruction は OP_GET_LOCAL_PROPERTY と OP_GET_LOCAL_FIELD を表示する.
+static int localPropertyInstruction(const char *name, Chunk *chunk,
+                                    int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+  cache |= chunk->code[offset + 4];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' ic %d\n", cache);
+  return offset + 5;
+}
+
+// constantJumpInstruction は定数とジャンプ先のオペランドを持つ命令を表示する.
+static int constantJumpInstruction(const char *name, Chunk *chunk,
+                                   int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 2] << 8);
+  jump |= chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' %d -> %d\n", offset, offset + 4 + jump);
+  return offset + 4;
+}
+
+// localConstantInstruction はスロット番号と定数のオペランドを持つ命令を表示する.
+static int localConstantInstruction(const char *name, Chunk *chunk,
+                                    int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
+// wideInstruction は OP_WIDE とそれに続く命令をまとめて表示する.
+static int wideInstruction(Chunk *chunk, int offset) {
+  static const char *names[] = {
+#define OPCODE(name, length) "OP_" #name,
+#include "opcodes.h"
+#undef OPCODE
+  };
+
+  uint8_t instruction = chunk->code[offset + 1];
+  const char *name = names[instruction];
+  int operand = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+  offset += 4;
+  printf("OP_WIDE ");
+
+  switch (instruction) {
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_OUTER:
+    case OP_SET_OUTER:
+      printf("%-16s %4d\n", name, operand);
+      return offset;
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+      printf("%-16s %4d '", name, operand);
+      printValue(vm.globalNames.values[operand]);
+      printf("'\n");
+      return offset;
+    case OP_CLOSURE:
+    case OP_SHARED_CLOSURE: {
+      printf("%-16s %4d ", name, operand);
+      printValue(chunk->constants.values[operand]);
+      printf("\n");
+
+      ObjFunction *function = AS_FUNCTION(chunk->constants.values[operand]);
+      for (int j = 0; j < function->upvalueCount; j++) {
+        int isLocal = chunk->code[offset];
+        int index = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+        printf("%04d      |                     %s %d\n",
+               offset, isLocal ? "local" : "upvalue", index);
+        offset += 3;
+      }
+      return offset;
+    }
+    default:
+      // 残りはすべて定数をオペランドに持つ命令
+      if (instruction == OP_INVOKE || instruction == OP_INVOKE_METHOD ||
+          instruction == OP_SUPER_INVOKE) {
+        printf("%-16s (%d args) %4d '", name, chunk->code[offset++], operand);
+      } else {
+        printf("%-16s %4d '", name, operand);
+      }
+      printValue(chunk->constants.values[operand]);
+      printf("'");
+      if (instruction == OP_GET_PROPERTY || instruction == OP_SET_PROPERTY ||
+          instruction == OP_INVOKE || instruction == OP_GET_FIELD ||
+          instruction == OP_INVOKE_METHOD) {
+        printf(" ic %d", (chunk->code[offset] << 8) | chunk->code[offset + 1]);
+        offset += 2;
+      }
+      printf("\n");
+      return offset;
+  }
+}
+
 static int simpleInstruction(const char *name, int offset) {
   printf("%s\n", name);
   return offset + 1;
@@ -59,10 +198,11 @@ static int jumpInstruction(const char *name, int sign,
 // デバッグ用関数
 int disassembleInstruction(Chunk *chunk, int offset) {
   printf("%04d ", offset);
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
   }
 
   uint8_t instruction = chunk->code[offset];
@@ -82,20 +222,24 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     case OP_SET_LOCAL:
       return byteInstruction("OP_SET_LOCAL", chunk, offset);
     case OP_GET_GLOBAL:
-      return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+      return globalInstruction("OP_GET_GLOBAL", chunk, offset);
     case OP_DEFINE_GLOBAL:
-      return constantInstruction("OP_DEFINE_GLOBAL", chunk,
+      return globalInstruction("OP_DEFINE_GLOBAL", chunk,
                                  offset);
     case OP_SET_GLOBAL:
-      return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+      return globalInstruction("OP_SET_GLOBAL", chunk, offset);
     case OP_GET_UPVALUE:
       return byteInstruction("OP_GET_UPVALUE", chunk, offset);
     case OP_SET_UPVALUE:
       return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+    case OP_GET_OUTER:
+      return byteInstruction("OP_GET_OUTER", chunk, offset);
+    case OP_SET_OUTER:
+      return byteInstruction("OP_SET_OUTER", chunk, offset);
     case OP_GET_PROPERTY:
-      return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+      return cachedConstantInstruction("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
-      return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+      return cachedConstantInstruction("OP_SET_PROPERTY", chunk, offset);
     case OP_GET_SUPER:
       return constantInstruction("OP_GET_SUPER", chunk, offset);
     case OP_EQUAL:
@@ -126,14 +270,19 @@ int disassembleInstruction(Chunk *chunk, int offset) {
       return jumpInstruction("OP_LOOP", -1, chunk, offset);
     case OP_CALL:
       return byteInstruction("OP_CALL", chunk, offset);
+    case OP_TAIL_CALL:
+      return byteInstruction("OP_TAIL_CALL", chunk, offset);
     case OP_INVOKE:
-      return invokeInstruction("OP_INVOKE", chunk, offset);
+      return cachedInvokeInstruction("OP_INVOKE", chunk, offset);
     case OP_SUPER_INVOKE:
       return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
-    case OP_CLOSURE: {
+    case OP_CLOSURE:
+    case OP_SHARED_CLOSURE: {
+      const char *name = instruction == OP_CLOSURE ? "OP_CLOSURE"
+                                                   : "OP_SHARED_CLOSURE";
       offset++;
       uint8_t constant = chunk->code[offset++];
-      printf("%-16s %4d ", "OP_CLOSURE", constant);
+      printf("%-16s %4d ", name, constant);
       printValue(chunk->constants.values[constant]);
       printf("\n");
 
@@ -158,8 +307,195 @@ int disassembleInstruction(Chunk *chunk, int offset) {
       return simpleInstruction("OP_INHERIT", offset);
     case OP_METHOD:
       return constantInstruction("OP_METHOD", chunk, offset);
+    case OP_WIDE:
+      return wideInstruction(chunk, offset);
+    case OP_POP_JUMP_IF_FALSE:
+      return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_GET_LOCAL_PROPERTY:
+      return localPropertyInstruction("OP_GET_LOCAL_PROPERTY", chunk, offset);
+    case OP_ADD_CONSTANT:
+      return constantInstruction("OP_ADD_CONSTANT", chunk, offset);
+    case OP_SUBTRACT_CONSTANT:
+      return constantInstruction("OP_SUBTRACT_CONSTANT", chunk, offset);
+    case OP_LESS_CONSTANT:
+      return constantInstruction("OP_LESS_CONSTANT", chunk, offset);
+    case OP_EQUAL_CONSTANT:
+      return constantInstruction("OP_EQUAL_CONSTANT", chunk, offset);
+    case OP_LESS_CONSTANT_JUMP:
+      return constantJumpInstruction("OP_LESS_CONSTANT_JUMP", chunk, offset);
+    case OP_INCREMENT_LOCAL:
+      return localConstantInstruction("OP_INCREMENT_LOCAL", chunk, offset);
+    case OP_BUILD_LIST:
+      return byteInstruction("OP_BUILD_LIST", chunk, offset);
+    case OP_GET_INDEX:
+      return simpleInstruction("OP_GET_INDEX", offset);
+    case OP_SET_INDEX:
+      return simpleInstruction("OP_SET_INDEX", offset);
+    case OP_ADD_NUM:
+      return simpleInstruction("OP_ADD_NUM", offset);
+    case OP_GET_FIELD:
+      return cachedConstantInstruction("OP_GET_FIELD", chunk, offset);
+    case OP_INVOKE_METHOD:
+      return cachedInvokeInstruction("OP_INVOKE_METHOD", chunk, offset);
+    case OP_GET_LOCAL_FIELD:
+      return localPropertyInstruction("OP_GET_LOCAL_FIELD", chunk, offset);
     default:
       printf("Unknown opcode %d\n", instruction);
       return offset + 1;
   }
 }
+
+// レジスタ層 -------------------------------------------------------------------
+
+void disassembleRegisterCode(ObjFunction *function) {
+  printf("== %s (registers: %d) ==\n",
+         function->name != NULL ? function->name->chars : "<script>",
+         function->registers->frameSize);
+
+  for (int offset = 0; offset < function->registers->count;) {
+    offset = disassembleRegisterInstruction(function, offset);
+  }
+}
+
+static void printConstant(ObjFunction *function, int constant) {
+  printf(" '");
+  printValue(function->chunk.constants.values[constant]);
+  printf("'");
+}
+
+int disassembleRegisterInstruction(ObjFunction *function, int offset) {
+  static const char *names[] = {
+#define REGOP(name, length) "REG_" #name,
+#include "regops.h"
+#undef REGOP
+  };
+
+  RegisterCode *code = function->registers;
+  uint32_t word = code->code[offset];
+  uint32_t extra = offset + 1 < code->count ? code->code[offset + 1] : 0;
+  int next = offset + registerInstructionLength(function, offset);
+
+  printf("%04d ", offset);
+  int line = getLine(&function->chunk, code->origins[offset]);
+  if (offset > 0 &&
+      line == getLine(&function->chunk, code->origins[offset - 1])) {
+    printf("   | ");
+  } else {
+    printf("%4d ", line);
+  }
+  printf("%-28s", names[REG_OP(word)]);
+
+  switch (REG_OP(word)) {
+    case REG_MOVE:
+    case REG_NOT:
+    case REG_NEGATE:
+      printf(" r%d r%d", REG_A(word), REG_B(word));
+      break;
+    case REG_LOADK:
+    case REG_CLASS:
+    case REG_METHOD:
+      printf(" r%d", REG_A(word));
+      printConstant(function, REG_BX(word));
+      break;
+    case REG_GET_GLOBAL:
+    case REG_DEFINE_GLOBAL:
+    case REG_SET_GLOBAL:
+      printf(" r%d '", REG_A(word));
+      printValue(vm.globalNames.values[REG_BX(word)]);
+      printf("'");
+      break;
+    case REG_GET_UPVALUE:
+    case REG_SET_UPVALUE:
+      printf(" r%d u%d", REG_A(word), REG_BX(word));
+      break;
+    case REG_GET_OUTER:
+    case REG_SET_OUTER:
+      printf(" r%d outer r%d", REG_A(word), REG_BX(word));
+      break;
+    case REG_GET_PROPERTY:
+    case REG_SET_PROPERTY:
+      printf(" r%d r%d", REG_A(word), REG_B(word));
+      printConstant(function, extra & 0xffff);
+      printf(" ic %d", extra >> 16);
+      break;
+    case REG_GET_SUPER:
+      printf(" r%d", REG_A(word));
+      printConstant(function, extra);
+      break;
+    case REG_EQUAL:
+    case REG_GREATER:
+    case REG_LESS:
+    case REG_ADD:
+    case REG_SUBTRACT:
+    case REG_MULTIPLY:
+    case REG_DIVIDE:
+    case REG_GET_INDEX:
+    case REG_SET_INDEX:
+      printf(" r%d r%d r%d", REG_A(word), REG_B(word), REG_C(word));
+      break;
+    case REG_BUILD_LIST:
+      printf(" r%d (%d items)", REG_A(word), REG_B(word));
+      break;
+    case REG_EQUAL_CONSTANT:
+    case REG_GREATER_CONSTANT:
+    case REG_LESS_CONSTANT:
+    case REG_ADD_CONSTANT:
+    case REG_SUBTRACT_CONSTANT:
+    case REG_MULTIPLY_CONSTANT:
+    case REG_DIVIDE_CONSTANT:
+      printf(" r%d r%d", REG_A(word), REG_B(word));
+      printConstant(function, REG_C(word));
+      break;
+    case REG_LOADNIL:
+    case REG_LOADTRUE:
+    case REG_LOADFALSE:
+    case REG_PRINT:
+    case REG_CLOSE_UPVALUE:
+    case REG_RETURN:
+    case REG_INHERIT:
+      printf(" r%d", REG_A(word));
+      break;
+    case REG_JUMP:
+      printf(" -> %d", next + REG_SAX(word));
+      break;
+    case REG_JUMP_IF_FALSE:
+      printf(" r%d -> %d", REG_A(word), next + REG_SBX(word));
+      break;
+    case REG_JUMP_IF_NOT_LESS:
+    case REG_JUMP_IF_NOT_GREATER:
+      printf(" r%d r%d -> %d", REG_B(word), REG_C(word),
+             next + (int32_t) extra);
+      break;
+    case REG_JUMP_IF_NOT_LESS_CONSTANT:
+    case REG_JUMP_IF_NOT_GREATER_CONSTANT:
+      printf(" r%d", REG_B(word));
+      printConstant(function, REG_C(word));
+      printf(" -> %d", next + (int32_t) extra);
+      break;
+    case REG_CALL:
+    case REG_TAIL_CALL:
+      printf(" r%d (%d args)", REG_A(word), REG_B(word));
+      break;
+    case REG_INVOKE:
+      printf(" r%d (%d args)", REG_A(word), REG_B(word));
+      printConstant(function, extra & 0xffff);
+      printf(" ic %d", extra >> 16);
+      break;
+    case REG_SUPER_INVOKE:
+      printf(" r%d (%d args)", REG_A(word), REG_B(word));
+      printConstant(function, extra);
+      break;
+    case REG_CLOSURE:
+    case REG_SHARED_CLOSURE:
+      printf(" r%d", REG_A(word));
+      printConstant(function, REG_BX(word));
+      for (int i = offset + 1; i < next; i++) {
+        uint32_t capture = code->code[i];
+        printf("\n%04d      |%28s %s %d", i, "",
+               (capture & 0xff) ? "local" : "upvalue", capture >> 8);
+      }
+      break;
+  }
+  printf("\n");
+  return next;
+}
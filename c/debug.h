@@ -2,9 +2,15 @@
 #define clox_debug_h
 
 #include "chunk.h"
+#include "object.h"
 
 void disassembleChunk(Chunk *chunk, const char *name);
 
 int disassembleInstruction(Chunk *chunk, int offset);
 
+// レジスタ層に翻訳した function の命令列を表示する.
+void disassembleRegisterCode(ObjFunction *function);
+
+int disassembleRegisterInstruction(ObjFunction *function, int offset);
+
 #endif
@@ -0,0 +1,510 @@
+// mkdir() と rename() の宣言のため. -std=c99 では POSIX の宣言が隠れてしまう.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
+#endif
+
+#include "compiler.h"
+#include "image.h"
+#include "memory.h"
+
+// イメージの形式 (整数はすべてリトルエンディアン):
+//
+//   ヘッダ   magic "LOXI", u32 版数, u32 命令一覧の指紋, u64 ソースのハッシュ値,
+//            u64 本体のチェックサム
+//   本体     u32 グローバル変数の数, その数だけの変数名(文字列),
+//            スクリプト関数(関数)
+//
+//   文字列   u32 長さ, 文字の並び
+//   関数     u32 引数の数, u32 upvalue の数, u32 スロット数, u8 名前の有無, [名前(文字列)],
+//            u32 命令のバイト数, 命令列, u32 行番号表の項目数, 項目ごとの (u32 offset, u32 行番号),
+//            u32 インラインキャッシュの数, u32 定数の数, 定数
+//   定数     u8 種類, 数値なら u64 (double のビット列), 文字列/関数ならその中身
+//
+// グローバル変数の命令はスロット番号をオペランドに持つが, スロット番号は VM ごとに採番される.
+// そのため書き出したときのスロット順の変数名を保存しておき, 読み込み時に今の VM のスロットに付け替える.
+
+#define HEADER_SIZE (IMAGE_MAGIC_LENGTH + 4 + 4 + 8 + 8)
+
+typedef enum {
+  CONSTANT_NUMBER,
+  CONSTANT_STRING,
+  CONSTANT_FUNCTION,
+} ConstantTag;
+
+// Writer は書き出すイメージの本体をためておくバッファ.
+typedef struct {
+  uint8_t *bytes;
+  int count;
+  int capacity;
+} Writer;
+
+// Reader は読み込み中のイメージの位置を表す. 範囲外を読もうとすると error が立つ.
+typedef struct {
+  const uint8_t *current;
+  const uint8_t *end;
+  bool error;
+  int *globalMap;  // イメージのスロット番号 -> 今の VM のスロット番号
+  int globalCount;
+} Reader;
+
+static uint64_t fnv1a(const uint8_t *bytes, size_t length) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+uint64_t hashSource(const char *source, size_t length) {
+  return fnv1a((const uint8_t *) source, length);
+}
+
+// opcodeFingerprint は命令の名前と長さの一覧から作った値を返す.
+// 命令を追加したり並べ替えたりすると変わるので, 古い実行ファイルが書いたイメージを読まずに済む.
+static uint32_t opcodeFingerprint() {
+  static const char opcodes[] =
+#define OPCODE(name, length) #name ":" #length ","
+#include "opcodes.h"
+#undef OPCODE
+      ;
+  return (uint32_t) fnv1a((const uint8_t *) opcodes, sizeof(opcodes) - 1);
+}
+
+bool isImage(const char *data, size_t length) {
+  return length >= IMAGE_MAGIC_LENGTH &&
+         memcmp(data, IMAGE_MAGIC, IMAGE_MAGIC_LENGTH) == 0;
+}
+
+// 書き出し ---------------------------------------------------------------------
+
+static void writeByte(Writer *writer, uint8_t byte) {
+  if (writer->capacity < writer->count + 1) {
+    int oldCapacity = writer->capacity;
+    writer->capacity = GROW_CAPACITY(oldCapacity);
+    writer->bytes = GROW_ARRAY(uint8_t, writer->bytes,
+                               oldCapacity, writer->capacity);
+  }
+  writer->bytes[writer->count++] = byte;
+}
+
+static void writeU32(Writer *writer, uint32_t value) {
+  for (int i = 0; i < 4; i++) writeByte(writer, (value >> (i * 8)) & 0xff);
+}
+
+static void writeU64(Writer *writer, uint64_t value) {
+  for (int i = 0; i < 8; i++) writeByte(writer, (value >> (i * 8)) & 0xff);
+}
+
+static void writeString(Writer *writer, ObjString *string) {
+  writeU32(writer, (uint32_t) string->length);
+  for (int i = 0; i < string->length; i++) {
+    writeByte(writer, (uint8_t) string->chars[i]);
+  }
+}
+
+static void writeFunction(Writer *writer, ObjFunction *function) {
+  writeU32(writer, (uint32_t) function->arity);
+  writeU32(writer, (uint32_t) function->upvalueCount);
+  writeU32(writer, (uint32_t) function->maxStack);
+  writeByte(writer, function->nonEscaping);
+  writeByte(writer, function->name != NULL);
+  if (function->name != NULL) writeString(writer, function->name);
+
+  Chunk *chunk = &function->chunk;
+  writeU32(writer, (uint32_t) chunk->count);
+  for (int i = 0; i < chunk->count; i++) writeByte(writer, chunk->code[i]);
+  writeU32(writer, (uint32_t) chunk->lineCount);
+  for (int i = 0; i < chunk->lineCount; i++) {
+    writeU32(writer, (uint32_t) chunk->lines[i].offset);
+    writeU32(writer, (uint32_t) chunk->lines[i].line);
+  }
+  writeU32(writer, (uint32_t) chunk->cacheCount);
+
+  writeU32(writer, (uint32_t) chunk->constants.count);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (IS_NUMBER(constant)) {
+      double number = AS_NUMBER(constant);
+      uint64_t bits;
+      memcpy(&bits, &number, sizeof(bits));
+      writeByte(writer, CONSTANT_NUMBER);
+      writeU64(writer, bits);
+    } else if (IS_STRING(constant)) {
+      writeByte(writer, CONSTANT_STRING);
+      writeString(writer, AS_STRING(constant));
+    } else {
+      writeByte(writer, CONSTANT_FUNCTION);
+      writeFunction(writer, AS_FUNCTION(constant));
+    }
+  }
+}
+
+bool writeImage(FILE *file, ObjFunction *script, uint64_t sourceHash) {
+  Writer writer = {NULL, 0, 0};
+  writeU32(&writer, (uint32_t) vm.globalNames.count);
+  for (int i = 0; i < vm.globalNames.count; i++) {
+    writeString(&writer, AS_STRING(vm.globalNames.values[i]));
+  }
+  writeFunction(&writer, script);
+
+  Writer header = {NULL, 0, 0};
+  for (int i = 0; i < IMAGE_MAGIC_LENGTH; i++) {
+    writeByte(&header, (uint8_t) IMAGE_MAGIC[i]);
+  }
+  writeU32(&header, IMAGE_VERSION);
+  writeU32(&header, opcodeFingerprint());
+  writeU64(&header, sourceHash);
+  writeU64(&header, fnv1a(writer.bytes, (size_t) writer.count));
+
+  bool ok = fwrite(header.bytes, 1, header.count, file) == (size_t) header.count &&
+            fwrite(writer.bytes, 1, writer.count, file) == (size_t) writer.count;
+
+  FREE_ARRAY(uint8_t, header.bytes, header.capacity);
+  FREE_ARRAY(uint8_t, writer.bytes, writer.capacity);
+  return ok;
+}
+
+// 読み込み ---------------------------------------------------------------------
+
+static uint8_t readByte(Reader *reader) {
+  if (reader->current >= reader->end) {
+    reader->error = true;
+    return 0;
+  }
+  return *reader->current++;
+}
+
+static uint32_t readU32(Reader *reader) {
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) value |= (uint32_t) readByte(reader) << (i * 8);
+  return value;
+}
+
+static uint64_t readU64(Reader *reader) {
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) value |= (uint64_t) readByte(reader) << (i * 8);
+  return value;
+}
+
+// readCount は後続の要素数を読む. 残りのバイト数より多い数は壊れているとみなす.
+static int readCount(Reader *reader) {
+  uint32_t count = readU32(reader);
+  if (count > (uint32_t) (reader->end - reader->current)) {
+    reader->error = true;
+    return 0;
+  }
+  return (int) count;
+}
+
+static ObjString *readString(Reader *reader) {
+  int length = readCount(reader);
+  if (reader->error) return NULL;
+  ObjString *string = copyString((const char *) reader->current, length);
+  reader->current += length;
+  return string;
+}
+
+// validLength は offset の命令がチャンクに収まっていればその長さを, 壊れていれば -1 を返す.
+// instructionLength() は正しい命令列を前提にしているので, 先にこちらで検査する.
+static int validLength(Chunk *chunk, int offset) {
+  static const int opcodeCount = 0
+#define OPCODE(name, length) +1
+#include "opcodes.h"
+#undef OPCODE
+      ;
+
+  bool wide = chunk->code[offset] == OP_WIDE;
+  int operand = offset + (wide ? 2 : 1);
+  if (wide && operand > chunk->count) return -1;
+  uint8_t instruction = chunk->code[offset + (wide ? 1 : 0)];
+  if (instruction >= opcodeCount || (wide && instruction == OP_WIDE)) return -1;
+
+  if (instruction == OP_CLOSURE || instruction == OP_SHARED_CLOSURE) {
+    if (operand + (wide ? 2 : 1) > chunk->count) return -1;
+    int constant = chunk->code[operand];
+    if (wide) constant = (constant << 8) | chunk->code[operand + 1];
+    if (constant >= chunk->constants.count ||
+        !IS_FUNCTION(chunk->constants.values[constant])) {
+      return -1;
+    }
+    // 使い回すクロージャは nonEscaping な関数にしかない
+    if (instruction == OP_SHARED_CLOSURE &&
+        !AS_FUNCTION(chunk->constants.values[constant])->nonEscaping) {
+      return -1;
+    }
+  }
+
+  int length = instructionLength(chunk, offset);
+  return offset + length <= chunk->count ? length : -1;
+}
+
+// remapGlobals はグローバル変数の命令のオペランドを今の VM のスロット番号に付け替える.
+// 命令列が壊れている場合や, 付け替え先が 1byte のオペランドに収まらない場合は失敗する.
+static bool remapGlobals(Reader *reader, Chunk *chunk) {
+  int length;
+  for (int offset = 0; offset < chunk->count; offset += length) {
+    length = validLength(chunk, offset);
+    if (length < 0) return false;
+
+    bool wide = chunk->code[offset] == OP_WIDE;
+
+    uint8_t instruction = chunk->code[offset + (wide ? 1 : 0)];
+    if (instruction != OP_GET_GLOBAL && instruction != OP_DEFINE_GLOBAL &&
+        instruction != OP_SET_GLOBAL) {
+      continue;
+    }
+
+    int operand = offset + (wide ? 2 : 1);
+
+    int slot = chunk->code[operand];
+    if (wide) slot = (slot << 8) | chunk->code[operand + 1];
+    if (slot >= reader->globalCount) return false;
+
+    int newSlot = reader->globalMap[slot];
+    if (wide) {
+      chunk->code[operand] = (newSlot >> 8) & 0xff;
+      chunk->code[operand + 1] = newSlot & 0xff;
+    } else if (newSlot <= UINT8_MAX) {
+      chunk->code[operand] = (uint8_t) newSlot;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// readFunction は関数を一つ読み込む.
+// 確保したオブジェクトが GC に回収されないように, 読み込み中の関数はスタックに積んでおく.
+static ObjFunction *readFunction(Reader *reader) {
+  ObjFunction *function = newFunction();
+  push(OBJ_VAL(function));
+
+  function->arity = (int) readU32(reader);
+  function->upvalueCount = (int) readU32(reader);
+  function->maxStack = (int) readU32(reader);
+  if (readByte(reader)) markNonEscaping(function);
+  if (readByte(reader)) {
+    function->name = readString(reader);
+    writeBarrier((Obj *) function);
+  }
+
+  Chunk *chunk = &function->chunk;
+  int count = readCount(reader);
+  const uint8_t *code = reader->current;
+  reader->current += reader->error ? 0 : count;
+
+  // 行番号表の各項目が受け持つ範囲の命令を, その行番号で書き込んでいく.
+  // 項目は offset の昇順で, 最初の項目は命令列の先頭から始まっていなければならない.
+  int lineCount = readCount(reader);
+  if (count > 0 && lineCount == 0) reader->error = true;
+  int offset = 0;
+  int line = 0;
+  for (int i = 0; i < lineCount && !reader->error; i++) {
+    int start = (int) readU32(reader);
+    int nextLine = (int) readU32(reader);
+    if (i == 0 ? start != 0 : start <= offset || start >= count) {
+      reader->error = true;
+      break;
+    }
+    for (; offset < start; offset++) writeChunk(chunk, code[offset], line);
+    line = nextLine;
+  }
+  for (; offset < count && !reader->error; offset++) {
+    writeChunk(chunk, code[offset], line);
+  }
+
+  int cacheCount = (int) readU32(reader);
+  for (int i = 0; i < cacheCount && !reader->error; i++) {
+    addInlineCache(chunk);
+  }
+
+  int constantCount = readCount(reader);
+  for (int i = 0; i < constantCount && !reader->error; i++) {
+    Value constant = NIL_VAL;
+    switch (readByte(reader)) {
+      case CONSTANT_NUMBER: {
+        uint64_t bits = readU64(reader);
+        double number;
+        memcpy(&number, &bits, sizeof(number));
+        constant = NUMBER_VAL(number);
+        break;
+      }
+      case CONSTANT_STRING: {
+        ObjString *string = readString(reader);
+        if (string != NULL) constant = OBJ_VAL(string);
+        break;
+      }
+      case CONSTANT_FUNCTION: {
+        ObjFunction *nested = readFunction(reader);
+        if (nested != NULL) constant = OBJ_VAL(nested);
+        break;
+      }
+      default:
+        reader->error = true;
+        break;
+    }
+    if (reader->error) break;
+
+    // 定数表の並びはオペランドと対応しているので addConstant の重複排除は通さない
+    push(constant);
+    writeValueArray(&chunk->constants, constant);
+    pop();
+    writeBarrier((Obj *) function);
+  }
+
+  if (!reader->error && !remapGlobals(reader, chunk)) reader->error = true;
+
+  pop();
+  return reader->error ? NULL : function;
+}
+
+ObjFunction *readImage(const char *data, size_t length,
+                       uint64_t sourceHash, bool checkHash) {
+  Reader reader;
+  reader.current = (const uint8_t *) data;
+  reader.end = reader.current + length;
+  reader.error = false;
+  reader.globalMap = NULL;
+  reader.globalCount = 0;
+
+  if (length < HEADER_SIZE || !isImage(data, length)) return NULL;
+  reader.current += IMAGE_MAGIC_LENGTH;
+  if (readU32(&reader) != IMAGE_VERSION) return NULL;
+  if (readU32(&reader) != opcodeFingerprint()) return NULL;
+  uint64_t imageHash = readU64(&reader);
+  if (checkHash && imageHash != sourceHash) return NULL;
+  uint64_t checksum = readU64(&reader);
+  if (checksum != fnv1a(reader.current, (size_t) (reader.end - reader.current))) {
+    return NULL;
+  }
+
+  // イメージを書き出した VM のスロット順に並んだ変数名を今の VM のスロットに対応付ける
+  reader.globalCount = readCount(&reader);
+  reader.globalMap = ALLOCATE(int, reader.globalCount);
+  for (int i = 0; i < reader.globalCount && !reader.error; i++) {
+    ObjString *name = readString(&reader);
+    if (name != NULL) reader.globalMap[i] = globalSlot(name);
+  }
+
+  ObjFunction *script = reader.error ? NULL : readFunction(&reader);
+  FREE_ARRAY(int, reader.globalMap, reader.globalCount);
+  if (reader.current != reader.end) return NULL;
+  return script;
+}
+
+// ディスク上のキャッシュ ----------------------------------------------------------------
+
+// cacheDirectory はキャッシュを置くディレクトリを buffer に書き, 作成を試みる.
+// LOX_CACHE_DIR, $XDG_CACHE_HOME/clox, $HOME/.cache/clox の順に探す.
+static bool cacheDirectory(char *buffer, size_t size) {
+  const char *dir = getenv("LOX_CACHE_DIR");
+  if (dir != NULL && dir[0] != '\0') {
+    snprintf(buffer, size, "%s", dir);
+  } else if ((dir = getenv("XDG_CACHE_HOME")) != NULL && dir[0] != '\0') {
+    snprintf(buffer, size, "%s/clox", dir);
+  } else if ((dir = getenv("HOME")) != NULL && dir[0] != '\0') {
+    snprintf(buffer, size, "%s/.cache", dir);
+    mkdir(buffer, 0755);
+    snprintf(buffer, size, "%s/.cache/clox", dir);
+  } else {
+    return false;
+  }
+
+  mkdir(buffer, 0755);
+  struct stat info;
+  return stat(buffer, &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+static char *readWholeFile(const char *path, size_t *length) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) return NULL;
+
+  fseek(file, 0L, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+
+  char *buffer = size < 0 ? NULL : (char *) malloc((size_t) size + 1);
+  if (buffer != NULL &&
+      fread(buffer, 1, (size_t) size, file) != (size_t) size) {
+    free(buffer);
+    buffer = NULL;
+  }
+
+  fclose(file);
+  *length = (size_t) size;
+  return buffer;
+}
+
+// buildIdentity は実行中の実行ファイルの中身のハッシュ値を *identity に入れる.
+// どのソースファイルを変えて作り直しても値が変わるので, 別のビルドが書いたイメージは読まない.
+// 実行ファイルを読めない環境では偽を返し, キャッシュを使わない.
+static bool buildIdentity(uint64_t *identity) {
+  static THREAD_LOCAL int state = 0; // 0: 未計算, 1: あり, -1: なし
+  static THREAD_LOCAL uint64_t value;
+  if (state == 0) {
+    state = -1;
+    char path[4096];
+#if defined(__linux__)
+    snprintf(path, sizeof(path), "/proc/self/exe");
+#elif defined(__APPLE__)
+    uint32_t size = sizeof(path);
+    if (_NSGetExecutablePath(path, &size) != 0) return false;
+#else
+    return false;
+#endif
+    size_t length;
+    char *executable = readWholeFile(path, &length);
+    if (executable != NULL) {
+      value = fnv1a((const uint8_t *) executable, length);
+      free(executable);
+      state = 1;
+    }
+  }
+  *identity = value;
+  return state == 1;
+}
+
+ObjFunction *compileCached(const char *source, size_t length) {
+  // キャッシュのキーには実行ファイルのハッシュ値も混ぜる. コンパイラを作り直したら古い出力は使わない.
+  uint64_t build;
+  char dir[1024];
+  char path[1100];
+  if (!buildIdentity(&build) || !cacheDirectory(dir, sizeof(dir))) {
+    return compile(source);
+  }
+  uint64_t hash = hashSource(source, length) ^ build;
+  snprintf(path, sizeof(path), "%s/%016llx.loxi", dir, (unsigned long long) hash);
+
+  size_t imageLength;
+  char *image = readWholeFile(path, &imageLength);
+  if (image != NULL) {
+    ObjFunction *function = readImage(image, imageLength, hash, true);
+    free(image);
+    if (function != NULL) return function;
+  }
+
+  ObjFunction *function = compile(source);
+  if (function == NULL) return NULL;
+
+  // 書き出し途中のファイルを他のプロセスが読まないように, 一時ファイルに書いてから置き換える
+  char temp[1200];
+  snprintf(temp, sizeof(temp), "%s.%p.tmp", path, (void *) &temp);
+  FILE *file = fopen(temp, "wb");
+  if (file != NULL) {
+    push(OBJ_VAL(function));
+    bool written = writeImage(file, function, hash);
+    pop();
+    if (fclose(file) == 0 && written && rename(temp, path) == 0) {
+      return function;
+    }
+    remove(temp);
+  }
+  return function;
+}
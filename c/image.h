@@ -0,0 +1,36 @@
+#ifndef clox_image_h
+#define clox_image_h
+
+#include <stdio.h>
+
+#include "object.h"
+#include "vm.h"
+
+// イメージはコンパイル済みのスクリプト(ObjFunction の木)をそのままバイト列にしたもの.
+// 読み込めばスキャナとコンパイラを通さずに実行できる.
+#define IMAGE_MAGIC "LOXI"
+#define IMAGE_MAGIC_LENGTH 4
+
+// イメージの形式を変えたら上げること. 命令の一覧の変更は opcodes.h から自動で検出する.
+#define IMAGE_VERSION 4
+
+// hashSource はソースコードの 64bit ハッシュ値を返す. キャッシュのキーに使う.
+uint64_t hashSource(const char *source, size_t length);
+
+// isImage は data がイメージの先頭であれば真を返す.
+bool isImage(const char *data, size_t length);
+
+// writeImage はコンパイルしたスクリプト関数をイメージとして file に書き出す.
+bool writeImage(FILE *file, ObjFunction *script, uint64_t sourceHash);
+
+// readImage はイメージからスクリプト関数を復元する. 壊れている, 形式が違う,
+// あるいは checkHash が真で sourceHash と一致しない場合は NULL を返す.
+ObjFunction *readImage(const char *data, size_t length,
+                       uint64_t sourceHash, bool checkHash);
+
+// compileCached は呼び出し側がキャッシュを有効にしたとき (--cache か LOX_CACHE_DIR) に使う.
+// ディスク上のキャッシュにソースのハッシュ値で引けるイメージがあればそれを読み込み,
+// なければコンパイルしてキャッシュに保存する. コンパイルエラーなら NULL を返す.
+ObjFunction *compileCached(const char *source, size_t length);
+
+#endif
@@ -0,0 +1,1090 @@
+// mmap() と MAP_ANONYMOUS の宣言のため. -std=c99 では隠れてしまう.
+#define _DEFAULT_SOURCE
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+#include "memory.h"
+
+#ifdef JIT_AVAILABLE
+
+#include <sys/mman.h>
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+// CodeBlock は機械語を詰めて置く mmap() した領域. 関数ごとにページを分けると, どの関数の機械語も
+// ページ内の同じ位置から始まり, 命令キャッシュや分岐予測の同じ組を取り合ってしまう.
+// 領域はスレッドごとに別にするので, 書き込むために一時的に実行を禁止しても他のスレッドに影響しない.
+typedef struct CodeBlock {
+  uint8_t *memory;
+  size_t size;
+  size_t used;
+  int live; // この領域に置いた JitCode の数. 0 になったら解放する.
+} CodeBlock;
+
+#define CODE_BLOCK_SIZE (256 * 1024)
+
+static THREAD_LOCAL CodeBlock *currentBlock;
+
+// allocateCode は code の size バイトを実行可能なメモリに置き, その位置を返す. できなければ NULL を返す.
+static uint8_t *allocateCode(const uint8_t *code, size_t size,
+                             CodeBlock **block) {
+  // 入口は 16byte 境界に揃える
+  size_t offset = currentBlock == NULL
+                      ? 0
+                      : (currentBlock->used + 15) & ~(size_t) 15;
+  if (currentBlock == NULL || offset + size > currentBlock->size) {
+    size_t blockSize = size > CODE_BLOCK_SIZE ? size : CODE_BLOCK_SIZE;
+    void *memory = mmap(NULL, blockSize, PROT_READ | PROT_EXEC,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return NULL;
+    CodeBlock *fresh = (CodeBlock *) malloc(sizeof(CodeBlock));
+    if (fresh == NULL) exit(1); // out of memory
+    fresh->memory = (uint8_t *) memory;
+    fresh->size = blockSize;
+    fresh->used = 0;
+    fresh->live = 0;
+    // 前の領域は, そこに置いた JitCode がすべて解放されたときに解放される
+    if (currentBlock != NULL && currentBlock->live == 0) {
+      munmap(currentBlock->memory, currentBlock->size);
+      free(currentBlock);
+    }
+    currentBlock = fresh;
+    offset = 0;
+  }
+
+  // 実行中の機械語と同じ領域に書くこともあるが, このスレッドは書き終わるまでそれを実行しない
+  if (mprotect(currentBlock->memory, currentBlock->size,
+               PROT_READ | PROT_WRITE) != 0) {
+    return NULL;
+  }
+  memcpy(currentBlock->memory + offset, code, size);
+  if (mprotect(currentBlock->memory, currentBlock->size,
+               PROT_READ | PROT_EXEC) != 0) {
+    exit(1); // 書き込み中の領域は実行できない
+  }
+  currentBlock->used = offset + size;
+  currentBlock->live++;
+  *block = currentBlock;
+  return currentBlock->memory + offset;
+}
+
+// x86-64 の汎用レジスタの番号
+enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// コンパイル済みのコードの実行中に値を固定しておくレジスタ. どれも System V ABI の callee-saved なので,
+// jit* 関数を呼んでも保たれる. RAX, RCX, RDX, RSI, RDI と xmm0, xmm1 は命令の中だけで使う.
+#define SLOTS     RBX // frame->slots
+#define SP        R12 // スタックトップ. jit* 関数を呼ぶ間と抜けるときだけ vm.stackTop に書き戻す.
+#define CONSTANTS R13 // 関数の定数表
+#define UPVALUES  R14 // frame->closure->upvalues
+#define VMPTR     R15 // &vm. vm はスレッドごとにあるので, 入口で受け取る.
+#define QNANREG   RBP // QNAN. 数値かどうかの判定に使う.
+
+// 条件コード (jcc と setcc の下位 4bit)
+enum {
+  CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+  CC_S = 0x8, CC_NS = 0x9, CC_NP = 0xb,
+};
+
+// 即値のオペランドを取る命令の ModRM の reg 欄
+enum { ALU_ADD = 0, ALU_SUB = 5, ALU_CMP = 7 };
+
+// レジスタ同士の命令のオペコード (r/m64, r64 の形)
+enum {
+  RR_ADD = 0x01, RR_OR = 0x09, RR_AND = 0x21, RR_XOR = 0x31,
+  RR_CMP = 0x39, RR_TEST = 0x85, RR_MOV = 0x89,
+};
+
+// SSE2 のスカラー倍精度の演算 (F2 0F xx)
+enum { SSE_ADD = 0x58, SSE_MUL = 0x59, SSE_SUB = 0x5c, SSE_DIV = 0x5e };
+
+// Patch は後から飛び先を埋める rel32. exit なら target の命令で抜ける出口へ, そうでなければ target の命令へ飛ぶ.
+typedef struct {
+  int at;
+  int target;
+  bool exit;
+} Patch;
+
+typedef struct {
+  Chunk *chunk;
+  uint8_t *code;
+  int count;
+  int capacity;
+  int *labels; // バイトコードのオフセットごとの機械語の位置. 命令の先頭でなければ -1.
+  Patch *patches;
+  int patchCount;
+  int patchCapacity;
+  int epilogue;
+} Assembler;
+
+// 機械語を実行可能なメモリに移すまでの作業領域は reallocate() で確保するので, GCが走ることがある.
+// コンパイルする関数は実行中なのでGCから到達可能になっている.
+static void emitByte(Assembler *a, uint8_t byte) {
+  if (a->count + 1 > a->capacity) {
+    int oldCapacity = a->capacity;
+    a->capacity = GROW_CAPACITY(oldCapacity);
+    a->code = GROW_ARRAY(uint8_t, a->code, oldCapacity, a->capacity);
+  }
+  a->code[a->count++] = byte;
+}
+
+static void emitBytes(Assembler *a, const uint8_t *bytes, int count) {
+  for (int i = 0; i < count; i++) emitByte(a, bytes[i]);
+}
+
+static void emit2(Assembler *a, uint8_t first, uint8_t second) {
+  emitByte(a, first);
+  emitByte(a, second);
+}
+
+static void emit3(Assembler *a, uint8_t first, uint8_t second,
+                  uint8_t third) {
+  emit2(a, first, second);
+  emitByte(a, third);
+}
+
+static void emit32(Assembler *a, uint32_t value) {
+  for (int i = 0; i < 4; i++) emitByte(a, (uint8_t) (value >> (8 * i)));
+}
+
+static void emit64(Assembler *a, uint64_t value) {
+  for (int i = 0; i < 8; i++) emitByte(a, (uint8_t) (value >> (8 * i)));
+}
+
+static void put32(Assembler *a, int at, int32_t value) {
+  for (int i = 0; i < 4; i++) {
+    a->code[at + i] = (uint8_t) ((uint32_t) value >> (8 * i));
+  }
+}
+
+// REX 接頭辞. 64bit の演算か, 拡張レジスタ (R8-R15) を使うときだけ出力する.
+static void emitRex(Assembler *a, bool wide, int reg, int index, int base) {
+  uint8_t rex = (uint8_t) (0x40 | (wide ? 8 : 0) | ((reg >> 3) << 2) |
+                           ((index >> 3) << 1) | (base >> 3));
+  if (rex != 0x40) emitByte(a, rex);
+}
+
+// [base + disp] を指す ModRM (と SIB と変位).
+static void emitMemory(Assembler *a, int reg, int base, int32_t disp) {
+  int mod = disp == 0 && (base & 7) != RBP ? 0
+            : disp >= -128 && disp <= 127   ? 1
+                                            : 2;
+  emitByte(a, (uint8_t) ((mod << 6) | ((reg & 7) << 3) | (base & 7)));
+  if ((base & 7) == RSP) emitByte(a, 0x24);
+  if (mod == 1) emitByte(a, (uint8_t) disp);
+  if (mod == 2) emit32(a, (uint32_t) disp);
+}
+
+// mov dst, [base + disp]
+static void emitLoad(Assembler *a, int dst, int base, int32_t disp) {
+  emitRex(a, true, dst, 0, base);
+  emitByte(a, 0x8b);
+  emitMemory(a, dst, base, disp);
+}
+
+// mov [base + disp], src
+static void emitStore(Assembler *a, int base, int32_t disp, int src) {
+  emitRex(a, true, src, 0, base);
+  emitByte(a, 0x89);
+  emitMemory(a, src, base, disp);
+}
+
+// movsxd dst, dword [base + disp]
+static void emitLoadInt(Assembler *a, int dst, int base, int32_t disp) {
+  emitRex(a, true, dst, 0, base);
+  emitByte(a, 0x63);
+  emitMemory(a, dst, base, disp);
+}
+
+// mov dst, [base + index * 8]. base は RBP と R13 以外.
+static void emitLoadIndexed(Assembler *a, int dst, int base, int index) {
+  emitRex(a, true, dst, index, base);
+  emitByte(a, 0x8b);
+  emitByte(a, (uint8_t) (((dst & 7) << 3) | RSP));
+  emitByte(a, (uint8_t) ((3 << 6) | ((index & 7) << 3) | (base & 7)));
+}
+
+// op dst, src
+static void emitRR(Assembler *a, uint8_t op, int dst, int src) {
+  emitRex(a, true, src, 0, dst);
+  emitByte(a, op);
+  emitByte(a, (uint8_t) (0xc0 | ((src & 7) << 3) | (dst & 7)));
+}
+
+// cmp reg, [base + disp]
+static void emitCompareMemory(Assembler *a, int reg, int base, int32_t disp) {
+  emitRex(a, true, reg, 0, base);
+  emitByte(a, 0x3b);
+  emitMemory(a, reg, base, disp);
+}
+
+// cmp dword [base + disp], imm
+static void emitCompareInt(Assembler *a, int base, int32_t disp, int32_t imm) {
+  emitRex(a, false, 0, 0, base);
+  bool small = imm >= -128 && imm <= 127;
+  emitByte(a, small ? 0x83 : 0x81);
+  emitMemory(a, ALU_CMP, base, disp);
+  if (small) emitByte(a, (uint8_t) imm); else emit32(a, (uint32_t) imm);
+}
+
+// mov dword [base + disp], src
+static void emitStoreInt(Assembler *a, int base, int32_t disp, int src) {
+  emitRex(a, false, src, 0, base);
+  emitByte(a, 0x89);
+  emitMemory(a, src, base, disp);
+}
+
+// lea dst, [base + disp]
+static void emitLea(Assembler *a, int dst, int base, int32_t disp) {
+  emitRex(a, true, dst, 0, base);
+  emitByte(a, 0x8d);
+  emitMemory(a, dst, base, disp);
+}
+
+// shl reg, imm8
+static void emitShiftLeft(Assembler *a, int reg, uint8_t imm) {
+  emitRex(a, true, 0, 0, reg);
+  emitByte(a, 0xc1);
+  emitByte(a, (uint8_t) (0xe0 | (reg & 7)));
+  emitByte(a, imm);
+}
+
+// add/sub/cmp reg, imm
+static void emitALUImm(Assembler *a, int alu, int reg, int32_t imm) {
+  emitRex(a, true, 0, 0, reg);
+  if (imm >= -128 && imm <= 127) {
+    emitByte(a, 0x83);
+    emitByte(a, (uint8_t) (0xc0 | (alu << 3) | (reg & 7)));
+    emitByte(a, (uint8_t) imm);
+  } else {
+    emitByte(a, 0x81);
+    emitByte(a, (uint8_t) (0xc0 | (alu << 3) | (reg & 7)));
+    emit32(a, (uint32_t) imm);
+  }
+}
+
+// mov reg, imm64
+static void emitMoveImm(Assembler *a, int reg, uint64_t imm) {
+  emitRex(a, true, 0, 0, reg);
+  emitByte(a, (uint8_t) (0xb8 + (reg & 7)));
+  emit64(a, imm);
+}
+
+// movq xmm, reg
+static void emitToXmm(Assembler *a, int xmm, int reg) {
+  emitByte(a, 0x66);
+  emitRex(a, true, xmm, 0, reg);
+  emit2(a, 0x0f, 0x6e);
+  emitByte(a, (uint8_t) (0xc0 | ((xmm & 7) << 3) | (reg & 7)));
+}
+
+// movq reg, xmm
+static void emitFromXmm(Assembler *a, int reg, int xmm) {
+  emitByte(a, 0x66);
+  emitRex(a, true, xmm, 0, reg);
+  emit2(a, 0x0f, 0x7e);
+  emitByte(a, (uint8_t) (0xc0 | ((xmm & 7) << 3) | (reg & 7)));
+}
+
+// addsd などの xmm 同士の演算
+static void emitSSE(Assembler *a, uint8_t op, int dst, int src) {
+  emit3(a, 0xf2, 0x0f, op);
+  emitByte(a, (uint8_t) (0xc0 | (dst << 3) | src));
+}
+
+// ucomisd x, y
+static void emitUcomisd(Assembler *a, int x, int y) {
+  emit3(a, 0x66, 0x0f, 0x2e);
+  emitByte(a, (uint8_t) (0xc0 | (x << 3) | y));
+}
+
+// setcc reg8 (AL, CL, DL のいずれか)
+static void emitSet(Assembler *a, int cc, int reg) {
+  emit2(a, 0x0f, (uint8_t) (0x90 | cc));
+  emitByte(a, (uint8_t) (0xc0 | reg));
+}
+
+// 条件分岐 (cc < 0 なら無条件). 飛び先の rel32 の位置を返す.
+static int emitJump(Assembler *a, int cc) {
+  if (cc < 0) {
+    emitByte(a, 0xe9);
+  } else {
+    emit2(a, 0x0f, (uint8_t) (0x80 | cc));
+  }
+  emit32(a, 0);
+  return a->count - 4;
+}
+
+// bindJump は emitJump() の飛び先を現在の位置にする.
+static void bindJump(Assembler *a, int at) {
+  put32(a, at, a->count - (at + 4));
+}
+
+// jumpBack は出力済みの位置 at への分岐を出力する.
+static void jumpBack(Assembler *a, int cc, int at) {
+  int from = emitJump(a, cc);
+  put32(a, from, at - (from + 4));
+}
+
+static void addPatch(Assembler *a, int at, int target, bool exit) {
+  if (a->patchCount + 1 > a->patchCapacity) {
+    int oldCapacity = a->patchCapacity;
+    a->patchCapacity = GROW_CAPACITY(oldCapacity);
+    a->patches = GROW_ARRAY(Patch, a->patches, oldCapacity,
+                            a->patchCapacity);
+  }
+  a->patches[a->patchCount++] = (Patch) {at, target, exit};
+}
+
+// jumpToInstruction はバイトコードの target の命令への分岐を出力する.
+static void jumpToInstruction(Assembler *a, int cc, int target) {
+  addPatch(a, emitJump(a, cc), target, false);
+}
+
+// exitAt は offset の命令から先をインタプリタに任せる出口への分岐を出力する.
+static void exitAt(Assembler *a, int cc, int offset) {
+  addPatch(a, emitJump(a, cc), offset, true);
+}
+
+static void emitPush(Assembler *a, int reg) {
+  emitStore(a, SP, 0, reg);
+  emitALUImm(a, ALU_ADD, SP, 8);
+}
+
+// guardNumber は reg が数値でなければ分岐する. 分岐の rel32 の位置を返す.
+static int guardNumber(Assembler *a, int reg) {
+  emitRR(a, RR_MOV, RDX, reg);
+  emitRR(a, RR_AND, RDX, QNANREG);
+  emitRR(a, RR_CMP, RDX, QNANREG);
+  return emitJump(a, CC_E);
+}
+
+// callHelper は jit* 関数を offset の命令の位置で呼び, 偽が返ればその命令で抜ける.
+static void callHelper(Assembler *a, bool (*helper)(uint8_t *), int offset) {
+  emitStore(a, VMPTR, (int32_t) offsetof(VM, stackTop), SP);
+  emitMoveImm(a, RDI, (uint64_t) (uintptr_t) (a->chunk->code + offset));
+  emitMoveImm(a, RAX, (uint64_t) (uintptr_t) helper);
+  emit2(a, 0xff, 0xd0); // call rax
+  emitLoad(a, SP, VMPTR, (int32_t) offsetof(VM, stackTop));
+  emit2(a, 0x84, 0xc0); // test al, al
+  exitAt(a, CC_E, offset);
+}
+
+// emitResume は RAX の CallFrame に固定のレジスタを取り替え, その ip の入口に飛ぶ.
+// 入口と出口はどの関数でも同じなので, 別の関数の機械語に飛び移ってもよい.
+static void emitResume(Assembler *a) {
+  emitLoad(a, SLOTS, RAX, (int32_t) offsetof(CallFrame, slots));
+  emitLoad(a, RCX, RAX, (int32_t) offsetof(CallFrame, closure));
+  emitLoad(a, UPVALUES, RCX, (int32_t) offsetof(ObjClosure, upvalues));
+  emitLoad(a, RDX, RCX, (int32_t) offsetof(ObjClosure, function));
+  emitLoad(a, CONSTANTS, RDX,
+           (int32_t) offsetof(ObjFunction, chunk.constants.values));
+  emitLoad(a, RSI, RAX, (int32_t) offsetof(CallFrame, ip));
+  // sub rsi, [rdx + chunk.code]
+  emitRex(a, true, RSI, 0, RDX);
+  emitByte(a, 0x2b);
+  emitMemory(a, RSI, RDX, (int32_t) offsetof(ObjFunction, chunk.code));
+  emitLoad(a, RDX, RDX, (int32_t) offsetof(ObjFunction, jit));
+  emitLoad(a, RDX, RDX, (int32_t) offsetof(JitCode, entries));
+  emitLoadIndexed(a, RDX, RDX, RSI);
+  emit2(a, 0xff, 0xe2); // jmp rdx
+}
+
+// callTransfer は呼び出しか復帰の jit* 関数を offset の命令の位置で呼ぶ. JIT_CONTINUE なら次の命令へ進み,
+// JIT_ERROR か JIT_SWITCH ならそのまま抜け, そうでなければ返された CallFrame に飛び移る.
+// 飛び移る間接分岐は, 分岐予測が呼び出し元ごとに効くように命令ごとに置く.
+static void callTransfer(Assembler *a, CallFrame *(*helper)(uint8_t *),
+                         int offset) {
+  emitStore(a, VMPTR, (int32_t) offsetof(VM, stackTop), SP);
+  emitMoveImm(a, RDI, (uint64_t) (uintptr_t) (a->chunk->code + offset));
+  emitMoveImm(a, RAX, (uint64_t) (uintptr_t) helper);
+  emit2(a, 0xff, 0xd0); // call rax
+  emitLoad(a, SP, VMPTR, (int32_t) offsetof(VM, stackTop));
+  emitALUImm(a, ALU_CMP, RAX, (int32_t) (uintptr_t) JIT_CONTINUE);
+  int done = emitJump(a, CC_E);
+  // JIT_ERROR と JIT_SWITCH は JIT_EXIT_* と同じ値なので, RAX のまま抜ける
+  emitALUImm(a, ALU_CMP, RAX, (int32_t) (uintptr_t) JIT_SWITCH);
+  jumpBack(a, CC_BE, a->epilogue);
+  emitResume(a);
+  bindJump(a, done);
+}
+
+// guardObject は RAX が type のオブジェクトでなければ slow の分岐を出力し, RAX をそのポインタにする.
+// slow には分岐の rel32 の位置を二つ入れる.
+static void guardObject(Assembler *a, ObjType type, int slow[2]) {
+  emitMoveImm(a, RDX, SIGN_BIT | QNAN);
+  emitRR(a, RR_MOV, RCX, RAX);
+  emitRR(a, RR_AND, RCX, RDX);
+  emitRR(a, RR_CMP, RCX, RDX);
+  slow[0] = emitJump(a, CC_NE);
+  emitRR(a, RR_XOR, RAX, RDX);
+  emitCompareInt(a, RAX, (int32_t) offsetof(Obj, type), (int32_t) type);
+  slow[1] = emitJump(a, CC_NE);
+}
+
+// callClosure は RCX のクロージャを argCount 個の引数で呼ぶ call() の機械語. 呼び出し先がコンパイル済みで,
+// 引数の数が合い, スタックも CallFrame も伸ばさずに済むときだけ, CallFrame を積んでその先頭に飛ぶ.
+// それ以外は slow の分岐 (rel32 の位置を五つ入れる) で jit* 関数に任せる. next は戻り先の命令.
+static void callClosure(Assembler *a, int argCount, uint8_t *next,
+                        int slow[5]) {
+  emitLoad(a, RDX, RCX, (int32_t) offsetof(ObjClosure, function));
+  emitCompareInt(a, RDX, (int32_t) offsetof(ObjFunction, arity), argCount);
+  slow[0] = emitJump(a, CC_NE);
+  emitLoad(a, RSI, RDX, (int32_t) offsetof(ObjFunction, jit));
+  emitRR(a, RR_TEST, RSI, RSI);
+  slow[1] = emitJump(a, CC_E);
+  emitLoad(a, RSI, RSI, (int32_t) offsetof(JitCode, entries));
+  emitLoad(a, RSI, RSI, 0); // 関数の先頭の入口
+  emitRR(a, RR_TEST, RSI, RSI);
+  slow[2] = emitJump(a, CC_E);
+
+  // reserveFrame() の検査
+  emitLea(a, RDI, SP, -8 * (argCount + 1)); // 呼び出し先の slots
+  emitLoadInt(a, RAX, RDX, (int32_t) offsetof(ObjFunction, maxStack));
+  emitShiftLeft(a, RAX, 3);
+  emitRR(a, RR_ADD, RAX, RDI);
+  emitCompareMemory(a, RAX, VMPTR, (int32_t) offsetof(VM, stackEnd));
+  slow[3] = emitJump(a, CC_A);
+  emitLoadInt(a, R8, VMPTR, (int32_t) offsetof(VM, frameCount));
+  emitLoadInt(a, R9, VMPTR, (int32_t) offsetof(VM, frameCapacity));
+  emitRR(a, RR_CMP, R8, R9);
+  slow[4] = emitJump(a, CC_E);
+  // 呼び出し先がコンパイル済みならレジスタ層の関数ではないので, pc は使わない
+
+  emitRR(a, RR_MOV, R10, R8);
+  emitShiftLeft(a, R10, 5);
+  emitLoad(a, R9, VMPTR, (int32_t) offsetof(VM, frames));
+  emitRR(a, RR_ADD, R10, R9); // 新しい CallFrame
+  emitMoveImm(a, R11, (uint64_t) (uintptr_t) next);
+  emitStore(a, R10,
+            (int32_t) offsetof(CallFrame, ip) - (int32_t) sizeof(CallFrame),
+            R11);
+  emitStore(a, R10, (int32_t) offsetof(CallFrame, closure), RCX);
+  emitLoad(a, R11, RDX, (int32_t) offsetof(ObjFunction, chunk.code));
+  emitStore(a, R10, (int32_t) offsetof(CallFrame, ip), R11);
+  emitStore(a, R10, (int32_t) offsetof(CallFrame, slots), RDI);
+  emitALUImm(a, ALU_ADD, R8, 1);
+  emitStoreInt(a, VMPTR, (int32_t) offsetof(VM, frameCount), R8);
+
+  emitRR(a, RR_MOV, SLOTS, RDI);
+  emitLoad(a, UPVALUES, RCX, (int32_t) offsetof(ObjClosure, upvalues));
+  emitLoad(a, CONSTANTS, RDX,
+           (int32_t) offsetof(ObjFunction, chunk.constants.values));
+  emit2(a, 0xff, 0xe6); // jmp rsi
+}
+
+// bindAll は slow の分岐の飛び先を現在の位置にする.
+static void bindAll(Assembler *a, const int *slow, int count) {
+  for (int i = 0; i < count; i++) bindJump(a, slow[i]);
+}
+
+// compileCall は OP_CALL. 呼び出されるのがクロージャなら callClosure() で呼ぶ.
+static void compileCall(Assembler *a, int offset) {
+  uint8_t *ip = a->chunk->code + offset;
+  int argCount = ip[1];
+  int slow[7];
+  emitLoad(a, RAX, SP, -8 * (argCount + 1));
+  guardObject(a, OBJ_CLOSURE, slow);
+  emitRR(a, RR_MOV, RCX, RAX);
+  callClosure(a, argCount, ip + 2, slow + 2);
+  bindAll(a, slow, 7);
+  callTransfer(a, jitCall, offset);
+}
+
+// compileInvoke は OP_INVOKE と OP_INVOKE_METHOD. インラインキャッシュの先頭のエントリが
+// レシーバのシェイプのメソッドを覚えていれば, そのクロージャを callClosure() で呼ぶ.
+// jitInvoke() がキャッシュを埋めるので, OP_INVOKE のままでも一度呼べば速い経路に乗る.
+static void compileInvoke(Assembler *a, int offset, int argCount,
+                          InlineCache *cache, uint8_t *next) {
+  InlineCacheEntry *entry = &cache->entries[0];
+  int slow[10];
+  emitLoad(a, RAX, SP, -8 * (argCount + 1));
+  guardObject(a, OBJ_INSTANCE, slow);
+  emitLoad(a, RCX, RAX, (int32_t) offsetof(ObjInstance, shape));
+  emitRR(a, RR_TEST, RCX, RCX); // 辞書モード
+  slow[2] = emitJump(a, CC_E);
+  emitMoveImm(a, RDX, (uint64_t) (uintptr_t) entry);
+  emitCompareMemory(a, RCX, RDX, (int32_t) offsetof(InlineCacheEntry, shape));
+  slow[3] = emitJump(a, CC_NE);
+  emitCompareInt(a, RDX, (int32_t) offsetof(InlineCacheEntry, slot), 0);
+  slow[4] = emitJump(a, CC_NS); // フィールド
+  emitLoad(a, RCX, RDX, (int32_t) offsetof(InlineCacheEntry, method));
+  emitMoveImm(a, RDX, ~(SIGN_BIT | QNAN));
+  emitRR(a, RR_AND, RCX, RDX);
+  callClosure(a, argCount, next, slow + 5);
+  bindAll(a, slow, 10);
+  callTransfer(a, jitInvoke, offset);
+}
+
+// compileReturn は OP_RETURN. 閉じる上位値がなく, 呼び出し元もコンパイル済みで戻り先に入口があれば,
+// CallFrame を外してそこに飛ぶ. それ以外は jitReturn() に任せる.
+static void compileReturn(Assembler *a, int offset) {
+  int slow[4];
+  // closeUpvalues(slots) が何もしないこと. openUpvalues は位置の降順に並んでいる.
+  emitLoad(a, RCX, VMPTR, (int32_t) offsetof(VM, openUpvalues));
+  emitRR(a, RR_TEST, RCX, RCX);
+  int closed = emitJump(a, CC_E);
+  emitCompareMemory(a, SLOTS, RCX, (int32_t) offsetof(ObjUpvalue, location));
+  slow[0] = emitJump(a, CC_BE);
+  bindJump(a, closed);
+
+  emitLoadInt(a, R8, VMPTR, (int32_t) offsetof(VM, frameCount));
+  emitALUImm(a, ALU_SUB, R8, 1);
+  emitLoadInt(a, RDX, VMPTR, (int32_t) offsetof(VM, baseFrame));
+  emitRR(a, RR_CMP, R8, RDX);
+  slow[1] = emitJump(a, CC_E);
+  emitRR(a, RR_MOV, R9, R8);
+  emitShiftLeft(a, R9, 5);
+  emitLoad(a, RDX, VMPTR, (int32_t) offsetof(VM, frames));
+  emitRR(a, RR_ADD, R9, RDX);
+  emitALUImm(a, ALU_SUB, R9, (int32_t) sizeof(CallFrame)); // 呼び出し元の CallFrame
+  emitLoad(a, RSI, R9, (int32_t) offsetof(CallFrame, closure));
+  emitLoad(a, RDI, RSI, (int32_t) offsetof(ObjClosure, function));
+  emitLoad(a, R10, RDI, (int32_t) offsetof(ObjFunction, jit));
+  emitRR(a, RR_TEST, R10, R10);
+  slow[2] = emitJump(a, CC_E);
+  emitLoad(a, R11, R9, (int32_t) offsetof(CallFrame, ip));
+  // sub r11, [rdi + chunk.code]
+  emitRex(a, true, R11, 0, RDI);
+  emitByte(a, 0x2b);
+  emitMemory(a, R11, RDI, (int32_t) offsetof(ObjFunction, chunk.code));
+  emitLoad(a, R10, R10, (int32_t) offsetof(JitCode, entries));
+  emitLoadIndexed(a, R10, R10, R11);
+  emitRR(a, RR_TEST, R10, R10);
+  slow[3] = emitJump(a, CC_E);
+
+  emitStoreInt(a, VMPTR, (int32_t) offsetof(VM, frameCount), R8);
+  emitLoad(a, RAX, SP, -8);
+  emitStore(a, SLOTS, 0, RAX);
+  emitLea(a, SP, SLOTS, 8);
+  emitLoad(a, SLOTS, R9, (int32_t) offsetof(CallFrame, slots));
+  emitLoad(a, UPVALUES, RSI, (int32_t) offsetof(ObjClosure, upvalues));
+  emitLoad(a, CONSTANTS, RDI,
+           (int32_t) offsetof(ObjFunction, chunk.constants.values));
+  emit3(a, 0x41, 0xff, 0xe2); // jmp r10
+  bindAll(a, slow, 4);
+  callTransfer(a, jitReturn, offset);
+}
+
+// boolFromAL は AL の 0/1 を RAX の真偽値の Value にする.
+static void boolFromAL(Assembler *a) {
+  emit3(a, 0x0f, 0xb6, 0xc0); // movzx eax, al
+  emitMoveImm(a, RDX, FALSE_VAL);
+  emitRR(a, RR_OR, RAX, RDX); // TRUE_VAL は FALSE_VAL | 1
+}
+
+// jumpIfFalsey は RAX が偽として扱われる値 (nil か false) なら分岐する.
+static void jumpIfFalsey(Assembler *a, int target) {
+  emitMoveImm(a, RCX, NIL_VAL);
+  emitRR(a, RR_CMP, RAX, RCX);
+  jumpToInstruction(a, CC_E, target);
+  emitMoveImm(a, RCX, FALSE_VAL);
+  emitRR(a, RR_CMP, RAX, RCX);
+  jumpToInstruction(a, CC_E, target);
+}
+
+// arithmetic は RAX と RCX の数値の演算か比較の結果を RAX に置く. compare が負でなければ
+// ucomisd の後の setcc の条件で, swap なら右辺と左辺を入れ替えて比べる.
+static void arithmetic(Assembler *a, uint8_t op, int compare, bool swap) {
+  emitToXmm(a, 0, RAX);
+  emitToXmm(a, 1, RCX);
+  if (compare < 0) {
+    emitSSE(a, op, 0, 1);
+    emitFromXmm(a, RAX, 0);
+  } else if (compare == CC_E) {
+    // 順序付けられない (NaN を含む) 比較は ZF と PF が両方立つ
+    emitUcomisd(a, 0, 1);
+    emitSet(a, CC_E, RAX);
+    emitSet(a, CC_NP, RCX);
+    emit2(a, 0x20, 0xc8); // and al, cl
+    boolFromAL(a);
+  } else {
+    if (swap) emitUcomisd(a, 1, 0); else emitUcomisd(a, 0, 1);
+    emitSet(a, compare, RAX);
+    boolFromAL(a);
+  }
+}
+
+// binary はスタックの上の二つの数値の演算. 数値でなければ helper を呼ぶか, helper がなければ抜ける.
+static void binary(Assembler *a, int offset, uint8_t op, int compare,
+                   bool swap, bool (*helper)(uint8_t *)) {
+  emitLoad(a, RAX, SP, -16);
+  emitLoad(a, RCX, SP, -8);
+  int notLeft = guardNumber(a, RAX);
+  int notRight = guardNumber(a, RCX);
+  arithmetic(a, op, compare, swap);
+  emitStore(a, SP, -16, RAX);
+  emitALUImm(a, ALU_SUB, SP, 8);
+  if (helper == NULL) {
+    addPatch(a, notLeft, offset, true);
+    addPatch(a, notRight, offset, true);
+    return;
+  }
+  int done = emitJump(a, -1);
+  bindJump(a, notLeft);
+  bindJump(a, notRight);
+  callHelper(a, helper, offset);
+  bindJump(a, done);
+}
+
+// binaryConstant はスタックトップと定数の演算. 定数が数値でない組は helper に任せるか抜ける.
+static void binaryConstant(Assembler *a, int offset, Value constant,
+                           uint8_t op, int compare, bool swap,
+                           bool (*helper)(uint8_t *)) {
+  if (!IS_NUMBER(constant)) {
+    if (helper != NULL) callHelper(a, helper, offset);
+    else exitAt(a, -1, offset);
+    return;
+  }
+  emitLoad(a, RAX, SP, -8);
+  int notNumber = guardNumber(a, RAX);
+  emitMoveImm(a, RCX, constant);
+  arithmetic(a, op, compare, swap);
+  emitStore(a, SP, -8, RAX);
+  if (helper == NULL) {
+    addPatch(a, notNumber, offset, true);
+    return;
+  }
+  int done = emitJump(a, -1);
+  bindJump(a, notNumber);
+  callHelper(a, helper, offset);
+  bindJump(a, done);
+}
+
+// getField は RAX のインスタンスの, インラインキャッシュの先頭のエントリが覚えているフィールドを RAX に読む.
+// 想定が外れたら jitGetProperty() を呼ぶ. 分岐の rel32 の位置を notField に入れる.
+static void getField(Assembler *a, InlineCache *cache, int notField[5]) {
+  InlineCacheEntry *entry = &cache->entries[0];
+  emitMoveImm(a, RDX, SIGN_BIT | QNAN);
+  emitRR(a, RR_MOV, RCX, RAX);
+  emitRR(a, RR_AND, RCX, RDX);
+  emitRR(a, RR_CMP, RCX, RDX);
+  notField[0] = emitJump(a, CC_NE);
+  emitRR(a, RR_XOR, RAX, RDX); // Obj へのポインタ
+  emitCompareInt(a, RAX, (int32_t) offsetof(Obj, type), OBJ_INSTANCE);
+  notField[1] = emitJump(a, CC_NE);
+  emitLoad(a, RCX, RAX, (int32_t) offsetof(ObjInstance, shape));
+  emitRR(a, RR_TEST, RCX, RCX); // 辞書モード
+  notField[2] = emitJump(a, CC_E);
+  // エントリの中身は実行中に変わるので, 毎回メモリから読む
+  emitMoveImm(a, RDX, (uint64_t) (uintptr_t) entry);
+  emitCompareMemory(a, RCX, RDX, (int32_t) offsetof(InlineCacheEntry, shape));
+  notField[3] = emitJump(a, CC_NE);
+  emitLoadInt(a, RSI, RDX, (int32_t) offsetof(InlineCacheEntry, slot));
+  emitRR(a, RR_TEST, RSI, RSI); // メソッド
+  notField[4] = emitJump(a, CC_S);
+  emitLoad(a, RCX, RAX, (int32_t) offsetof(ObjInstance, fields));
+  emitLoadIndexed(a, RAX, RCX, RSI);
+}
+
+static void getProperty(Assembler *a, int offset, InlineCache *cache,
+                        int localSlot) {
+  int notField[5];
+  if (localSlot >= 0) {
+    emitLoad(a, RAX, SLOTS, 8 * localSlot);
+  } else {
+    emitLoad(a, RAX, SP, -8);
+  }
+  getField(a, cache, notField);
+  if (localSlot >= 0) {
+    emitPush(a, RAX);
+  } else {
+    emitStore(a, SP, -8, RAX);
+  }
+  int done = emitJump(a, -1);
+  for (int i = 0; i < 5; i++) bindJump(a, notField[i]);
+  callHelper(a, jitGetProperty, offset);
+  bindJump(a, done);
+}
+
+// compileInstruction は offset の命令の機械語を出力する. 入口にできない命令なら偽を返す.
+static bool compileInstruction(Assembler *a, int offset) {
+  Chunk *chunk = a->chunk;
+  uint8_t *ip = chunk->code + offset;
+  bool wide = ip[0] == OP_WIDE;
+  int op = wide ? ip[1] : ip[0];
+  // インデックスオペランドとその後のオペランドの位置. オペランドのない命令はチャンクの末尾にあることもある.
+  int operand = wide                                  ? (ip[2] << 8) | ip[3]
+                : instructionLength(chunk, offset) > 1 ? ip[1]
+                                                      : 0;
+  uint8_t *rest = ip + (wide ? 4 : 2);
+  Value *constants = chunk->constants.values;
+
+  switch (op) {
+    case OP_CONSTANT:
+      emitLoad(a, RAX, CONSTANTS, 8 * operand);
+      emitPush(a, RAX);
+      return true;
+    case OP_NIL:
+      emitMoveImm(a, RAX, NIL_VAL);
+      emitPush(a, RAX);
+      return true;
+    case OP_TRUE:
+      emitMoveImm(a, RAX, TRUE_VAL);
+      emitPush(a, RAX);
+      return true;
+    case OP_FALSE:
+      emitMoveImm(a, RAX, FALSE_VAL);
+      emitPush(a, RAX);
+      return true;
+    case OP_POP:
+      emitALUImm(a, ALU_SUB, SP, 8);
+      return true;
+    case OP_GET_LOCAL:
+      emitLoad(a, RAX, SLOTS, 8 * operand);
+      emitPush(a, RAX);
+      return true;
+    case OP_SET_LOCAL:
+      emitLoad(a, RAX, SP, -8);
+      emitStore(a, SLOTS, 8 * operand, RAX);
+      return true;
+    // globalValues は新しいグローバル変数が増えると伸びるので, 毎回 vm から読む
+    case OP_GET_GLOBAL:
+      emitLoad(a, RCX, VMPTR, (int32_t) offsetof(VM, globalValues.values));
+      emitLoad(a, RAX, RCX, 8 * operand);
+      emitMoveImm(a, RDX, UNDEFINED_VAL);
+      emitRR(a, RR_CMP, RAX, RDX);
+      exitAt(a, CC_E, offset);
+      emitPush(a, RAX);
+      return true;
+    case OP_DEFINE_GLOBAL:
+      emitLoad(a, RCX, VMPTR, (int32_t) offsetof(VM, globalValues.values));
+      emitLoad(a, RAX, SP, -8);
+      emitStore(a, RCX, 8 * operand, RAX);
+      emitALUImm(a, ALU_SUB, SP, 8);
+      return true;
+    case OP_SET_GLOBAL:
+      emitLoad(a, RCX, VMPTR, (int32_t) offsetof(VM, globalValues.values));
+      emitLoad(a, RAX, RCX, 8 * operand);
+      emitMoveImm(a, RDX, UNDEFINED_VAL);
+      emitRR(a, RR_CMP, RAX, RDX);
+      exitAt(a, CC_E, offset);
+      emitLoad(a, RAX, SP, -8);
+      emitStore(a, RCX, 8 * operand, RAX);
+      return true;
+    case OP_GET_UPVALUE:
+      emitLoad(a, RAX, UPVALUES, 8 * operand);
+      emitLoad(a, RAX, RAX, (int32_t) offsetof(ObjUpvalue, location));
+      emitLoad(a, RAX, RAX, 0);
+      emitPush(a, RAX);
+      return true;
+    case OP_SET_UPVALUE:
+      callHelper(a, jitSetUpvalue, offset);
+      return true;
+    case OP_GET_OUTER:
+      callHelper(a, jitGetOuter, offset);
+      return true;
+    case OP_SET_OUTER:
+      callHelper(a, jitSetOuter, offset);
+      return true;
+    case OP_GET_PROPERTY:
+    case OP_GET_FIELD:
+      getProperty(a, offset, &chunk->caches[(rest[0] << 8) | rest[1]], -1);
+      return true;
+    case OP_GET_LOCAL_PROPERTY:
+    case OP_GET_LOCAL_FIELD:
+      getProperty(a, offset, &chunk->caches[(ip[3] << 8) | ip[4]], ip[1]);
+      return true;
+    case OP_SET_PROPERTY:
+      callHelper(a, jitSetProperty, offset);
+      return true;
+    case OP_EQUAL:
+      binary(a, offset, 0, CC_E, false, jitEqual);
+      return true;
+    case OP_GREATER:
+      binary(a, offset, 0, CC_A, false, NULL);
+      return true;
+    case OP_LESS:
+      binary(a, offset, 0, CC_A, true, NULL);
+      return true;
+    case OP_ADD:
+    case OP_ADD_NUM:
+      binary(a, offset, SSE_ADD, -1, false, jitAdd);
+      return true;
+    case OP_SUBTRACT:
+      binary(a, offset, SSE_SUB, -1, false, NULL);
+      return true;
+    case OP_MULTIPLY:
+      binary(a, offset, SSE_MUL, -1, false, NULL);
+      return true;
+    case OP_DIVIDE:
+      binary(a, offset, SSE_DIV, -1, false, NULL);
+      return true;
+    case OP_NOT:
+      emitLoad(a, RCX, SP, -8);
+      emitMoveImm(a, RDX, NIL_VAL);
+      emitRR(a, RR_CMP, RCX, RDX);
+      emitSet(a, CC_E, RDX);
+      emitMoveImm(a, RAX, FALSE_VAL);
+      emitRR(a, RR_CMP, RCX, RAX);
+      emitSet(a, CC_E, RAX);
+      emit2(a, 0x08, 0xd0); // or al, dl
+      boolFromAL(a);
+      emitStore(a, SP, -8, RAX);
+      return true;
+    case OP_NEGATE: {
+      emitLoad(a, RAX, SP, -8);
+      addPatch(a, guardNumber(a, RAX), offset, true);
+      // btc rax, 63
+      emitRex(a, true, 0, 0, RAX);
+      emit2(a, 0x0f, 0xba);
+      emit2(a, 0xf8, 0x3f);
+      emitStore(a, SP, -8, RAX);
+      return true;
+    }
+    case OP_PRINT:
+      callHelper(a, jitPrint, offset);
+      return true;
+    case OP_JUMP:
+      jumpToInstruction(a, -1, offset + 3 + ((ip[1] << 8) | ip[2]));
+      return true;
+    case OP_LOOP:
+      jumpToInstruction(a, -1, offset + 3 - ((ip[1] << 8) | ip[2]));
+      return true;
+    case OP_JUMP_IF_FALSE:
+      emitLoad(a, RAX, SP, -8);
+      jumpIfFalsey(a, offset + 3 + ((ip[1] << 8) | ip[2]));
+      return true;
+    case OP_POP_JUMP_IF_FALSE:
+      emitALUImm(a, ALU_SUB, SP, 8);
+      emitLoad(a, RAX, SP, 0);
+      jumpIfFalsey(a, offset + 3 + ((ip[1] << 8) | ip[2]));
+      return true;
+    case OP_ADD_CONSTANT:
+      binaryConstant(a, offset, constants[ip[1]], SSE_ADD, -1, false, jitAdd);
+      return true;
+    case OP_SUBTRACT_CONSTANT:
+      binaryConstant(a, offset, constants[ip[1]], SSE_SUB, -1, false, NULL);
+      return true;
+    case OP_LESS_CONSTANT:
+      binaryConstant(a, offset, constants[ip[1]], 0, CC_A, true, NULL);
+      return true;
+    case OP_EQUAL_CONSTANT:
+      binaryConstant(a, offset, constants[ip[1]], 0, CC_E, false, jitEqual);
+      return true;
+    case OP_LESS_CONSTANT_JUMP: {
+      Value constant = constants[ip[1]];
+      if (!IS_NUMBER(constant)) return false;
+      emitLoad(a, RAX, SP, -8);
+      addPatch(a, guardNumber(a, RAX), offset, true);
+      emitALUImm(a, ALU_SUB, SP, 8);
+      emitToXmm(a, 0, RAX);
+      emitMoveImm(a, RCX, constant);
+      emitToXmm(a, 1, RCX);
+      // !(a < k) なら分岐. 順序付けられないときも CF と ZF が立つので分岐する.
+      emitUcomisd(a, 1, 0);
+      jumpToInstruction(a, CC_BE, offset + 4 + ((ip[2] << 8) | ip[3]));
+      return true;
+    }
+    case OP_INCREMENT_LOCAL: {
+      Value constant = constants[ip[2]];
+      if (!IS_NUMBER(constant)) {
+        callHelper(a, jitAdd, offset);
+        return true;
+      }
+      emitLoad(a, RAX, SLOTS, 8 * ip[1]);
+      int notNumber = guardNumber(a, RAX);
+      emitMoveImm(a, RCX, constant);
+      arithmetic(a, SSE_ADD, -1, false);
+      emitStore(a, SLOTS, 8 * ip[1], RAX);
+      int done = emitJump(a, -1);
+      bindJump(a, notNumber);
+      callHelper(a, jitAdd, offset);
+      bindJump(a, done);
+      return true;
+    }
+    case OP_CLOSE_UPVALUE:
+      callHelper(a, jitCloseUpvalue, offset);
+      return true;
+    case OP_BUILD_LIST:
+      callHelper(a, jitBuildList, offset);
+      return true;
+    case OP_GET_INDEX:
+      callHelper(a, jitGetIndex, offset);
+      return true;
+    case OP_SET_INDEX:
+      callHelper(a, jitSetIndex, offset);
+      return true;
+    case OP_CALL:
+      compileCall(a, offset);
+      return true;
+    case OP_TAIL_CALL:
+    case OP_SUPER_INVOKE:
+      callTransfer(a, op == OP_TAIL_CALL ? jitCall : jitInvoke, offset);
+      return true;
+    case OP_INVOKE:
+    case OP_INVOKE_METHOD:
+      compileInvoke(a, offset, rest[0], &chunk->caches[(rest[1] << 8) | rest[2]],
+                    rest + 3);
+      return true;
+    case OP_RETURN:
+      compileReturn(a, offset);
+      return true;
+    default:
+      // クラスやクロージャの生成などはインタプリタが実行する
+      return false;
+  }
+}
+
+// 入口: 呼び出し規約のレジスタで受け取った値を固定のレジスタに移して entry に飛ぶ.
+//   uint8_t *enter(void *entry, Value *slots, Value *stackTop, Value *constants,
+//                  ObjUpvalue **upvalues, VM *vm)
+// 出口: 抜けた命令のバイトコードを RAX に入れてここに飛ぶ.
+typedef uint8_t *(*JitEnter)(void *entry, Value *slots, Value *stackTop,
+                             Value *constants, ObjUpvalue **upvalues,
+                             VM *vm);
+
+static void emitPrologue(Assembler *a) {
+  static const uint8_t enter[] = {
+    0x55,                   // push rbp
+    0x53,                   // push rbx
+    0x41, 0x54,             // push r12
+    0x41, 0x55,             // push r13
+    0x41, 0x56,             // push r14
+    0x41, 0x57,             // push r15
+    0x48, 0x83, 0xec, 0x08, // sub rsp, 8 (呼び出しのために 16byte 境界に揃える)
+    0x48, 0x89, 0xf3,       // mov rbx, rsi
+    0x49, 0x89, 0xd4,       // mov r12, rdx
+    0x49, 0x89, 0xcd,       // mov r13, rcx
+    0x4d, 0x89, 0xc6,       // mov r14, r8
+    0x4d, 0x89, 0xcf,       // mov r15, r9
+  };
+  emitBytes(a, enter, (int) sizeof(enter));
+  emitMoveImm(a, QNANREG, QNAN);
+  emit2(a, 0xff, 0xe7); // jmp rdi
+
+  static const uint8_t leave[] = {
+    0x48, 0x83, 0xc4, 0x08, // add rsp, 8
+    0x41, 0x5f,             // pop r15
+    0x41, 0x5e,             // pop r14
+    0x41, 0x5d,             // pop r13
+    0x41, 0x5c,             // pop r12
+    0x5b,                   // pop rbx
+    0x5d,                   // pop rbp
+    0xc3,                   // ret
+  };
+  a->epilogue = a->count;
+  emitBytes(a, leave, (int) sizeof(leave));
+}
+
+// emitExits は分岐の飛び先を埋める. 出口は命令ごとに一つだけ, 必要になったものを末尾に置く.
+// 命令の先頭でない位置への分岐があれば偽を返す.
+static bool emitExits(Assembler *a, int *exits) {
+  for (int i = 0; i < a->patchCount; i++) {
+    Patch *patch = &a->patches[i];
+    if (patch->target < 0 || patch->target >= a->chunk->count) return false;
+    int target;
+    if (!patch->exit) {
+      target = a->labels[patch->target];
+      if (target < 0) return false;
+    } else {
+      if (exits[patch->target] < 0) {
+        exits[patch->target] = a->count;
+        emitStore(a, VMPTR, (int32_t) offsetof(VM, stackTop), SP);
+        emitMoveImm(a, RAX,
+                    (uint64_t) (uintptr_t) (a->chunk->code + patch->target));
+        jumpBack(a, -1, a->epilogue);
+      }
+      target = exits[patch->target];
+    }
+    put32(a, patch->at, target - (patch->at + 4));
+  }
+  return true;
+}
+
+bool jitCompile(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  Assembler a;
+  a.chunk = chunk;
+  a.code = NULL;
+  a.count = 0;
+  a.capacity = 0;
+  a.patches = NULL;
+  a.patchCount = 0;
+  a.patchCapacity = 0;
+  a.labels = ALLOCATE(int, chunk->count);
+  int *exits = ALLOCATE(int, chunk->count);
+  bool *isEntry = ALLOCATE(bool, chunk->count);
+  for (int i = 0; i < chunk->count; i++) {
+    a.labels[i] = -1;
+    exits[i] = -1;
+    isEntry[i] = false;
+  }
+
+  emitPrologue(&a);
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    a.labels[offset] = a.count;
+    isEntry[offset] = compileInstruction(&a, offset);
+    if (!isEntry[offset]) exitAt(&a, -1, offset);
+  }
+  bool resolved = emitExits(&a, exits);
+
+  JitCode *code = NULL;
+  CodeBlock *block = NULL;
+  uint8_t *memory =
+      resolved ? allocateCode(a.code, (size_t) a.count, &block) : NULL;
+  if (memory != NULL) {
+    code = ALLOCATE(JitCode, 1);
+    code->memory = memory;
+    code->block = block;
+    code->entryCount = chunk->count;
+    code->entries = ALLOCATE(void *, chunk->count);
+    for (int i = 0; i < chunk->count; i++) {
+      code->entries[i] = isEntry[i] ? code->memory + a.labels[i] : NULL;
+    }
+  }
+
+  FREE_ARRAY(uint8_t, a.code, a.capacity);
+  FREE_ARRAY(Patch, a.patches, a.patchCapacity);
+  FREE_ARRAY(int, a.labels, chunk->count);
+  FREE_ARRAY(int, exits, chunk->count);
+  FREE_ARRAY(bool, isEntry, chunk->count);
+
+  function->jit = code;
+  if (code == NULL) function->hotness = INT_MIN; // もう数えない
+  return code != NULL;
+}
+
+uint8_t *jitExecute(CallFrame *frame, void *entry) {
+  ObjClosure *closure = frame->closure;
+  JitEnter enter = (JitEnter) (void *) closure->function->jit->memory;
+  return enter(entry, frame->slots, vm.stackTop,
+               closure->function->chunk.constants.values, closure->upvalues,
+               &vm);
+}
+
+void freeJitCode(JitCode *code) {
+  CodeBlock *block = code->block;
+  if (--block->live == 0) {
+    if (block == currentBlock) currentBlock = NULL;
+    munmap(block->memory, block->size);
+    free(block);
+  }
+  FREE_ARRAY(void *, code->entries, code->entryCount);
+  FREE(JitCode, code);
+}
+
+#else
+
+bool jitCompile(ObjFunction *function) {
+  function->hotness = INT_MIN;
+  return false;
+}
+
+uint8_t *jitExecute(CallFrame *frame, void *entry) {
+  return frame->ip;
+}
+
+void freeJitCode(JitCode *code) {
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// JIT_AVAILABLE はベースライン JIT が機械語を出力できる環境で定義される.
+// 今のところ x86-64 の POSIX 環境 (mmap() で実行可能なメモリを確保できるもの) と NaN boxing の Value だけに対応する.
+// それ以外では --tier=jit はスタック層と同じになる.
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__)) && \
+    defined(NAN_BOXING)
+#define JIT_AVAILABLE
+#endif
+
+// --tier=jit で関数を機械語にコンパイルするまでの, 関数の呼び出しとループの後方ジャンプの回数.
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+
+// JitCode は一つの関数のバイトコードを命令ごとにテンプレートで機械語に置き換えたもの.
+// 機械語はスタック層と同じく VM のスタックの上で動くので, フレームの配置は両方で同じになり,
+// どの命令の境目でもインタプリタとの間を行き来できる.
+// 数値の演算, ローカル変数やグローバル変数の読み書き, 分岐とループ, フィールドの読み出しと
+// コンパイル済みのクロージャの呼び出しと復帰はその場で実行し, それ以外のプロパティや文字列,
+// 呼び出しなどは下の jit* 関数を呼ぶ. まれな命令と型の想定が外れた場合は
+// その命令の位置でコンパイル済みのコードを抜け, インタプリタがその命令から実行を続ける.
+// 呼び出しや復帰で先頭の CallFrame が変わったとき, その関数もコンパイル済みなら機械語のまま飛び移る.
+typedef struct JitCode {
+  uint8_t *memory; // 機械語. 先頭は入口と出口の共通部分.
+  struct CodeBlock *block; // memory を切り出した領域
+  void **entries; // バイトコードのオフセットごとの機械語の入口. 入れない位置は NULL.
+  int entryCount;
+} JitCode;
+
+// jitCompile は function を機械語にコンパイルして function->jit に設定する. できなければ偽を返す.
+bool jitCompile(ObjFunction *function);
+
+// jitEntry は function のバイトコード ip から機械語の実行に入れるなら, その入口を返す.
+static inline void *jitEntry(ObjFunction *function, uint8_t *ip) {
+  return function->jit->entries[ip - function->chunk.code];
+}
+
+// jitExecute は先頭の CallFrame を entry から機械語で実行し, 抜けた位置のバイトコードを返す.
+// そのときの vm.stackTop は抜けた命令を実行する直前の高さになっている.
+// 抜けた位置が命令でなければ, 次のどちらかを返す.
+uint8_t *jitExecute(CallFrame *frame, void *entry);
+
+#define JIT_EXIT_ERROR  ((uint8_t *) 0) // 実行時エラーを報告した
+#define JIT_EXIT_SWITCH ((uint8_t *) 2) // 先頭の CallFrame から先はインタプリタが続ける
+
+void freeJitCode(JitCode *code);
+
+// 以下はコンパイル済みのコードが呼ぶ vm.c の関数. ip は実行する命令の先頭 (OP_WIDE を含む).
+// スタック層のハンドラと同じことをして真を返す. 実行時エラーになる場合は何もせずに偽を返すので,
+// 呼び出し元はその命令で機械語を抜け, インタプリタが同じ命令を実行し直してエラーを報告する.
+bool jitGetProperty(uint8_t *ip);
+bool jitSetProperty(uint8_t *ip);
+bool jitSetUpvalue(uint8_t *ip);
+bool jitGetOuter(uint8_t *ip);
+bool jitSetOuter(uint8_t *ip);
+bool jitEqual(uint8_t *ip);
+bool jitAdd(uint8_t *ip);
+bool jitPrint(uint8_t *ip);
+bool jitBuildList(uint8_t *ip);
+bool jitGetIndex(uint8_t *ip);
+bool jitSetIndex(uint8_t *ip);
+bool jitCloseUpvalue(uint8_t *ip);
+
+// 呼び出しと復帰の jit* 関数は, 先頭の CallFrame が変わって機械語で続けられるならその CallFrame を,
+// そうでなければ下のどれかを返す. エラーはインタプリタと同じくその場で報告する.
+// JIT_ERROR と JIT_SWITCH はそのまま jitExecute() の戻り値になるので, JIT_EXIT_* と同じ値にしておく.
+#define JIT_ERROR    ((CallFrame *) 0) // 実行時エラー
+#define JIT_CONTINUE ((CallFrame *) 1) // ネイティブ関数の呼び出しなどで, 次の命令から機械語のまま続ける
+#define JIT_SWITCH   ((CallFrame *) 2) // 先頭の CallFrame から先はインタプリタが続ける
+
+CallFrame *jitCall(uint8_t *ip);   // OP_CALL と OP_TAIL_CALL
+CallFrame *jitInvoke(uint8_t *ip); // OP_INVOKE, OP_INVOKE_METHOD と OP_SUPER_INVOKE
+CallFrame *jitReturn(uint8_t *ip);
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef clox_lox_h
+#define clox_lox_h
+
+// lox.h は clox をライブラリとして組み込むホストのためのヘッダ.
+// ここには組み込みに使う型と関数だけを置き, VM やオブジェクトの中身は見せない. 使い方は test/embed/host.c を参照.
+// VM はスレッドごとに一つで, initVM() してから使い, freeVM() で片付ける.
+// ホストはネイティブ関数を登録し, interpret() でスクリプトを実行してから,
+// getGlobal() で取り出した Lox の関数を callFunction() で呼び出せる.
+// ネイティブ関数の中から callFunction() を呼んで Lox に戻ってもよい. 入れ子の深さは C のスタックの大きさで制限される.
+// スクリプトはファイバー (fiber(), resume(), yield()) で実行を止められ, ホストは止まったファイバーを後から再開できる.
+//
+// Value はGCから見えるところ (スタック, グローバル変数, 到達可能なオブジェクト) になければ回収されうる.
+// ネイティブ関数の args と *result は見えているが, C の変数に持っているだけの値は見えないので,
+// 確保をはさむ間は push() しておくこと.
+
+#include "value.h"
+
+// ファイバーとホストのバッファを包むオブジェクト. ホストからは中身が見えない.
+typedef struct ObjFiber ObjFiber;
+typedef struct ObjForeign ObjForeign;
+
+typedef enum {
+  INTERPRET_OK,
+  INTERPRET_COMPILE_ERROR,
+  INTERPRET_RUNTIME_ERROR
+} InterpretResult;
+
+// NativeFn はC言語で実装された関数. args は VM のスタック上の引数を直接指すのでコピーはしない.
+// 戻り値は *result に書いて真を返す. 実行時エラーなら nativeError() を呼んで (あるいは失敗した
+// callFunction() の結果をそのまま) 偽を返す. userdata は defineNative() に渡したポインタ.
+typedef bool (*NativeFn)(int argCount, Value *args, Value *result,
+                         void *userdata);
+
+// ForeignFinalizer は ObjForeign が回収されるときに呼ばれ, ホストのバッファを解放する.
+typedef void (*ForeignFinalizer)(void *data, size_t length);
+
+// WriteFn はホストが setOutput() で設定する print 文の出力先.
+// 溜めておいた出力を length バイトずつ受け取る. chars は '\0' 終端ではない.
+typedef void (*WriteFn)(const char *chars, size_t length, void *userdata);
+
+void initVM();
+
+void freeVM();
+
+InterpretResult interpret(const char *source);
+
+void push(Value value);
+
+Value pop();
+
+// defineNative はグローバル変数 name にネイティブ関数を定義する.
+// 呼ばれるたびに function に userdata を渡す.
+void defineNative(const char *name, NativeFn function, void *userdata);
+
+// setOutput は print 文の出力先を write にする. 出力は VM の中に溜めてからまとめて渡す.
+// write が NULL なら vm.out に戻す. それまでに溜まっていた出力は前の出力先に書き出す.
+// ホストが自分でも stdout に書くなら, その前に flushOutput() を呼ぶこと.
+void setOutput(WriteFn write, void *userdata);
+
+// flushOutput は溜まっている print 文の出力を出力先に書き出す.
+// interpret() の終わりと実行時エラーの報告の前には VM が呼ぶ.
+void flushOutput();
+
+// defineGlobal はグローバル変数 name に value を設定する.
+void defineGlobal(const char *name, Value value);
+
+// getGlobal はグローバル変数 name の値を *value に読む. 定義されていなければ偽を返す.
+bool getGlobal(const char *name, Value *value);
+
+// nativeError はネイティブ関数から実行時エラーを起こす. メッセージとスタックトレースを書いて偽を返すので,
+// ネイティブ関数は `return nativeError("...", ...);` とすればよい.
+// callFunction() で入れ子に実行していた分も含めて実行全体が打ち切られる.
+bool nativeError(const char *format, ...);
+
+// callFunction は callee (クロージャ, メソッド, クラス, ネイティブ関数) を args の argCount 個の引数で呼び出し,
+// 戻り値を *result に格納する. ネイティブ関数の中からも呼べて, その場合は実行中のループの中で入れ子に実行する.
+// 実行時エラーならエラーは報告済みで, ネイティブ関数はその結果の偽をそのまま返すこと.
+// スタックは伸びて移動することがあるので, 呼び出した後のネイティブ関数の args は無効になる.
+InterpretResult callFunction(Value callee, int argCount, Value *args,
+                             Value *result);
+
+// resumeFiber は fiber を次の yield か終了まで実行し, yield した値か関数の戻り値を *result に格納する.
+// value は初めての resume なら関数の引数に (引数があれば), yield で止まっていたら yield の戻り値になる.
+// ホストのイベントループからも, ネイティブ関数の中からも呼べる. fiber はGCから見えるところに置いておくこと.
+// ホストが扱うファイバーは parkFiber() で得る.
+InterpretResult resumeFiber(ObjFiber *fiber, Value value, Value *result);
+
+// yieldFiber は実行中のファイバーを止め, value を resume の結果として返す.
+// ネイティブ関数から `return yieldFiber(value);` として使う. 次に resume されると,
+// そのときの値がこのネイティブ関数の戻り値になる. 止められなければエラーを報告する.
+bool yieldFiber(Value value);
+
+// parkFiber は yieldFiber(NIL_VAL) と同じく実行中のファイバーを止め, そのファイバーを返す.
+// 止めたファイバーは resumeFiber() されるまでGCに回収されない. ホストはこれを非同期 I/O に結び付け,
+// 完了したらイベントループから resumeFiber() で結果を渡して再開する.
+// ネイティブ関数はこの後すぐに偽を返すこと. 止められなければエラーを報告して NULL を返す.
+ObjFiber *parkFiber();
+
+// newForeign はホストのバッファ data をコピーせずに包む. Lox からは中身が見えず, 変数に入れて
+// ネイティブ関数に渡すことしかできない. 等価性は同じオブジェクトかどうかで決まる.
+// tag は型の名前で, 表示と foreignData() での確認に使う. 静的な文字列であること.
+// data の寿命はホストが管理する. finalize があれば回収されたとき (freeVM() を含む) に呼ぶ.
+// Value にするには OBJ_VAL() で包む.
+ObjForeign *newForeign(const char *tag, void *data, size_t length,
+                       ForeignFinalizer finalize);
+
+// foreignData は value が tag の ObjForeign ならその data を返し, *length があれば長さを書く.
+// 違う種類の値なら NULL を返す.
+void *foreignData(Value value, const char *tag, size_t *length);
+
+#endif
@@ -1,10 +1,24 @@
+// mmap() などの POSIX の宣言のため. -std=c99 では隠れてしまう.
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "common.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "image.h"
+#include "profile.h"
 #include "vm.h"
 
 static void repl() {
@@ -21,46 +35,371 @@ static void repl() {
   }
 }
 
-static char *readFile(const char *path) {
+// SourceFile は読み込んだファイルの中身. mapped が真なら data は mmap() した領域を指す.
+// どちらの場合も data[length] は '\0' で, スキャナはそこで止まる.
+typedef struct {
+  char *data;
+  size_t length;
+  bool mapped;
+} SourceFile;
+
+// readStream は長さの分からない入力(パイプや標準入力)を末尾まで読む.
+// fseek() できないので, バッファを倍々に広げながら読み進める.
+static SourceFile readStream(FILE *file, const char *path) {
+  size_t capacity = 8192;
+  size_t length = 0;
+  char *buffer = (char *) malloc(capacity);
+  for (;;) {
+    if (buffer == NULL) {
+      fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+      exit(74);
+    }
+    length += fread(buffer + length, sizeof(char), capacity - length - 1, file);
+    if (length < capacity - 1) break;
+    capacity *= 2;
+    buffer = (char *) realloc(buffer, capacity);
+  }
+
+  if (ferror(file)) {
+    fprintf(stderr, "Could not read file \"%s\".\n", path);
+    exit(74);
+  }
+
+  buffer[length] = '\0';
+  SourceFile source = {buffer, length, false};
+  return source;
+}
+
+#ifdef HAVE_POSIX
+// mapFile は通常のファイルをコピーせずにアドレス空間へ写像する. ページは触れたときに読み込まれる.
+// 写像の末尾のページの残りはゼロで埋められるので, ファイルの長さがページサイズの倍数でなければ
+// data[length] が '\0' になることが保証される. そうでなければ写像しない.
+static bool mapFile(FILE *file, SourceFile *source) {
+  struct stat info;
+  if (fstat(fileno(file), &info) != 0 || !S_ISREG(info.st_mode)) return false;
+
+  size_t length = (size_t) info.st_size;
+  long pageSize = sysconf(_SC_PAGESIZE);
+  if (length == 0 || pageSize <= 0 || length % (size_t) pageSize == 0) {
+    return false;
+  }
+
+  void *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+  if (data == MAP_FAILED) return false;
+
+  source->data = (char *) data;
+  source->length = length;
+  source->mapped = true;
+  return true;
+}
+#endif
+
+static SourceFile readFile(const char *path) {
+  // "-" は標準入力を表す
+  if (strcmp(path, "-") == 0) return readStream(stdin, "<stdin>");
+
   FILE *file = fopen(path, "rb");
   if (file == NULL) {
     fprintf(stderr, "Could not open file \"%s\".\n", path);
     exit(74);
   }
 
-  fseek(file, 0L, SEEK_END);
-  size_t fileSize = ftell(file);
-  rewind(file);
+  SourceFile source;
+#ifdef HAVE_POSIX
+  if (mapFile(file, &source)) {
+    fclose(file);
+    return source;
+  }
+#endif
 
-  char *buffer = (char *) malloc(fileSize + 1);
-  if (buffer == NULL) {
-    fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-    exit(74);
+  source = readStream(file, path);
+  fclose(file);
+  return source;
+}
+
+static void freeFile(SourceFile *source) {
+#ifdef HAVE_POSIX
+  if (source->mapped) {
+    munmap(source->data, source->length);
+    return;
   }
+#endif
+  free(source->data);
+}
 
-  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-  if (bytesRead < fileSize) {
-    fprintf(stderr, "Could not read file \"%s\".\n", path);
-    exit(74);
+// runSource はソースファイルかイメージファイルを読み込んで実行する.
+// ソースファイルは useCache が真であればディスク上のキャッシュを通してコンパイルする.
+static InterpretResult runSource(const char *path, bool useCache) {
+  SourceFile source = readFile(path);
+
+  ObjFunction *function;
+  if (isImage(source.data, source.length)) {
+    function = readImage(source.data, source.length, 0, false);
+    if (function == NULL) {
+      fprintf(stderr, "Could not load image \"%s\".\n", path);
+      freeFile(&source);
+      exit(65);
+    }
+  } else if (useCache) {
+    function = compileCached(source.data, source.length);
+  } else {
+    function = compile(source.data);
   }
+  freeFile(&source); // [owner]
 
-  buffer[bytesRead] = '\0';
+  return function == NULL ? INTERPRET_COMPILE_ERROR
+                          : interpretFunction(function);
+}
 
-  fclose(file);
-  return buffer;
+static int exitCode(InterpretResult result) {
+  if (result == INTERPRET_COMPILE_ERROR) return 65;
+  if (result == INTERPRET_RUNTIME_ERROR) return 70;
+  return 0;
 }
 
-static void runFile(const char *path) {
-  char *source = readFile(path);
-  InterpretResult result = interpret(source);
-  free(source); // [owner]
+static void runFile(const char *path, bool useCache) {
+  int code = exitCode(runSource(path, useCache));
+  if (code != 0) exit(code);
+}
 
-  if (result == INTERPRET_COMPILE_ERROR) exit(65);
-  if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+// 並列実行のワーカースレッドのスタックの大きさ. コンパイラの再帰が主スレッドと同じだけ深くなれるように.
+#define WORKER_STACK_SIZE (8 * 1024 * 1024)
+
+// Job は並列実行する一つのスクリプト. 出力は終わるまで out と err に溜めておく.
+typedef struct {
+  const char *path;
+  char *out;
+  size_t outLength;
+  char *err;
+  size_t errLength;
+  InterpretResult result;
+  bool done;
+} Job;
+
+// Batch は並列実行するスクリプトの一覧と, それぞれのVMに設定するオプション.
+typedef struct {
+  Job *jobs;
+  int count;
+  int next; // 次にワーカーが取るスクリプト
+  bool useCache;
+  GcMode gcMode;
+  bool gcStats;
+  int gcStepBudget;
+  ExecutionTier tier;
+#ifdef HAVE_POSIX
+  pthread_mutex_t lock; // next と各 Job の done を守る
+  pthread_cond_t finished; // いずれかの Job が終わった
+#endif
+} Batch;
+
+// runJob はこのスレッドに新しい VM を作って job を実行し, 捨てる.
+static void runJob(Batch *batch, Job *job) {
+  vm.gcMode = batch->gcMode;
+  vm.gcStats = batch->gcStats;
+  vm.gcStepBudget = batch->gcStepBudget;
+  vm.tier = batch->tier;
+  initVM();
+
+#ifdef HAVE_POSIX
+  FILE *out = open_memstream(&job->out, &job->outLength);
+  FILE *err = open_memstream(&job->err, &job->errLength);
+  if (out == NULL || err == NULL) exit(1); // out of memory
+  vm.out = out;
+  vm.err = err;
+#endif
+
+  job->result = runSource(job->path, batch->useCache);
+  freeVM();
+
+#ifdef HAVE_POSIX
+  fclose(out);
+  fclose(err);
+#endif
+}
+
+#ifdef HAVE_POSIX
+static void *worker(void *argument) {
+  Batch *batch = (Batch *) argument;
+  for (;;) {
+    pthread_mutex_lock(&batch->lock);
+    int index = batch->next++;
+    pthread_mutex_unlock(&batch->lock);
+    if (index >= batch->count) return NULL;
+
+    runJob(batch, &batch->jobs[index]);
+
+    pthread_mutex_lock(&batch->lock);
+    batch->jobs[index].done = true;
+    pthread_cond_broadcast(&batch->finished);
+    pthread_mutex_unlock(&batch->lock);
+  }
+}
+#endif
+
+// runBatch は paths のスクリプトを workers 個のスレッドで並列に実行する.
+// スクリプトごとに独立した VM を使うので, グローバル変数やヒープは共有しない.
+// 出力は引数の順にスクリプトごとにまとめて書き出すので, 並列に実行しても混ざらない.
+// 終了コードは最初に失敗したスクリプトのもの.
+static int runBatch(Batch *batch, const char **paths, int count,
+                    int workers) {
+  batch->jobs = (Job *) calloc((size_t) count, sizeof(Job));
+  if (batch->jobs == NULL) exit(1); // out of memory
+  batch->count = count;
+  batch->next = 0;
+  for (int i = 0; i < count; i++) {
+    // ワーカーの中で readFile() が exit() すると他のスクリプトの出力まで失われるので, 先に確かめる.
+    // 標準入力は一つしかないので "-" は受け付けない.
+    FILE *file = strcmp(paths[i], "-") == 0 ? NULL : fopen(paths[i], "rb");
+    if (file == NULL) {
+      fprintf(stderr, "Could not open file \"%s\".\n", paths[i]);
+      exit(74);
+    }
+    fclose(file);
+    batch->jobs[i].path = paths[i];
+  }
+
+#ifdef HAVE_POSIX
+  if (workers > count) workers = count;
+  if (workers < 1) workers = 1;
+  pthread_mutex_init(&batch->lock, NULL);
+  pthread_cond_init(&batch->finished, NULL);
+
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setstacksize(&attributes, WORKER_STACK_SIZE);
+  pthread_t *threads = (pthread_t *) malloc(sizeof(pthread_t) * (size_t) workers);
+  if (threads == NULL) exit(1); // out of memory
+  for (int i = 0; i < workers; i++) {
+    if (pthread_create(&threads[i], &attributes, worker, batch) != 0) {
+      fprintf(stderr, "Could not start worker thread.\n");
+      exit(71);
+    }
+  }
+  pthread_attr_destroy(&attributes);
+#else
+  // スレッドがなければ一つずつ順に実行する. 出力はそのまま書き出される.
+  for (int i = 0; i < count; i++) runJob(batch, &batch->jobs[i]);
+#endif
+
+  int code = 0;
+  for (int i = 0; i < count; i++) {
+    Job *job = &batch->jobs[i];
+#ifdef HAVE_POSIX
+    pthread_mutex_lock(&batch->lock);
+    while (!job->done) pthread_cond_wait(&batch->finished, &batch->lock);
+    pthread_mutex_unlock(&batch->lock);
+
+    fwrite(job->out, sizeof(char), job->outLength, stdout);
+    fflush(stdout);
+    fwrite(job->err, sizeof(char), job->errLength, stderr);
+    free(job->out);
+    free(job->err);
+#endif
+    if (code == 0) code = exitCode(job->result);
+  }
+
+#ifdef HAVE_POSIX
+  for (int i = 0; i < workers; i++) pthread_join(threads[i], NULL);
+  free(threads);
+  pthread_cond_destroy(&batch->finished);
+  pthread_mutex_destroy(&batch->lock);
+#endif
+  free(batch->jobs);
+  return code;
+}
+
+// saveImage はソースファイルをコンパイルし, 実行せずにイメージとして書き出す.
+static void saveImage(const char *path, const char *imagePath) {
+  SourceFile source = readFile(path);
+  ObjFunction *function = compile(source.data);
+  uint64_t hash = hashSource(source.data, source.length);
+  freeFile(&source);
+  if (function == NULL) exit(65);
+
+  FILE *file = fopen(imagePath, "wb");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", imagePath);
+    exit(74);
+  }
+  push(OBJ_VAL(function));
+  bool written = writeImage(file, function, hash);
+  pop();
+  if (fclose(file) != 0 || !written) {
+    fprintf(stderr, "Could not write image \"%s\".\n", imagePath);
+    exit(74);
+  }
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: clox [--gc=full|generational|incremental] "
+                  "[--gc-step-us=N] [--gc-stats] [--cache | --no-cache] "
+                  "[--profile=PATH] [--save-image=PATH] "
+                  "[--tier=stack|register|jit] "
+                  "[path | -]\n"
+                  "       clox [options] --jobs=N path...\n");
+  exit(64);
 }
 
 int main(int argc, const char *argv[]) {
+  // オプションはGCの方式を決めるので initVM() より前に解析する
+  vm.gcMode = GC_FULL;
+  vm.gcStats = false;
+  vm.gcStepBudget = 0;
+  vm.tier = TIER_STACK;
+  // キャッシュは --cache か LOX_CACHE_DIR で明示したときだけ使う. 既定ではディスクに書かない.
+  const char *cacheDir = getenv("LOX_CACHE_DIR");
+  bool useCache = cacheDir != NULL && cacheDir[0] != '\0';
+  const char *imagePath = NULL;
+  const char *profilePath = NULL;
+  int jobs = 0;
+  int argi = 1;
+  for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; argi++) {
+    if (strcmp(argv[argi], "--gc=full") == 0) {
+      vm.gcMode = GC_FULL;
+    } else if (strcmp(argv[argi], "--gc=generational") == 0) {
+      vm.gcMode = GC_GENERATIONAL;
+    } else if (strcmp(argv[argi], "--gc=incremental") == 0) {
+      vm.gcMode = GC_INCREMENTAL;
+    } else if (strncmp(argv[argi], "--gc-step-us=", 13) == 0) {
+      vm.gcStepBudget = atoi(argv[argi] + 13);
+    } else if (strcmp(argv[argi], "--gc-stats") == 0) {
+      vm.gcStats = true;
+    } else if (strcmp(argv[argi], "--cache") == 0) {
+      useCache = true;
+    } else if (strcmp(argv[argi], "--no-cache") == 0) {
+      useCache = false;
+    } else if (strncmp(argv[argi], "--jobs=", 7) == 0) {
+      jobs = atoi(argv[argi] + 7);
+      if (jobs < 1) usage();
+    } else if (strncmp(argv[argi], "--profile=", 10) == 0) {
+      profilePath = argv[argi] + 10;
+    } else if (strncmp(argv[argi], "--save-image=", 13) == 0) {
+      imagePath = argv[argi] + 13;
+    } else if (strcmp(argv[argi], "--tier=stack") == 0) {
+      vm.tier = TIER_STACK;
+    } else if (strcmp(argv[argi], "--tier=register") == 0) {
+      vm.tier = TIER_REGISTER;
+    } else if (strcmp(argv[argi], "--tier=jit") == 0) {
+      vm.tier = TIER_JIT;
+    } else {
+      usage();
+    }
+  }
+
+  if (jobs > 0) {
+    // プロファイラはプロセスに一つしかなく, イメージの書き出しは一つのファイルしか扱わない
+    if (argi == argc || profilePath != NULL || imagePath != NULL) usage();
+    Batch batch;
+    batch.useCache = useCache;
+    batch.gcMode = vm.gcMode;
+    batch.gcStats = vm.gcStats;
+    batch.gcStepBudget = vm.gcStepBudget;
+    batch.tier = vm.tier;
+    return runBatch(&batch, argv + argi, argc - argi, jobs);
+  }
+
   initVM();
+  if (profilePath != NULL) startProfiler(profilePath);
 
 /* Chunks of Bytecode main-chunk < Scanning on Demand args
   Chunk chunk;
@@ -110,13 +449,24 @@ int main(int argc, const char *argv[]) {
 /* A Virtual Machine main-interpret < Scanning on Demand args
   interpret(&chunk);
 */
-  if (argc == 1) {
+  if (imagePath != NULL) {
+    if (argi != argc - 1) usage();
+    saveImage(argv[argi], imagePath);
+  } else if (argi == argc) {
+#ifdef HAVE_POSIX
+    // 端末でない標準入力(パイプやリダイレクト)は一行ずつではなくスクリプト全体として実行する
+    if (!isatty(fileno(stdin))) {
+      runFile("-", useCache);
+    } else {
+      repl();
+    }
+#else
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
+#endif
+  } else if (argi == argc - 1) {
+    runFile(argv[argi], useCache);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    usage();
   }
 
   freeVM();
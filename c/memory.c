@@ -1,15 +1,117 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX
+#include <sys/resource.h>
+#endif
 
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
+#include "regcode.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 
 #define GC_HEAP_GROW_FACTOR 2
+// 世代別GCでこれだけ確保するたびにマイナーGCを起動する
+#define GC_NURSERY_SIZE (256 * 1024)
+// 逐次GCでこれだけ確保するたびに一回のステップを進める
+#define GC_STEP_BYTES (8 * 1024)
+// 逐次GCの一回のステップで黒く塗るオブジェクト数の上限. sweep はこの4倍まで.
+#define GC_STEP_OBJECTS 1024
+
+void initPool(Pool *pool) {
+  for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+    pool->freeLists[i] = NULL;
+  }
+  pool->bumpNext = NULL;
+  pool->bumpEnd = NULL;
+  pool->blocks = NULL;
+}
+
+// freePool はプールのすべてのブロックを解放する. プールから確保した領域はすべて無効になる.
+void freePool(Pool *pool) {
+  PoolBlock *block = pool->blocks;
+  while (block != NULL) {
+    PoolBlock *next = block->next;
+    free(block);
+    block = next;
+  }
+  initPool(pool);
+}
+
+#ifdef POOL_ALLOCATOR
+// sizeClass は size (1 以上 POOL_MAX_SIZE 以下) バイトの領域が属するサイズクラスを返す.
+static inline int sizeClass(size_t size) {
+  return (int) ((size - 1) / POOL_GRANULE);
+}
+
+static void *poolAllocate(int index) {
+  Pool *pool = &vm.pool;
+  PoolFree *node = pool->freeLists[index];
+  if (node != NULL) {
+    pool->freeLists[index] = node->next;
+    return node;
+  }
+
+  size_t size = (size_t) (index + 1) * POOL_GRANULE;
+  if (pool->bumpNext == NULL ||
+      (size_t) (pool->bumpEnd - pool->bumpNext) < size) {
+    // 現在のブロックの残りは捨てる. 高々 POOL_MAX_SIZE バイトの無駄で済む.
+    PoolBlock *block = (PoolBlock *) malloc(POOL_BLOCK_SIZE);
+    if (block == NULL) exit(1); // out of memory
+    block->next = pool->blocks;
+    pool->blocks = block;
+    // ブロックのヘッダの後ろから使う. POOL_GRANULE 境界に揃えておく.
+    pool->bumpNext = (char *) block + POOL_GRANULE;
+    pool->bumpEnd = (char *) block + POOL_BLOCK_SIZE;
+  }
+
+  void *result = pool->bumpNext;
+  pool->bumpNext += size;
+  return result;
+}
+
+static void poolRelease(void *pointer, int index) {
+  PoolFree *node = (PoolFree *) pointer;
+  node->next = vm.pool.freeLists[index];
+  vm.pool.freeLists[index] = node;
+}
+
+// poolReallocate は古い領域か新しい領域の少なくとも一方がプールに属する場合の reallocate.
+static void *poolReallocate(void *pointer, size_t oldSize, size_t newSize) {
+  bool oldPooled = oldSize > 0 && oldSize <= POOL_MAX_SIZE;
+  bool newPooled = newSize > 0 && newSize <= POOL_MAX_SIZE;
+  // 同じサイズクラスの中での伸縮なら領域はそのまま使える
+  if (oldPooled && newPooled && sizeClass(oldSize) == sizeClass(newSize)) {
+    return pointer;
+  }
+
+  void *result = NULL;
+  if (newSize > 0) {
+    result = newPooled ? poolAllocate(sizeClass(newSize)) : malloc(newSize);
+    if (result == NULL) exit(1); // out of memory
+    if (pointer != NULL) {
+      memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    }
+  }
+
+  if (pointer != NULL) {
+    if (oldPooled) {
+      poolRelease(pointer, sizeClass(oldSize));
+    } else {
+      free(pointer);
+    }
+  }
+  return result;
+}
+#endif
 
 // reallocate は clox 全体で使用されるメモリ確保ユーティリティ関数.
 // この関数を呼び出すときGCが起動することがある.
@@ -19,15 +121,32 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
   vm.bytesAllocated += newSize - oldSize;
   // GC call-collect
   if (newSize > oldSize) {
-#ifdef DEBUG_SRESS_GC  // GCのデバッグ時に有効化する
+#ifdef DEBUG_STRESS_GC  // GCのデバッグ時に有効化する
     collectGarbage();
 #endif
     // しきい値を超えたらGCを起動する
-    if (vm.bytesAllocated > vm.nextGC) {
+    vm.allocatedSinceGC += newSize - oldSize;
+    if (vm.gcMode == GC_GENERATIONAL) {
+      if (vm.allocatedSinceGC > GC_NURSERY_SIZE ||
+          vm.bytesAllocated > vm.nextGC) {
+        collectGarbage();
+      }
+    } else if (vm.gcMode == GC_INCREMENTAL) {
+      if (vm.allocatedSinceGC > GC_STEP_BYTES &&
+          (vm.gcPhase != GC_IDLE || vm.bytesAllocated > vm.nextGC)) {
+        collectGarbage();
+      }
+    } else if (vm.bytesAllocated > vm.nextGC) {
       collectGarbage();
     }
   }
 
+#ifdef POOL_ALLOCATOR
+  bool oldPooled = oldSize > 0 && oldSize <= POOL_MAX_SIZE;
+  bool newPooled = newSize > 0 && newSize <= POOL_MAX_SIZE;
+  if (oldPooled || newPooled) return poolReallocate(pointer, oldSize, newSize);
+#endif
+
   if (newSize == 0) {
     free(pointer);
     return NULL;
@@ -43,6 +162,9 @@ void markObject(Obj *object) {
   if (object == NULL) return;
   // すでに追跡された痕跡がある(灰色 or 黒色)なら何もしない
   if (object->isMarked) return;
+  // マイナーGCでは古い世代は生きているものとみなして辿らない.
+  // 古い世代から若い世代への参照は記憶集合から辿る.
+  if (vm.gcMinor && object->isOld) return;
 
 #ifdef DEBUG_LOG_GC
   printf("%p mark ", (void*)object);
@@ -50,6 +172,11 @@ void markObject(Obj *object) {
   printf("\n");
 #endif
 
+  grayObject(object);
+}
+
+// grayObject は object を灰色に塗る. 作りかけのオブジェクトに対して呼んでもよい.
+void grayObject(Obj *object) {
   // GCに追跡された痕跡をマークする
   // 注意:このフラグは黒色に塗りつぶすことを意味しない
   object->isMarked = true;
@@ -68,18 +195,55 @@ void markObject(Obj *object) {
   vm.grayStack[vm.grayCount++] = object;
 }
 
+// rememberObject は writeBarrier から呼ばれ, object への書き込みをGCに知らせる.
+void rememberObject(Obj *object) {
+  if (vm.gcMode == GC_INCREMENTAL) {
+    // 黒いオブジェクトに白いオブジェクトへの参照が書き込まれたかもしれないので灰色に戻す.
+    // 灰色スタックに積んでいる間は isRemembered を立てて二重に積まないようにする.
+    if (vm.gcPhase != GC_MARKING) return;
+    object->isRemembered = true;
+    grayObject(object);
+    return;
+  }
+
+  if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+    vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+    // grayStack と同じ理由で reallocate を経由しない
+    vm.remembered = (Obj **) realloc(vm.remembered,
+                                     sizeof(Obj *) * vm.rememberedCapacity);
+
+    if (vm.remembered == NULL) exit(1);
+  }
+
+  object->isRemembered = true;
+  vm.remembered[vm.rememberedCount++] = object;
+}
+
+// forgetRemembered は記憶集合を空にする.
+// GCの後は若い世代が空になるので, 古い世代から若い世代への参照も残っていない.
+static void forgetRemembered() {
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    vm.remembered[i]->isRemembered = false;
+  }
+  vm.rememberedCount = 0;
+}
+
 // markValue は値が到達可能かチェックする
 void markValue(Value value) {
   // Obj 以外(数値, bool, nil)は内部的に即値でありヒープに確保されないので IS_OBJ で判別する.
   if (IS_OBJ(value)) markObject(AS_OBJ(value));
 }
 
-static void markArray(ValueArray *array) {
-  for (int i = 0; i < array->count; i++) {
-    markValue(array->values[i]);
+static void markValues(Value *values, int count) {
+  for (int i = 0; i < count; i++) {
+    markValue(values[i]);
   }
 }
 
+static void markArray(ValueArray *array) {
+  markValues(array->values, array->count);
+}
+
 // grayStack から取り出された灰色オブジェクトを黒く塗っていく(GC処理)
 static void blackenObject(Obj *object) {
 #ifdef DEBUG_LOG_GC
@@ -99,6 +263,7 @@ static void blackenObject(Obj *object) {
       ObjClass *klass = (ObjClass *) object;
       markObject((Obj *) klass->name);
       markTable(&klass->methods);
+      markObject((Obj *) klass->rootShape);
       break;
     }
     case OBJ_CLOSURE: {
@@ -113,18 +278,79 @@ static void blackenObject(Obj *object) {
     case OBJ_FUNCTION: {
       ObjFunction *function = (ObjFunction *) object;
       markObject((Obj *) function->name);
+      markObject((Obj *) function->closure);
       markArray(&function->chunk.constants);
+      // インラインキャッシュが覚えているクラスとメソッドも到達可能として扱う.
+      // こうしておけばキャッシュが解放済みのクラスを指すことはない.
+      for (int i = 0; i < function->chunk.cacheCount; i++) {
+        InlineCache *cache = &function->chunk.caches[i];
+        for (int j = 0; j < INLINE_CACHE_SIZE; j++) {
+          markObject((Obj *) cache->entries[j].shape);
+          markObject((Obj *) cache->entries[j].transition);
+          markValue(cache->entries[j].method);
+        }
+      }
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance *instance = (ObjInstance *) object;
       markObject((Obj *) instance->klass);
-      markTable(&instance->fields);
+      markObject((Obj *) instance->shape);
+      if (instance->shape != NULL) {
+        markValues(instance->fields, instance->shape->slotCount);
+      }
+      markTable(&instance->dictionary);
       break;
     }
-    case OBJ_UPVALUE:
-      markValue(((ObjUpvalue *) object)->closed);
+    case OBJ_LIST: {
+      ObjList *list = (ObjList *) object;
+      // 数値だけのリストは辿らなくてよい
+      if (list->nonNumbers > 0) markArray(&list->items);
+      break;
+    }
+    case OBJ_ROPE: {
+      ObjRope *rope = (ObjRope *) object;
+      markObject(rope->left);
+      markObject(rope->right);
+      markObject((Obj *) rope->flat);
       break;
+    }
+    case OBJ_SHAPE: {
+      ObjShape *shape = (ObjShape *) object;
+      markObject((Obj *) shape->parent);
+      markObject((Obj *) shape->name);
+      markTable(&shape->transitions);
+      break;
+    }
+    case OBJ_FIBER: {
+      ObjFiber *fiber = (ObjFiber *) object;
+      markObject((Obj *) fiber->caller);
+      markObject((Obj *) fiber->nextParked);
+      markValue(fiber->transfer);
+      // 実行中のファイバーの状態は VM にあり, markRoots() が辿る
+      if (fiber == vm.fiber) break;
+      for (Value *slot = fiber->stack; slot < fiber->stackTop; slot++) {
+        markValue(*slot);
+      }
+      for (int i = 0; i < fiber->frameCount; i++) {
+        markObject((Obj *) fiber->frames[i].closure);
+      }
+      for (ObjUpvalue *upvalue = fiber->openUpvalues; upvalue != NULL;
+           upvalue = upvalue->next) {
+        markObject((Obj *) upvalue);
+      }
+      break;
+    }
+    case OBJ_UPVALUE: {
+      ObjUpvalue *upvalue = (ObjUpvalue *) object;
+      // open な upvalue は, 止まっているファイバーのスタックを指していることがある
+      markValue(*upvalue->location);
+      if (upvalue->location != &upvalue->closed) {
+        markObject((Obj *) upvalue->fiber);
+      }
+      break;
+    }
+    case OBJ_FOREIGN:
     case OBJ_NATIVE:
     case OBJ_STRING:
       break;
@@ -154,25 +380,55 @@ static void freeObject(Obj *object) {
       FREE(ObjClosure, object);
       break;
     }
+    case OBJ_FIBER:
+      freeFiberStacks((ObjFiber *) object);
+      FREE(ObjFiber, object);
+      break;
+    case OBJ_FOREIGN: {
+      ObjForeign *foreign = (ObjForeign *) object;
+      if (foreign->finalize != NULL) {
+        foreign->finalize(foreign->data, foreign->length);
+      }
+      FREE(ObjForeign, object);
+      break;
+    }
     case OBJ_FUNCTION: {
       ObjFunction *function = (ObjFunction *) object;
       freeChunk(&function->chunk);
+      if (function->registers != NULL) freeRegisterCode(function->registers);
+      if (function->jit != NULL) freeJitCode(function->jit);
       FREE(ObjFunction, object);
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance *instance = (ObjInstance *) object;
-      freeTable(&instance->fields);
-      FREE(ObjInstance, object);
+      if (instance->fields != instance->inlineFields) {
+        FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+      }
+      freeTable(&instance->dictionary);
+      reallocate(object, sizeof(ObjInstance) +
+                 sizeof(Value) * instance->inlineCapacity, 0);
       break;
     }
+    case OBJ_LIST:
+      freeValueArray(&((ObjList *) object)->items);
+      FREE(ObjList, object);
+      break;
     case OBJ_NATIVE:
       FREE(ObjNative, object);
       break;
+    case OBJ_ROPE:
+      FREE(ObjRope, object);
+      break;
+    case OBJ_SHAPE: {
+      ObjShape *shape = (ObjShape *) object;
+      freeTable(&shape->transitions);
+      FREE(ObjShape, object);
+      break;
+    }
     case OBJ_STRING: {
       ObjString *string = (ObjString *) object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, object);
+      reallocate(object, sizeof(ObjString) + string->length + 1, 0);
       break;
     }
     case OBJ_UPVALUE:
@@ -198,7 +454,12 @@ static void markRoots() {
     markObject((Obj *) upvalue);
   }
 
+  markObject((Obj *) vm.fiber); // resume を待っているファイバーは caller から辿る
+  markObject((Obj *) vm.parked);
+
   markTable(&vm.globals);  // グローバル変数
+  markArray(&vm.globalValues);
+  markArray(&vm.globalNames);
   markCompilerRoots();  // compilerチェーンを辿って関数オブジェクトをmarkしていく
   markObject((Obj *) vm.initString);
 }
@@ -239,20 +500,195 @@ static void sweep() {
   }
 }
 
-// collectGarbage は mark-sweep GC を開始する起点.
-void collectGarbage() {
-#ifdef DEBUG_LOG_GC
-  printf("-- gc begin\n");
-  size_t before = vm.bytesAllocated;
-#endif
+// sweepNursery は若い世代の白色オブジェクトを解放し, 生き残ったオブジェクトを古い世代に昇格させる.
+// オブジェクトは移動しないので, C のローカル変数やスタックが持つポインタはそのまま使える.
+static void sweepNursery() {
+  Obj *object = vm.youngObjects;
+  while (object != NULL) {
+    Obj *next = object->next;
+    if (object->isMarked) {
+      object->isMarked = false;
+      object->isOld = true;
+      object->next = vm.objects;
+      vm.objects = object;
+    } else {
+      freeObject(object);
+    }
+    object = next;
+  }
+  vm.youngObjects = NULL;
+  vm.allocatedSinceGC = 0;
+}
+
+// minorCollection は若い世代だけを回収する.
+// ルートと記憶集合から到達できる若いオブジェクトを mark し, 残りを解放する.
+static void minorCollection() {
+  vm.gcMinor = true;
+  markRoots();
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    blackenObject(vm.remembered[i]);
+  }
+  traceReferences();
+  tableRemoveWhite(&vm.strings);
+  sweepNursery();
+  forgetRemembered();
+  vm.gcMinor = false;
+}
 
+// majorCollection はヒープ全体を mark-sweep する.
+static void majorCollection() {
   markRoots();
   traceReferences();
   // 文字列テーブルはmark終了とsweepが実施される間にチェックする
   tableRemoveWhite(&vm.strings);
+  forgetRemembered();
   sweep();
+  if (vm.gcMode == GC_GENERATIONAL) sweepNursery();
 
   vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+}
+
+// recordPause は停止時間 seconds を kind とヒストグラムに加える.
+static void recordPause(PauseStats *kind, clock_t start) {
+  double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+  kind->count++;
+  kind->total += seconds;
+  if (seconds > kind->max) kind->max = seconds;
+
+  double micros = seconds * 1e6;
+  int bucket;
+  if (micros < GC_PAUSE_LINEAR) {
+    bucket = (int) micros;
+  } else if (micros >= 4294967296.0) {
+    bucket = GC_PAUSE_BUCKETS - 1;
+  } else {
+    uint32_t value = (uint32_t) micros;
+    int exponent = 31;
+    while (!(value & (1u << exponent))) exponent--; // exponent >= 10
+    int sub = (int) (value >> (exponent - 4)) & (GC_PAUSE_SUBBUCKETS - 1);
+    bucket = GC_PAUSE_LINEAR + (exponent - 10) * GC_PAUSE_SUBBUCKETS + sub;
+  }
+  vm.stats.pauseHistogram[bucket]++;
+}
+
+// pauseBucketLimit はヒストグラムの区間 bucket に入る停止時間の上限(マイクロ秒)を返す.
+static double pauseBucketLimit(int bucket) {
+  if (bucket < GC_PAUSE_LINEAR) return bucket;
+  int exponent = 10 + (bucket - GC_PAUSE_LINEAR) / GC_PAUSE_SUBBUCKETS;
+  int sub = (bucket - GC_PAUSE_LINEAR) % GC_PAUSE_SUBBUCKETS;
+  double width = (double) (1u << (exponent - 4));
+  return (GC_PAUSE_SUBBUCKETS + sub + 1) * width - 1;
+}
+
+// stepExhausted は逐次GCのステップで work 個のオブジェクトを処理した時点で, 時間の予算を使い切ったかを返す.
+// clock() も安くはないので 64 個ごとにしか調べない.
+static bool stepExhausted(clock_t start, int work) {
+  if (vm.gcStepBudget <= 0 || work % 64 != 0) return false;
+  return (double) (clock() - start) * 1e6 / CLOCKS_PER_SEC >=
+         vm.gcStepBudget;
+}
+
+// markStep は灰色のオブジェクトを最大 limit 個まで黒く塗る. 灰色がなくなれば true を返す.
+static bool markStep(clock_t start, int limit) {
+  for (int work = 1; vm.grayCount > 0; work++) {
+    if (work > limit || stepExhausted(start, work)) return false;
+    Obj *object = vm.grayStack[--vm.grayCount];
+    object->isRemembered = false;
+    blackenObject(object);
+  }
+  return true;
+}
+
+// sweepStep は vm.objects を最大 limit 個まで sweep する. 末尾に達したら true を返す.
+// sweep 中に作られたオブジェクトはリストの先頭, つまり sweep 済みの側に入るので調べなくてよい.
+static bool sweepStep(clock_t start, int limit) {
+  for (int work = 1; vm.sweepCursor != NULL; work++) {
+    if (work > limit || stepExhausted(start, work)) return false;
+    Obj *object = vm.sweepCursor;
+    vm.sweepCursor = object->next;
+    if (object->isMarked) {
+      object->isMarked = false;
+      vm.sweepPrevious = object;
+    } else {
+      if (vm.sweepPrevious != NULL) {
+        vm.sweepPrevious->next = vm.sweepCursor;
+      } else {
+        vm.objects = vm.sweepCursor;
+      }
+      freeObject(object);
+    }
+  }
+  return true;
+}
+
+// finishMarking は逐次GCの mark を終える.
+// スタックやグローバル変数への書き込みにはバリアがないので, ルートを辿り直してから sweep に移る.
+static void finishMarking() {
+  markRoots();
+  while (vm.grayCount > 0) {
+    Obj *object = vm.grayStack[--vm.grayCount];
+    object->isRemembered = false;
+    blackenObject(object);
+  }
+  tableRemoveWhite(&vm.strings);
+
+  vm.gcPhase = GC_SWEEPING;
+  vm.sweepPrevious = NULL;
+  vm.sweepCursor = vm.objects;
+}
+
+// incrementalStep は逐次GCを一ステップ進める. サイクルの合間なら新しいサイクルを始める.
+static void incrementalStep() {
+  clock_t start = clock();
+  switch (vm.gcPhase) {
+    case GC_IDLE:
+      markRoots();
+      vm.gcPhase = GC_MARKING;
+      break;
+    case GC_MARKING:
+      if (markStep(start, GC_STEP_OBJECTS)) finishMarking();
+      break;
+    case GC_SWEEPING:
+      if (sweepStep(start, GC_STEP_OBJECTS * 4)) {
+        vm.gcPhase = GC_IDLE;
+        vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+        vm.stats.cycles++;
+      }
+      break;
+  }
+  vm.allocatedSinceGC = 0;
+  recordPause(&vm.stats.step, start);
+}
+
+// collectGarbage は GC を開始する起点.
+// 世代別GCではまずマイナーGCを行い, それでもヒープがしきい値を超えていればメジャーGCを行う.
+// 逐次GCでは一回分のステップだけを進める.
+void collectGarbage() {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+#endif
+  size_t before = vm.bytesAllocated;
+  if (before > vm.stats.peakHeap) vm.stats.peakHeap = before;
+  // 確保量の合計は数え直す前の allocatedSinceGC を足していって求める
+  vm.stats.totalAllocated += vm.allocatedSinceGC;
+  vm.allocatedSinceGC = 0;
+
+  if (vm.gcMode == GC_INCREMENTAL) {
+    incrementalStep();
+  } else {
+    if (vm.gcMode == GC_GENERATIONAL) {
+      clock_t start = clock();
+      minorCollection();
+      recordPause(&vm.stats.minor, start);
+    }
+
+    if (vm.gcMode == GC_FULL || vm.bytesAllocated > vm.nextGC) {
+      clock_t start = clock();
+      majorCollection();
+      recordPause(&vm.stats.major, start);
+    }
+  }
+  vm.stats.bytesFreed += before - vm.bytesAllocated;
 
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
@@ -262,13 +698,103 @@ void collectGarbage() {
 #endif
 }
 
-void freeObjects() {
-  Obj *object = vm.objects;
+// peakResidentSize はこのプロセスの最大常駐サイズを KB で返す. 分からなければ -1.
+static long peakResidentSize() {
+#ifdef __linux__
+  // Linux の ru_maxrss は exec() をまたいで親の値を引き継ぐので, 大きなプロセスから
+  // 起動されるとその値が出てしまう. VmHWM はこのプロセスのアドレス空間だけを数える.
+  FILE *status = fopen("/proc/self/status", "r");
+  if (status != NULL) {
+    char line[256];
+    long peak = -1;
+    while (fgets(line, sizeof(line), status) != NULL) {
+      if (sscanf(line, "VmHWM: %ld kB", &peak) == 1) break;
+    }
+    fclose(status);
+    if (peak >= 0) return peak;
+  }
+#endif
+#ifdef HAVE_POSIX
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // macOS はバイト単位
+#else
+    return usage.ru_maxrss;
+#endif
+  }
+#endif
+  return -1;
+}
+
+static void printPauseStats(FILE *out, const char *name,
+                            const PauseStats *kind) {
+  fprintf(out, "gc: %s %d (total %.3f ms, max %.3f ms)\n", name,
+          kind->count, kind->total * 1000, kind->max * 1000);
+}
+
+// pausePercentile はすべての停止時間のうち percent パーセント目の値(マイクロ秒)を返す.
+// その値を含む区間の上限を返すが, 実際の最大値 max を超えることはない.
+static double pausePercentile(int count, double percent, double max) {
+  int rank = (int) (count * percent / 100);
+  int seen = 0;
+  int bucket = GC_PAUSE_BUCKETS - 1;
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+    seen += vm.stats.pauseHistogram[i];
+    if (seen > rank) {
+      bucket = i;
+      break;
+    }
+  }
+  double limit = pauseBucketLimit(bucket);
+  return limit < max ? limit : max;
+}
+
+// printGCStats はGCの回数と停止時間, 解放したメモリ量を out に書き出す.
+void printGCStats(FILE *out) {
+  const GCStats *stats = &vm.stats;
+  if (vm.gcMode == GC_INCREMENTAL) {
+    printPauseStats(out, "step", &stats->step);
+    fprintf(out, "gc: cycles %d\n", stats->cycles);
+  } else {
+    if (vm.gcMode == GC_GENERATIONAL) {
+      printPauseStats(out, "minor", &stats->minor);
+    }
+    printPauseStats(out, "major", &stats->major);
+  }
+
+  size_t peakHeap = stats->peakHeap > vm.bytesAllocated ? stats->peakHeap
+                                                         : vm.bytesAllocated;
+  fprintf(out, "gc: allocated %zu bytes, freed %zu bytes, peak heap %zu bytes\n",
+          stats->totalAllocated + vm.allocatedSinceGC, stats->bytesFreed,
+          peakHeap);
+  long peakRss = peakResidentSize();
+  if (peakRss >= 0) fprintf(out, "gc: peak rss %ld KB\n", peakRss);
+
+  int count = stats->minor.count + stats->major.count + stats->step.count;
+  if (count == 0) return;
+  double max = stats->minor.max;
+  if (stats->major.max > max) max = stats->major.max;
+  if (stats->step.max > max) max = stats->step.max;
+  max *= 1e6;
+  fprintf(out, "gc: pause p50 %.0f us, p90 %.0f us, p99 %.0f us, "
+               "max %.0f us\n",
+          pausePercentile(count, 50, max), pausePercentile(count, 90, max),
+          pausePercentile(count, 99, max), max);
+}
+
+static void freeObjectList(Obj *object) {
   while (object != NULL) {
     Obj *next = object->next;
     freeObject(object);
     object = next;
   }
+}
+
+void freeObjects() {
+  freeObjectList(vm.objects);
+  freeObjectList(vm.youngObjects);
 
   free(vm.grayStack);
+  free(vm.remembered);
 }
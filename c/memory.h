@@ -1,9 +1,35 @@
 #ifndef clox_memory_h
 #define clox_memory_h
 
+#include <stdio.h>
+
 #include "common.h"
 #include "object.h"
 
+// reallocate() は POOL_MAX_SIZE バイト以下の領域を POOL_GRANULE バイト刻みのサイズクラスに
+// 切り上げ, クラスごとのフリーリストから確保する. フリーリストが空なら
+// POOL_BLOCK_SIZE バイトのブロックを malloc して先頭から切り出す.
+// 固定長の Obj や短い文字列, 小さな配列のほとんどがここに収まる.
+#define POOL_GRANULE 16
+#define POOL_MAX_SIZE 256
+#define POOL_CLASS_COUNT (POOL_MAX_SIZE / POOL_GRANULE)
+#define POOL_BLOCK_SIZE (64 * 1024)
+
+typedef struct PoolFree {
+  struct PoolFree *next;
+} PoolFree;
+
+typedef struct PoolBlock {
+  struct PoolBlock *next;
+} PoolBlock;
+
+typedef struct {
+  PoolFree *freeLists[POOL_CLASS_COUNT]; // サイズクラスごとの解放済み領域
+  char *bumpNext; // 現在のブロックの未使用部分の先頭
+  char *bumpEnd;  // 現在のブロックの終端
+  PoolBlock *blocks; // 確保したすべてのブロック. freePool() でまとめて解放する.
+} Pool;
+
 #define ALLOCATE(type, count) \
     (type*)reallocate(NULL, 0, sizeof(type) * (count))
 
@@ -24,6 +50,29 @@
 // メモリ管理関数 (fin-lang の alloc_func に通じるものがある)
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
 
+void rememberObject(Obj *object);
+
+// writeBarrier は作成済みのオブジェクト object に別のオブジェクトへの参照を書き込んだ後に呼ぶ.
+// 世代別GCでは古い世代の object を記憶集合に追加し, 次のマイナーGCで参照先も辿るようにする.
+// 逐次GCでは mark 済みの object を灰色に戻し, 黒から白への参照ができないようにする.
+// GC_FULL ではミューテータの実行中に古いオブジェクトも mark 済みのオブジェクトもないので何もしない.
+static inline void writeBarrier(Obj *object) {
+  if (!object->isRemembered && (object->isOld || object->isMarked)) {
+    rememberObject(object);
+  }
+}
+
+// writeBarrierValue は object に書き込んだ value が若い世代のオブジェクトのときだけ記録する.
+static inline void writeBarrierValue(Obj *object, Value value) {
+  if (IS_OBJ(value) && !AS_OBJ(value)->isOld) writeBarrier(object);
+}
+
+void initPool(Pool *pool);
+
+void freePool(Pool *pool);
+
+void grayObject(Obj *object);
+
 void markObject(Obj *object);
 
 void markValue(Value value);
@@ -32,4 +81,6 @@ void collectGarbage();
 
 void freeObjects();
 
+void printGCStats(FILE *out);
+
 #endif
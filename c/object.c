@@ -1,8 +1,10 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
 #include "object.h"
+#include "output.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
@@ -16,10 +18,26 @@ static Obj *allocateObject(size_t size, ObjType type) {
   Obj *object = (Obj *) reallocate(NULL, 0, size);
   object->type = type;
   object->isMarked = false;
+  object->isOld = false;
+  object->isRemembered = false;
 
-  // 新規オブジェクトをVM管理のアドレスの先頭に挿入する
-  object->next = vm.objects;
-  vm.objects = object;
+  // 新規オブジェクトをVM管理のアドレスの先頭に挿入する.
+  // 世代別GCでは若い世代(nursery)のリストに入り, マイナーGCを生き延びると vm.objects に移る.
+  if (vm.gcMode == GC_GENERATIONAL) {
+    object->next = vm.youngObjects;
+    vm.youngObjects = object;
+  } else {
+    object->next = vm.objects;
+    vm.objects = object;
+  }
+
+  if (vm.gcPhase == GC_MARKING) {
+    // 逐次GCの mark 中に作られたオブジェクトは灰色にしておき, 参照先も後で辿る
+    grayObject(object);
+  } else if (vm.gcPhase == GC_SWEEPING && vm.sweepPrevious == NULL) {
+    // sweep 済みの先頭部分に挿入したので, リストから外すときの起点をずらしておく
+    vm.sweepPrevious = object;
+  }
 
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -41,6 +59,8 @@ ObjClass *newClass(ObjString *name) {
   ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
   klass->name = name; // [klass]
   initTable(&klass->methods);
+  klass->rootShape = NULL;
+  klass->fieldHint = 0;
   return klass;
 }
 
@@ -61,39 +81,305 @@ ObjClosure *newClosure(ObjFunction *function) {
   return closure;
 }
 
+// markNonEscaping は function を nonEscaping にし, 使い回すクロージャを作る.
+// function は呼び出し側でGCから到達可能にしておくこと.
+void markNonEscaping(ObjFunction *function) {
+  function->nonEscaping = true;
+  function->closure = newClosure(function);
+  writeBarrier((Obj *) function);
+}
+
 // newFunction は新しい関数構造体を生成する
 ObjFunction *newFunction() {
   ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->maxStack = 0;
   function->name = NULL;
+  function->registers = NULL;
+  function->jit = NULL;
+  function->hotness = 0;
+  function->nonEscaping = false;
+  function->closure = NULL;
   initChunk(&function->chunk);
   return function;
 }
 
+// newInstance は klass のインスタンスを生成する.
+// klass は呼び出し側でGCから到達可能にしておくこと.
 ObjInstance *newInstance(ObjClass *klass) {
-  ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+  if (klass->rootShape == NULL) {
+    klass->rootShape = newShape(NULL, NULL);
+    writeBarrier((Obj *) klass);
+  }
+
+  // 同じクラスのこれまでのインスタンスと同じ数のフィールドを本体と一緒に確保しておく.
+  // そうすればたいていのインスタンスはフィールドのために追加の確保をしなくて済む.
+  int inlineCapacity = klass->fieldHint;
+  ObjInstance *instance = (ObjInstance *) allocateObject(
+      sizeof(ObjInstance) + sizeof(Value) * inlineCapacity, OBJ_INSTANCE);
   instance->klass = klass;
-  initTable(&instance->fields);
+  instance->shape = klass->rootShape;
+  instance->fields = instance->inlineFields;
+  instance->fieldCapacity = inlineCapacity;
+  instance->inlineCapacity = inlineCapacity;
+  initTable(&instance->dictionary);
   return instance;
 }
 
+// newList は values の count 個の値を要素に持つリストを返す.
+// values はGCから到達可能な場所 (VMのスタックなど) を指していること.
+ObjList *newList(Value *values, int count) {
+  // 配列を先に確保する. オブジェクトの確保でGCが走っても配列は回収されない.
+  Value *items = count == 0 ? NULL : ALLOCATE(Value, count);
+  ObjList *list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+  list->items.values = items;
+  list->items.capacity = count;
+  list->items.count = count;
+  list->nonNumbers = 0;
+  list->printing = false;
+  for (int i = 0; i < count; i++) {
+    items[i] = values[i];
+    if (!IS_NUMBER(values[i])) list->nonNumbers++;
+  }
+  return list;
+}
+
+// listAppend は list の末尾に value を追加する.
+// value は呼び出し側でGCから到達可能にしておくこと.
+void listAppend(ObjList *list, Value value) {
+  writeValueArray(&list->items, value);
+  if (!IS_NUMBER(value)) list->nonNumbers++;
+  writeBarrierValue((Obj *) list, value);
+}
+
+// listSet は list の index 番目の要素を value にする. index は範囲内であること.
+void listSet(ObjList *list, int index, Value value) {
+  Value *slot = &list->items.values[index];
+  list->nonNumbers += (int) !IS_NUMBER(value) - (int) !IS_NUMBER(*slot);
+  *slot = value;
+  writeBarrierValue((Obj *) list, value);
+}
+
 // newNative はC言語ネイティブ関数を扱う構造体を返す
-ObjNative *newNative(NativeFn function) {
+ObjNative *newNative(NativeFn function, void *userdata) {
   ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->function = function;
+  native->userdata = userdata;
   return native;
 }
 
+// FIBER_ARRAYS_SIZE はファイバーが最初に確保する配列の大きさ.
+// 配列は VM のスタックと同じく reallocate() を経由しないが, GCを起動する目安には数えておく.
+#define FIBER_ARRAYS_SIZE \
+    ((sizeof(Value) + sizeof(ObjUpvalue *)) * FIBER_STACK_INITIAL + \
+     sizeof(CallFrame) * FIBER_FRAMES_INITIAL)
+
+// newFiber は closure を実行するファイバーを生成する. closure は最初の resume で呼び出す.
+// closure が NULL なら配列を確保しない. initVM() が VM の状態をそのまま使う最初のファイバーに使う.
+ObjFiber *newFiber(ObjClosure *closure) {
+  ObjFiber *fiber = ALLOCATE_OBJ(ObjFiber, OBJ_FIBER);
+  fiber->state = closure == NULL ? FIBER_RUNNING : FIBER_NEW;
+  fiber->caller = NULL;
+  fiber->nextParked = NULL;
+  fiber->transfer = NIL_VAL;
+  fiber->frames = NULL;
+  fiber->frameCount = 0;
+  fiber->frameCapacity = 0;
+  fiber->baseFrame = 0;
+  fiber->stack = NULL;
+  fiber->stackEnd = NULL;
+  fiber->stackTop = NULL;
+  fiber->openUpvalues = NULL;
+  fiber->openSlots = NULL;
+  if (closure == NULL) return fiber;
+
+  fiber->frames = (CallFrame *) malloc(sizeof(CallFrame) *
+                                       FIBER_FRAMES_INITIAL);
+  fiber->stack = (Value *) malloc(sizeof(Value) * FIBER_STACK_INITIAL);
+  fiber->openSlots = (ObjUpvalue **) calloc(FIBER_STACK_INITIAL,
+                                            sizeof(ObjUpvalue *));
+  if (fiber->frames == NULL || fiber->stack == NULL ||
+      fiber->openSlots == NULL) {
+    exit(1); // out of memory
+  }
+  vm.bytesAllocated += FIBER_ARRAYS_SIZE;
+  fiber->frameCapacity = FIBER_FRAMES_INITIAL;
+  fiber->stackEnd = fiber->stack + FIBER_STACK_INITIAL;
+  // 最初の resume はこのクロージャを呼び出す
+  fiber->stack[0] = OBJ_VAL(closure);
+  fiber->stackTop = fiber->stack + 1;
+  writeBarrier((Obj *) fiber);
+  return fiber;
+}
+
+// freeFiberStacks はファイバーの配列を解放する. 終わったファイバーは回収を待たずに解放してよい.
+void freeFiberStacks(ObjFiber *fiber) {
+  if (fiber->stack == NULL) return;
+  free(fiber->frames);
+  free(fiber->stack);
+  free(fiber->openSlots);
+  vm.bytesAllocated -= FIBER_ARRAYS_SIZE;
+  fiber->frames = NULL;
+  fiber->frameCount = 0;
+  fiber->frameCapacity = 0;
+  fiber->stack = NULL;
+  fiber->stackEnd = NULL;
+  fiber->stackTop = NULL;
+  fiber->openUpvalues = NULL;
+  fiber->openSlots = NULL;
+}
+
+// newForeign はホストのバッファ data を包むオブジェクトを返す. data はコピーしない.
+ObjForeign *newForeign(const char *tag, void *data, size_t length,
+                       ForeignFinalizer finalize) {
+  ObjForeign *foreign = ALLOCATE_OBJ(ObjForeign, OBJ_FOREIGN);
+  foreign->tag = tag;
+  foreign->data = data;
+  foreign->length = length;
+  foreign->finalize = finalize;
+  return foreign;
+}
+
+void *foreignData(Value value, const char *tag, size_t *length) {
+  // 別の翻訳単位の同じ名前の tag はポインタが違うことがあるので, 中身も比べる
+  if (!IS_FOREIGN(value)) return NULL;
+  ObjForeign *foreign = AS_FOREIGN(value);
+  if (foreign->tag != tag && strcmp(foreign->tag, tag) != 0) return NULL;
+  if (length != NULL) *length = foreign->length;
+  return foreign->data;
+}
+
+// newShape は parent にフィールド name を一つ追加したシェイプを生成する.
+// parent が NULL なら根のシェイプになる.
+ObjShape *newShape(ObjShape *parent, ObjString *name) {
+  ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  shape->parent = parent;
+  shape->name = name;
+  shape->slotCount = parent == NULL ? 0 : parent->slotCount + 1;
+  initTable(&shape->transitions);
+  return shape;
+}
+
+// shapeFindSlot はフィールド name のスロット番号を返す. なければ -1 を返す.
+// フィールド名はインターン化されているのでポインタの比較だけで済む.
+int shapeFindSlot(ObjShape *shape, ObjString *name) {
+  for (; shape->parent != NULL; shape = shape->parent) {
+    if (shape->name == name) return shape->slotCount - 1;
+  }
+  return -1;
+}
+
+// shapeTransition は shape にフィールド name を追加した子のシェイプを返す.
+// 子がまだなければ作って遷移先として登録する.
+// フィールド数の上限に達している場合は NULL を返すので, 呼び出し側は辞書モードに切り替えること.
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name) {
+  Value next;
+  if (tableGet(&shape->transitions, name, &next)) {
+    return (ObjShape *) AS_OBJ(next);
+  }
+
+  if (shape->slotCount >= SHAPE_MAX_FIELDS) return NULL;
+
+  ObjShape *child = newShape(shape, name);
+  push(OBJ_VAL(child));
+  tableSet(&shape->transitions, name, OBJ_VAL(child));
+  writeBarrier((Obj *) shape);
+  pop();
+  return child;
+}
+
+// instanceAddField は instance の末尾に value を追加し, シェイプを shape に遷移させる.
+// shape は instance の現在のシェイプから一つフィールドを追加した子でなければならない.
+// value は呼び出し側でGCから到達可能にしておくこと.
+void instanceAddField(ObjInstance *instance, ObjShape *shape, Value value) {
+  int slot = shape->slotCount - 1;
+  if (slot >= instance->fieldCapacity) {
+    int oldCapacity = instance->fieldCapacity;
+    int capacity = oldCapacity < 4 ? 4 : oldCapacity * 2;
+    Value *fields = ALLOCATE(Value, capacity);
+    memcpy(fields, instance->fields, sizeof(Value) * slot);
+    if (instance->fields != instance->inlineFields) {
+      FREE_ARRAY(Value, instance->fields, oldCapacity);
+    }
+    instance->fields = fields;
+    instance->fieldCapacity = capacity;
+  }
+
+  instance->fields[slot] = value;
+  instance->shape = shape;
+  writeBarrier((Obj *) instance);
+  if (instance->klass->fieldHint < shape->slotCount) {
+    instance->klass->fieldHint = shape->slotCount;
+  }
+}
+
+// toDictionary はシェイプのフィールド数の上限を超えたインスタンスを辞書モードに切り替える.
+static void toDictionary(ObjInstance *instance) {
+  for (ObjShape *shape = instance->shape; shape->parent != NULL;
+       shape = shape->parent) {
+    tableSet(&instance->dictionary, shape->name,
+             instance->fields[shape->slotCount - 1]);
+  }
+
+  if (instance->fields != instance->inlineFields) {
+    FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+  }
+  instance->fields = instance->inlineFields;
+  instance->fieldCapacity = instance->inlineCapacity;
+  instance->shape = NULL;
+}
+
+bool instanceGetField(ObjInstance *instance, ObjString *name, Value *value) {
+  if (instance->shape == NULL) {
+    return tableGet(&instance->dictionary, name, value);
+  }
+
+  int slot = shapeFindSlot(instance->shape, name);
+  if (slot < 0) return false;
+  *value = instance->fields[slot];
+  return true;
+}
+
+// instanceSetField は instance のフィールド name に value を設定する. なければ追加する.
+// value は呼び出し側でGCから到達可能にしておくこと.
+void instanceSetField(ObjInstance *instance, ObjString *name, Value value) {
+  if (instance->shape != NULL) {
+    int slot = shapeFindSlot(instance->shape, name);
+    if (slot >= 0) {
+      instance->fields[slot] = value;
+      writeBarrierValue((Obj *) instance, value);
+      return;
+    }
+
+    ObjShape *next = shapeTransition(instance->shape, name);
+    if (next != NULL) {
+      instanceAddField(instance, next, value);
+      return;
+    }
+
+    toDictionary(instance);
+  }
+
+  tableSet(&instance->dictionary, name, value);
+  writeBarrier((Obj *) instance);
+}
+
 /* Strings allocate-string < Hash Tables allocate-string
 static ObjString* allocateString(char* chars, int length) {
 */
-static ObjString *allocateString(char *chars, int length, uint32_t hash) {
-  ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+// newString は長さ length の文字列オブジェクトを確保する. 中身は呼び出し側で埋めること.
+static ObjString *newString(int length, uint32_t hash) {
+  ObjString *string = (ObjString *) allocateObject(
+      sizeof(ObjString) + length + 1, OBJ_STRING);
   string->length = length;
-  string->chars = chars;
   string->hash = hash;
+  string->chars[length] = '\0';
+  return string;
+}
 
+// internString は中身を埋め終えた string を文字列プールに登録する.
+static ObjString *internString(ObjString *string) {
   push(OBJ_VAL(string));
   tableSet(&vm.strings, string, NIL_VAL);
   pop();
@@ -101,45 +387,157 @@ static ObjString *allocateString(char *chars, int length, uint32_t hash) {
   return string;
 }
 
-// hashString は char配列を1byte毎とりだしてハッシュ計算して返す
-static uint32_t hashString(const char *key, int length) {
-  uint32_t hash = 2166136261u;
+// hashString は char配列を1byte毎とりだしてハッシュ計算して返す.
+// FNV-1a は先頭から順に計算するので, hash に a のハッシュ値を渡せば a に key を連結した文字列のハッシュ値になる.
+static uint32_t hashContinue(uint32_t hash, const char *key, int length) {
   for (int i = 0; i < length; i++) {
     hash ^= (uint8_t) key[i];
-    hash *= 16777619;
+    hash *= FNV_PRIME;
   }
   return hash;
 }
 
+uint32_t hashString(const char *key, int length) {
+  return hashContinue(FNV_OFFSET_BASIS, key, length);
+}
+
+// takeString は ALLOCATE(char, length + 1) で確保された chars の所有権を受け取り, 文字列オブジェクトを返す.
+// 中身は文字列オブジェクトにコピーするので chars はここで解放する.
 ObjString *takeString(char *chars, int length) {
 /* Strings take-string < Hash Tables take-string-hash
   return allocateString(chars, length);
 */
-  uint32_t hash = hashString(chars, length);
-  ObjString *interned = tableFindString(&vm.strings, chars, length,
-                                        hash);
-  if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
-    return interned;
-  }
-
-  return allocateString(chars, length, hash);
+  ObjString *string = copyString(chars, length);
+  FREE_ARRAY(char, chars, length + 1);
+  return string;
 }
 
 ObjString *copyString(const char *chars, int length) {
-  uint32_t hash = hashString(chars, length);
+  return copyStringHashed(chars, length, hashString(chars, length));
+}
+
+ObjString *copyStringHashed(const char *chars, int length, uint32_t hash) {
   // テーブルに文字列がインターン化されたものがあればそれを返す
   ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
   if (interned != NULL)
     return interned;
 
-  char *heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
+  ObjString *string = newString(length, hash);
+  memcpy(string->chars, chars, length);
 /* Strings object-c < Hash Tables copy-string-allocate
   return allocateString(heapChars, length);
 */
-  return allocateString(heapChars, length, hash);
+  return internString(string);
+}
+
+// concatenateStrings は a と b を連結した文字列を返す.
+// 結果がすでにインターン化されていれば, 一時的な領域を確保することなくそれを返す.
+// a と b は呼び出し側でGCから到達可能にしておくこと.
+ObjString *concatenateStrings(ObjString *a, ObjString *b) {
+  int length = a->length + b->length;
+  uint32_t hash = hashContinue(a->hash, b->chars, b->length);
+  ObjString *interned = tableFindConcatenation(&vm.strings, a, b, hash);
+  if (interned != NULL) return interned;
+
+  ObjString *string = newString(length, hash);
+  memcpy(string->chars, a->chars, a->length);
+  memcpy(string->chars + a->length, b->chars, b->length);
+  return internString(string);
+}
+
+// ropeChild はロープの子として保持する節を返す. 平坦化済みのロープなら結果の文字列を使い, 木を浅く保つ.
+static Obj *ropeChild(Value value) {
+  if (IS_ROPE(value) && AS_ROPE(value)->flat != NULL) {
+    return (Obj *) AS_ROPE(value)->flat;
+  }
+  return AS_OBJ(value);
+}
+
+// newRope は left と right を連結したロープを作る.
+// どちらも ObjString か ObjRope で, 合計の長さが ROPE_MIN_LENGTH 以上であること.
+// left と right は呼び出し側でGCから到達可能にしておくこと.
+ObjRope *newRope(Value left, Value right) {
+  ObjRope *rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+  rope->length = textLength(left) + textLength(right);
+  rope->left = ropeChild(left);
+  rope->right = ropeChild(right);
+  rope->flat = NULL;
+  return rope;
+}
+
+// textLength は ObjString か ObjRope の長さを返す.
+int textLength(Value value) {
+  if (IS_ROPE(value)) return AS_ROPE(value)->length;
+  return AS_STRING(value)->length;
+}
+
+// RopeVisitor はロープの葉の文字列を先頭から順に受け取る.
+typedef void (*RopeVisitor)(ObjString *leaf, void *context);
+
+// visitRope は rope の葉を先頭から順に visitor に渡す.
+// 左に深いロープ(ループで末尾に連結し続けたもの)は非常に深くなるので, 再帰せず明示的なスタックで辿る.
+// スタックは reallocate() を経由せずに確保するので, この間にGCが走ることはない.
+static void visitRope(ObjRope *rope, RopeVisitor visitor, void *context) {
+  int capacity = 8;
+  int count = 0;
+  Obj **stack = (Obj **) malloc(sizeof(Obj *) * capacity);
+  if (stack == NULL) exit(1);
+  stack[count++] = (Obj *) rope;
+
+  while (count > 0) {
+    Obj *node = stack[--count];
+    if (node->type == OBJ_STRING) {
+      visitor((ObjString *) node, context);
+      continue;
+    }
+
+    ObjRope *inner = (ObjRope *) node;
+    if (inner->flat != NULL) {
+      visitor(inner->flat, context);
+      continue;
+    }
+
+    if (capacity < count + 2) {
+      capacity *= 2;
+      stack = (Obj **) realloc(stack, sizeof(Obj *) * capacity);
+      if (stack == NULL) exit(1);
+    }
+    // 左を先に取り出すので右から積む
+    stack[count++] = inner->right;
+    stack[count++] = inner->left;
+  }
+
+  free(stack);
+}
+
+static void copyLeaf(ObjString *leaf, void *context) {
+  char **cursor = (char **) context;
+  memcpy(*cursor, leaf->chars, leaf->length);
+  *cursor += leaf->length;
+}
+
+// flattenRope は rope の中身をつなげてインターン化した文字列を返す. 結果は rope に覚えておく.
+// rope は呼び出し側でGCから到達可能にしておくこと.
+ObjString *flattenRope(ObjRope *rope) {
+  if (rope->flat != NULL) return rope->flat;
+
+  ObjString *string = newString(rope->length, 0);
+  char *cursor = string->chars;
+  visitRope(rope, copyLeaf, &cursor);
+  string->hash = hashString(string->chars, string->length);
+
+  // すでに同じ内容の文字列があればそちらを使う. いま作った string はどこからも参照されずに回収される.
+  ObjString *interned = tableFindString(&vm.strings, string->chars,
+                                        string->length, string->hash);
+  rope->flat = interned != NULL ? interned : internString(string);
+  rope->left = NULL;
+  rope->right = NULL;
+  writeBarrier((Obj *) rope);
+  return rope->flat;
+}
+
+static void printLeaf(ObjString *leaf, void *context) {
+  writeOutput(leaf->chars, (size_t) leaf->length);
 }
 
 // newUpvalue は upvalueオブジェクトを生成して返す.
@@ -149,15 +547,33 @@ ObjUpvalue *newUpvalue(Value *slot) {
   upvalue->closed = NIL_VAL;
   upvalue->location = slot;
   upvalue->next = NULL;
+  upvalue->fiber = vm.fiber;
   return upvalue;
 }
 
 static void printFunction(ObjFunction *function) {
   if (function->name == NULL) {
-    printf("<script>");
+    writeOutputString("<script>");
+    return;
+  }
+  writeOutputString("<fn ");
+  writeOutput(function->name->chars, (size_t) function->name->length);
+  writeOutputString(">");
+}
+
+static void printList(ObjList *list) {
+  if (list->printing) {
+    writeOutputString("[...]");
     return;
   }
-  printf("<fn %s>", function->name->chars);
+  list->printing = true;
+  writeOutputString("[");
+  for (int i = 0; i < list->items.count; i++) {
+    if (i > 0) writeOutputString(", ");
+    printValue(list->items.values[i]);
+  }
+  writeOutputString("]");
+  list->printing = false;
 }
 
 void printObject(Value value) {
@@ -166,26 +582,44 @@ void printObject(Value value) {
       printFunction(AS_BOUND_METHOD(value)->method->function);
       break;
     case OBJ_CLASS:
-      printf("%s", AS_CLASS(value)->name->chars);
+      writeOutputString(AS_CLASS(value)->name->chars);
       break;
     case OBJ_CLOSURE:
       printFunction(AS_CLOSURE(value)->function);
       break;
+    case OBJ_FIBER:
+      writeOutputString("<fiber>");
+      break;
+    case OBJ_FOREIGN:
+      writeOutputString("<foreign ");
+      writeOutputString(AS_FOREIGN(value)->tag);
+      writeOutputString(">");
+      break;
     case OBJ_FUNCTION:
       printFunction(AS_FUNCTION(value));
       break;
     case OBJ_INSTANCE:
-      printf("%s instance",
-             AS_INSTANCE(value)->klass->name->chars);
+      writeOutputString(AS_INSTANCE(value)->klass->name->chars);
+      writeOutputString(" instance");
+      break;
+    case OBJ_LIST:
+      printList(AS_LIST(value));
       break;
     case OBJ_NATIVE:
-      printf("<native fn>");
+      writeOutputString("<native fn>");
+      break;
+    case OBJ_ROPE:
+      // 表示のためだけに確保はしない
+      visitRope(AS_ROPE(value), printLeaf, NULL);
+      break;
+    case OBJ_SHAPE:
+      writeOutputString("shape");
       break;
     case OBJ_STRING:
-      printf("%s", AS_CSTRING(value));
+      writeOutput(AS_CSTRING(value), (size_t) AS_STRING(value)->length);
       break;
     case OBJ_UPVALUE:
-      printf("upvalue");
+      writeOutputString("upvalue");
       break;
   }
 }
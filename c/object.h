@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "chunk.h"
+#include "lox.h"
 #include "table.h"
 #include "value.h"
 
@@ -11,18 +12,28 @@
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
 #define IS_CLASS(value)        isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value)      isObjType(value, OBJ_CLOSURE)
+#define IS_FIBER(value)        isObjType(value, OBJ_FIBER)
+#define IS_FOREIGN(value)      isObjType(value, OBJ_FOREIGN)
 #define IS_FUNCTION(value)     isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)     isObjType(value, OBJ_INSTANCE)
+#define IS_LIST(value)         isObjType(value, OBJ_LIST)
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
+#define IS_ROPE(value)         isObjType(value, OBJ_ROPE)
+#define IS_SHAPE(value)        isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
+// IS_TEXT は言語の上で文字列として振る舞う値(ObjString か ObjRope)かを判定する
+#define IS_TEXT(value)         (IS_STRING(value) || IS_ROPE(value))
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
 #define AS_CLASS(value)        ((ObjClass*)AS_OBJ(value))
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
+#define AS_FIBER(value)        ((ObjFiber*)AS_OBJ(value))
+#define AS_FOREIGN(value)      ((ObjForeign*)AS_OBJ(value))
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
-#define AS_NATIVE(value) \
-    (((ObjNative*)AS_OBJ(value))->function)
+#define AS_LIST(value)         ((ObjList*)AS_OBJ(value))
+#define AS_NATIVE(value)       ((ObjNative*)AS_OBJ(value))
+#define AS_ROPE(value)         ((ObjRope*)AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 
@@ -30,9 +41,14 @@ typedef enum {
   OBJ_BOUND_METHOD,
   OBJ_CLASS,
   OBJ_CLOSURE,
+  OBJ_FIBER,
+  OBJ_FOREIGN,
   OBJ_FUNCTION,
   OBJ_INSTANCE,
+  OBJ_LIST,
   OBJ_NATIVE,
+  OBJ_ROPE,
+  OBJ_SHAPE,
   OBJ_STRING,
   OBJ_UPVALUE
 } ObjType;
@@ -42,6 +58,8 @@ typedef enum {
 struct Obj {
   ObjType type; // オブジェクトの種類
   bool isMarked; // mark-sweep の目印
+  bool isOld; // 世代別GCでマイナーGCを生き延びて古い世代に昇格したか
+  bool isRemembered; // 古い世代のオブジェクトが記憶集合に入っているか
   struct Obj *next; // 連結リスト用
 };
 
@@ -52,53 +70,164 @@ typedef struct {
   Obj obj;           // 言語内でファーストクラスの扱うを受けるものは Obj を継承(?)しなければならない.
   int arity;         // 関数が受け取る引数の数
   int upvalueCount;  // キャプチャしたクロージャ変数の数. 実行時に必要なため Compiler ではなく ObjFunction 側で保持する.
+  int maxStack;      // フレームのスタックの高さの最大値 (ローカル変数と一時的な値). 呼び出し時にスタックの残りと比べる.
   Chunk chunk;       // 関数本体のバイトコード
   ObjString *name;   // 関数名
+  struct RegisterCode *registers; // レジスタ層に翻訳した命令列. 翻訳していなければ NULL.
+  struct JitCode *jit; // --tier=jit でコンパイルした機械語. まだなら NULL.
+  int hotness;         // --tier=jit での呼び出しとループの後方ジャンプの回数. コンパイルに失敗したら INT_MIN.
+  // nonEscaping は宣言した関数の中で直接呼び出されるだけのローカル関数であることを示す.
+  // 捕捉した変数は OP_GET_OUTER で呼び出し元のフレームから読む. 設定するときは markNonEscaping() を使う.
+  bool nonEscaping;
+  struct ObjClosure *closure; // nonEscaping な関数の OP_CLOSURE が使い回すクロージャ. 状態を持たないので一つで足りる.
 } ObjFunction;
 
+/* Calls and Functions obj-native-h < Embedding native-fn
 typedef Value (*NativeFn)(int argCount, Value *args);
+*/
+// NativeFn は lox.h にある
 
 // ObjNative はC言語で実装された関数を表す
 typedef struct {
   Obj obj;
   NativeFn function;
+  void *userdata; // function に毎回渡すホストのポインタ
 } ObjNative;
 
+// ObjForeign はホストのバッファをコピーせずに包む. Lox からは中身が見えず, 変数に入れて
+// ネイティブ関数に渡すことしかできない. 等価性は同じオブジェクトかどうかで決まる.
+// data の寿命はホストが管理する. finalize があれば回収されたとき (freeVM() を含む) に呼ぶ.
+struct ObjForeign {
+  Obj obj;
+  const char *tag; // 型の名前. 表示と, ネイティブ関数が引数の種類を確かめるのに使う. 静的な文字列であること.
+  void *data;
+  size_t length;
+  ForeignFinalizer finalize;
+};
+
+// 文字列の中身はヘッダの直後に NUL 終端で格納し, 一回の確保で済ませる.
+// 短い文字列なら reallocate() のプールの小さなサイズクラスにそのまま収まる.
 struct ObjString {
   Obj obj;
   int length; // 文字列の長さ
-  char *chars; // 実際の文字列
   uint32_t hash; // 文字列のハッシュ値(毎回計算する必要がないようにメモ化しておく)
+  char chars[]; // 実際の文字列
 };
 
+// この長さ未満の文字列の連結はその場でコピーし, これ以上ならロープを作る
+#define ROPE_MIN_LENGTH 64
+
+// ObjRope は文字列の連結を遅延させる. 長い文字列を少しずつ組み立てるループで
+// 毎回全体をコピーしてハッシュ計算とインターン化をすると二乗の時間がかかるため,
+// 連結では left と right を指すだけの節を作り, 中身が必要になったときに一度だけ平坦化する.
+// 言語の上では ObjString と区別できない. 平坦化の結果は flat に覚えておく.
+typedef struct {
+  Obj obj;
+  int length; // 連結した文字列全体の長さ. ROPE_MIN_LENGTH 以上.
+  Obj *left;  // ObjString か ObjRope. 平坦化した後は NULL.
+  Obj *right;
+  ObjString *flat; // 平坦化してインターン化した結果. まだなら NULL.
+} ObjRope;
+
 // upvalue のランタイム表現
 typedef struct ObjUpvalue {
   Obj obj;
   Value *location; // キャプチャした変数への参照
   Value closed; // upvalueがクローズされた際に値を保持しておくためのフィールド
   struct ObjUpvalue *next; // 連結リストでメモリアドレス順になるよう管理する
+  // location が指すスタックを持つファイバー. open の間はファイバーを生かしておき, スタックが解放されないようにする.
+  struct ObjFiber *fiber;
 } ObjUpvalue;
 
+// 新しいファイバーのスタックと CallFrame の配列の大きさ. VM のスタックと同じく足りなくなれば倍に伸ばす.
+#define FIBER_STACK_INITIAL 256
+#define FIBER_FRAMES_INITIAL 8
+
+typedef enum {
+  FIBER_NEW,       // まだ一度も resume されていない
+  FIBER_RUNNING,   // 実行中か, resume したファイバーの終了や yield を待っている
+  FIBER_SUSPENDED, // yield して resume を待っている
+  FIBER_DONE,      // 関数が返ったか, 実行時エラーで終わった
+} FiberState;
+
+// ObjFiber は独自の値のスタックと CallFrame の配列を持つ実行の流れ (コルーチン).
+// 実行中のファイバー (vm.fiber) の状態は VM の同名のフィールドにあり, ここの配列は NULL になっている.
+// resume と yield のときに VM のフィールドとの間で入れ替える. 最初のファイバーはスクリプトを実行する initVM() のもの.
+struct ObjFiber {
+  Obj obj;
+  FiberState state;
+  struct ObjFiber *caller; // このファイバーを resume して, yield や終了を待っているファイバー
+  struct ObjFiber *nextParked; // parkFiber() で止められているファイバーの連結リスト
+  Value transfer; // yield した値. resumeFiber() が受け取るまでの間だけ使う
+  struct CallFrame *frames;
+  int frameCount;
+  int frameCapacity;
+  int baseFrame;
+  Value *stack;
+  Value *stackEnd;
+  Value *stackTop;
+  ObjUpvalue *openUpvalues;
+  ObjUpvalue **openSlots;
+};
+
 // ObjClosure は閉包関数を表す.
-typedef struct {
+typedef struct ObjClosure {
   Obj obj;
   ObjFunction *function; // 実行される関数への参照.
   ObjUpvalue **upvalues; // キャプチャした変数への参照は一つとは限らないのでダブルポインタで動的配列で確保.
   int upvalueCount;
 } ObjClosure;
 
-typedef struct {
+// シェイプ(hidden class)が持てるフィールド数の上限.
+// これを超えてフィールドが追加されたインスタンスは辞書モードに切り替わる.
+#define SHAPE_MAX_FIELDS 32
+
+// ObjShape はインスタンスのフィールドの並び(どの名前が何番目のスロットにあるか)を表す.
+// 同じ順序でフィールドが追加されたインスタンスは同じシェイプを共有する.
+// シェイプはフィールドを一つ追加するたびに子のシェイプへ遷移する木構造(transition chain)になっていて,
+// 根はクラスごとに一つある. よってシェイプが同じならクラスも同じである.
+struct ObjShape {
+  Obj obj;
+  struct ObjShape *parent; // フィールドを一つ減らしたシェイプ. 根なら NULL
+  ObjString *name;         // このシェイプで追加されたフィールドの名前 (スロット slotCount - 1)
+  int slotCount;           // このシェイプのインスタンスが持つフィールドの数
+  Table transitions;       // フィールド名 -> そのフィールドを追加した子のシェイプ
+};
+
+struct ObjClass {
   Obj obj;
   ObjString *name;
   Table methods;
-} ObjClass;
+  ObjShape *rootShape; // フィールドを持たないインスタンスのシェイプ. 最初のインスタンス生成時に作る
+  int fieldHint;       // これまでのインスタンスが持ったフィールド数の最大値. インライン領域の大きさに使う
+};
 
+// ObjInstance のフィールドは通常 shape が示す順序で fields 配列に並べて保存する.
+// fields は最初はオブジェクト本体と同時に確保した inlineFields を指し,
+// 溢れたら別に確保した配列を指すようになる.
+// シェイプのフィールド数の上限を超えたインスタンスは shape を NULL にして dictionary に移る(辞書モード).
 typedef struct {
   Obj obj;
   ObjClass *klass;
-  Table fields; // [fields]
+  ObjShape *shape;      // NULL なら辞書モード
+  Value *fields;        // shape->slotCount 個のフィールド値
+  int fieldCapacity;    // fields の容量
+  int inlineCapacity;   // inlineFields の容量
+  Table dictionary;     // 辞書モードのフィールド
+  Value inlineFields[]; // [fields]
 } ObjInstance;
 
+// ObjList は要素を ValueArray に連続して並べたリスト.
+// NAN_BOXING では数値の Value は double のビット列そのものなので, 数値だけのリストの items.values は
+// そのまま double の配列として読める. nonNumbers が 0 ならそうなっていて,
+// 一括処理のネイティブ関数は要素ごとの型検査を省き, GCは要素を辿らずに済ませる.
+typedef struct {
+  Obj obj;
+  ValueArray items;
+  int nonNumbers; // 数値でない要素の数
+  bool printing;  // 表示中. 自身を含むリストを表示するときに無限に再帰しないように.
+} ObjList;
+
 typedef struct {
   Obj obj;
   Value receiver;
@@ -113,15 +242,53 @@ ObjClass *newClass(ObjString *name);
 ObjClosure *newClosure(ObjFunction *function);
 
 ObjFunction *newFunction();
+void markNonEscaping(ObjFunction *function);
 
 ObjInstance *newInstance(ObjClass *klass);
 
-ObjNative *newNative(NativeFn function);
+ObjList *newList(Value *values, int count);
+
+void listAppend(ObjList *list, Value value);
+
+void listSet(ObjList *list, int index, Value value);
+
+ObjNative *newNative(NativeFn function, void *userdata);
+
+ObjFiber *newFiber(ObjClosure *closure);
+
+void freeFiberStacks(ObjFiber *fiber);
+
+ObjShape *newShape(ObjShape *parent, ObjString *name);
+
+int shapeFindSlot(ObjShape *shape, ObjString *name);
+
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name);
+
+void instanceAddField(ObjInstance *instance, ObjShape *shape, Value value);
+
+bool instanceGetField(ObjInstance *instance, ObjString *name, Value *value);
+
+void instanceSetField(ObjInstance *instance, ObjString *name, Value value);
 
 ObjString *takeString(char *chars, int length);
 
 ObjString *copyString(const char *chars, int length);
 
+// copyStringHashed は hash が hashString(chars, length) と分かっているときの copyString.
+// コンパイラはスキャナが求めた字句のハッシュ値を渡して計算し直さないようにする.
+ObjString *copyStringHashed(const char *chars, int length, uint32_t hash);
+
+// hashString はインターンした文字列の表で使う chars のハッシュ値を返す.
+uint32_t hashString(const char *key, int length);
+
+ObjString *concatenateStrings(ObjString *a, ObjString *b);
+
+ObjRope *newRope(Value left, Value right);
+
+ObjString *flattenRope(ObjRope *rope);
+
+int textLength(Value value);
+
 ObjUpvalue *newUpvalue(Value *slot);
 
 void printObject(Value value);
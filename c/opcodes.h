@@ -0,0 +1,90 @@
+// このファイルには意図的にインクルードガードがない.
+// インクルードする側で OPCODE(name, length) マクロを定義してから #include すると,
+// すべての命令に対してそのマクロが展開される (いわゆる X-Macro).
+// chunk.h の OpCode 列挙型と vm.c のディスパッチテーブルはどちらもここから生成されるので,
+// 命令を追加するときはこのファイルだけを編集すればよい.
+// length はオペランドを含めた命令のバイト数. OP_CLOSURE と OP_SHARED_CLOSURE だけは可変長で,
+// 捕捉する upvalue ごとにさらに 2byte 続く (instructionLength() を参照).
+
+OPCODE(CONSTANT, 2)
+OPCODE(NIL, 1)
+OPCODE(TRUE, 1)
+OPCODE(FALSE, 1)
+OPCODE(POP, 1)
+OPCODE(GET_LOCAL, 2)
+OPCODE(SET_LOCAL, 2)
+OPCODE(GET_GLOBAL, 2)
+OPCODE(DEFINE_GLOBAL, 2)
+OPCODE(SET_GLOBAL, 2)
+OPCODE(GET_UPVALUE, 2)
+OPCODE(SET_UPVALUE, 2)
+OPCODE(GET_PROPERTY, 4)
+OPCODE(SET_PROPERTY, 4)
+OPCODE(GET_SUPER, 2)
+OPCODE(EQUAL, 1)
+OPCODE(GREATER, 1)
+OPCODE(LESS, 1)
+OPCODE(ADD, 1)
+OPCODE(SUBTRACT, 1)
+OPCODE(MULTIPLY, 1)
+OPCODE(DIVIDE, 1)
+OPCODE(NOT, 1)
+OPCODE(NEGATE, 1)
+OPCODE(PRINT, 1)
+OPCODE(JUMP, 3)
+OPCODE(JUMP_IF_FALSE, 3)
+OPCODE(LOOP, 3)
+OPCODE(CALL, 2)
+OPCODE(INVOKE, 5)
+OPCODE(SUPER_INVOKE, 3)
+OPCODE(CLOSURE, 2)
+OPCODE(CLOSE_UPVALUE, 1)
+OPCODE(RETURN, 1)
+OPCODE(CLASS, 2)
+OPCODE(INHERIT, 1)
+OPCODE(METHOD, 2)
+
+// 後続の命令のインデックスオペランド(定数, ローカル変数, upvalue, グローバル変数のスロット)を
+// 1byte から 2byte に広げる接頭辞. 256 個を超える定数や変数を持つ関数で使う.
+// OP_CLOSURE と OP_SHARED_CLOSURE に付くと, 続く upvalue ごとのインデックスも 2byte になる.
+OPCODE(WIDE, 1)
+
+// 条件分岐に特化した命令. 条件式の値を POP してから分岐する.
+// if/while/for の条件は OP_JUMP_IF_FALSE の後に両方の行き先で OP_POP していたのをまとめたもの.
+OPCODE(POP_JUMP_IF_FALSE, 3)
+
+// return f(...) の呼び出し. 実行中の CallFrame を呼び出し先に使い回す (末尾呼び出しの除去).
+// 呼び出し先がクロージャでなければ OP_CALL と同じで, 直後に必ず置かれる OP_RETURN が結果を返す.
+OPCODE(TAIL_CALL, 2)
+
+// エスケープしないローカル関数の upvalue の読み書き. オペランドは捕捉した変数のスロット番号.
+// そうした関数は宣言した関数のフレームからしか呼ばれないので, 呼び出し元のフレームを直接読み書きする.
+// コンパイラが関数のスコープを抜けるときに OP_GET_UPVALUE / OP_SET_UPVALUE から書き換える.
+OPCODE(GET_OUTER, 2)
+OPCODE(SET_OUTER, 2)
+// オペランドは OP_CLOSURE と同じだが, 新しいクロージャを作らずに関数が使い回すクロージャを積む.
+// 捕捉の記述子は読み飛ばす (捕捉した変数は OP_GET_OUTER / OP_SET_OUTER で読み書きする).
+OPCODE(SHARED_CLOSURE, 2)
+
+// 以下はコンパイラの覗き穴最適化が隣り合う命令を融合して出力する命令(superinstruction).
+// ベンチマークで実行された命令の組の頻度を数え, 上位の組を選んだ.
+OPCODE(GET_LOCAL_PROPERTY, 5)  // GET_LOCAL slot; GET_PROPERTY name ic
+OPCODE(ADD_CONSTANT, 2)        // CONSTANT k; ADD
+OPCODE(SUBTRACT_CONSTANT, 2)   // CONSTANT k; SUBTRACT
+OPCODE(LESS_CONSTANT, 2)       // CONSTANT k; LESS
+OPCODE(EQUAL_CONSTANT, 2)      // CONSTANT k; EQUAL
+OPCODE(LESS_CONSTANT_JUMP, 4)  // CONSTANT k; LESS; POP_JUMP_IF_FALSE offset
+OPCODE(INCREMENT_LOCAL, 3)     // GET_LOCAL slot; CONSTANT k; ADD; SET_LOCAL slot; POP
+
+// リストの生成と添字による読み書き.
+OPCODE(BUILD_LIST, 2) // オペランドの個数の要素を POP して, それを並べたリストを積む
+OPCODE(GET_INDEX, 1)  // list index -> list[index]
+OPCODE(SET_INDEX, 1)  // list index value -> value. list[index] = value
+
+// quickening で実行時に書き換わる, 特化した命令. コンパイラは出力しない.
+// 汎用の命令は実行したときのオペランドを見て自身をこれらに書き換え (quicken),
+// 特化した命令は想定が外れると汎用の命令に書き戻して (deoptimize) そのハンドラに合流する.
+OPCODE(ADD_NUM, 1)       // ADD. 両方のオペランドが数値
+OPCODE(GET_FIELD, 4)     // GET_PROPERTY. 単相のインラインキャッシュが覚えているフィールド
+OPCODE(INVOKE_METHOD, 5) // INVOKE. 単相のインラインキャッシュが覚えているメソッド
+OPCODE(GET_LOCAL_FIELD, 5) // GET_LOCAL_PROPERTY. GET_FIELD と同じ
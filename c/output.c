@@ -0,0 +1,92 @@
+// fileno() と isatty() の宣言のため. -std=c99 では隠れてしまう.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX
+#include <unistd.h>
+#endif
+
+#include "lox.h"
+#include "output.h"
+#include "vm.h"
+
+void initOutput(Output *output) {
+  // vm.stack と同じく GC の対象ではないので reallocate を経由しない
+  output->buffer = (char *) malloc(OUTPUT_BUFFER_SIZE);
+  if (output->buffer == NULL) exit(1); // out of memory
+  output->length = 0;
+  output->write = NULL;
+  output->userdata = NULL;
+  output->interactive = -1;
+}
+
+void freeOutput(Output *output) {
+  flushOutput();
+  free(output->buffer);
+  output->buffer = NULL;
+}
+
+static void writeSink(const char *chars, size_t length) {
+  if (length == 0) return;
+  if (vm.output.write != NULL) {
+    vm.output.write(chars, length, vm.output.userdata);
+  } else {
+    fwrite(chars, sizeof(char), length, vm.out);
+  }
+}
+
+// isInteractive は出力先が端末かどうかを返す. vm.out は initVM() の後で
+// 差し替えられることがあるので, 最初に書くときに調べて覚えておく.
+static bool isInteractive(Output *output) {
+  if (output->interactive < 0) {
+    output->interactive = 0;
+#ifdef HAVE_POSIX
+    if (output->write == NULL && isatty(fileno(vm.out))) output->interactive = 1;
+#endif
+  }
+  return output->interactive == 1;
+}
+
+void flushOutput() {
+  writeSink(vm.output.buffer, vm.output.length);
+  vm.output.length = 0;
+}
+
+void writeOutput(const char *chars, size_t length) {
+  Output *output = &vm.output;
+  if (output->length + length > OUTPUT_BUFFER_SIZE) {
+    flushOutput();
+    // 溜め場所より大きければ溜めずにそのまま書く
+    if (length > OUTPUT_BUFFER_SIZE) {
+      writeSink(chars, length);
+      return;
+    }
+  }
+  memcpy(output->buffer + output->length, chars, length);
+  output->length += length;
+
+  if (isInteractive(output) && memchr(chars, '\n', length) != NULL) {
+    flushOutput();
+  }
+
+#if defined(DEBUG_PRINT_CODE) || defined(DEBUG_TRACE_EXECUTION) || \
+    defined(DEBUG_LOG_GC)
+  // デバッグ出力は printf() で stdout に直接書くので, 順番が入れ替わらないよう溜めない
+  flushOutput();
+#endif
+}
+
+void writeOutputString(const char *string) {
+  writeOutput(string, strlen(string));
+}
+
+void setOutput(WriteFn write, void *userdata) {
+  flushOutput();
+  vm.output.write = write;
+  vm.output.userdata = userdata;
+  vm.output.interactive = -1;
+}
@@ -0,0 +1,35 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+#include "common.h"
+#include "lox.h"
+
+// print 文の出力を溜めておく領域の大きさ. 溜まったら出力先にまとめて書く.
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+// Output は VM が持つ print 文の出力の溜め場所. 一回の print ごとに stdio を呼ぶと
+// ロックと書式の解釈が重いので, ここに溜めて一杯になったときと実行の終わりにだけ書き出す.
+// ただし vm.out が端末なら, 対話的に使えるよう改行ごとに書き出す.
+typedef struct {
+  char *buffer;
+  size_t length;
+  WriteFn write; // NULL なら vm.out に fwrite() する
+  void *userdata;
+  int interactive; // 1: 出力先が端末, 0: 端末ではない, -1: まだ調べていない
+} Output;
+
+void initOutput(Output *output);
+
+// freeOutput は溜まっている出力を書き出してから領域を解放する.
+void freeOutput(Output *output);
+
+// flushOutput は vm.output に溜まっている出力を出力先に書き出す.
+// interpret() の終わりと実行時エラーの報告の前には VM が呼ぶ.
+void flushOutput();
+
+// writeOutput は chars の length バイトを vm.output に追加する.
+void writeOutput(const char *chars, size_t length);
+
+void writeOutputString(const char *string);
+
+#endif
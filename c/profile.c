@@ -0,0 +1,327 @@
+// sigaction() や setitimer() などの POSIX の宣言のため. -std=c99 では隠れてしまう.
+#define _XOPEN_SOURCE 700
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_POSIX
+#include <sys/time.h>
+#endif
+
+#include "image.h"
+#include "memory.h"
+#include "profile.h"
+
+static const char *opcodeNames[] = {
+#define OPCODE(name, length) "OP_" #name,
+#include "opcodes.h"
+#undef OPCODE
+};
+
+#define OPCODE_COUNT ((int) (sizeof(opcodeNames) / sizeof(opcodeNames[0])))
+
+// Sample は同じ CallFrame の列で取れた標本の数. stack が NULL なら空きエントリ.
+typedef struct {
+  char *stack; // 外側のフレームから順に "関数名:行番号" を ';' でつないだもの
+  uint64_t hash;
+  uint64_t count;
+} Sample;
+
+typedef struct {
+  const char *path;
+  uint64_t counts[OPCODE_COUNT];
+  uint64_t pairs[OPCODE_COUNT][OPCODE_COUNT]; // [前の命令][次の命令]
+  int previous; // 直前に実行した命令. まだなければ -1.
+
+  // 標本のハッシュ表 (開番地法). 大きさは 2 のべき乗.
+  Sample *samples;
+  int sampleCount;
+  int sampleCapacity;
+  uint64_t sampleTotal;
+
+  char *buffer; // 標本のフレームの列を組み立てる作業領域
+  size_t bufferCapacity;
+} Profiler;
+
+static Profiler profiler;
+
+// シグナルハンドラは印を付けるだけで, 実際の処理は次の命令の境目で行う.
+static volatile sig_atomic_t pending;    // sampleDue か dumpDue のどちらかが立っている
+static volatile sig_atomic_t sampleDue;  // 標本を取る時刻になった
+static volatile sig_atomic_t dumpDue;    // SIGUSR1 で書き出しを求められた
+
+static void writeProfile();
+
+static void append(size_t *length, const char *format, const char *name,
+                   int line) {
+  size_t needed = *length + strlen(name) + 16;
+  if (needed > profiler.bufferCapacity) {
+    profiler.bufferCapacity = needed * 2;
+    profiler.buffer = (char *) realloc(profiler.buffer, profiler.bufferCapacity);
+    if (profiler.buffer == NULL) exit(1); // out of memory
+  }
+  *length += (size_t) sprintf(profiler.buffer + *length, format, name, line);
+}
+
+static Sample *findSample(Sample *samples, int capacity, const char *stack,
+                          size_t length, uint64_t hash) {
+  int index = (int) (hash & (uint64_t) (capacity - 1));
+  for (;;) {
+    Sample *sample = &samples[index];
+    if (sample->stack == NULL ||
+        (sample->hash == hash && strlen(sample->stack) == length &&
+         memcmp(sample->stack, stack, length) == 0)) {
+      return sample;
+    }
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+static void growSamples() {
+  int capacity = profiler.sampleCapacity < 64 ? 64
+                                              : profiler.sampleCapacity * 2;
+  Sample *samples = (Sample *) calloc((size_t) capacity, sizeof(Sample));
+  if (samples == NULL) exit(1); // out of memory
+
+  for (int i = 0; i < profiler.sampleCapacity; i++) {
+    Sample *old = &profiler.samples[i];
+    if (old->stack == NULL) continue;
+    *findSample(samples, capacity, old->stack, strlen(old->stack),
+                old->hash) = *old;
+  }
+  free(profiler.samples);
+  profiler.samples = samples;
+  profiler.sampleCapacity = capacity;
+}
+
+// recordSample は vm.frames の CallFrame の列を一つの標本として数える.
+// 深い再帰では外側と内側の PROFILE_FRAMES 個ずつだけを残す.
+static void recordSample() {
+  size_t length = 0;
+  for (int i = 0; i < vm.frameCount; i++) {
+    if (vm.frameCount > 2 * PROFILE_FRAMES && i == PROFILE_FRAMES) {
+      append(&length, "%s;", "...", 0);
+      i = vm.frameCount - PROFILE_FRAMES - 1;
+      continue;
+    }
+    CallFrame *frame = &vm.frames[i];
+    ObjString *name = frame->closure->function->name;
+    append(&length, "%s:%d;", name == NULL ? "script" : name->chars,
+           frameLine(frame));
+  }
+  if (length == 0) return;
+  profiler.buffer[--length] = '\0'; // 末尾の ';'
+
+  if (profiler.sampleCount + 1 > profiler.sampleCapacity * 3 / 4) {
+    growSamples();
+  }
+  uint64_t hash = hashSource(profiler.buffer, length);
+  Sample *sample = findSample(profiler.samples, profiler.sampleCapacity,
+                              profiler.buffer, length, hash);
+  if (sample->stack == NULL) {
+    sample->stack = (char *) malloc(length + 1);
+    if (sample->stack == NULL) exit(1); // out of memory
+    memcpy(sample->stack, profiler.buffer, length + 1);
+    sample->hash = hash;
+    profiler.sampleCount++;
+  }
+  sample->count++;
+  profiler.sampleTotal++;
+}
+
+static void handlePending() {
+  pending = 0;
+  if (sampleDue) {
+    sampleDue = 0;
+    recordSample();
+  }
+  if (dumpDue) {
+    dumpDue = 0;
+    writeProfile();
+  }
+}
+
+void profileInstruction(CallFrame *frame, uint8_t *instruction) {
+  int op = *instruction;
+  profiler.counts[op]++;
+  if (profiler.previous >= 0) profiler.pairs[profiler.previous][op]++;
+  profiler.previous = op;
+
+  if (pending) {
+    frame->ip = instruction + 1;
+    handlePending();
+  }
+}
+
+// Count は出力するときに回数の多い順に並べ替える一項目.
+typedef struct {
+  const char *first;
+  const char *second; // 命令の組でなければ NULL
+  uint64_t count;
+} Count;
+
+static int compareCounts(const void *a, const void *b) {
+  uint64_t left = ((const Count *) a)->count;
+  uint64_t right = ((const Count *) b)->count;
+  return left < right ? 1 : left > right ? -1 : 0;
+}
+
+static int compareSamples(const void *a, const void *b) {
+  uint64_t left = ((const Sample *) a)->count;
+  uint64_t right = ((const Sample *) b)->count;
+  return left < right ? 1 : left > right ? -1 : 0;
+}
+
+// writeCounts は counts のうち 0 でないものを多い順に書き出す.
+static void writeCounts(FILE *file, const char *title, Count *counts,
+                        int count) {
+  uint64_t total = 0;
+  int used = 0;
+  for (int i = 0; i < count; i++) {
+    total += counts[i].count;
+    if (counts[i].count > 0) counts[used++] = counts[i];
+  }
+  if (used == 0) return;
+  qsort(counts, (size_t) used, sizeof(Count), compareCounts);
+
+  fprintf(file, "# %s\n", title);
+  for (int i = 0; i < used; i++) {
+    fprintf(file, "%14llu %5.1f%% %s", (unsigned long long) counts[i].count,
+            100.0 * (double) counts[i].count / (double) total,
+            counts[i].first);
+    if (counts[i].second != NULL) fprintf(file, " %s", counts[i].second);
+    fprintf(file, "\n");
+  }
+  fprintf(file, "\n");
+}
+
+static void writeHistograms(FILE *file, const char **names, int opCount,
+                            const uint64_t *counts, const uint64_t *pairs,
+                            const char *title, const char *pairTitle) {
+  Count *entries = (Count *) malloc(sizeof(Count) * (size_t) opCount *
+                                    (size_t) opCount);
+  if (entries == NULL) exit(1); // out of memory
+
+  for (int i = 0; i < opCount; i++) {
+    entries[i].first = names[i];
+    entries[i].second = NULL;
+    entries[i].count = counts[i];
+  }
+  writeCounts(file, title, entries, opCount);
+
+  for (int i = 0; i < opCount; i++) {
+    for (int j = 0; j < opCount; j++) {
+      Count *entry = &entries[i * opCount + j];
+      entry->first = names[i];
+      entry->second = names[j];
+      entry->count = pairs[i * opCount + j];
+    }
+  }
+  writeCounts(file, pairTitle, entries, opCount * opCount);
+  free(entries);
+}
+
+// writeProfile はここまでの結果で profiler.path と profiler.path.stats を書き直す.
+static void writeProfile() {
+  FILE *file = fopen(profiler.path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Could not write profile \"%s\".\n", profiler.path);
+    return;
+  }
+  Sample *samples = (Sample *) malloc(sizeof(Sample) *
+                                      (size_t) (profiler.sampleCount + 1));
+  if (samples == NULL) exit(1); // out of memory
+  int count = 0;
+  for (int i = 0; i < profiler.sampleCapacity; i++) {
+    if (profiler.samples[i].stack != NULL) samples[count++] = profiler.samples[i];
+  }
+  qsort(samples, (size_t) count, sizeof(Sample), compareSamples);
+  for (int i = 0; i < count; i++) {
+    fprintf(file, "%s %llu\n", samples[i].stack,
+            (unsigned long long) samples[i].count);
+  }
+  free(samples);
+  fclose(file);
+
+  size_t length = strlen(profiler.path);
+  char *statsPath = (char *) malloc(length + sizeof(".stats"));
+  if (statsPath == NULL) exit(1); // out of memory
+  memcpy(statsPath, profiler.path, length);
+  memcpy(statsPath + length, ".stats", sizeof(".stats"));
+  file = fopen(statsPath, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Could not write profile \"%s\".\n", statsPath);
+    free(statsPath);
+    return;
+  }
+  free(statsPath);
+
+  fprintf(file, "# samples %llu (every %d us of CPU time)\n\n",
+          (unsigned long long) profiler.sampleTotal, PROFILE_INTERVAL_US);
+  writeHistograms(file, opcodeNames, OPCODE_COUNT, profiler.counts,
+                  &profiler.pairs[0][0], "instructions",
+                  "instruction pairs");
+  fprintf(file, "# quickening\n");
+  printQuickenStats(file);
+  fprintf(file, "\n# gc\n");
+  printGCStats(file);
+  fclose(file);
+}
+
+#ifdef HAVE_POSIX
+static void onTimer(int signum) {
+  sampleDue = 1;
+  pending = 1;
+}
+
+static void onDumpSignal(int signum) {
+  dumpDue = 1;
+  pending = 1;
+}
+
+static void setTimer(int microseconds) {
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = microseconds;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
+#endif
+
+// stopProfiler は exit() のときに呼ばれ, 最終的な結果を書き出す.
+static void stopProfiler() {
+#ifdef HAVE_POSIX
+  setTimer(0);
+#endif
+  vm.profiling = false;
+  writeProfile();
+
+  for (int i = 0; i < profiler.sampleCapacity; i++) {
+    free(profiler.samples[i].stack);
+  }
+  free(profiler.samples);
+  free(profiler.buffer);
+}
+
+void startProfiler(const char *path) {
+  profiler.path = path;
+  profiler.previous = -1;
+  vm.profiling = true;
+  atexit(stopProfiler);
+
+#ifdef HAVE_POSIX
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+  // 標本を取るたびに read() などが EINTR で失敗しないように
+  action.sa_flags = SA_RESTART;
+  action.sa_handler = onTimer;
+  sigaction(SIGPROF, &action, NULL);
+  action.sa_handler = onDumpSignal;
+  sigaction(SIGUSR1, &action, NULL);
+  setTimer(PROFILE_INTERVAL_US);
+#endif
+}
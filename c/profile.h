@@ -0,0 +1,25 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include "common.h"
+#include "vm.h"
+
+// 標本を取る間隔. CPU 時間で数える (ITIMER_PROF).
+#define PROFILE_INTERVAL_US 1000
+
+// 一つの標本に記録する, 最も外側と最も内側のフレームの数. その間は "..." にまとめる.
+#define PROFILE_FRAMES 64
+
+// startProfiler はプロファイラを有効にする. initVM() の後に呼ぶこと.
+// 結果はプログラムの終了時 (exit() を含む) と SIGUSR1 を受けたときに書き出す.
+// path には関数と行ごとの CallFrame の標本を folded 形式 (flamegraph.pl の入力) で,
+// path.stats には命令ごとの実行回数, 続けて実行された命令の組の回数, GCの統計を書く.
+// 標本は命令の境目でしか取らないので, GCやネイティブ関数の中の時間は次の命令に数える.
+// プロファイル中は --tier=register でもスタック層で実行する.
+void startProfiler(const char *path);
+
+// profileInstruction はプロファイル中のインタプリタループが命令を実行する直前に呼ぶ.
+// instruction は実行する命令の先頭で, 標本を取るときは frame->ip をその次に書き戻す.
+void profileInstruction(CallFrame *frame, uint8_t *instruction);
+
+#endif
@@ -0,0 +1,834 @@
+#include <stdlib.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "regcode.h"
+#include "vm.h"
+
+#ifdef DEBUG_PRINT_CODE
+#include "debug.h"
+#endif
+
+// スタック層のバイトコードはどの命令でもスタックの高さが静的に決まるので,
+// 高さ n の位置をレジスタ n と見なせば, そのままレジスタ層の命令に置き換えられる.
+// 翻訳中はスタックの各位置に積まれるはずの値を Operand として覚えておき,
+// OP_GET_LOCAL や OP_CONSTANT の値はレジスタに書き込まずに, それを使う命令のオペランドへ直接埋め込む.
+// これでスタック層では push/pop だった大半のデータの移動がなくなる.
+
+// OperandKind はスタックのある位置に積まれた値がどこにあるかを表す.
+typedef enum {
+  OPERAND_REGISTER, // この位置のレジスタに書き込み済み
+  OPERAND_LOCAL,    // ローカル変数 index のレジスタの値 (まだこの位置には書き込んでいない)
+  OPERAND_CONSTANT, // 定数 index (まだこの位置には書き込んでいない)
+  OPERAND_NIL,
+  OPERAND_TRUE,
+  OPERAND_FALSE,
+} OperandKind;
+
+typedef struct {
+  OperandKind kind;
+  int index;
+} Operand;
+
+// JumpField はジャンプの変位を書き込む欄を表す.
+typedef enum {
+  JUMP_SAX,  // 1 語の JUMP の上位 24bit
+  JUMP_SBX,  // 1 語の JUMP_IF_FALSE の上位 16bit
+  JUMP_WORD, // 2 語の比較付きジャンプの 2 語目
+} JumpField;
+
+// JumpFixup は翻訳が終わってから変位を書き込むジャンプ.
+typedef struct {
+  int word;   // 変位を書き込む語
+  JumpField field;
+  int target; // ジャンプ先のスタック層のオフセット
+} JumpFixup;
+
+typedef struct {
+  ObjFunction *function;
+  Chunk *chunk;
+  RegisterCode *out;
+  int origin; // 翻訳中のスタック層の命令のオフセット
+
+  Operand stack[UINT8_COUNT];
+  int depth; // 翻訳中の命令の直前のスタックの高さ. -1 なら到達不能.
+
+  bool *isTarget;   // スタック層のオフセットごとの, ジャンプ先かどうか
+  int *targetDepth; // ジャンプ先に着いたときのスタックの高さ. -1 なら未定.
+  int *wordAt;      // ジャンプ先のオフセット -> レジスタ層の語の位置
+
+  JumpFixup *fixups;
+  int fixupCount;
+  int fixupCapacity;
+
+  // 直前に出力した命令が結果を書き込んだ語の位置. 書き込み先を付け替えたり分岐と融合したりできる.
+  // 他の命令を出力したら -1 に戻す.
+  int last;
+  // これより前の語は書き換えてはならない. ジャンプ先に着くたびに進める.
+  int barrier;
+  bool failed;
+} Translator;
+
+int registerInstructionLength(ObjFunction *function, int offset) {
+  static const int lengths[] = {
+#define REGOP(name, length) length,
+#include "regops.h"
+#undef REGOP
+  };
+
+  uint32_t word = function->registers->code[offset];
+  if (REG_OP(word) == REG_CLOSURE) {
+    ObjFunction *closure = AS_FUNCTION(function->chunk.constants.values[REG_BX(word)]);
+    return 1 + closure->upvalueCount;
+  }
+  return lengths[REG_OP(word)];
+}
+
+void freeRegisterCode(RegisterCode *code) {
+  FREE_ARRAY(uint32_t, code->code, code->capacity);
+  FREE_ARRAY(int, code->origins, code->capacity);
+  FREE(RegisterCode, code);
+}
+
+// emit は命令語を一つ出力し, その位置を返す.
+static int emit(Translator *t, uint32_t word) {
+  RegisterCode *out = t->out;
+  if (out->capacity < out->count + 1) {
+    int oldCapacity = out->capacity;
+    out->capacity = GROW_CAPACITY(oldCapacity);
+    out->code = GROW_ARRAY(uint32_t, out->code, oldCapacity, out->capacity);
+    out->origins = GROW_ARRAY(int, out->origins, oldCapacity, out->capacity);
+  }
+
+  out->code[out->count] = word;
+  out->origins[out->count] = t->origin;
+  t->last = -1;
+  return out->count++;
+}
+
+// emitResult は結果を A のレジスタだけに書き込む単純な命令を出力する.
+static void emitResult(Translator *t, uint32_t word) {
+  t->last = emit(t, word);
+}
+
+// emitJump はジャンプ命令を出力し, 変位を後で書き込むように記録する.
+// ジャンプ先に着いたときのスタックの高さはいまの高さになる.
+static void emitJump(Translator *t, uint32_t word, JumpField field,
+                     int target) {
+  int at = emit(t, word);
+  if (field == JUMP_WORD) at = emit(t, 0);
+
+  if (target < 0 || target > t->chunk->count) {
+    t->failed = true;
+    return;
+  }
+  if (t->targetDepth[target] == -1) {
+    t->targetDepth[target] = t->depth;
+  } else if (t->targetDepth[target] != t->depth) {
+    t->failed = true;
+  }
+
+  if (t->fixupCapacity < t->fixupCount + 1) {
+    int oldCapacity = t->fixupCapacity;
+    t->fixupCapacity = GROW_CAPACITY(oldCapacity);
+    t->fixups = GROW_ARRAY(JumpFixup, t->fixups, oldCapacity, t->fixupCapacity);
+  }
+  JumpFixup *fixup = &t->fixups[t->fixupCount++];
+  fixup->word = at;
+  fixup->field = field;
+  fixup->target = target;
+}
+
+// useRegister はレジスタ番号 reg を使うことを記録する. 8bit に収まらなければ翻訳を諦める.
+static void useRegister(Translator *t, int reg) {
+  if (reg > UINT8_MAX) {
+    t->failed = true;
+  } else if (reg + 1 > t->out->frameSize) {
+    t->out->frameSize = reg + 1;
+  }
+}
+
+static void pushOperand(Translator *t, OperandKind kind, int index) {
+  useRegister(t, t->depth);
+  if (t->failed) return;
+  t->stack[t->depth].kind = kind;
+  t->stack[t->depth].index = index;
+  t->depth++;
+}
+
+// pushRegister は結果をレジスタに書き込む命令のために, スタックに一つ積んでその位置を返す.
+static int pushRegister(Translator *t) {
+  int pos = t->depth;
+  pushOperand(t, OPERAND_REGISTER, 0);
+  return pos;
+}
+
+// materialize はスタックの位置 pos の値をその位置のレジスタに書き込む.
+static void materialize(Translator *t, int pos) {
+  Operand *operand = &t->stack[pos];
+  switch (operand->kind) {
+    case OPERAND_REGISTER: return;
+    case OPERAND_LOCAL:
+      emitResult(t, REG_ABC(REG_MOVE, pos, operand->index, 0));
+      break;
+    case OPERAND_CONSTANT:
+      emitResult(t, REG_ABX(REG_LOADK, pos, operand->index));
+      break;
+    case OPERAND_NIL:   emitResult(t, REG_ABC(REG_LOADNIL, pos, 0, 0)); break;
+    case OPERAND_TRUE:  emitResult(t, REG_ABC(REG_LOADTRUE, pos, 0, 0)); break;
+    case OPERAND_FALSE: emitResult(t, REG_ABC(REG_LOADFALSE, pos, 0, 0)); break;
+  }
+  operand->kind = OPERAND_REGISTER;
+}
+
+// flush はスタックのすべての値をそれぞれの位置のレジスタに書き込む.
+// ジャンプや呼び出しの前に必要. ジャンプ先や呼び出し先はスタック層と同じ配置を前提にする.
+static void flush(Translator *t) {
+  for (int pos = 0; pos < t->depth; pos++) materialize(t, pos);
+}
+
+// reg はスタックの位置 pos の値が入っているレジスタの番号を返す.
+// ローカル変数の値ならそのレジスタを, 定数ならこの位置に読み込んでから返す.
+static int reg(Translator *t, int pos) {
+  if (t->stack[pos].kind == OPERAND_LOCAL) return t->stack[pos].index;
+  materialize(t, pos);
+  return pos;
+}
+
+// referencesLocal はスタックにローカル変数 slot の値を読み込み待ちの位置があれば真を返す.
+static bool referencesLocal(Translator *t, int slot) {
+  for (int pos = 0; pos < t->depth; pos++) {
+    if (t->stack[pos].kind == OPERAND_LOCAL && t->stack[pos].index == slot) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// spill はローカル変数 slot に書き込む前に, その古い値を読み込み待ちの位置をレジスタに書き込む.
+static void spill(Translator *t, int slot) {
+  for (int pos = 0; pos < t->depth; pos++) {
+    if (t->stack[pos].kind == OPERAND_LOCAL && t->stack[pos].index == slot) {
+      materialize(t, pos);
+    }
+  }
+}
+
+// lastResult は直前の命令がスタックの位置 pos に結果を書き込んでいて, まだ書き換えてよければその語の位置を返す.
+static int lastResult(Translator *t, int pos) {
+  if (t->last == -1 || t->last < t->barrier) return -1;
+  if (t->stack[pos].kind != OPERAND_REGISTER) return -1;
+  if (REG_A(t->out->code[t->last]) != (uint32_t) pos) return -1;
+  return t->last;
+}
+
+// binary は二項演算子を翻訳する. 右オペランドが定数なら定数を直接指す命令を出力する.
+static void binary(Translator *t, RegOpCode op, RegOpCode constantOp) {
+  int left = t->depth - 2;
+  int right = t->depth - 1;
+  if (left < 0) {
+    t->failed = true;
+    return;
+  }
+
+  Operand operand = t->stack[right];
+  int c;
+  if (operand.kind == OPERAND_CONSTANT && operand.index <= UINT8_MAX) {
+    op = constantOp;
+    c = operand.index;
+  } else {
+    c = reg(t, right);
+  }
+  int b = reg(t, left);
+
+  t->depth = left + 1;
+  t->stack[left].kind = OPERAND_REGISTER;
+  emitResult(t, REG_ABC(op, left, b, c));
+}
+
+// setLocal はスタックトップの値をローカル変数 slot に代入する (値はスタックに残す).
+static void setLocal(Translator *t, int slot) {
+  int pos = t->depth - 1;
+  if (slot >= pos) {
+    t->failed = true;
+    return;
+  }
+
+  int last = lastResult(t, pos);
+  if (last != -1 && !referencesLocal(t, slot)) {
+    // 直前の命令の書き込み先をローカル変数に付け替える. a = a + 1 などが 1 命令で済む.
+    uint32_t word = t->out->code[last];
+    t->out->code[last] = (word & ~(uint32_t) 0xff00) | (uint32_t) slot << 8;
+    t->last = -1;
+  } else {
+    spill(t, slot);
+    Operand value = t->stack[pos];
+    switch (value.kind) {
+      case OPERAND_REGISTER:
+        emit(t, REG_ABC(REG_MOVE, slot, pos, 0));
+        break;
+      case OPERAND_LOCAL:
+        if (value.index != slot) emit(t, REG_ABC(REG_MOVE, slot, value.index, 0));
+        break;
+      case OPERAND_CONSTANT: emit(t, REG_ABX(REG_LOADK, slot, value.index)); break;
+      case OPERAND_NIL:   emit(t, REG_ABC(REG_LOADNIL, slot, 0, 0)); break;
+      case OPERAND_TRUE:  emit(t, REG_ABC(REG_LOADTRUE, slot, 0, 0)); break;
+      case OPERAND_FALSE: emit(t, REG_ABC(REG_LOADFALSE, slot, 0, 0)); break;
+    }
+  }
+
+  t->stack[slot].kind = OPERAND_REGISTER;
+  t->stack[pos].kind = OPERAND_LOCAL;
+  t->stack[pos].index = slot;
+}
+
+// allInRegisters はスタックのすべての値がそれぞれの位置のレジスタに書き込み済みなら真を返す.
+static bool allInRegisters(Translator *t) {
+  for (int pos = 0; pos < t->depth; pos++) {
+    if (t->stack[pos].kind != OPERAND_REGISTER) return false;
+  }
+  return true;
+}
+
+// popJumpIfFalse はスタックトップの条件を POP して, 偽なら target へ分岐する.
+// 条件が直前の比較の結果なら, 比較と分岐を一つの命令にまとめて結果をレジスタに書かずに済ませる.
+static void popJumpIfFalse(Translator *t, int target) {
+  int pos = t->depth - 1;
+  int last = lastResult(t, pos);
+  t->depth--;
+
+  if (last != -1 && allInRegisters(t)) {
+    uint32_t word = t->out->code[last];
+    RegOpCode jump;
+    switch (REG_OP(word)) {
+      case REG_LESS:             jump = REG_JUMP_IF_NOT_LESS; break;
+      case REG_LESS_CONSTANT:    jump = REG_JUMP_IF_NOT_LESS_CONSTANT; break;
+      case REG_GREATER:          jump = REG_JUMP_IF_NOT_GREATER; break;
+      case REG_GREATER_CONSTANT: jump = REG_JUMP_IF_NOT_GREATER_CONSTANT; break;
+      default:                   jump = REG_MOVE; break;
+    }
+    if (jump != REG_MOVE) {
+      // 比較の命令語を取り消して, 融合した命令として出力し直す
+      t->out->count--;
+      t->origin = t->out->origins[t->out->count];
+      emitJump(t, REG_ABC(jump, 0, REG_B(word), REG_C(word)), JUMP_WORD, target);
+      return;
+    }
+  }
+
+  t->depth++;
+  int condition = reg(t, pos);
+  t->depth--;
+  flush(t);
+  emitJump(t, REG_ABX(REG_JUMP_IF_FALSE, condition, 0), JUMP_SBX, target);
+}
+
+// readIndex は offset の命令の at バイト目から, OP_WIDE なら 2byte, そうでなければ 1byte のオペランドを読む.
+static int readIndex(Chunk *chunk, int *at, bool wide) {
+  int value = chunk->code[(*at)++];
+  if (wide) value = (value << 8) | chunk->code[(*at)++];
+  return value;
+}
+
+static int readShort(Chunk *chunk, int *at) {
+  int value = (chunk->code[*at] << 8) | chunk->code[*at + 1];
+  *at += 2;
+  return value;
+}
+
+// propertyWord は名前とインラインキャッシュのオペランドをまとめた 2 語目を作る.
+static uint32_t propertyWord(int name, int cache) {
+  return (uint32_t) name | (uint32_t) cache << 16;
+}
+
+// translateInstruction はスタック層の offset の命令を一つ翻訳する.
+static void translateInstruction(Translator *t, int offset) {
+  Chunk *chunk = t->chunk;
+  bool wide = chunk->code[offset] == OP_WIDE;
+  uint8_t instruction = chunk->code[offset + (wide ? 1 : 0)];
+  int at = offset + (wide ? 2 : 1);
+  int end = offset + instructionLength(chunk, offset);
+
+  switch (instruction) {
+    case OP_CONSTANT:
+      pushOperand(t, OPERAND_CONSTANT, readIndex(chunk, &at, wide));
+      break;
+    case OP_NIL:   pushOperand(t, OPERAND_NIL, 0); break;
+    case OP_TRUE:  pushOperand(t, OPERAND_TRUE, 0); break;
+    case OP_FALSE: pushOperand(t, OPERAND_FALSE, 0); break;
+    case OP_POP:
+      t->depth--;
+      break;
+    case OP_GET_LOCAL: {
+      int slot = readIndex(chunk, &at, wide);
+      if (slot >= t->depth) {
+        t->failed = true;
+        break;
+      }
+      materialize(t, slot);
+      pushOperand(t, OPERAND_LOCAL, slot);
+      break;
+    }
+    case OP_SET_LOCAL:
+      setLocal(t, readIndex(chunk, &at, wide));
+      break;
+    case OP_GET_GLOBAL: {
+      int slot = readIndex(chunk, &at, wide);
+      int pos = pushRegister(t);
+      emitResult(t, REG_ABX(REG_GET_GLOBAL, pos, slot));
+      break;
+    }
+    case OP_DEFINE_GLOBAL: {
+      int slot = readIndex(chunk, &at, wide);
+      emit(t, REG_ABX(REG_DEFINE_GLOBAL, reg(t, t->depth - 1), slot));
+      t->depth--;
+      break;
+    }
+    case OP_SET_GLOBAL: {
+      int slot = readIndex(chunk, &at, wide);
+      emit(t, REG_ABX(REG_SET_GLOBAL, reg(t, t->depth - 1), slot));
+      break;
+    }
+    case OP_GET_UPVALUE: {
+      int slot = readIndex(chunk, &at, wide);
+      int pos = pushRegister(t);
+      emitResult(t, REG_ABX(REG_GET_UPVALUE, pos, slot));
+      break;
+    }
+    case OP_SET_UPVALUE: {
+      int slot = readIndex(chunk, &at, wide);
+      emit(t, REG_ABX(REG_SET_UPVALUE, reg(t, t->depth - 1), slot));
+      break;
+    }
+    case OP_GET_OUTER: {
+      int slot = readIndex(chunk, &at, wide);
+      int pos = pushRegister(t);
+      emitResult(t, REG_ABX(REG_GET_OUTER, pos, slot));
+      break;
+    }
+    case OP_SET_OUTER: {
+      int slot = readIndex(chunk, &at, wide);
+      emit(t, REG_ABX(REG_SET_OUTER, reg(t, t->depth - 1), slot));
+      break;
+    }
+    // 特化した命令は汎用の命令と同じに翻訳する
+    case OP_GET_PROPERTY:
+    case OP_GET_FIELD: {
+      int name = readIndex(chunk, &at, wide);
+      int cache = readShort(chunk, &at);
+      int pos = t->depth - 1;
+      int receiver = reg(t, pos);
+      t->stack[pos].kind = OPERAND_REGISTER;
+      emit(t, REG_ABC(REG_GET_PROPERTY, pos, receiver, 0));
+      emit(t, propertyWord(name, cache));
+      break;
+    }
+    case OP_SET_PROPERTY: {
+      int name = readIndex(chunk, &at, wide);
+      int cache = readShort(chunk, &at);
+      int pos = t->depth - 2;
+      materialize(t, pos);
+      int value = reg(t, pos + 1);
+      t->depth--;
+      emit(t, REG_ABC(REG_SET_PROPERTY, pos, value, 0));
+      emit(t, propertyWord(name, cache));
+      break;
+    }
+    case OP_GET_SUPER: {
+      int name = readIndex(chunk, &at, wide);
+      flush(t);
+      t->depth--;
+      emit(t, REG_ABC(REG_GET_SUPER, t->depth - 1, 0, 0));
+      emit(t, (uint32_t) name);
+      break;
+    }
+    case OP_EQUAL:    binary(t, REG_EQUAL, REG_EQUAL_CONSTANT); break;
+    case OP_GREATER:  binary(t, REG_GREATER, REG_GREATER_CONSTANT); break;
+    case OP_LESS:     binary(t, REG_LESS, REG_LESS_CONSTANT); break;
+    case OP_ADD:
+    case OP_ADD_NUM:  binary(t, REG_ADD, REG_ADD_CONSTANT); break;
+    case OP_SUBTRACT: binary(t, REG_SUBTRACT, REG_SUBTRACT_CONSTANT); break;
+    case OP_MULTIPLY: binary(t, REG_MULTIPLY, REG_MULTIPLY_CONSTANT); break;
+    case OP_DIVIDE:   binary(t, REG_DIVIDE, REG_DIVIDE_CONSTANT); break;
+    case OP_NOT:
+    case OP_NEGATE: {
+      int pos = t->depth - 1;
+      int operand = reg(t, pos);
+      t->stack[pos].kind = OPERAND_REGISTER;
+      emitResult(t, REG_ABC(instruction == OP_NOT ? REG_NOT : REG_NEGATE,
+                            pos, operand, 0));
+      break;
+    }
+    case OP_PRINT:
+      emit(t, REG_ABC(REG_PRINT, reg(t, t->depth - 1), 0, 0));
+      t->depth--;
+      break;
+    case OP_JUMP: {
+      int jump = readShort(chunk, &at);
+      flush(t);
+      emitJump(t, (uint32_t) REG_JUMP, JUMP_SAX, end + jump);
+      t->depth = -1;
+      break;
+    }
+    case OP_JUMP_IF_FALSE: {
+      int jump = readShort(chunk, &at);
+      flush(t);
+      emitJump(t, REG_ABX(REG_JUMP_IF_FALSE, t->depth - 1, 0), JUMP_SBX,
+               end + jump);
+      break;
+    }
+    case OP_POP_JUMP_IF_FALSE:
+      popJumpIfFalse(t, end + readShort(chunk, &at));
+      break;
+    case OP_LOOP: {
+      int jump = readShort(chunk, &at);
+      flush(t);
+      emitJump(t, (uint32_t) REG_JUMP, JUMP_SAX, end - jump);
+      t->depth = -1;
+      break;
+    }
+    case OP_CALL:
+    case OP_TAIL_CALL: {
+      int argCount = chunk->code[at];
+      flush(t);
+      int callee = t->depth - argCount - 1;
+      emit(t, REG_ABC(instruction == OP_CALL ? REG_CALL : REG_TAIL_CALL,
+                      callee, argCount, 0));
+      t->depth = callee + 1;
+      break;
+    }
+    case OP_INVOKE:
+    case OP_INVOKE_METHOD: {
+      int name = readIndex(chunk, &at, wide);
+      int argCount = chunk->code[at++];
+      int cache = readShort(chunk, &at);
+      flush(t);
+      int receiver = t->depth - argCount - 1;
+      emit(t, REG_ABC(REG_INVOKE, receiver, argCount, 0));
+      emit(t, propertyWord(name, cache));
+      t->depth = receiver + 1;
+      break;
+    }
+    case OP_SUPER_INVOKE: {
+      int name = readIndex(chunk, &at, wide);
+      int argCount = chunk->code[at++];
+      flush(t);
+      int receiver = t->depth - argCount - 2;
+      emit(t, REG_ABC(REG_SUPER_INVOKE, receiver, argCount, 0));
+      emit(t, (uint32_t) name);
+      t->depth = receiver + 1;
+      break;
+    }
+    case OP_CLOSURE:
+    case OP_SHARED_CLOSURE: {
+      int constant = readIndex(chunk, &at, wide);
+      ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+      // 捕捉するローカル変数はレジスタに書き込んでおく. upvalue はレジスタのアドレスを指す.
+      int captures = at;
+      for (int i = 0; i < function->upvalueCount; i++) {
+        bool isLocal = chunk->code[captures++];
+        int index = readIndex(chunk, &captures, wide);
+        // index がいまの高さなら, 作るクロージャ自身を捕捉する (再帰するローカル関数)
+        if (isLocal) {
+          if (index > t->depth) t->failed = true;
+          else if (index < t->depth) materialize(t, index);
+        }
+      }
+
+      int pos = pushRegister(t);
+      if (instruction == OP_SHARED_CLOSURE) {
+        emit(t, REG_ABX(REG_SHARED_CLOSURE, pos, constant));
+        break;
+      }
+      emit(t, REG_ABX(REG_CLOSURE, pos, constant));
+      for (int i = 0; i < function->upvalueCount; i++) {
+        uint32_t isLocal = chunk->code[at++];
+        uint32_t index = (uint32_t) readIndex(chunk, &at, wide);
+        emit(t, isLocal | index << 8);
+      }
+      break;
+    }
+    case OP_CLOSE_UPVALUE:
+      materialize(t, t->depth - 1);
+      emit(t, REG_ABC(REG_CLOSE_UPVALUE, t->depth - 1, 0, 0));
+      t->depth--;
+      break;
+    case OP_RETURN:
+      emit(t, REG_ABC(REG_RETURN, reg(t, t->depth - 1), 0, 0));
+      t->depth = -1;
+      break;
+    case OP_CLASS: {
+      int name = readIndex(chunk, &at, wide);
+      int pos = pushRegister(t);
+      emit(t, REG_ABX(REG_CLASS, pos, name));
+      break;
+    }
+    case OP_INHERIT:
+      flush(t);
+      t->depth--;
+      emit(t, REG_ABC(REG_INHERIT, t->depth - 1, 0, 0));
+      break;
+    case OP_METHOD: {
+      int name = readIndex(chunk, &at, wide);
+      flush(t);
+      t->depth--;
+      emit(t, REG_ABX(REG_METHOD, t->depth - 1, name));
+      break;
+    }
+    case OP_GET_LOCAL_PROPERTY:
+    case OP_GET_LOCAL_FIELD: {
+      int slot = chunk->code[at++];
+      int name = chunk->code[at++];
+      int cache = readShort(chunk, &at);
+      materialize(t, slot);
+      int pos = pushRegister(t);
+      emit(t, REG_ABC(REG_GET_PROPERTY, pos, slot, 0));
+      emit(t, propertyWord(name, cache));
+      break;
+    }
+    case OP_ADD_CONSTANT:
+      pushOperand(t, OPERAND_CONSTANT, chunk->code[at]);
+      binary(t, REG_ADD, REG_ADD_CONSTANT);
+      break;
+    case OP_SUBTRACT_CONSTANT:
+      pushOperand(t, OPERAND_CONSTANT, chunk->code[at]);
+      binary(t, REG_SUBTRACT, REG_SUBTRACT_CONSTANT);
+      break;
+    case OP_LESS_CONSTANT:
+      pushOperand(t, OPERAND_CONSTANT, chunk->code[at]);
+      binary(t, REG_LESS, REG_LESS_CONSTANT);
+      break;
+    case OP_EQUAL_CONSTANT:
+      pushOperand(t, OPERAND_CONSTANT, chunk->code[at]);
+      binary(t, REG_EQUAL, REG_EQUAL_CONSTANT);
+      break;
+    case OP_LESS_CONSTANT_JUMP: {
+      pushOperand(t, OPERAND_CONSTANT, chunk->code[at++]);
+      binary(t, REG_LESS, REG_LESS_CONSTANT);
+      int jump = readShort(chunk, &at);
+      if (!t->failed) popJumpIfFalse(t, end + jump);
+      break;
+    }
+    case OP_INCREMENT_LOCAL: {
+      int slot = chunk->code[at];
+      int constant = chunk->code[at + 1];
+      spill(t, slot);
+      materialize(t, slot);
+      emit(t, REG_ABC(REG_ADD_CONSTANT, slot, slot, constant));
+      break;
+    }
+    case OP_BUILD_LIST: {
+      int count = chunk->code[at];
+      int first = t->depth - count;
+      if (first < 0) {
+        t->failed = true;
+        break;
+      }
+      // 要素は連続したレジスタに並べておく. 空のリストは積む位置に作る.
+      for (int pos = first; pos < t->depth; pos++) materialize(t, pos);
+      t->depth = first;
+      int pos = pushRegister(t);
+      // A は要素の先頭も兼ねるので, 書き込み先は付け替えられない (emitResult は使わない)
+      emit(t, REG_ABC(REG_BUILD_LIST, pos, count, 0));
+      break;
+    }
+    case OP_GET_INDEX: {
+      int pos = t->depth - 2;
+      if (pos < 0) {
+        t->failed = true;
+        break;
+      }
+      int index = reg(t, pos + 1);
+      int list = reg(t, pos);
+      t->depth = pos + 1;
+      t->stack[pos].kind = OPERAND_REGISTER;
+      emitResult(t, REG_ABC(REG_GET_INDEX, pos, list, index));
+      break;
+    }
+    case OP_SET_INDEX: {
+      int pos = t->depth - 3;
+      if (pos < 0) {
+        t->failed = true;
+        break;
+      }
+      // 結果は list のレジスタに上書きする
+      materialize(t, pos);
+      int index = reg(t, pos + 1);
+      int value = reg(t, pos + 2);
+      t->depth = pos + 1;
+      emit(t, REG_ABC(REG_SET_INDEX, pos, index, value));
+      break;
+    }
+    default:
+      // コンパイラが出力しない命令
+      t->failed = true;
+      break;
+  }
+
+  if (t->depth < -1) t->failed = true;
+}
+
+// markTargets はすべてのジャンプ先に印を付ける.
+static void markTargets(Translator *t) {
+  Chunk *chunk = t->chunk;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    int end = offset + instructionLength(chunk, offset);
+    int target = -1;
+    switch (chunk->code[offset]) {
+      case OP_JUMP:
+      case OP_JUMP_IF_FALSE:
+      case OP_POP_JUMP_IF_FALSE:
+        target = end + ((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+        break;
+      case OP_LESS_CONSTANT_JUMP:
+        target = end + ((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+        break;
+      case OP_LOOP:
+        target = end - ((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+        break;
+      default:
+        break;
+    }
+    if (target >= 0 && target <= chunk->count) t->isTarget[target] = true;
+  }
+}
+
+// patchJumps は記録しておいたジャンプに変位を書き込む.
+static void patchJumps(Translator *t) {
+  uint32_t *code = t->out->code;
+  for (int i = 0; i < t->fixupCount && !t->failed; i++) {
+    JumpFixup *fixup = &t->fixups[i];
+    int target = t->wordAt[fixup->target];
+    if (target == -1) {
+      t->failed = true;
+      break;
+    }
+
+    int jump = target - (fixup->word + 1);
+    switch (fixup->field) {
+      case JUMP_SAX:
+        if (jump < -(1 << 23) || jump >= (1 << 23)) t->failed = true;
+        code[fixup->word] |= (uint32_t) jump << 8;
+        break;
+      case JUMP_SBX:
+        if (jump < INT16_MIN || jump > INT16_MAX) t->failed = true;
+        code[fixup->word] |= (uint32_t) (uint16_t) jump << 16;
+        break;
+      case JUMP_WORD:
+        code[fixup->word] = (uint32_t) jump;
+        break;
+    }
+  }
+}
+
+// countKnownTargets はスタックの高さがわかっているジャンプ先の数を返す.
+static int countKnownTargets(Translator *t) {
+  int count = 0;
+  for (int i = 0; i <= t->chunk->count; i++) {
+    if (t->targetDepth[i] != -1) count++;
+  }
+  return count;
+}
+
+// translatePass は関数の先頭から一通り翻訳する.
+static void translatePass(Translator *t) {
+  Chunk *chunk = t->chunk;
+  t->out->count = 0;
+  t->out->frameSize = 0;
+  t->depth = 0;
+  t->fixupCount = 0;
+  t->last = -1;
+  t->barrier = 0;
+  t->failed = false;
+  for (int i = 0; i <= chunk->count; i++) t->wordAt[i] = -1;
+
+  // 呼び出された直後のスタックには関数自身と引数が積まれている
+  for (int i = 0; i <= t->function->arity; i++) {
+    pushOperand(t, OPERAND_REGISTER, 0);
+  }
+
+  for (int offset = 0; offset < chunk->count && !t->failed;
+       offset += instructionLength(chunk, offset)) {
+    t->origin = offset;
+    if (t->isTarget[offset]) {
+      if (t->depth != -1) {
+        // 直前の命令から流れ込む経路の値もジャンプしてくる経路に合わせてレジスタに書き込む
+        flush(t);
+        if (t->targetDepth[offset] != -1 && t->targetDepth[offset] != t->depth) {
+          t->failed = true;
+          break;
+        }
+        t->targetDepth[offset] = t->depth;
+      } else if (t->targetDepth[offset] != -1) {
+        t->depth = t->targetDepth[offset];
+        for (int pos = 0; pos < t->depth; pos++) {
+          t->stack[pos].kind = OPERAND_REGISTER;
+        }
+      }
+      // 高さのわからないジャンプ先は飛ばすので, 後からそこへジャンプする命令があればこの回は失敗する
+      if (t->depth != -1) t->wordAt[offset] = t->out->count;
+      t->barrier = t->out->count;
+      t->last = -1;
+    }
+
+    // 無条件ジャンプや return の後ろで, どこからもジャンプしてこない命令は実行されない
+    if (t->depth == -1) continue;
+    translateInstruction(t, offset);
+  }
+  if (t->depth != -1) t->failed = true;
+  patchJumps(t);
+}
+
+bool translateFunction(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (IS_FUNCTION(constant)) translateFunction(AS_FUNCTION(constant));
+  }
+
+  Translator t;
+  t.function = function;
+  t.chunk = chunk;
+  t.out = ALLOCATE(RegisterCode, 1);
+  t.out->count = 0;
+  t.out->capacity = 0;
+  t.out->code = NULL;
+  t.out->origins = NULL;
+  t.origin = 0;
+  t.fixups = NULL;
+  t.fixupCapacity = 0;
+
+  t.isTarget = ALLOCATE(bool, chunk->count + 1);
+  t.targetDepth = ALLOCATE(int, chunk->count + 1);
+  t.wordAt = ALLOCATE(int, chunk->count + 1);
+  for (int i = 0; i <= chunk->count; i++) {
+    t.isTarget[i] = false;
+    t.targetDepth[i] = -1;
+  }
+  markTargets(&t);
+
+  // for 文の増分節のように, 後ろからの LOOP でしか到達しない命令は最初の回では高さがわからない.
+  // ジャンプ先の高さが新しくわかる限り翻訳をやり直す.
+  int known;
+  do {
+    known = countKnownTargets(&t);
+    translatePass(&t);
+  } while (t.failed && countKnownTargets(&t) > known);
+
+  FREE_ARRAY(bool, t.isTarget, chunk->count + 1);
+  FREE_ARRAY(int, t.targetDepth, chunk->count + 1);
+  FREE_ARRAY(int, t.wordAt, chunk->count + 1);
+  FREE_ARRAY(JumpFixup, t.fixups, t.fixupCapacity);
+
+  if (t.failed) {
+    freeRegisterCode(t.out);
+  } else {
+    function->registers = t.out;
+#ifdef DEBUG_PRINT_CODE
+    disassembleRegisterCode(function);
+#endif
+  }
+
+  return function->registers != NULL;
+}
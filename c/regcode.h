@@ -0,0 +1,51 @@
+#ifndef clox_regcode_h
+#define clox_regcode_h
+
+#include "common.h"
+#include "object.h"
+
+// レジスタ層の命令. 一覧と各命令の意味は regops.h を参照.
+typedef enum {
+#define REGOP(name, length) REG_##name,
+#include "regops.h"
+#undef REGOP
+} RegOpCode;
+
+// 命令語の組み立てと分解
+#define REG_ABC(op, a, b, c) \
+    ((uint32_t) (op) | (uint32_t) (a) << 8 | (uint32_t) (b) << 16 | \
+     (uint32_t) (c) << 24)
+#define REG_ABX(op, a, bx) \
+    ((uint32_t) (op) | (uint32_t) (a) << 8 | (uint32_t) (bx) << 16)
+
+#define REG_OP(word)  ((word) & 0xff)
+#define REG_A(word)   (((word) >> 8) & 0xff)
+#define REG_B(word)   (((word) >> 16) & 0xff)
+#define REG_C(word)   ((word) >> 24)
+#define REG_BX(word)  ((word) >> 16)
+#define REG_SBX(word) ((int16_t) ((word) >> 16))
+#define REG_SAX(word) ((int32_t) (word) >> 8)
+
+// RegisterCode は一つの関数をレジスタ層の命令列に翻訳したもの.
+// スタック層での高さ n の位置がそのままレジスタ n になるので, フレームの配置は両方の層で同じになり,
+// 層をまたいだ呼び出しでも引数や戻り値をそのまま受け渡せる.
+typedef struct RegisterCode {
+  int count;
+  int capacity;
+  uint32_t *code;
+  int *origins;  // 語ごとの, 翻訳元のスタック層の命令のオフセット. 行番号を引くのに使う.
+  int frameSize; // 使うレジスタの数 (スタック層での高さの最大値)
+} RegisterCode;
+
+// translateFunction は function と, その定数表にある入れ子の関数をすべてレジスタ層の命令列に翻訳し,
+// それぞれの registers に設定する. function 自身を翻訳できなければ偽を返す.
+// 翻訳できない関数 (レジスタが 256 個を超えるなど) は registers が NULL のままで, スタック層で実行する.
+// function は呼び出し側でGCから到達可能にしておくこと.
+bool translateFunction(ObjFunction *function);
+
+void freeRegisterCode(RegisterCode *code);
+
+// registerInstructionLength は offset から始まる命令の語数を返す.
+int registerInstructionLength(ObjFunction *function, int offset);
+
+#endif
@@ -0,0 +1,64 @@
+// このファイルには意図的にインクルードガードがない (opcodes.h と同じ X-Macro).
+// インクルードする側で REGOP(name, length) マクロを定義してから #include すること.
+//
+// レジスタ層の命令は 32bit の語で, 下位から順に op, A, B, C の各 8bit を持つ.
+// Bx は B と C を合わせた 16bit, sBx はその符号付き版, sAx は A から C までの符号付き 24bit.
+// r[n] は frame->slots[n], K[n] は関数の定数表の n 番目を表す.
+// length は命令の語数. REG_CLOSURE だけは可変長で, 捕捉する upvalue ごとにさらに 1 語続く.
+// ジャンプの変位はいずれも命令の最後の語の次の語からの相対位置 (語単位).
+
+REGOP(MOVE, 1)          // r[A] = r[B]
+REGOP(LOADK, 1)         // r[A] = K[Bx]
+REGOP(LOADNIL, 1)       // r[A] = nil
+REGOP(LOADTRUE, 1)      // r[A] = true
+REGOP(LOADFALSE, 1)     // r[A] = false
+REGOP(GET_GLOBAL, 1)    // r[A] = グローバル変数 Bx
+REGOP(DEFINE_GLOBAL, 1) // グローバル変数 Bx を r[A] で定義する
+REGOP(SET_GLOBAL, 1)    // グローバル変数 Bx = r[A]
+REGOP(GET_UPVALUE, 1)   // r[A] = upvalue Bx
+REGOP(SET_UPVALUE, 1)   // upvalue Bx = r[A]
+REGOP(GET_OUTER, 1)     // r[A] = 呼び出し元のフレームの r[Bx]
+REGOP(SET_OUTER, 1)     // 呼び出し元のフレームの r[Bx] = r[A]
+REGOP(GET_PROPERTY, 2)  // r[A] = r[B].name. 2 語目は name の定数番号 | キャッシュ番号 << 16
+REGOP(SET_PROPERTY, 2)  // r[A].name = r[B]; r[A] = r[B]. 2 語目は GET_PROPERTY と同じ
+REGOP(GET_SUPER, 2)     // r[A] = r[A] に束縛した r[A + 1] のメソッド. 2 語目は name の定数番号
+
+REGOP(EQUAL, 1)         // r[A] = r[B] == r[C]
+REGOP(GREATER, 1)       // r[A] = r[B] > r[C]
+REGOP(LESS, 1)          // r[A] = r[B] < r[C]
+REGOP(ADD, 1)           // r[A] = r[B] + r[C]
+REGOP(SUBTRACT, 1)      // r[A] = r[B] - r[C]
+REGOP(MULTIPLY, 1)      // r[A] = r[B] * r[C]
+REGOP(DIVIDE, 1)        // r[A] = r[B] / r[C]
+REGOP(EQUAL_CONSTANT, 1)    // r[A] = r[B] == K[C]
+REGOP(GREATER_CONSTANT, 1)  // r[A] = r[B] > K[C]
+REGOP(LESS_CONSTANT, 1)     // r[A] = r[B] < K[C]
+REGOP(ADD_CONSTANT, 1)      // r[A] = r[B] + K[C]
+REGOP(SUBTRACT_CONSTANT, 1) // r[A] = r[B] - K[C]
+REGOP(MULTIPLY_CONSTANT, 1) // r[A] = r[B] * K[C]
+REGOP(DIVIDE_CONSTANT, 1)   // r[A] = r[B] / K[C]
+REGOP(NOT, 1)           // r[A] = !r[B]
+REGOP(NEGATE, 1)        // r[A] = -r[B]
+REGOP(PRINT, 1)         // print r[A]
+
+REGOP(JUMP, 1)           // sAx だけ進む
+REGOP(JUMP_IF_FALSE, 1)  // r[A] が偽なら sBx だけ進む
+REGOP(JUMP_IF_NOT_LESS, 2)             // !(r[B] < r[C]) なら 2 語目だけ進む
+REGOP(JUMP_IF_NOT_LESS_CONSTANT, 2)    // !(r[B] < K[C]) なら 2 語目だけ進む
+REGOP(JUMP_IF_NOT_GREATER, 2)          // !(r[B] > r[C]) なら 2 語目だけ進む
+REGOP(JUMP_IF_NOT_GREATER_CONSTANT, 2) // !(r[B] > K[C]) なら 2 語目だけ進む
+
+REGOP(CALL, 1)          // r[A](r[A + 1] .. r[A + B]). 結果は r[A]
+REGOP(TAIL_CALL, 1)     // CALL と同じだが, 実行中のフレームを呼び出し先に使い回す. 直後は必ず RETURN
+REGOP(INVOKE, 2)        // r[A].name(r[A + 1] .. r[A + B]). 2 語目は GET_PROPERTY と同じ
+REGOP(SUPER_INVOKE, 2)  // r[A + B + 1] のメソッド name を r[A] に対して呼ぶ. 2 語目は name の定数番号
+REGOP(CLOSURE, 1)       // r[A] = K[Bx] のクロージャ. 続く語は upvalue ごとの isLocal | index << 8
+REGOP(SHARED_CLOSURE, 1) // r[A] = K[Bx] の関数が使い回すクロージャ
+REGOP(CLOSE_UPVALUE, 1) // r[A] を捕捉している upvalue を閉じる
+REGOP(RETURN, 1)        // r[A] を返す
+REGOP(CLASS, 1)         // r[A] = クラス K[Bx]
+REGOP(INHERIT, 1)       // r[A] のメソッドを r[A + 1] にコピーする
+REGOP(METHOD, 1)        // r[A] にメソッド K[Bx] = r[A + 1] を定義する
+REGOP(BUILD_LIST, 1)    // r[A] = [r[A] .. r[A + B - 1]]
+REGOP(GET_INDEX, 1)     // r[A] = r[B][r[C]]
+REGOP(SET_INDEX, 1)     // r[A][r[B]] = r[C]; r[A] = r[C]
@@ -0,0 +1,777 @@
+// このファイルには意図的にインクルードガードがない (opcodes.h と同じく何度もインクルードする).
+// スタック層のインタプリタループ run() の本体で, vm.c が RUN_NAME, RUN_PROFILE と RUN_JIT を定義してから #include する.
+// RUN_PROFILE が真なら命令ごとに profileInstruction() を呼ぶ.
+// RUN_JIT が真なら関数の呼び出しとループの後方ジャンプを数え, 機械語にコンパイルした関数は execute() に任せる.
+// フックは実行されなくてもループの中にあるだけでレジスタ割り当てが変わって遅くなるので, 別の関数に分けている.
+
+static InterpretResult RUN_NAME() {
+  // 実行中の CallFrame と, そこから頻繁に参照するものはローカル変数にキャッシュしておく.
+  // こうしておくと READ_BYTE() などのたびに frame-> を経由したメモリアクセスをせずに済み,
+  // コンパイラも ip をレジスタに割り当てやすくなる.
+  // その代わり, ip を frame に書き戻すまで runtimeError() や呼び出し先から現在地が見えないので,
+  // 関数呼び出しやエラー報告の前には必ず STORE_FRAME() すること.
+  CallFrame *frame;
+  uint8_t *ip;
+  Value *slots;     // frame->slots
+  Value *constants; // 実行中の関数の定数プール
+  InlineCache *caches; // 実行中の関数のインラインキャッシュ
+  int operand;      // OP_WIDE を前置できる命令のインデックスオペランド
+  bool wide = false; // OP_WIDE 付きの OP_CLOSURE / OP_SHARED_CLOSURE を実行中か
+
+// vm.frames の先頭の CallFrame をローカル変数に読み込む.
+#define LOAD_FRAME() \
+    do { \
+      frame = &vm.frames[vm.frameCount - 1]; \
+      ip = frame->ip; \
+      slots = frame->slots; \
+      constants = frame->closure->function->chunk.constants.values; \
+      caches = frame->closure->function->chunk.caches; \
+    } while (false)
+
+// キャッシュしている ip を CallFrame に書き戻す.
+#define STORE_FRAME() (frame->ip = ip)
+
+#if RUN_JIT
+// 実行中の関数がコンパイル済みなら, あるいは hot が真で数えた回数がしきい値に達してコンパイルできたら,
+// execute() に戻って機械語で実行を続ける.
+#define ENTER_JIT(hot) \
+    do { \
+      ObjFunction *running = frame->closure->function; \
+      if (running->jit != NULL || \
+          ((hot) && ++running->hotness >= JIT_THRESHOLD && \
+           jitCompile(running))) { \
+        STORE_FRAME(); \
+        return INTERPRET_SWITCH_TIER; \
+      } \
+    } while (false)
+#else
+#define ENTER_JIT(hot) do { } while (false)
+#endif
+
+// 呼び出しや復帰の後に先頭の CallFrame を読み込む. それがレジスタ層の関数なら execute() に任せる.
+// 関数の先頭から始めるなら呼び出しなので, 回数を数える.
+#define ENTER_FRAME() \
+    do { \
+      LOAD_FRAME(); \
+      if (frame->closure->function->registers != NULL) { \
+        return INTERPRET_SWITCH_TIER; \
+      } \
+      ENTER_JIT(ip == frame->closure->function->chunk.code); \
+    } while (false)
+
+#define READ_BYTE() (*ip++)
+
+#define READ_SHORT() \
+    (ip += 2, \
+    (uint16_t)((ip[-2] << 8) | ip[-1]))
+
+#define READ_CONSTANT() (constants[READ_BYTE()])
+
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define OPERAND_STRING() AS_STRING(constants[operand])
+#define GLOBAL_NAME(slot) AS_STRING(vm.globalNames.values[slot])->chars
+
+#define READ_CACHE() (&caches[READ_SHORT()])
+
+// INDEXED_SITE は OP_WIDE を前置できる length バイトの命令を読み終えた後の, その命令のオペコードの位置.
+// コンパイラはインデックスが 1byte に収まらないときだけ OP_WIDE を付けるので, operand の大きさで区別できる.
+#define INDEXED_SITE(length) (ip - (length) - (operand > UINT8_MAX ? 1 : 0))
+
+// site のオペコードを書き換える. 汎用の命令 generic と特化した命令 specialized の組ごとに回数を数える.
+#define QUICKEN(site, generic, specialized) \
+    do { \
+      uint8_t *at = (site); \
+      if (*at == OP_##generic) { \
+        *at = OP_##specialized; \
+        vm.quickenStats[QUICKEN_##specialized].quickened++; \
+      } \
+    } while (false)
+
+#define DEOPTIMIZE(site, generic, specialized) \
+    do { \
+      *(site) = OP_##generic; \
+      vm.quickenStats[QUICKEN_##specialized].deoptimized++; \
+    } while (false)
+
+#define RUNTIME_ERROR(...) \
+    do { \
+      STORE_FRAME(); \
+      runtimeError(__VA_ARGS__); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+
+/* A Virtual Machine binary-op < Types of Values binary-op
+#define BINARY_OP(op) \
+    do { \
+      double b = pop(); \
+      double a = pop(); \
+      push(a op b); \
+    } while (false)
+*/
+#define BINARY_OP(valueType, op) \
+    do { \
+      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+        RUNTIME_ERROR("Operands must be numbers."); \
+      } \
+      double b = AS_NUMBER(pop()); \
+      double a = AS_NUMBER(pop()); \
+      push(valueType(a op b)); \
+    } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_INSTRUCTION() \
+    do { \
+      printf("          "); \
+      for (Value* slot = vm.stack; slot < vm.stackTop; slot++) { \
+        printf("[ "); \
+        printValue(*slot); \
+        printf(" ]"); \
+      } \
+      printf("\n"); \
+      disassembleInstruction(&frame->closure->function->chunk, \
+          (int)(ip - frame->closure->function->chunk.code)); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
+#endif
+
+#if RUN_PROFILE
+#define PROFILE_INSTRUCTION() profileInstruction(frame, ip)
+#else
+#define PROFILE_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef THREADED_DISPATCH
+  // OpCode の並びと同じ順序でハンドラのラベルのアドレスを並べたディスパッチテーブル.
+  // 各ハンドラの末尾で次の命令のハンドラへ直接ジャンプする.
+  static void *dispatchTable[] = {
+#define OPCODE(name, length) &&code_##name,
+#include "opcodes.h"
+#undef OPCODE
+  };
+
+#define INTERPRET_LOOP  DISPATCH();
+#define CASE_CODE(name) code_##name
+
+#define DISPATCH() \
+    do { \
+      TRACE_INSTRUCTION(); \
+      PROFILE_INSTRUCTION(); \
+      goto *dispatchTable[READ_BYTE()]; \
+    } while (false)
+#else
+#define INTERPRET_LOOP \
+    loop: \
+      TRACE_INSTRUCTION(); \
+      PROFILE_INSTRUCTION(); \
+      switch (READ_BYTE())
+
+#define CASE_CODE(name) case OP_##name
+#define DISPATCH()      goto loop
+#endif
+
+// OP_WIDE を前置できる命令のハンドラの先頭. 1byte のインデックスオペランドを operand に読んでから本体に入る.
+// OP_WIDE のハンドラは 2byte のオペランドを読んでから wide_<name> に直接ジャンプしてくる.
+#define CASE_INDEXED(name) \
+    CASE_CODE(name): \
+      operand = READ_BYTE(); \
+    wide_##name
+
+  LOAD_FRAME();
+
+  INTERPRET_LOOP
+  {
+    CASE_INDEXED(CONSTANT): {
+      Value constant = constants[operand];
+/* A Virtual Machine op-constant < A Virtual Machine push-constant
+      printValue(constant);
+      printf("\n");
+*/
+      push(constant);
+      DISPATCH();
+    }
+    CASE_CODE(NIL):
+      push(NIL_VAL);
+      DISPATCH();
+    CASE_CODE(TRUE):
+      push(BOOL_VAL(true));
+      DISPATCH();
+    CASE_CODE(FALSE):
+      push(BOOL_VAL(false));
+      DISPATCH();
+    CASE_CODE(POP):
+      pop();
+      DISPATCH();
+    CASE_INDEXED(GET_LOCAL): {
+      // ローカル変数のロード
+
+      // ローカル変数が存在するスタックidxをオペランドで取る
+      int slot = operand;
+      // 現在CallFrameのslots先頭を経由して相対的にアクセスしてPUSHする.
+      push(slots[slot]);
+      DISPATCH();
+    }
+    CASE_INDEXED(SET_LOCAL): {
+      // ローカル変数への代入
+      int slot = operand;
+      // スタックの先頭から代入される値を取り出し, ローカル変数に対応するスタック・スロットに保存する.
+      // スタックから値をポップしないことに注意.
+      // 代入は式であり, すべての式は値を返す. よって代入式は代入された値を返すので, VMはスタックに値を残す.
+      slots[slot] = peek(0); // GET_OP_LOCAL 同様 CallFrame の slots 経由でセットする.
+      DISPATCH();
+    }
+    // グローバル変数の命令のオペランドは定数ではなく vm.globalValues のスロット番号.
+    CASE_INDEXED(GET_GLOBAL): {
+      int slot = operand;
+      Value value = vm.globalValues.values[slot];
+      if (IS_UNDEFINED(value)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+      }
+      push(value);
+      DISPATCH();
+    }
+    CASE_INDEXED(DEFINE_GLOBAL): {
+      int slot = operand;
+      vm.globalValues.values[slot] = peek(0);
+      pop();
+      DISPATCH();
+    }
+    CASE_INDEXED(SET_GLOBAL): {
+      int slot = operand;
+      if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
+      }
+      vm.globalValues.values[slot] = peek(0);
+      DISPATCH();
+    }
+    CASE_INDEXED(GET_UPVALUE): {
+      int slot = operand;
+      push(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
+    }
+    CASE_INDEXED(SET_UPVALUE): {
+      int slot = operand;
+      ObjUpvalue *upvalue = frame->closure->upvalues[slot];
+      *upvalue->location = peek(0);
+      // open なら書き込み先はスタックなのでバリアは不要だが, 区別せずに呼んでも害はない
+      writeBarrierValue((Obj *) upvalue, peek(0));
+      DISPATCH();
+    }
+    CASE_INDEXED(GET_PROPERTY): {
+      if (!IS_INSTANCE(peek(0))) {
+        RUNTIME_ERROR("Only instances have properties.");
+      }
+
+      ObjInstance *instance = AS_INSTANCE(peek(0));
+      ObjString *name = OPERAND_STRING();
+      InlineCache *cache = READ_CACHE();
+
+      // フィールドの読み出しが一番多いので, キャッシュに当たった場合だけここで片付ける
+      InlineCacheEntry *entry = cacheFind(cache, instance->shape);
+      if (entry != NULL && entry->slot >= 0) {
+        vm.stackTop[-1] = instance->fields[entry->slot];
+        DISPATCH();
+      }
+
+/* Classes and Instances get-undefined < Methods and Initializers get-method
+      runtimeError("Undefined property '%s'.", name->chars);
+      return INTERPRET_RUNTIME_ERROR;
+*/
+      STORE_FRAME();
+      if (!getProperty(instance, name, cache, &vm.stackTop[-1])) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      if (isMonomorphic(cache) && cache->entries[0].slot >= 0) {
+        QUICKEN(INDEXED_SITE(4), GET_PROPERTY, GET_FIELD);
+      }
+      DISPATCH();
+    }
+    CASE_INDEXED(GET_FIELD): {
+      InlineCache *cache = READ_CACHE();
+      InlineCacheEntry *entry = &cache->entries[0];
+      Value receiver = peek(0);
+      if (IS_INSTANCE(receiver) &&
+          AS_INSTANCE(receiver)->shape == entry->shape) {
+        vm.stackTop[-1] = AS_INSTANCE(receiver)->fields[entry->slot];
+        DISPATCH();
+      }
+      DEOPTIMIZE(INDEXED_SITE(4), GET_PROPERTY, GET_FIELD);
+      ip -= 2; // キャッシュのオペランドを読み直す
+      goto wide_GET_PROPERTY;
+    }
+    CASE_INDEXED(SET_PROPERTY): {
+      if (!IS_INSTANCE(peek(1))) {
+        RUNTIME_ERROR("Only instances have fields.");
+      }
+
+      ObjInstance *instance = AS_INSTANCE(peek(1));
+      ObjString *name = OPERAND_STRING();
+      InlineCache *cache = READ_CACHE();
+      InlineCacheEntry *entry = cacheFind(cache, instance->shape);
+      if (entry != NULL && entry->transition == NULL) {
+        instance->fields[entry->slot] = peek(0);
+        writeBarrierValue((Obj *) instance, peek(0));
+      } else {
+        setProperty(instance, name, cache, peek(0));
+      }
+      Value value = pop();
+      pop();
+      push(value);
+      DISPATCH();
+    }
+    CASE_INDEXED(GET_SUPER): {
+      ObjString *name = OPERAND_STRING();
+      ObjClass *superclass = AS_CLASS(pop());
+
+      STORE_FRAME();
+      if (!bindMethod(superclass, name, &vm.stackTop[-1])) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE_CODE(EQUAL):
+    op_equal: {
+      bool equal = equalValues(peek(1), peek(0));
+      vm.stackTop -= 2;
+      push(BOOL_VAL(equal));
+      DISPATCH();
+    }
+    CASE_CODE(GREATER):
+      BINARY_OP(BOOL_VAL, >);
+      DISPATCH();
+    CASE_CODE(LESS):
+    op_less:
+      BINARY_OP(BOOL_VAL, <);
+      DISPATCH();
+/* A Virtual Machine op-binary < Types of Values op-arithmetic
+    case OP_ADD:      BINARY_OP(+); break;
+    case OP_SUBTRACT: BINARY_OP(-); break;
+    case OP_MULTIPLY: BINARY_OP(*); break;
+    case OP_DIVIDE:   BINARY_OP(/); break;
+*/
+/* A Virtual Machine op-negate < Types of Values op-negate
+    case OP_NEGATE:   push(-pop()); break;
+*/
+/* Types of Values op-arithmetic < Strings add-strings
+    case OP_ADD:      BINARY_OP(NUMBER_VAL, +); break;
+*/
+    CASE_CODE(ADD):
+      if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+        QUICKEN(ip - 1, ADD, ADD_NUM);
+        goto op_add_num;
+      }
+    op_add: {
+      if (IS_TEXT(peek(0)) && IS_TEXT(peek(1))) {
+        concatenate();
+      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+        double b = AS_NUMBER(pop());
+        double a = AS_NUMBER(pop());
+        push(NUMBER_VAL(a + b));
+      } else {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
+      }
+      DISPATCH();
+    }
+    CASE_CODE(ADD_NUM):
+      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+        DEOPTIMIZE(ip - 1, ADD, ADD_NUM);
+        goto op_add;
+      }
+    op_add_num: {
+      double b = AS_NUMBER(pop());
+      double a = AS_NUMBER(pop());
+      push(NUMBER_VAL(a + b));
+      DISPATCH();
+    }
+    CASE_CODE(SUBTRACT):
+    op_subtract:
+      BINARY_OP(NUMBER_VAL, -);
+      DISPATCH();
+    CASE_CODE(MULTIPLY):
+      BINARY_OP(NUMBER_VAL, *);
+      DISPATCH();
+    CASE_CODE(DIVIDE):
+      BINARY_OP(NUMBER_VAL, /);
+      DISPATCH();
+    CASE_CODE(NOT):
+      push(BOOL_VAL(isFalsey(pop())));
+      DISPATCH();
+    CASE_CODE(NEGATE):
+      if (!IS_NUMBER(peek(0))) {
+        RUNTIME_ERROR("Operand must be a number.");
+      }
+      push(NUMBER_VAL(-AS_NUMBER(pop())));
+      DISPATCH();
+    CASE_CODE(PRINT): {
+      printValue(pop());
+      writeOutput("\n", 1);
+      DISPATCH();
+    }
+    CASE_CODE(JUMP): {
+      uint16_t offset = READ_SHORT();
+/* Jumping Back and Forth op-jump < Calls and Functions jump
+      vm.ip += offset;
+*/
+      ip += offset;
+      DISPATCH();
+    }
+    CASE_CODE(JUMP_IF_FALSE): {
+      uint16_t offset = READ_SHORT();
+      if (isFalsey(peek(0))) ip += offset;
+      DISPATCH();
+    }
+    CASE_CODE(LOOP): {
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+      // ループの先頭から機械語で続ける (on-stack replacement)
+      ENTER_JIT(true);
+      DISPATCH();
+    }
+    CASE_CODE(POP_JUMP_IF_FALSE): {
+      uint16_t offset = READ_SHORT();
+      if (isFalsey(pop())) ip += offset;
+      DISPATCH();
+    }
+    // 以下は superinstruction. 数値同士の場合だけをその場で片付け,
+    // それ以外はオペランドを積み直して元の命令のハンドラに合流する (エラーメッセージも共通になる).
+    CASE_CODE(GET_LOCAL_PROPERTY):
+    op_get_local_property: {
+      Value receiver = slots[READ_BYTE()];
+      if (!IS_INSTANCE(receiver)) {
+        RUNTIME_ERROR("Only instances have properties.");
+      }
+
+      ObjInstance *instance = AS_INSTANCE(receiver);
+      ObjString *name = READ_STRING();
+      InlineCache *cache = READ_CACHE();
+      InlineCacheEntry *entry = cacheFind(cache, instance->shape);
+      if (entry != NULL && entry->slot >= 0) {
+        push(instance->fields[entry->slot]);
+        DISPATCH();
+      }
+
+      push(receiver);
+      STORE_FRAME();
+      if (!getProperty(instance, name, cache, &vm.stackTop[-1])) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      if (isMonomorphic(cache) && cache->entries[0].slot >= 0) {
+        QUICKEN(ip - 5, GET_LOCAL_PROPERTY, GET_LOCAL_FIELD);
+      }
+      DISPATCH();
+    }
+    CASE_CODE(GET_LOCAL_FIELD): {
+      Value receiver = slots[READ_BYTE()];
+      ip++; // 名前
+      InlineCache *cache = READ_CACHE();
+      InlineCacheEntry *entry = &cache->entries[0];
+      if (IS_INSTANCE(receiver) &&
+          AS_INSTANCE(receiver)->shape == entry->shape) {
+        push(AS_INSTANCE(receiver)->fields[entry->slot]);
+        DISPATCH();
+      }
+      DEOPTIMIZE(ip - 5, GET_LOCAL_PROPERTY, GET_LOCAL_FIELD);
+      ip -= 4; // オペランドを読み直す
+      goto op_get_local_property;
+    }
+    CASE_CODE(ADD_CONSTANT): {
+      Value constant = READ_CONSTANT();
+      if (IS_NUMBER(peek(0)) && IS_NUMBER(constant)) {
+        vm.stackTop[-1] = NUMBER_VAL(AS_NUMBER(peek(0)) + AS_NUMBER(constant));
+        DISPATCH();
+      }
+      push(constant);
+      goto op_add;
+    }
+    CASE_CODE(SUBTRACT_CONSTANT): {
+      Value constant = READ_CONSTANT();
+      if (IS_NUMBER(peek(0)) && IS_NUMBER(constant)) {
+        vm.stackTop[-1] = NUMBER_VAL(AS_NUMBER(peek(0)) - AS_NUMBER(constant));
+        DISPATCH();
+      }
+      push(constant);
+      goto op_subtract;
+    }
+    CASE_CODE(LESS_CONSTANT): {
+      Value constant = READ_CONSTANT();
+      if (IS_NUMBER(peek(0)) && IS_NUMBER(constant)) {
+        vm.stackTop[-1] = BOOL_VAL(AS_NUMBER(peek(0)) < AS_NUMBER(constant));
+        DISPATCH();
+      }
+      push(constant);
+      goto op_less;
+    }
+    CASE_CODE(EQUAL_CONSTANT): {
+      Value constant = READ_CONSTANT();
+      // 定数がロープになることはないので, 平坦化が要るのはスタック側だけ
+      if (!IS_ROPE(peek(0))) {
+        vm.stackTop[-1] = BOOL_VAL(valuesEqual(peek(0), constant));
+        DISPATCH();
+      }
+      push(constant);
+      goto op_equal;
+    }
+    CASE_CODE(LESS_CONSTANT_JUMP): {
+      Value constant = READ_CONSTANT();
+      uint16_t offset = READ_SHORT();
+      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(constant)) {
+        RUNTIME_ERROR("Operands must be numbers.");
+      }
+      if (!(AS_NUMBER(pop()) < AS_NUMBER(constant))) ip += offset;
+      DISPATCH();
+    }
+    CASE_CODE(INCREMENT_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      Value constant = READ_CONSTANT();
+      if (IS_NUMBER(slots[slot]) && IS_NUMBER(constant)) {
+        slots[slot] = NUMBER_VAL(AS_NUMBER(slots[slot]) + AS_NUMBER(constant));
+      } else if (IS_TEXT(slots[slot]) && IS_TEXT(constant)) {
+        push(slots[slot]);
+        push(constant);
+        concatenate();
+        slots[slot] = pop();
+      } else {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
+      }
+      DISPATCH();
+    }
+    // 関数の呼び出し命令.
+    CASE_CODE(CALL): {
+      int argCount = READ_BYTE();
+      // 呼び出し先から戻ってきたときにここから再開できるように ip を書き戻しておく.
+      STORE_FRAME();
+      // VMのスタックの先頭に引数が積まれているので argCount の数だけ peek した箇所に関数が収められている.
+      // その関数を callValue にわたす.
+      if (!callValue(peek(argCount), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      // 関数呼び出しに成功した場合VMのスタックに新しいCallFrameが積まれている.
+      // それを現在実行している frame として読み込み直す.
+      ENTER_FRAME();
+      DISPATCH();
+    }
+    CASE_CODE(TAIL_CALL): {
+      int argCount = READ_BYTE();
+      STORE_FRAME();
+      if (!tailCall(peek(argCount), argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      ENTER_FRAME();
+      DISPATCH();
+    }
+    CASE_INDEXED(INVOKE): {
+      ObjString *method = OPERAND_STRING();
+      int argCount = READ_BYTE();
+      InlineCache *cache = READ_CACHE();
+      STORE_FRAME();
+      if (!invoke(method, argCount, cache)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      if (isMonomorphic(cache) && cache->entries[0].slot < 0) {
+        QUICKEN(INDEXED_SITE(5), INVOKE, INVOKE_METHOD);
+      }
+      ENTER_FRAME();
+      DISPATCH();
+    }
+    CASE_INDEXED(INVOKE_METHOD): {
+      int argCount = READ_BYTE();
+      InlineCache *cache = READ_CACHE();
+      InlineCacheEntry *entry = &cache->entries[0];
+      Value receiver = peek(argCount);
+      if (IS_INSTANCE(receiver) &&
+          AS_INSTANCE(receiver)->shape == entry->shape) {
+        STORE_FRAME();
+        if (!call(AS_CLOSURE(entry->method), argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        ENTER_FRAME();
+        DISPATCH();
+      }
+      DEOPTIMIZE(INDEXED_SITE(5), INVOKE, INVOKE_METHOD);
+      ip -= 3; // 引数の数とキャッシュのオペランドを読み直す
+      goto wide_INVOKE;
+    }
+    CASE_INDEXED(SUPER_INVOKE): {
+      ObjString *method = OPERAND_STRING();
+      int argCount = READ_BYTE();
+      ObjClass *superclass = AS_CLASS(pop());
+      STORE_FRAME();
+      if (!invokeFromClass(superclass, method, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      ENTER_FRAME();
+      DISPATCH();
+    }
+    CASE_INDEXED(CLOSURE): {
+      ObjFunction *function = AS_FUNCTION(constants[operand]);
+      ObjClosure *closure = newClosure(function);
+      push(OBJ_VAL(closure));
+      // upvalueCount のぶんだけオペランドバイトコードを読み込む.
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = READ_BYTE();
+        int index = wide ? READ_SHORT() : READ_BYTE();
+        if (isLocal) {
+          // isLocal=true ならば「現在実行中のCallFrame」で宣言された関数がそのCallFrameで宣言された変数をキャプチャしているので,
+          // slots+index に位置にある変数をcaptureUpvalueでキャプチャする.
+          closure->upvalues[i] = captureUpvalue(slots + index);
+        } else {
+          // isLocal=falseは更に外部のスコープにある変数キャプチャなのでupvaluesのindexから参照チェーンを取得しておく
+          closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+      }
+      wide = false;
+      // captureUpvalue の確保でGCが走ると closure はすでに昇格しているかもしれない
+      writeBarrier((Obj *) closure);
+      DISPATCH();
+    }
+    // キャプチャされた変数をヒープに退避させる命令.
+    // コンパイラはブロックの終端に達するたび(関数定義除く)そのブロック内のすべてのローカル変数を破棄しクローズされた各ローカル変数に対して,
+    // OP_CLOSE_UPVALUE を出力しなければならない.
+    CASE_CODE(CLOSE_UPVALUE):
+      closeUpvalues(vm.stackTop - 1);
+      pop();
+      DISPATCH();
+    // 関数からの復帰命令
+    CASE_CODE(RETURN): {
+      Value result = pop(); // 関数の実行結果を取得
+      closeUpvalues(slots); // 関数内部で定義された変数(引数含む)も正しくCLOSEされなければならない(入れ子関数定義でクロージャにキャプチャされる可能性がある).
+      // CallFrame の破棄
+      vm.frameCount--;
+      // 呼び終わった関数のCallFrame先頭をスタックトップに更新 = CallFrame が積んでいた値を破棄する.
+      vm.stackTop = slots;
+      push(result); // 関数の結果を先頭に積む
+      if (vm.frameCount == vm.baseFrame) {
+        // トップレベルのCallFrameの終了 = プログラム全体の終了.
+        // callFunction() から入れ子に実行しているなら, その呼び出しの終了.
+        return INTERPRET_OK;
+      }
+
+      // 呼び出し元の CallFrame を読み込み直し, 書き戻しておいた ip から実行を再開する
+      ENTER_FRAME();
+      DISPATCH();
+    }
+    CASE_INDEXED(CLASS):
+      push(OBJ_VAL(newClass(OPERAND_STRING())));
+      DISPATCH();
+    CASE_CODE(INHERIT): {
+      Value superclass = peek(1);
+      if (!IS_CLASS(superclass)) {
+        RUNTIME_ERROR("Superclass must be a class.");
+      }
+
+      ObjClass *subclass = AS_CLASS(peek(0));
+      tableAddAll(&AS_CLASS(superclass)->methods,
+                  &subclass->methods);
+      writeBarrier((Obj *) subclass);
+      pop(); // Subclass.
+      DISPATCH();
+    }
+    CASE_INDEXED(METHOD):
+      defineMethod(OPERAND_STRING());
+      DISPATCH();
+    // frame[-1] は関数を宣言したフレーム (nonEscaping な関数の呼び出し元)
+    CASE_INDEXED(GET_OUTER):
+      push(frame[-1].slots[operand]);
+      DISPATCH();
+    CASE_INDEXED(SET_OUTER):
+      frame[-1].slots[operand] = peek(0);
+      DISPATCH();
+    CASE_INDEXED(SHARED_CLOSURE): {
+      ObjFunction *function = AS_FUNCTION(constants[operand]);
+      push(OBJ_VAL(function->closure));
+      ip += function->upvalueCount * (wide ? 3 : 2);
+      wide = false;
+      DISPATCH();
+    }
+    CASE_CODE(BUILD_LIST): {
+      int count = READ_BYTE();
+      // 要素はスタックに積んだまま確保するのでGCに回収されない
+      ObjList *list = newList(vm.stackTop - count, count);
+      vm.stackTop -= count;
+      push(OBJ_VAL(list));
+      DISPATCH();
+    }
+    CASE_CODE(GET_INDEX): {
+      STORE_FRAME();
+      int slot = listIndex(peek(1), peek(0));
+      if (slot < 0) return INTERPRET_RUNTIME_ERROR;
+      vm.stackTop[-2] = AS_LIST(peek(1))->items.values[slot];
+      vm.stackTop--;
+      DISPATCH();
+    }
+    CASE_CODE(SET_INDEX): {
+      STORE_FRAME();
+      int slot = listIndex(peek(2), peek(1));
+      if (slot < 0) return INTERPRET_RUNTIME_ERROR;
+      listSet(AS_LIST(peek(2)), slot, peek(0));
+      vm.stackTop[-3] = peek(0);
+      vm.stackTop -= 2;
+      DISPATCH();
+    }
+    CASE_CODE(WIDE):
+      // 2byte のインデックスオペランドを読み, 後続の命令のハンドラの本体に合流する
+      switch (READ_BYTE()) {
+        case OP_CONSTANT:      operand = READ_SHORT(); goto wide_CONSTANT;
+        case OP_GET_LOCAL:     operand = READ_SHORT(); goto wide_GET_LOCAL;
+        case OP_SET_LOCAL:     operand = READ_SHORT(); goto wide_SET_LOCAL;
+        case OP_GET_GLOBAL:    operand = READ_SHORT(); goto wide_GET_GLOBAL;
+        case OP_DEFINE_GLOBAL: operand = READ_SHORT(); goto wide_DEFINE_GLOBAL;
+        case OP_SET_GLOBAL:    operand = READ_SHORT(); goto wide_SET_GLOBAL;
+        case OP_GET_UPVALUE:   operand = READ_SHORT(); goto wide_GET_UPVALUE;
+        case OP_SET_UPVALUE:   operand = READ_SHORT(); goto wide_SET_UPVALUE;
+        case OP_GET_OUTER:     operand = READ_SHORT(); goto wide_GET_OUTER;
+        case OP_SET_OUTER:     operand = READ_SHORT(); goto wide_SET_OUTER;
+        case OP_GET_PROPERTY:  operand = READ_SHORT(); goto wide_GET_PROPERTY;
+        case OP_SET_PROPERTY:  operand = READ_SHORT(); goto wide_SET_PROPERTY;
+        case OP_GET_SUPER:     operand = READ_SHORT(); goto wide_GET_SUPER;
+        case OP_GET_FIELD:     operand = READ_SHORT(); goto wide_GET_FIELD;
+        case OP_INVOKE:        operand = READ_SHORT(); goto wide_INVOKE;
+        case OP_INVOKE_METHOD: operand = READ_SHORT(); goto wide_INVOKE_METHOD;
+        case OP_SUPER_INVOKE:  operand = READ_SHORT(); goto wide_SUPER_INVOKE;
+        case OP_CLASS:         operand = READ_SHORT(); goto wide_CLASS;
+        case OP_METHOD:        operand = READ_SHORT(); goto wide_METHOD;
+        case OP_CLOSURE:
+          operand = READ_SHORT();
+          wide = true;
+          goto wide_CLOSURE;
+        case OP_SHARED_CLOSURE:
+          operand = READ_SHORT();
+          wide = true;
+          goto wide_SHARED_CLOSURE;
+        default:
+          break;
+      }
+      // コンパイラが不正な命令を出力しない限りここには到達しない.
+      return INTERPRET_RUNTIME_ERROR;
+  }
+
+  // コンパイラが不正な命令を出力しない限りここには到達しない.
+  return INTERPRET_RUNTIME_ERROR;
+
+#undef LOAD_FRAME
+#undef STORE_FRAME
+#undef ENTER_FRAME
+#undef ENTER_JIT
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef OPERAND_STRING
+#undef CASE_INDEXED
+#undef GLOBAL_NAME
+#undef READ_CACHE
+#undef INDEXED_SITE
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef RUNTIME_ERROR
+#undef BINARY_OP
+#undef TRACE_INSTRUCTION
+#undef PROFILE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE_CODE
+#undef DISPATCH
+}
+
+#undef RUN_NAME
+#undef RUN_PROFILE
+#undef RUN_JIT
@@ -2,19 +2,27 @@
 #include <string.h>
 
 #include "common.h"
+#include "memory.h"
 #include "scanner.h"
 
+// SSE2 が使えれば空白の連続を 16byte ずつまとめて読み飛ばす. x86-64 では常に使える.
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 typedef struct {
   const char *start;
   const char *current;
+  const char *end; // ソースコードの終端の '\0'
   int line;
 } Scanner;
 
-Scanner scanner;
+THREAD_LOCAL Scanner scanner;
 
-void initScanner(const char *source) {
+static void initScanner(const char *source) {
   scanner.start = source;
   scanner.current = source;
+  scanner.end = source + strlen(source);
   scanner.line = 1;
 }
 
@@ -61,6 +69,7 @@ static Token makeToken(TokenType type) {
   token.start = scanner.start;
   token.length = (int) (scanner.current - scanner.start);
   token.line = scanner.line;
+  token.hash = 0;
   return token;
 }
 
@@ -70,14 +79,35 @@ static Token errorToken(const char *message) {
   token.start = message;
   token.length = (int) strlen(message);
   token.line = scanner.line;
+  token.hash = 0;
   return token;
 }
 
+// skipSpaces は ' ' の連続を読み飛ばす. 字下げは空白が続くことが多いので,
+// SSE2 で 16byte ずつ比べて最初の ' ' でない文字の位置を求める.
+static void skipSpaces() {
+#ifdef __SSE2__
+  const __m128i spaces = _mm_set1_epi8(' ');
+  while (scanner.end - scanner.current >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *) scanner.current);
+    unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, spaces));
+    if (mask != 0xffff) {
+      scanner.current += __builtin_ctz(~mask);
+      return;
+    }
+    scanner.current += 16;
+  }
+#endif
+  while (peek() == ' ') advance();
+}
+
 static void skipWhitespace() {
   for (;;) {
     char c = peek();
     switch (c) {
       case ' ':
+        skipSpaces();
+        break;
       case '\r':
       case '\t':
         advance();
@@ -89,7 +119,10 @@ static void skipWhitespace() {
       case '/':
         if (peekNext() == '/') {
           // A comment goes until the end of the line.
-          while (peek() != '\n' && !isAtEnd()) advance();
+          // 改行は次の周回で数えるので, その手前まで memchr() で読み飛ばす.
+          const char *newline = (const char *) memchr(
+              scanner.current, '\n', (size_t) (scanner.end - scanner.current));
+          scanner.current = newline != NULL ? newline : scanner.end;
         } else {
           return;
         }
@@ -100,74 +133,51 @@ static void skipWhitespace() {
   }
 }
 
-static TokenType checkKeyword(int start, int length, const char *rest, TokenType type) {
-  // (スキャナの現在位置 - スキャナの解析開始位置) はポインタのアドレス値を減算しているのでint(size_t)となるので
-  // 引数の (開始位置 + 長さ) と比較し同じであることは, TODO: スキャンしている文字列が特定の長さかどうかを確認しているのか? memcpy は重いから.
-  if (scanner.current - scanner.start == start + length &&
-      memcmp(scanner.start + start, rest, length) == 0) {
-    // スキャナの開始位置+offset から length分の文字列が rest で指定された内容と同じなら特定の予約語である.
+// checkKeyword は識別子が hash の値を持つ予約語 rest と同じなら type を返す.
+static TokenType checkKeyword(const char *rest, int length, TokenType type) {
+  if (scanner.current - scanner.start == length &&
+      memcmp(scanner.start, rest, length) == 0) {
     return type;
   }
 
   return TOKEN_IDENTIFIER;
 }
 
-// identifierType は lox の予約語か識別子かを解析し字句を返す
-static TokenType identifierType() {
-  switch (scanner.start[0]) {
-    case 'a':
-      return checkKeyword(1, 2, "nd", TOKEN_AND);
-    case 'c':
-      return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-    case 'e':
-      return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-    case 'f':
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'a':
-            return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-          case 'o':
-            return checkKeyword(2, 1, "r", TOKEN_FOR);
-          case 'u':
-            return checkKeyword(2, 1, "n", TOKEN_FUN);
-        }
-      }
-      break;
-    case 'i':
-      return checkKeyword(1, 1, "f", TOKEN_IF);
-    case 'n':
-      return checkKeyword(1, 2, "il", TOKEN_NIL);
-    case 'o':
-      return checkKeyword(1, 1, "r", TOKEN_OR);
-    case 'p':
-      return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-    case 'r':
-      return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-    case 's':
-      return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-    case 't':
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'h':
-            return checkKeyword(2, 2, "is", TOKEN_THIS);
-          case 'r':
-            return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-        }
-      }
-      break;
-    case 'v':
-      return checkKeyword(1, 2, "ar", TOKEN_VAR);
-    case 'w':
-      return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+// identifierType は lox の予約語か識別子かを解析し字句を返す.
+// 識別子の FNV-1a ハッシュ値は読みながら求めているので, 先頭の文字をたどる代わりにその値で予約語を引く.
+// case の値は各予約語の hashString() の値.
+static TokenType identifierType(uint32_t hash) {
+  switch (hash) {
+    case 0x0f29c2a6u: return checkKeyword("and", 3, TOKEN_AND);
+    case 0xab3e0bffu: return checkKeyword("class", 5, TOKEN_CLASS);
+    case 0xbdbf5bf0u: return checkKeyword("else", 4, TOKEN_ELSE);
+    case 0x0b069958u: return checkKeyword("false", 5, TOKEN_FALSE);
+    case 0xacf38390u: return checkKeyword("for", 3, TOKEN_FOR);
+    case 0xa8db785eu: return checkKeyword("fun", 3, TOKEN_FUN);
+    case 0x39386e06u: return checkKeyword("if", 2, TOKEN_IF);
+    case 0x0da3f8ecu: return checkKeyword("nil", 3, TOKEN_NIL);
+    case 0x5d342984u: return checkKeyword("or", 2, TOKEN_OR);
+    case 0x16378a88u: return checkKeyword("print", 5, TOKEN_PRINT);
+    case 0x85ee37bfu: return checkKeyword("return", 6, TOKEN_RETURN);
+    case 0xf77e01d4u: return checkKeyword("super", 5, TOKEN_SUPER);
+    case 0xda2bd281u: return checkKeyword("this", 4, TOKEN_THIS);
+    case 0x4db211e5u: return checkKeyword("true", 4, TOKEN_TRUE);
+    case 0x8a25e7beu: return checkKeyword("var", 3, TOKEN_VAR);
+    case 0x0dc628ceu: return checkKeyword("while", 5, TOKEN_WHILE);
   }
 
   return TOKEN_IDENTIFIER;
 }
 
 static Token identifier() {
-  while (isAlpha(peek()) || isDigit(peek()))
-    advance();
-  return makeToken(identifierType());
+  uint32_t hash = FNV_OFFSET_BASIS;
+  hash = (hash ^ (uint8_t) scanner.start[0]) * FNV_PRIME;
+  while (isAlpha(peek()) || isDigit(peek())) {
+    hash = (hash ^ (uint8_t) advance()) * FNV_PRIME;
+  }
+  Token token = makeToken(identifierType(hash));
+  token.hash = hash;
+  return token;
 }
 
 static Token number() {
@@ -184,20 +194,24 @@ static Token number() {
   return makeToken(TOKEN_NUMBER);
 }
 
+// string は文字列リテラルを読む. 字句の hash には前後の '"' を除いた中身のハッシュ値を入れる.
 static Token string() {
+  uint32_t hash = FNV_OFFSET_BASIS;
   while (peek() != '"' && !isAtEnd()) {
     if (peek() == '\n') scanner.line++;
-    advance();
+    hash = (hash ^ (uint8_t) advance()) * FNV_PRIME;
   }
 
   if (isAtEnd()) return errorToken("Unterminated string.");
 
   // The closing quote(").
   advance();
-  return makeToken(TOKEN_STRING);
+  Token token = makeToken(TOKEN_STRING);
+  token.hash = hash;
+  return token;
 }
 
-Token scanToken() {
+static Token scanToken() {
   skipWhitespace();
   // 読み込み開始位置を設定する.
   scanner.start = scanner.current;
@@ -221,6 +235,10 @@ Token scanToken() {
       return makeToken(TOKEN_LEFT_BRACE);
     case '}':
       return makeToken(TOKEN_RIGHT_BRACE);
+    case '[':
+      return makeToken(TOKEN_LEFT_BRACKET);
+    case ']':
+      return makeToken(TOKEN_RIGHT_BRACKET);
     case ';':
       return makeToken(TOKEN_SEMICOLON);
     case ',':
@@ -253,3 +271,29 @@ Token scanToken() {
 
   return errorToken("Unexpected character.");
 }
+
+void scanTokens(const char *source, TokenArray *array) {
+  initScanner(source);
+  array->count = 0;
+  array->capacity = 0;
+  array->tokens = NULL;
+
+  for (;;) {
+    if (array->capacity < array->count + 1) {
+      int oldCapacity = array->capacity;
+      array->capacity = GROW_CAPACITY(oldCapacity);
+      array->tokens = GROW_ARRAY(Token, array->tokens, oldCapacity,
+                                 array->capacity);
+    }
+    Token *token = &array->tokens[array->count++];
+    *token = scanToken();
+    if (token->type == TOKEN_EOF) break;
+  }
+}
+
+void freeTokens(TokenArray *array) {
+  FREE_ARRAY(Token, array->tokens, array->capacity);
+  array->count = 0;
+  array->capacity = 0;
+  array->tokens = NULL;
+}
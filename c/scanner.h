@@ -1,10 +1,13 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include "common.h"
+
 typedef enum {
   // Single-character tokens.
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
   TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
   TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
   // One or two character tokens.
@@ -25,14 +28,25 @@ typedef enum {
 
 // Token はスキャナが読み込む字句一つを表す
 typedef struct {
-  TokenType type;
   const char *start;
+  TokenType type;
   int length;
   int line;
+  // 識別子は字句そのものの, 文字列は前後の '"' を除いた中身の hashString() の値. 他の字句では 0.
+  uint32_t hash;
 } Token;
 
-void initScanner(const char *source);
+// TokenArray はソースコード全体を先に読み込んだ字句の列. 最後は TOKEN_EOF になる.
+typedef struct {
+  int count;
+  int capacity;
+  Token *tokens;
+} TokenArray;
+
+// scanTokens は source を一度にすべて字句に分けて array に入れる.
+// 字句のエラーも TOKEN_ERROR としてその位置に入るので, パーサーが順に報告する.
+void scanTokens(const char *source, TokenArray *array);
 
-Token scanToken();
+void freeTokens(TokenArray *array);
 
 #endif
@@ -5,8 +5,111 @@
 #include "object.h"
 #include "table.h"
 #include "value.h"
+#include "vm.h"
 
-#define TABLE_MAX_LOAD 0.75
+// 制御バイトの値. 使用中のスロットはハッシュ値の下位 7bit (0..127) を持つ.
+#define CONTROL_EMPTY ((uint8_t) 0x80)
+#define CONTROL_DELETED ((uint8_t) 0xFE)
+// capacity が TABLE_GROUP_SIZE より小さい表で, グループの残りを埋める. どれとも一致しない.
+#define CONTROL_SENTINEL ((uint8_t) 0xFF)
+
+#define IS_FULL(control) (((control) & 0x80) == 0)
+#define HASH_TAG(hash) ((uint8_t) ((hash) & 0x7F))
+#define HASH_GROUP(hash) ((int) ((hash) >> 7))
+
+#define GROUP_COUNT(capacity) \
+    (((unsigned) (capacity) + TABLE_GROUP_SIZE - 1) / TABLE_GROUP_SIZE)
+#define CONTROL_SIZE(capacity) (GROUP_COUNT(capacity) * TABLE_GROUP_SIZE)
+// グループの数は 2 のべき乗なので, グループ番号はこれとの & で折り返す
+#define GROUP_MASK(capacity) (((unsigned) (capacity) - 1) / TABLE_GROUP_SIZE)
+
+#define CONTROL(table) ((uint8_t *) ((table)->entries + (table)->capacity))
+#define ALLOCATION_SIZE(capacity) \
+    (sizeof(Entry) * (size_t) (capacity) + CONTROL_SIZE(capacity))
+
+// 使用中と墓石を合わせてこれを超えたら, 詰め直すか大きくする
+#define TABLE_MAX_LOAD(capacity) ((capacity) / 8 * 7)
+// 墓石がこれ以上あれば, 大きくせずに同じ大きさのまま詰め直す
+#define TABLE_MAX_TOMBSTONES(capacity) ((capacity) / 4)
+
+// GroupMask はグループ内で条件に合うスロットのビット集合.
+// NEON では 1 スロットが 4bit を占めるので, スロット番号は最下位のビット位置を MASK_SHIFT だけずらして得る.
+typedef uint64_t GroupMask;
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MASK_SHIFT 0
+
+static inline GroupMask matchByte(const uint8_t *group, uint8_t byte) {
+  __m128i control = _mm_loadu_si128((const __m128i *) group);
+  __m128i match = _mm_cmpeq_epi8(control, _mm_set1_epi8((char) byte));
+  return (GroupMask) _mm_movemask_epi8(match);
+}
+
+// 空きか墓石, つまり符号付きで -1 (CONTROL_SENTINEL) より小さいもの
+static inline GroupMask matchFree(const uint8_t *group) {
+  __m128i control = _mm_loadu_si128((const __m128i *) group);
+  __m128i match = _mm_cmpgt_epi8(_mm_set1_epi8(-1), control);
+  return (GroupMask) _mm_movemask_epi8(match);
+}
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MASK_SHIFT 2
+
+// 比較結果の各バイトを 4bit に縮めて 64bit に詰め, スロットごとに 1bit だけ残す
+static inline GroupMask toMask(uint8x16_t match) {
+  uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(match), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) &
+         0x8888888888888888ull;
+}
+
+static inline GroupMask matchByte(const uint8_t *group, uint8_t byte) {
+  return toMask(vceqq_u8(vld1q_u8(group), vdupq_n_u8(byte)));
+}
+
+static inline GroupMask matchFree(const uint8_t *group) {
+  int8x16_t control = vreinterpretq_s8_u8(vld1q_u8(group));
+  return toMask(vcltq_s8(control, vdupq_n_s8(-1)));
+}
+#else
+#define MASK_SHIFT 0
+
+static inline GroupMask matchByte(const uint8_t *group, uint8_t byte) {
+  GroupMask mask = 0;
+  for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+    if (group[i] == byte) mask |= (GroupMask) 1 << i;
+  }
+  return mask;
+}
+
+static inline GroupMask matchFree(const uint8_t *group) {
+  GroupMask mask = 0;
+  for (int i = 0; i < TABLE_GROUP_SIZE; i++) {
+    if ((int8_t) group[i] < -1) mask |= (GroupMask) 1 << i;
+  }
+  return mask;
+}
+#endif
+
+// firstSlot は mask (0 でないこと) のうち最も番号の小さいスロットを返す
+static inline int firstSlot(GroupMask mask) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(mask) >> MASK_SHIFT;
+#else
+  int bit = 0;
+  while ((mask & 1) == 0) {
+    mask >>= 1;
+    bit++;
+  }
+  return bit >> MASK_SHIFT;
+#endif
+}
+
+// グループは hash で決まるものから 1, 2, 3, ... 個ずつ飛ばして調べる.
+// グループの数が 2 のべき乗なので, いずれすべてのグループを一度ずつ訪れる.
+#define FOR_EACH_GROUP(capacity, hash, group)                        \
+  for (int group = HASH_GROUP(hash) & GROUP_MASK(capacity), step_ = 1;; \
+       group = (group + step_++) & GROUP_MASK(capacity))
 
 // initTableは引数のハッシュテーブルを初期化する
 void initTable(Table *table) {
@@ -16,116 +119,182 @@ void initTable(Table *table) {
 }
 
 void freeTable(Table *table) {
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  // インスタンスの辞書などはほとんど使われないまま解放されるので, 空なら何もしない
+  if (table->capacity > 0) {
+    FREE_ARRAY(uint8_t, table->entries, ALLOCATION_SIZE(table->capacity));
+  }
   initTable(table);
 }
 
-// NOTE: The "Optimization" chapter has a manual copy of this function.
-// If you change it here, make sure to update that copy.
-static Entry *findEntry(Entry *entries, int capacity,
-                        ObjString *key) {
-/* Hash Tables find-entry < Optimization initial-index
-  uint32_t index = key->hash % capacity;
-*/
-  uint32_t index = key->hash & (capacity - 1);
-  Entry *tombstone = NULL;
-
-  for (;;) {
-    Entry *entry = &entries[index];
-/* Hash Tables find-entry < Hash Tables find-tombstone
-    if (entry->key == key || entry->key == NULL) {
-      return entry;
-    }
-*/
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-        // Empty entry.
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        // We found a tombstone.
-        if (tombstone == NULL) tombstone = entry;
-      }
-    } else if (entry->key == key) {
-      // We found the key.
-      return entry;
+// findSlot は key のスロット番号を返す. なければ -1.
+static int findSlot(Table *table, ObjString *key) {
+  uint8_t *control = CONTROL(table);
+  uint32_t hash = key->hash;
+  uint8_t tag = HASH_TAG(hash);
+  FOR_EACH_GROUP(table->capacity, hash, group) {
+    const uint8_t *groupControl = &control[group * TABLE_GROUP_SIZE];
+    for (GroupMask match = matchByte(groupControl, tag); match != 0;
+         match &= match - 1) {
+      int index = group * TABLE_GROUP_SIZE + firstSlot(match);
+      if (table->entries[index].key == key) return index;
     }
+    // 空きのあるグループより先に key が置かれることはない
+    if (matchByte(groupControl, CONTROL_EMPTY) != 0) return -1;
+  }
+}
 
-/* Hash Tables find-entry < Optimization next-index
-    index = (index + 1) % capacity;
-*/
-    index = (index + 1) & (capacity - 1);
+// findFreeSlot は hash のキーを置ける最初の空きか墓石のスロット番号を返す
+static int findFreeSlot(uint8_t *control, int capacity, uint32_t hash) {
+  FOR_EACH_GROUP(capacity, hash, group) {
+    GroupMask slots = matchFree(&control[group * TABLE_GROUP_SIZE]);
+    if (slots != 0) return group * TABLE_GROUP_SIZE + firstSlot(slots);
   }
 }
 
 bool tableGet(Table *table, ObjString *key, Value *value) {
   if (table->count == 0) return false;
 
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  int index = findSlot(table, key);
+  if (index < 0) return false;
 
-  *value = entry->value;
+  *value = table->entries[index].value;
   return true;
 }
 
 static void adjustCapacity(Table *table, int capacity) {
-  Entry *entries = ALLOCATE(Entry, capacity);
-  for (int i = 0; i < capacity; i++) {
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
-  }
+  Entry *entries = (Entry *) ALLOCATE(uint8_t, ALLOCATION_SIZE(capacity));
+  uint8_t *control = (uint8_t *) (entries + capacity);
+  memset(control, CONTROL_EMPTY, (size_t) capacity);
+  memset(control + capacity, CONTROL_SENTINEL,
+         CONTROL_SIZE(capacity) - (size_t) capacity);
 
+  // ハッシュ値は ObjString が覚えているので, 新しい位置を決めるのに文字列は読まない.
+  // 新しい表にはまだ同じキーがないので, 比較もせずに最初の空きに置ける.
+  uint8_t *oldControl = CONTROL(table);
   table->count = 0;
   for (int i = 0; i < table->capacity; i++) {
-    Entry *entry = &table->entries[i];
-    if (entry->key == NULL) continue;
+    if (!IS_FULL(oldControl[i])) continue;
 
-    Entry *dest = findEntry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
+    Entry *entry = &table->entries[i];
+    int index = findFreeSlot(control, capacity, entry->key->hash);
+    control[index] = oldControl[i];
+    entries[index] = *entry;
     table->count++;
   }
 
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  if (table->capacity > 0) {
+    FREE_ARRAY(uint8_t, table->entries, ALLOCATION_SIZE(table->capacity));
+  }
   table->entries = entries;
   table->capacity = capacity;
 }
 
+// rehashInPlace は墓石をなくすため, 確保し直さずにすべてのキーを置き直す.
+// 使用中のスロットを「未処理」の印として CONTROL_DELETED に, 墓石を空きにしてから,
+// 未処理のキーを一つずつ, 今の状態で最初に置けるスロットへ動かしていく.
+static void rehashInPlace(Table *table) {
+  uint8_t *control = CONTROL(table);
+  table->count = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    if (IS_FULL(control[i])) {
+      control[i] = CONTROL_DELETED;
+      table->count++;
+    } else {
+      control[i] = CONTROL_EMPTY;
+    }
+  }
+
+  for (int i = 0; i < table->capacity; i++) {
+    if (control[i] != CONTROL_DELETED) continue;
+
+    uint32_t hash = table->entries[i].key->hash;
+    int index = findFreeSlot(control, table->capacity, hash);
+    if (index / TABLE_GROUP_SIZE == i / TABLE_GROUP_SIZE) {
+      // 同じグループにしか置けないならその場でよい
+      control[i] = HASH_TAG(hash);
+    } else if (control[index] == CONTROL_EMPTY) {
+      control[index] = HASH_TAG(hash);
+      table->entries[index] = table->entries[i];
+      control[i] = CONTROL_EMPTY;
+    } else {
+      // 移動先も未処理のキーなので入れ替え, 入れ替えたキーをもう一度処理する
+      Entry entry = table->entries[index];
+      table->entries[index] = table->entries[i];
+      table->entries[i] = entry;
+      control[index] = HASH_TAG(hash);
+      i--;
+    }
+  }
+}
+
+static int countTombstones(Table *table) {
+  uint8_t *control = CONTROL(table);
+  int tombstones = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    if (control[i] == CONTROL_DELETED) tombstones++;
+  }
+  return tombstones;
+}
+
 // tableSet は指定したハッシュテーブルに key, value をセットする
 bool tableSet(Table *table, ObjString *key, Value value) {
-  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-    int capacity = GROW_CAPACITY(table->capacity);
-    adjustCapacity(table, capacity);
+  if (table->count > 0) {
+    int index = findSlot(table, key);
+    if (index >= 0) {
+      table->entries[index].value = value;
+      return false;
+    }
+  }
+
+  if (table->count + 1 > TABLE_MAX_LOAD(table->capacity)) {
+    // どのみち表全体を作り直すので, 墓石はそのときに数える
+    int tombstones = table->capacity > 0 ? countTombstones(table) : 0;
+    if (tombstones > 0 &&
+        tombstones >= TABLE_MAX_TOMBSTONES(table->capacity)) {
+      rehashInPlace(table);
+    } else {
+      adjustCapacity(table, GROW_CAPACITY(table->capacity));
+    }
   }
 
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == NULL;
-/* Hash Tables table-set < Hash Tables set-increment-count
-  if (isNewKey) table->count++;
-*/
-  if (isNewKey && IS_NIL(entry->value)) table->count++;
+  uint8_t *control = CONTROL(table);
+  int index = findFreeSlot(control, table->capacity, key->hash);
+  if (control[index] == CONTROL_EMPTY) table->count++;
+  control[index] = HASH_TAG(key->hash);
+  table->entries[index].key = key;
+  table->entries[index].value = value;
+  return true;
+}
 
-  entry->key = key;
-  entry->value = value;
-  return isNewKey;
+// removeSlot は使用中のスロットを空ける. 墓石を置いたら true を返す.
+static bool removeSlot(Table *table, int index) {
+  uint8_t *control = CONTROL(table);
+  // グループに空きがあれば, 探索がこのグループを素通りしたことはないので墓石はいらない
+  if (matchByte(&control[index / TABLE_GROUP_SIZE * TABLE_GROUP_SIZE],
+                CONTROL_EMPTY) != 0) {
+    control[index] = CONTROL_EMPTY;
+    table->count--;
+    return false;
+  }
+  control[index] = CONTROL_DELETED;
+  return true;
 }
 
 bool tableDelete(Table *table, ObjString *key) {
   if (table->count == 0) return false;
 
-  // Find the entry.
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  int index = findSlot(table, key);
+  if (index < 0) return false;
 
-  // Place a tombstone in the entry.
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  removeSlot(table, index);
   return true;
 }
 
 void tableAddAll(Table *from, Table *to) {
+  uint8_t *control = CONTROL(from);
   for (int i = 0; i < from->capacity; i++) {
-    Entry *entry = &from->entries[i];
-    if (entry->key != NULL) {
+    if (IS_FULL(control[i])) {
+      Entry *entry = &from->entries[i];
       tableSet(to, entry->key, entry->value);
     }
   }
@@ -135,42 +304,76 @@ ObjString *tableFindString(Table *table, const char *chars,
                            int length, uint32_t hash) {
   if (table->count == 0) return NULL;
 
-/* Hash Tables table-find-string < Optimization find-string-index
-  uint32_t index = hash % table->capacity;
-*/
-  uint32_t index = hash & (table->capacity - 1);
-  for (;;) {
-    Entry *entry = &table->entries[index];
-    if (entry->key == NULL) {
-      // Stop if we find an empty non-tombstone entry.
-      if (IS_NIL(entry->value)) return NULL;
-    } else if (entry->key->length == length &&
-               entry->key->hash == hash &&
-               memcmp(entry->key->chars, chars, length) == 0) {
-      // We found it.
-      return entry->key;
+  uint8_t *control = CONTROL(table);
+  uint8_t tag = HASH_TAG(hash);
+  FOR_EACH_GROUP(table->capacity, hash, group) {
+    const uint8_t *groupControl = &control[group * TABLE_GROUP_SIZE];
+    for (GroupMask match = matchByte(groupControl, tag); match != 0;
+         match &= match - 1) {
+      ObjString *key =
+          table->entries[group * TABLE_GROUP_SIZE + firstSlot(match)].key;
+      if (key->length == length && key->hash == hash &&
+          memcmp(key->chars, chars, length) == 0) {
+        return key;
+      }
     }
+    if (matchByte(groupControl, CONTROL_EMPTY) != 0) return NULL;
+  }
+}
 
-/* Hash Tables table-find-string < Optimization find-string-next
-    index = (index + 1) % table->capacity;
-*/
-    index = (index + 1) & (table->capacity - 1);
+// tableFindConcatenation は a と b を連結した文字列と等しいキーを探す.
+// tableFindString と違い, 連結した文字列を実際に作らずに比較できる.
+ObjString *tableFindConcatenation(Table *table, ObjString *a, ObjString *b,
+                                  uint32_t hash) {
+  if (table->count == 0) return NULL;
+
+  int length = a->length + b->length;
+  uint8_t *control = CONTROL(table);
+  uint8_t tag = HASH_TAG(hash);
+  FOR_EACH_GROUP(table->capacity, hash, group) {
+    const uint8_t *groupControl = &control[group * TABLE_GROUP_SIZE];
+    for (GroupMask match = matchByte(groupControl, tag); match != 0;
+         match &= match - 1) {
+      ObjString *key =
+          table->entries[group * TABLE_GROUP_SIZE + firstSlot(match)].key;
+      if (key->length == length && key->hash == hash &&
+          memcmp(key->chars, a->chars, a->length) == 0 &&
+          memcmp(key->chars + a->length, b->chars, b->length) == 0) {
+        return key;
+      }
+    }
+    if (matchByte(groupControl, CONTROL_EMPTY) != 0) return NULL;
   }
 }
 
-// 到達不可能な文字列をインターンテーブルから削除していく
+// 到達不可能な文字列をインターンテーブルから削除していく.
+// 削除で墓石が溜まったら詰め直し, 長く動くプロセスでも探索が長くならないようにする.
 void tableRemoveWhite(Table *table) {
+  uint8_t *control = CONTROL(table);
+  int tombstones = 0;
   for (int i = 0; i < table->capacity; i++) {
-    Entry *entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.isMarked) {
-      tableDelete(table, entry->key);
+    if (!IS_FULL(control[i])) {
+      if (control[i] == CONTROL_DELETED) tombstones++;
+      continue;
+    }
+    ObjString *key = table->entries[i].key;
+    // マイナーGCでは古い世代の文字列は mark されないが生きている
+    if (!key->obj.isMarked && !(vm.gcMinor && key->obj.isOld) &&
+        removeSlot(table, i)) {
+      tombstones++;
     }
   }
+
+  if (tombstones > 0 && tombstones >= TABLE_MAX_TOMBSTONES(table->capacity)) {
+    rehashInPlace(table);
+  }
 }
 
 // markTable はハッシュテーブルに格納された値に isMarked=true していく.
 void markTable(Table *table) {
+  uint8_t *control = CONTROL(table);
   for (int i = 0; i < table->capacity; i++) {
+    if (!IS_FULL(control[i])) continue;
     Entry *entry = &table->entries[i];
     markObject((Obj *) entry->key); // キーとなる文字列もオブジェクトなのでマークする.
     markValue(entry->value);
@@ -9,12 +9,19 @@ typedef struct {
   Value value;
 } Entry;
 
+// Table は Swiss table 方式のハッシュ表.
+// スロットごとの状態とハッシュ値の下位 7bit を 1 バイトの制御バイトとして entries の後ろに並べ,
+// TABLE_GROUP_SIZE 個のスロット (グループ) の制御バイトを SIMD 命令でまとめて比較する.
+// 制御バイトが使用中でないスロットの entries は不定なので, 走査は必ず制御バイトを見て行う.
+// インスタンスやクラスに埋め込まれるので, 構造体は本の版と同じ大きさに保っている.
 typedef struct {
-  int count;
-  int capacity;
-  Entry *entries;
+  int count;    // 使用中と削除済み (墓石) のスロットの数
+  int capacity; // スロットの数. 0 か 8 以上の 2 のべき乗
+  Entry *entries; // [capacity] の後ろに制御バイトが続く
 } Table;
 
+#define TABLE_GROUP_SIZE 16
+
 void initTable(Table *table);
 
 void freeTable(Table *table);
@@ -27,6 +34,9 @@ bool tableDelete(Table *table, ObjString *key);
 
 void tableAddAll(Table *from, Table *to);
 
+ObjString *tableFindConcatenation(Table *table, ObjString *a, ObjString *b,
+                                  uint32_t hash);
+
 ObjString *tableFindString(Table *table, const char *chars,
                            int length, uint32_t hash);
 
@@ -1,9 +1,12 @@
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "object.h"
 #include "memory.h"
+#include "output.h"
 #include "value.h"
+#include "vm.h"
 
 
 void initValueArray(ValueArray *array) {
@@ -32,14 +35,98 @@ void freeValueArray(ValueArray *array) {
 }
 
 
+static const double powersOfTen[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+};
+
+// writeDigits は 0 以上の integer を 10 進数で buffer に書き, その長さを返す.
+static int writeDigits(uint32_t integer, char *buffer) {
+  char digits[10];
+  int count = 0;
+  do {
+    digits[count++] = (char) ('0' + integer % 10);
+    integer /= 10;
+  } while (integer != 0);
+  for (int i = 0; i < count; i++) buffer[i] = digits[count - 1 - i];
+  return count;
+}
+
+// "%g" は有効数字 6 桁に丸めた指数 X が -4 <= X < 6 なら小数で, それ以外なら指数表記で書き,
+// 小数部の末尾の 0 を取り除く. 小数で書く範囲は snprintf() を呼ばずにここで書く.
+// 10^k 倍した値の誤差は丸めの境目の判定に比べて十分小さいので, ちょうど境目に近いとき以外は
+// snprintf() と同じ結果になる. 境目に近いときと指数表記, 無限大と NaN は snprintf() に任せる.
+int formatNumber(double number, char *buffer) {
+  double magnitude = fabs(number);
+  int length = 0;
+
+  // 整数が最も多いので先に扱う. -0 も "%g" と同じく "-0" になる.
+  if (magnitude < 1e6 && magnitude == (double) (uint32_t) magnitude) {
+    if (signbit(number)) buffer[length++] = '-';
+    return length + writeDigits((uint32_t) magnitude, buffer + length);
+  }
+
+  if (magnitude >= 1e-4 && magnitude < 1e6) {
+    // 有効数字 6 桁の整数 digits と指数 exponent を求める. magnitude = digits * 10^(exponent - 5)
+    // 1 未満では 10^-k が double で正確に表せないので, 桁が足りなければ指数を一つずつ下げる.
+    int exponent = 5;
+    while (exponent > 0 && magnitude < powersOfTen[exponent]) exponent--;
+    if (magnitude < 1) exponent = -1;
+    for (;;) {
+      double scaled = magnitude * powersOfTen[5 - exponent];
+      double whole = (double) (uint32_t) scaled; // scaled < 10^6
+      double fraction = scaled - whole;
+      if (whole < 100000) {
+        if (exponent == -4) break; // 指数表記になる
+        exponent--;
+        continue;
+      }
+      if (fabs(fraction - 0.5) < 1e-6) break;
+
+      uint32_t digits = (uint32_t) whole + (fraction > 0.5 ? 1 : 0);
+      // 丸めで桁が上がったとき (999999.5 など). まれなので snprintf() に任せる.
+      if (digits >= 1000000) break;
+
+      char text[6];
+      writeDigits(digits, text);
+      if (number < 0) buffer[length++] = '-';
+      int point; // 小数点より前に書く桁数
+      if (exponent >= 0) {
+        point = exponent + 1;
+        memcpy(buffer + length, text, (size_t) point);
+        length += point;
+      } else {
+        point = 0;
+        buffer[length++] = '0';
+      }
+      int last = 5; // 末尾の 0 を除いた最後の桁
+      while (last >= point && text[last] == '0') last--;
+      if (last >= point) {
+        buffer[length++] = '.';
+        for (int i = exponent; i < -1; i++) buffer[length++] = '0';
+        int count = last - point + 1;
+        memcpy(buffer + length, text + point, (size_t) count);
+        length += count;
+      }
+      return length;
+    }
+  }
+
+  return snprintf(buffer, NUMBER_BUFFER_SIZE, "%g", number);
+}
+
+static void printNumber(double number) {
+  char buffer[NUMBER_BUFFER_SIZE];
+  writeOutput(buffer, (size_t) formatNumber(number, buffer));
+}
+
 void printValue(Value value) {
 #ifdef NAN_BOXING
   if (IS_BOOL(value)) {
-    printf(AS_BOOL(value) ? "true" : "false");
+    writeOutputString(AS_BOOL(value) ? "true" : "false");
   } else if (IS_NIL(value)) {
-    printf("nil");
+    writeOutputString("nil");
   } else if (IS_NUMBER(value)) {
-    printf("%g", AS_NUMBER(value));
+    printNumber(AS_NUMBER(value));
   } else if (IS_OBJ(value)) {
     printObject(value);
   }
@@ -52,11 +139,12 @@ void printValue(Value value) {
    */
     switch (value.type) {
       case VAL_BOOL:
-        printf(AS_BOOL(value) ? "true" : "false");
+        writeOutputString(AS_BOOL(value) ? "true" : "false");
         break;
-      case VAL_NIL: printf("nil"); break;
-      case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
+      case VAL_NIL: writeOutputString("nil"); break;
+      case VAL_NUMBER: printNumber(AS_NUMBER(value)); break;
       case VAL_OBJ: printObject(value); break;
+      case VAL_UNDEFINED: writeOutputString("undefined"); break;
     }
 #endif
 }
@@ -72,6 +160,7 @@ bool valuesEqual(Value a, Value b) {
   switch (a.type) {
     case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL:    return true;
+    case VAL_UNDEFINED: return true;
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
 /* Strings strings-equal < Hash Tables equal
     case VAL_OBJ: {
@@ -7,6 +7,8 @@
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct ObjClass ObjClass;
+typedef struct ObjShape ObjShape;
 
 #ifdef NAN_BOXING
 
@@ -16,11 +18,13 @@ typedef struct ObjString ObjString;
 #define TAG_NIL   1 // 01.
 #define TAG_FALSE 2 // 10.
 #define TAG_TRUE  3 // 11.
+#define TAG_UNDEFINED 4 // 100. 言語からは見えない, 未定義のグローバル変数スロットの印.
 
 typedef uint64_t Value;
 
 #define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value)       ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 #define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
 #define IS_OBJ(value) \
     (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
@@ -34,6 +38,7 @@ typedef uint64_t Value;
 #define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL         ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL   ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define NUMBER_VAL(num) numToValue(num)
 #define OBJ_VAL(obj) \
     (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
@@ -56,7 +61,8 @@ typedef enum {
   VAL_BOOL,
   VAL_NIL, // [user-types]
   VAL_NUMBER,
-  VAL_OBJ
+  VAL_OBJ,
+  VAL_UNDEFINED // 言語からは見えない, 未定義のグローバル変数スロットの印
 } ValueType;
 
 /* Chunks of Bytecode value-h < Types of Values value
@@ -75,6 +81,7 @@ typedef struct {
 #define IS_NIL(value)     ((value).type == VAL_NIL)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_OBJ(value)     ((value).as.obj)
 #define AS_BOOL(value)    ((value).as.boolean)
@@ -84,6 +91,7 @@ typedef struct {
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+#define UNDEFINED_VAL     ((Value){VAL_UNDEFINED, {.number = 0}})
 
 #endif
 
@@ -102,6 +110,14 @@ void writeValueArray(ValueArray *array, Value value);
 
 void freeValueArray(ValueArray *array);
 
+// printValue は value を print 文の出力 (output.h) に書く.
 void printValue(Value value);
 
+// formatNumber に渡す buffer の大きさ. "%g" で書ける最も長い数が入る.
+#define NUMBER_BUFFER_SIZE 32
+
+// formatNumber は number を printf() の "%g" と同じ文字列にして buffer に書き, その長さを返す.
+// '\0' 終端はしない.
+int formatNumber(double number, char *buffer);
+
 #endif
@@ -1,67 +1,336 @@
+// clock_gettime() の宣言のため. -std=c99 では POSIX の宣言が隠れてしまう.
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
+#include "lox.h"
 #include "object.h"
 #include "memory.h"
+#include "profile.h"
+#include "regcode.h"
 #include "vm.h"
 
-VM vm; // VMはグローバル変数. clox の実行はこのグローバル変数のVMが行う.
-static Value clockNative(int argCount, Value *args) {
-  return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
+// VMはスレッドごとのグローバル変数. clox の実行はこのスレッドのVMが行う.
+// 別のスレッドでは別のVMが, 独立したヒープ, GC, 文字列表で動く.
+THREAD_LOCAL VM vm;
+
+// run() と runRegister() が, 実行を続ける CallFrame が別の層のものになったときに返す.
+// execute() がその層のループを呼び直す. interpret() の呼び出し元には返らない.
+#define INTERPRET_SWITCH_TIER ((InterpretResult) (INTERPRET_RUNTIME_ERROR + 1))
+
+// 実行時エラーのスタックトレースに表示する, 最も内側と最も外側のフレームの数.
+#define TRACE_FRAMES 16
+
+// clockNative はこのスレッドが使った CPU 時間を返す.
+// clock() はプロセス全体の CPU 時間なので, --jobs で並列に動く他の VM の分まで数えてしまう.
+static bool clockNative(int argCount, Value *args, Value *result,
+                        void *userdata) {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  struct timespec now;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) == 0) {
+    *result = NUMBER_VAL((double) now.tv_sec + (double) now.tv_nsec / 1e9);
+    return true;
+  }
+#endif
+  *result = NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
+  return true;
+}
+
+// fiberNative は関数を実行するファイバーを作る. 関数は resume に渡された値を受け取る引数を一つだけ持ってよい.
+static bool fiberNative(int argCount, Value *args, Value *result,
+                        void *userdata) {
+  if (argCount != 1 || !IS_CLOSURE(args[0])) {
+    return nativeError("Expected a function.");
+  }
+  if (AS_CLOSURE(args[0])->function->arity > 1) {
+    return nativeError("A fiber function takes at most 1 argument.");
+  }
+  *result = OBJ_VAL(newFiber(AS_CLOSURE(args[0])));
+  return true;
+}
+
+// resumeNative は resume(fiber, value) で fiber を次の yield か終了まで実行し, yield した値か戻り値を返す.
+static bool resumeNative(int argCount, Value *args, Value *result,
+                         void *userdata) {
+  if (argCount < 1 || argCount > 2 || !IS_FIBER(args[0])) {
+    return nativeError("Expected a fiber and an optional value.");
+  }
+  return resumeFiber(AS_FIBER(args[0]), argCount == 2 ? args[1] : NIL_VAL,
+                     result) == INTERPRET_OK;
+}
+
+// yieldNative は yield(value) で実行中のファイバーを止める. 次の resume に渡された値を返す.
+static bool yieldNative(int argCount, Value *args, Value *result,
+                        void *userdata) {
+  if (argCount > 1) return nativeError("Expected at most 1 argument.");
+  return yieldFiber(argCount == 1 ? args[0] : NIL_VAL);
+}
+
+static bool fiberDoneNative(int argCount, Value *args, Value *result,
+                            void *userdata) {
+  if (argCount != 1 || !IS_FIBER(args[0])) {
+    return nativeError("Expected a fiber.");
+  }
+  *result = BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+  return true;
+}
+
+// リストの要素数の上限. ValueArray の容量を倍にしても int に収まるように.
+#define LIST_MAX_LENGTH (1 << 28)
+
+static bool appendNative(int argCount, Value *args, Value *result,
+                         void *userdata) {
+  if (argCount != 2 || !IS_LIST(args[0])) {
+    return nativeError("Expected a list and a value.");
+  }
+  if (AS_LIST(args[0])->items.count >= LIST_MAX_LENGTH) {
+    return nativeError("List is too long.");
+  }
+  listAppend(AS_LIST(args[0]), args[1]);
+  return true;
+}
+
+// popNative は pop(list) で末尾の要素を取り除いて返す.
+static bool popNative(int argCount, Value *args, Value *result,
+                      void *userdata) {
+  if (argCount != 1 || !IS_LIST(args[0])) {
+    return nativeError("Expected a list.");
+  }
+  ObjList *list = AS_LIST(args[0]);
+  if (list->items.count == 0) return nativeError("Can't pop from an empty list.");
+  *result = list->items.values[--list->items.count];
+  if (!IS_NUMBER(*result)) list->nonNumbers--;
+  return true;
+}
+
+static bool lengthNative(int argCount, Value *args, Value *result,
+                         void *userdata) {
+  if (argCount != 1 || !IS_LIST(args[0])) {
+    return nativeError("Expected a list.");
+  }
+  *result = NUMBER_VAL(AS_LIST(args[0])->items.count);
+  return true;
+}
+
+// makeListNative は makeList(length, value) で value を length 個並べたリストを作る.
+static bool makeListNative(int argCount, Value *args, Value *result,
+                           void *userdata) {
+  if (argCount != 2 || !IS_NUMBER(args[0])) {
+    return nativeError("Expected a length and a value.");
+  }
+  double number = AS_NUMBER(args[0]);
+  if (!(number >= 0 && number <= LIST_MAX_LENGTH) ||
+      number != (int) number) {
+    return nativeError("List length must be a non-negative integer.");
+  }
+
+  // 配列を先に埋めてからリストに渡す. 数値なら double の配列を埋めるだけのループになる.
+  int length = (int) number;
+  Value value = args[1];
+  Value *items = length == 0 ? NULL : ALLOCATE(Value, length);
+  for (int i = 0; i < length; i++) items[i] = value;
+  ObjList *list = newList(NULL, 0);
+  list->items.values = items;
+  list->items.capacity = length;
+  list->items.count = length;
+  list->nonNumbers = IS_NUMBER(value) ? 0 : length;
+  *result = OBJ_VAL(list);
+  return true;
+}
+
+// extendNative は extend(list, other) で other の要素をすべて list の末尾に追加する.
+static bool extendNative(int argCount, Value *args, Value *result,
+                         void *userdata) {
+  if (argCount != 2 || !IS_LIST(args[0]) || !IS_LIST(args[1])) {
+    return nativeError("Expected two lists.");
+  }
+  ObjList *list = AS_LIST(args[0]);
+  ObjList *other = AS_LIST(args[1]);
+  int count = other->items.count; // extend(a, a) でも伸ばす前の要素数だけ追加する
+  int nonNumbers = other->nonNumbers;
+  if (count > LIST_MAX_LENGTH - list->items.count) {
+    return nativeError("List is too long.");
+  }
+
+  ValueArray *items = &list->items;
+  if (items->count + count > items->capacity) {
+    int oldCapacity = items->capacity;
+    int capacity = GROW_CAPACITY(oldCapacity);
+    if (capacity < items->count + count) capacity = items->count + count;
+    items->values = GROW_ARRAY(Value, items->values, oldCapacity, capacity);
+    items->capacity = capacity;
+  }
+  memcpy(items->values + items->count, other->items.values,
+         sizeof(Value) * (size_t) count);
+  items->count += count;
+  list->nonNumbers += nonNumbers;
+  if (nonNumbers > 0) writeBarrier((Obj *) list);
+  return true;
+}
+
+// sumNative は sum(list) で数値のリストの要素の和を返す.
+// 要素は先頭から順に足すので, 結果は Lox のループで足したときと同じになる.
+static bool sumNative(int argCount, Value *args, Value *result,
+                      void *userdata) {
+  if (argCount != 1 || !IS_LIST(args[0])) {
+    return nativeError("Expected a list.");
+  }
+  ObjList *list = AS_LIST(args[0]);
+  if (list->nonNumbers > 0) return nativeError("Expected a list of numbers.");
+
+  // 数値だけのリストなので要素ごとの型検査はいらない
+  Value *values = list->items.values;
+  double total = 0;
+  for (int i = 0; i < list->items.count; i++) total += AS_NUMBER(values[i]);
+  *result = NUMBER_VAL(total);
+  return true;
 }
 
 // resetStack はグローバル変数vmのスタックを初期化する
 static void resetStack() {
   vm.stackTop = vm.stack; // スタックポインタを先頭に.
   vm.frameCount = 0;      // VM起動時は CallFrame は 0 である.
+  for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    vm.openSlots[upvalue->location - vm.stack] = NULL;
+  }
   vm.openUpvalues = NULL;
 }
 
-static void runtimeError(const char *format, ...) {
-  va_list args;
-  va_start(args, format);
-  vfprintf(stderr, format, args);
-  va_end(args);
-  fputs("\n", stderr);
+// frameLine は frame が実行中の命令(呼び出し元のフレームでは呼び出し命令)の行番号を返す.
+int frameLine(CallFrame *frame) {
+  ObjFunction *function = frame->closure->function;
+  int instruction;
+  if (function->registers != NULL) {
+    // レジスタ層の命令は翻訳元のスタック層の命令の行番号を使う
+    RegisterCode *code = function->registers;
+    instruction = code->origins[frame->pc - code->code - 1];
+  } else {
+    instruction = (int) (frame->ip - function->chunk.code - 1);
+  }
+  return getLine(&function->chunk, instruction);
+}
 
+// abortFiber は実行中のファイバーのスタックトレースを書き, スタックを空にする.
+static void abortFiber() {
 /*
   CallFrame* frame = &vm.frames[vm.frameCount - 1]; // CallFrameスタックの先頭を取得
   size_t instruction = frame->ip - frame->function->chunk.code - 1;
   int line = frame->function->chunk.lines[instruction];
 */
   // CallStackを呼び出し元まで辿ってエラーメッセージを有用なものにする.
+  // 深い再帰では内側と外側の TRACE_FRAMES 個ずつだけを表示する.
   for (int i = vm.frameCount - 1; i >= 0; i--) {
+    if (vm.frameCount > 2 * TRACE_FRAMES && i == vm.frameCount - 1 - TRACE_FRAMES) {
+      fprintf(vm.err, "... %d more frames\n", vm.frameCount - 2 * TRACE_FRAMES);
+      i = TRACE_FRAMES;
+      continue;
+    }
     CallFrame *frame = &vm.frames[i];
     ObjFunction *function = frame->closure->function;
-    size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ", // [minus]
-            function->chunk.lines[instruction]);
+    fprintf(vm.err, "[line %d] in ", frameLine(frame)); // [minus]
     if (function->name == NULL) {
-      fprintf(stderr, "script\n");
+      fprintf(vm.err, "script\n");
     } else {
-      fprintf(stderr, "%s()\n", function->name->chars);
+      fprintf(vm.err, "%s()\n", function->name->chars);
     }
   }
 
   resetStack();
+  vm.baseFrame = 0;
+}
+
+// reportError はエラーメッセージとスタックトレースを書き, スタックを空にする.
+// ネイティブ関数の中から callFunction() で入れ子に実行していても, 外側の実行ごとすべて打ち切る.
+// 別のファイバーから resume されていれば, resumeFiber() がそのファイバーのトレースを続けて書く.
+static void reportError(const char *format, va_list args) {
+  flushOutput(); // エラーより前の print の出力を先に出す
+  vfprintf(vm.err, format, args);
+  fputs("\n", vm.err);
+  abortFiber();
 }
 
-static void defineNative(const char *name, NativeFn function) {
+static void runtimeError(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  reportError(format, args);
+  va_end(args);
+}
+
+bool nativeError(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  reportError(format, args);
+  va_end(args);
+  return false;
+}
+
+void defineGlobal(const char *name, Value value) {
+  push(value);
   push(OBJ_VAL(copyString(name, (int) strlen(name))));
-  push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  int slot = globalSlot(AS_STRING(vm.stackTop[-1]));
+  vm.globalValues.values[slot] = vm.stackTop[-2];
   pop();
   pop();
 }
 
+bool getGlobal(const char *name, Value *value) {
+  Value slot;
+  if (!tableGet(&vm.globals, copyString(name, (int) strlen(name)), &slot)) {
+    return false;
+  }
+  *value = vm.globalValues.values[(int) AS_NUMBER(slot)];
+  return !IS_UNDEFINED(*value);
+}
+
+void defineNative(const char *name, NativeFn function, void *userdata) {
+  defineGlobal(name, OBJ_VAL(newNative(function, userdata)));
+}
+
+// globalSlot はグローバル変数 name のスロット番号を返す.
+// まだスロットがなければ未定義の状態で新しく割り当てる.
+// スロット番号は VM が生きている間変わらないので, REPL の行をまたいでも同じ番号になる.
+int globalSlot(ObjString *name) {
+  Value slot;
+  if (tableGet(&vm.globals, name, &slot)) {
+    return (int) AS_NUMBER(slot);
+  }
+
+  // 配列の拡張でGCが走っても name が回収されないようにスタックに置いておく
+  push(OBJ_VAL(name));
+  int index = vm.globalValues.count;
+  writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+  writeValueArray(&vm.globalNames, OBJ_VAL(name));
+  tableSet(&vm.globals, name, NUMBER_VAL((double) index));
+  pop();
+  return index;
+}
+
 // グローバル変数vmを初期化し, 実行の準備を行う
 void initVM() {
+  // 以降の確保はすべてプールを経由しうるので最初に初期化する
+  initPool(&vm.pool);
+  vm.out = stdout;
+  vm.err = stderr;
+  initOutput(&vm.output);
+  // スタックはGCの根なので, 伸ばすときにGCが走ってしまわないよう grayStack と同じく reallocate を経由しない
+  vm.frameCapacity = FRAMES_INITIAL;
+  vm.frames = (CallFrame *) malloc(sizeof(CallFrame) * vm.frameCapacity);
+  vm.stack = (Value *) malloc(sizeof(Value) * STACK_INITIAL);
+  vm.openSlots = (ObjUpvalue **) calloc(STACK_INITIAL, sizeof(ObjUpvalue *));
+  if (vm.frames == NULL || vm.stack == NULL || vm.openSlots == NULL) exit(1);
+  vm.stackEnd = vm.stack + STACK_INITIAL;
+  vm.openUpvalues = NULL;
   resetStack();
+  vm.baseFrame = 0;
   vm.objects = NULL;
   vm.bytesAllocated = 0;
   vm.nextGC = 1024 * 1024;
@@ -70,20 +339,60 @@ void initVM() {
   vm.grayCapacity = 0;
   vm.grayStack = NULL;
 
+  vm.gcMinor = false;
+  memset(&vm.stats, 0, sizeof(vm.stats));
+  memset(vm.quickenStats, 0, sizeof(vm.quickenStats));
+  vm.youngObjects = NULL;
+  vm.allocatedSinceGC = 0;
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+  vm.remembered = NULL;
+
+  vm.gcPhase = GC_IDLE;
+  vm.sweepPrevious = NULL;
+  vm.sweepCursor = NULL;
+
+  vm.fiber = NULL;
+  vm.parked = NULL;
+
   initTable(&vm.globals);
+  initValueArray(&vm.globalValues);
+  initValueArray(&vm.globalNames);
   initTable(&vm.strings);
 
   vm.initString = NULL;
   vm.initString = copyString("init", 4);
 
-  defineNative("clock", clockNative);
+  vm.fiber = newFiber(NULL);
+
+  defineNative("clock", clockNative, NULL);
+  defineNative("fiber", fiberNative, NULL);
+  defineNative("resume", resumeNative, NULL);
+  defineNative("yield", yieldNative, NULL);
+  defineNative("fiberDone", fiberDoneNative, NULL);
+  defineNative("append", appendNative, NULL);
+  defineNative("pop", popNative, NULL);
+  defineNative("length", lengthNative, NULL);
+  defineNative("makeList", makeListNative, NULL);
+  defineNative("extend", extendNative, NULL);
+  defineNative("sum", sumNative, NULL);
 }
 
 void freeVM() {
   freeTable(&vm.globals);
+  freeValueArray(&vm.globalValues);
+  freeValueArray(&vm.globalNames);
   freeTable(&vm.strings);
   vm.initString = NULL;
+  vm.fiber = NULL;
+  vm.parked = NULL;
+  if (vm.gcStats) printGCStats(vm.err);
   freeObjects();
+  freePool(&vm.pool);
+  free(vm.frames);
+  free(vm.stack);
+  free(vm.openSlots);
+  freeOutput(&vm.output);
 }
 
 // push はグローバル変数vmのスタックに引数の値をpushし, スタックポインタを一つ進める.
@@ -105,32 +414,97 @@ static Value peek(int distance) {
   return vm.stackTop[-1 - distance];
 }
 
+// growFrames は CallFrame の配列を倍に伸ばす. 上限に達していれば偽を返す.
+static bool growFrames() {
+  if (vm.frameCapacity >= FRAMES_MAX) return false;
+  vm.frameCapacity *= 2;
+  vm.frames = (CallFrame *) realloc(vm.frames,
+                                    sizeof(CallFrame) * vm.frameCapacity);
+  if (vm.frames == NULL) exit(1);
+  return true;
+}
+
+// growStack は値のスタックを needed 個の値が置けるまで伸ばす. 上限を超えるなら偽を返す.
+// スタックを指すポインタ (各 CallFrame の slots, open な upvalue, スタックトップ) は新しい領域に付け替える.
+// openSlots はスロット番号で引くので, 中身はそのまま伸ばすだけでよい.
+static bool growStack(size_t needed) {
+  if (needed > STACK_MAX) return false;
+  size_t capacity = (size_t) (vm.stackEnd - vm.stack);
+  while (capacity < needed) capacity *= 2;
+  if (capacity > STACK_MAX) capacity = STACK_MAX;
+
+  size_t oldCapacity = (size_t) (vm.stackEnd - vm.stack);
+  Value *stack = (Value *) malloc(sizeof(Value) * capacity);
+  vm.openSlots = (ObjUpvalue **) realloc(vm.openSlots,
+                                         sizeof(ObjUpvalue *) * capacity);
+  if (stack == NULL || vm.openSlots == NULL) exit(1);
+  memset(vm.openSlots + oldCapacity, 0,
+         sizeof(ObjUpvalue *) * (capacity - oldCapacity));
+  memcpy(stack, vm.stack, sizeof(Value) * (vm.stackTop - vm.stack));
+
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+  }
+  for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = stack + (upvalue->location - vm.stack);
+  }
+  vm.stackTop = stack + (vm.stackTop - vm.stack);
+
+  free(vm.stack);
+  vm.stack = stack;
+  vm.stackEnd = stack + capacity;
+  return true;
+}
+
+// reserveFrame は呼び出し先のフレームのために, スタックトップの argCount 個の引数と関数の下から
+// frameSize 個の値と CallFrame を一つ置けるようにする. 足りなければ伸ばし, 上限を超えるなら偽を返す.
+static FORCE_INLINE bool reserveFrame(int argCount, int frameSize) {
+  Value *slots = vm.stackTop - argCount - 1;
+  if (slots + frameSize > vm.stackEnd &&
+      !growStack((size_t) (slots - vm.stack) + frameSize)) {
+    return false;
+  }
+  if (vm.frameCount == vm.frameCapacity && !growFrames()) return false;
+  return true;
+}
+
+// frameSizeOf は function の CallFrame がスタックを使う大きさを返す.
+static inline int frameSizeOf(ObjFunction *function) {
+  return function->registers == NULL ? function->maxStack
+                                     : function->registers->frameSize;
+}
+
 // クロージャ(関数)へのポインタと引数の数が渡される
-static bool call(ObjClosure *closure, int argCount) {
+static FORCE_INLINE bool call(ObjClosure *closure, int argCount) {
   if (argCount != closure->function->arity) { // 引数の数チェック
     runtimeError("Expected %d arguments but got %d.",
                  closure->function->arity, argCount);
     return false;
   }
 
-  if (vm.frameCount == FRAMES_MAX) {
+  // ローカル変数は 256 個を超えられるので, フレームの数だけでなくスタックの残りも確かめる.
+  ObjFunction *function = closure->function;
+  if (!reserveFrame(argCount, frameSizeOf(function))) {
     runtimeError("Stack overflow.");
     return false;
   }
 
+  Value *slots = vm.stackTop - argCount - 1;
   CallFrame *frame = &vm.frames[vm.frameCount++];
   // 呼び出されたクロージャ(関数)オブジェクトでスタックトップの CallFrame を更新する
   frame->closure = closure;
-  frame->ip = closure->function->chunk.code;
+  frame->ip = function->chunk.code;
+  if (function->registers != NULL) frame->pc = function->registers->code;
   // スタックトップから (引数の数 + 1(関数オブジェクトの分)) したアドレスを CallFrame の先頭に設定する.
   // そうすると CallFrame の先頭は関数オブジェクトが slots[0] で参照できる.
   // よって引数は slots[1] から始まる.
-  frame->slots = vm.stackTop - argCount - 1;
+  frame->slots = slots;
   return true;
 }
 
-// callValue は値に対して`()`演算子が呼ばれたときの処理を行う.
-static bool callValue(Value callee, int argCount) {
+// callObject は callValue の遅い経路で, 呼び出される値の型ごとに振り分ける.
+static bool callObject(Value callee, int argCount) {
   if (IS_OBJ(callee)) {
     switch (OBJ_TYPE(callee)) {
       case OBJ_BOUND_METHOD: {
@@ -157,9 +531,18 @@ static bool callValue(Value callee, int argCount) {
         return call(AS_CLOSURE(callee), argCount);
       // Cネイティブ実装関数の処理
       case OBJ_NATIVE: {
-        NativeFn native = AS_NATIVE(callee);
-        // C言語実装なのでスタックなどを経由せず直接実行する
-        Value result = native(argCount, vm.stackTop - argCount);
+        ObjNative *native = AS_NATIVE(callee);
+        // C言語実装なのでスタックなどを経由せず直接実行する. 引数はスタック上のものをそのまま渡す.
+        Value result = NIL_VAL;
+        int frameCount = vm.frameCount;
+        // 入れ子の callFunction() が失敗していればスタックはもう空なので, 戻り値に関わらず打ち切る
+        if (!native->function(argCount, vm.stackTop - argCount, &result,
+                              native->userdata) ||
+            vm.frameCount != frameCount) {
+          // yield したファイバーは, 次の resume で渡された値をこの呼び出しの結果として受け取る
+          if (vm.fiber->state == FIBER_SUSPENDED) vm.stackTop -= argCount + 1;
+          return false;
+        }
         // ネイティブ関数のために積まれたスタックを破棄
         vm.stackTop -= argCount + 1;
         push(result); // 結果をPUSH
@@ -173,6 +556,13 @@ static bool callValue(Value callee, int argCount) {
   return false;
 }
 
+// callValue は値に対して`()`演算子が呼ばれたときの処理を行う.
+// 呼び出しのほとんどはクロージャなので, 型の switch を通さずに call() へ進む.
+static FORCE_INLINE bool callValue(Value callee, int argCount) {
+  if (IS_CLOSURE(callee)) return call(AS_CLOSURE(callee), argCount);
+  return callObject(callee, argCount);
+}
+
 static bool invokeFromClass(ObjClass *klass, ObjString *name,
                             int argCount) {
   Value method;
@@ -183,7 +573,73 @@ static bool invokeFromClass(ObjClass *klass, ObjString *name,
   return call(AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString *name, int argCount) {
+// currentFunction は実行中の関数を返す. インラインキャッシュはこの関数の Chunk に属している.
+static inline ObjFunction *currentFunction() {
+  return vm.frames[vm.frameCount - 1].closure->function;
+}
+
+// cacheFind は cache から shape のエントリを探す. なければ NULL を返す.
+// 未使用のエントリの shape は NULL なので, 辞書モードのインスタンス(shape == NULL)はいつも外れる.
+static inline InlineCacheEntry *cacheFind(InlineCache *cache,
+                                          ObjShape *shape) {
+  for (int i = 0; i < INLINE_CACHE_SIZE; i++) {
+    InlineCacheEntry *entry = &cache->entries[i];
+    if (entry->shape == NULL) break;
+    if (entry->shape == shape) return entry;
+  }
+  return NULL;
+}
+
+// isMonomorphic は cache がちょうど一つのシェイプを覚えていれば真を返す.
+// そうなった命令は quickening で先頭のエントリだけを見る命令に書き換える.
+static inline bool isMonomorphic(InlineCache *cache) {
+  return cache->entries[0].shape != NULL &&
+         (INLINE_CACHE_SIZE == 1 || cache->entries[1].shape == NULL);
+}
+
+// cacheAdd は cache の空きエントリを返す.
+// 満杯(megamorphic)なら NULL を返すので, 呼び出し側は諦めて毎回探索すること.
+static InlineCacheEntry *cacheAdd(InlineCache *cache) {
+  for (int i = 0; i < INLINE_CACHE_SIZE; i++) {
+    if (cache->entries[i].shape == NULL) return &cache->entries[i];
+  }
+  return NULL;
+}
+
+// findProperty はシェイプを持つ instance のプロパティ name を探す.
+// フィールドなら slot にスロット番号を, メソッドなら slot に -1 を, method にメソッドを格納する.
+// まず命令ごとのインラインキャッシュをシェイプで引き, 外れたら探索した結果をキャッシュに追加する.
+// クラスのメソッドはクラス宣言の実行中(OP_INHERIT と OP_METHOD)にしか変化せず,
+// その間にユーザーのコードが走ることはないので, キャッシュの無効化は不要.
+static FORCE_INLINE bool findProperty(ObjInstance *instance,
+                                      ObjString *name, InlineCache *cache,
+                                      int *slot, Value *method) {
+  InlineCacheEntry *entry = cacheFind(cache, instance->shape);
+  if (entry != NULL) {
+    *slot = entry->slot;
+    *method = entry->method;
+    return true;
+  }
+
+  *slot = shapeFindSlot(instance->shape, name);
+  *method = NIL_VAL;
+  if (*slot < 0 && !tableGet(&instance->klass->methods, name, method)) {
+    return false;
+  }
+
+  entry = cacheAdd(cache);
+  if (entry != NULL) {
+    entry->shape = instance->shape;
+    entry->transition = NULL;
+    entry->slot = *slot;
+    entry->method = *method;
+    writeBarrier((Obj *) currentFunction());
+  }
+  return true;
+}
+
+static FORCE_INLINE bool invoke(ObjString *name, int argCount,
+                                InlineCache *cache) {
   Value receiver = peek(argCount);
 
   if (!IS_INSTANCE(receiver)) {
@@ -193,49 +649,170 @@ static bool invoke(ObjString *name, int argCount) {
 
   ObjInstance *instance = AS_INSTANCE(receiver);
 
-  Value value;
-  if (tableGet(&instance->fields, name, &value)) {
+  if (instance->shape == NULL) {
+    Value value;
+    if (instanceGetField(instance, name, &value)) {
+      vm.stackTop[-argCount - 1] = value;
+      return callValue(value, argCount);
+    }
+    return invokeFromClass(instance->klass, name, argCount);
+  }
+
+  int slot;
+  Value method;
+  if (!findProperty(instance, name, cache, &slot, &method)) {
+    runtimeError("Undefined property '%s'.", name->chars);
+    return false;
+  }
+
+  if (slot >= 0) {
+    // フィールドに格納された関数の呼び出し
+    Value value = instance->fields[slot];
     vm.stackTop[-argCount - 1] = value;
     return callValue(value, argCount);
   }
+  return call(AS_CLOSURE(method), argCount);
+}
 
-  return invokeFromClass(instance->klass, name, argCount);
+// bindClosure は *receiver のレシーバを method に束縛したメソッドで置き換える.
+// receiver はGCから見えるスタック上の位置を指していること.
+static void bindClosure(ObjClosure *method, Value *receiver) {
+  ObjBoundMethod *bound = newBoundMethod(*receiver, method);
+  *receiver = OBJ_VAL(bound);
 }
 
-static bool bindMethod(ObjClass *klass, ObjString *name) {
+static bool bindMethod(ObjClass *klass, ObjString *name, Value *receiver) {
   Value method;
   if (!tableGet(&klass->methods, name, &method)) {
     runtimeError("Undefined property '%s'.", name->chars);
     return false;
   }
 
-  ObjBoundMethod *bound = newBoundMethod(peek(0),
-                                         AS_CLOSURE(method));
-  pop();
-  push(OBJ_VAL(bound));
+  bindClosure(AS_CLOSURE(method), receiver);
   return true;
 }
 
+// listIndex は list[index] の list と index を確かめて, 要素の位置を返す.
+// 不正なら実行時エラーを報告して -1 を返す.
+static FORCE_INLINE int listIndex(Value list, Value index) {
+  if (!IS_LIST(list)) {
+    runtimeError("Can only index lists.");
+    return -1;
+  }
+  if (!IS_NUMBER(index)) {
+    runtimeError("List index must be a number.");
+    return -1;
+  }
+  double number = AS_NUMBER(index);
+  if (!(number >= 0 && number < AS_LIST(list)->items.count)) {
+    runtimeError("List index out of range.");
+    return -1;
+  }
+  int slot = (int) number;
+  if (slot != number) {
+    runtimeError("List index must be an integer.");
+    return -1;
+  }
+  return slot;
+}
+
+// getProperty は *receiver のインスタンスをそのプロパティ name の値で置き換える.
+static bool getProperty(ObjInstance *instance, ObjString *name,
+                        InlineCache *cache, Value *receiver) {
+  if (instance->shape == NULL) {
+    Value value;
+    if (instanceGetField(instance, name, &value)) {
+      *receiver = value;
+      return true;
+    }
+    return bindMethod(instance->klass, name, receiver);
+  }
+
+  int slot;
+  Value method;
+  if (!findProperty(instance, name, cache, &slot, &method)) {
+    runtimeError("Undefined property '%s'.", name->chars);
+    return false;
+  }
+
+  if (slot >= 0) {
+    *receiver = instance->fields[slot];
+  } else {
+    bindClosure(AS_CLOSURE(method), receiver);
+  }
+  return true;
+}
+
+// setProperty はインスタンスのフィールド name に value を設定する.
+// フィールドの追加によるシェイプの遷移もインラインキャッシュに覚えておく.
+static void setProperty(ObjInstance *instance, ObjString *name,
+                        InlineCache *cache, Value value) {
+  ObjShape *shape = instance->shape;
+  if (shape == NULL) {
+    instanceSetField(instance, name, value);
+    return;
+  }
+
+  InlineCacheEntry *entry = cacheFind(cache, shape);
+  if (entry != NULL) {
+    if (entry->transition != NULL) {
+      instanceAddField(instance, entry->transition, value);
+    } else {
+      instance->fields[entry->slot] = value;
+      writeBarrierValue((Obj *) instance, value);
+    }
+    return;
+  }
+
+  int slot = shapeFindSlot(shape, name);
+  ObjShape *transition = NULL;
+  if (slot < 0) {
+    transition = shapeTransition(shape, name);
+    if (transition == NULL) {
+      // フィールド数の上限を超えたので辞書モードに切り替わる. キャッシュはしない.
+      instanceSetField(instance, name, value);
+      return;
+    }
+    slot = transition->slotCount - 1;
+  }
+
+  entry = cacheAdd(cache);
+  if (entry != NULL) {
+    entry->shape = shape;
+    entry->transition = transition;
+    entry->slot = slot;
+    entry->method = NIL_VAL;
+    writeBarrier((Obj *) currentFunction());
+  }
+
+  if (transition != NULL) {
+    instanceAddField(instance, transition, value);
+  } else {
+    instance->fields[slot] = value;
+    writeBarrierValue((Obj *) instance, value);
+  }
+}
+
 // captureUpvalue はOP_CLOSUREの初期化中に呼ばれる関数で,
 // isLocal=trueなクロージャ変数を取得する処理.
 // - 任意のローカル変数に対してObjUpvalueは一つしか存在しないようにしている.
 static ObjUpvalue *captureUpvalue(Value *local) {
+  // 同じ変数をキャプチャしているupvalueがあれば, それを返す
+  ObjUpvalue *existing = vm.openSlots[local - vm.stack];
+  if (existing != NULL) return existing;
+
+  // 新しいupValueオブジェクトを生成.
+  ObjUpvalue *createdUpvalue = newUpvalue(local);
+  vm.openSlots[local - vm.stack] = createdUpvalue;
+
+  // 挿入位置を連結リストから探す. 新しい変数はたいていスタックの上の方にあるので, 探索はすぐ終わる.
   ObjUpvalue *prevUpvalue = NULL;
   ObjUpvalue *upvalue = vm.openUpvalues;
-  // ローカル変数をcloseするときは,リスト内の既存の値がないかをVM管理の連結リストから探す
   while (upvalue != NULL && upvalue->location > local) {
     prevUpvalue = upvalue;
     upvalue = upvalue->next;
   }
 
-  if (upvalue != NULL && upvalue->location == local) {
-    // 同じ変数をキャプチャしているupvalueがあるので, それを返す
-    return upvalue;
-  }
-
-  // 新しいupValueオブジェクトを生成.
-  ObjUpvalue *createdUpvalue = newUpvalue(local);
-
   // 新しいupvalueを連結リストに挿入する
   createdUpvalue->next = upvalue;
 
@@ -259,16 +836,58 @@ static void closeUpvalues(Value *last) {
   while (vm.openUpvalues != NULL &&
          vm.openUpvalues->location >= last) {
     ObjUpvalue *upvalue = vm.openUpvalues;
+    vm.openSlots[upvalue->location - vm.stack] = NULL;
     upvalue->closed = *upvalue->location; // upvalueが現在指している値をデリファレンスして取得
     upvalue->location = &upvalue->closed; // 値の参照先を自身のclosedフィールドのアドレスに更新する.
+    writeBarrierValue((Obj *) upvalue, upvalue->closed);
     vm.openUpvalues = upvalue->next; // close されたので openUpvalues から除外
   }
 }
 
+// tailCall は `return f(...)` の呼び出しで, 実行中の CallFrame を呼び出し先のクロージャに使い回す.
+// スタックトップに積まれた関数と引数をフレームの先頭に移すので, 末尾再帰でも CallFrame が増えない.
+// クロージャ以外(クラス, ネイティブ関数)は普通に呼び出す. 後続の OP_RETURN がその結果を返す.
+static bool tailCall(Value callee, int argCount) {
+  if (IS_BOUND_METHOD(callee)) {
+    ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
+    vm.stackTop[-argCount - 1] = bound->receiver;
+    callee = OBJ_VAL(bound->method);
+  }
+  if (!IS_CLOSURE(callee)) return callObject(callee, argCount);
+
+  ObjClosure *closure = AS_CLOSURE(callee);
+  ObjFunction *function = closure->function;
+  // nonEscaping な関数は呼び出し元のフレームを読むので, それを上書きしてはならない
+  if (function->nonEscaping) return call(closure, argCount);
+  if (argCount != function->arity) {
+    runtimeError("Expected %d arguments but got %d.",
+                 function->arity, argCount);
+    return false;
+  }
+
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  Value *slots = frame->slots;
+  // 呼び出し元のローカル変数は上書きされるので, 捕捉されていれば先に閉じる
+  closeUpvalues(slots);
+  memmove(slots, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+  vm.stackTop = slots + argCount + 1;
+  if (slots + frameSizeOf(function) > vm.stackEnd &&
+      !growStack((size_t) (slots - vm.stack) + frameSizeOf(function))) {
+    runtimeError("Stack overflow.");
+    return false;
+  }
+
+  frame->closure = closure;
+  frame->ip = function->chunk.code;
+  if (function->registers != NULL) frame->pc = function->registers->code;
+  return true;
+}
+
 static void defineMethod(ObjString *name) {
   Value method = peek(0);
   ObjClass *klass = AS_CLASS(peek(1));
   tableSet(&klass->methods, name, method);
+  writeBarrier((Obj *) klass);
   pop();
 }
 
@@ -276,380 +895,957 @@ static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// concatenateValues は文字列 a と b を連結した値を返す. a と b はGCから到達可能にしておくこと.
+static Value concatenateValues(Value a, Value b) {
+  // 短い結果はその場でコピーする. ロープは ROPE_MIN_LENGTH 以上なので, ここに来るのは ObjString 同士だけ.
+  if (textLength(a) + textLength(b) < ROPE_MIN_LENGTH) {
+    return OBJ_VAL(concatenateStrings(AS_STRING(a), AS_STRING(b)));
+  }
+  return OBJ_VAL(newRope(a, b));
+}
+
 static void concatenate() {
 /* Strings concatenate < Garbage Collection concatenate-peek
   ObjString* b = AS_STRING(pop());
   ObjString* a = AS_STRING(pop());
 */
-  ObjString *b = AS_STRING(peek(0));
-  ObjString *a = AS_STRING(peek(1));
+  Value result = concatenateValues(peek(1), peek(0));
+  pop();
+  pop();
+  push(result);
+}
 
-  int length = a->length + b->length;
-  char *chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
+// equalValues は == の結果を返す. a と b はGCから到達可能にしておくこと.
+// インターン化された文字列同士ならポインタの比較で済むので, ロープは先に平坦化する.
+// 平坦化した文字列はロープが覚えているので, 回収されることはない.
+static bool equalValues(Value a, Value b) {
+  if ((IS_ROPE(a) || IS_ROPE(b)) && IS_TEXT(a) && IS_TEXT(b)) {
+    if (textLength(a) != textLength(b)) return false;
+    if (IS_ROPE(a)) a = OBJ_VAL(flattenRope(AS_ROPE(a)));
+    if (IS_ROPE(b)) b = OBJ_VAL(flattenRope(AS_ROPE(b)));
+  }
+  return valuesEqual(a, b);
+}
+
+// 以下は jit.h のコンパイル済みのコードが呼ぶ関数. 命令のオペランドは ip から自分で読む.
+
+// jitOperand は ip の命令 (OP_WIDE が前置されていてもよい) のインデックスオペランドを返し,
+// *ip をその次のオペランドに進める.
+static int jitOperand(uint8_t **ip) {
+  uint8_t *at = *ip;
+  if (at[0] == OP_WIDE) {
+    *ip = at + 4;
+    return (at[2] << 8) | at[3];
+  }
+  *ip = at + 2;
+  return at[1];
+}
+
+bool jitGetProperty(uint8_t *ip) {
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  Chunk *chunk = &frame->closure->function->chunk;
+  bool local = *ip == OP_GET_LOCAL_PROPERTY || *ip == OP_GET_LOCAL_FIELD;
+  Value receiver;
+  int name;
+  if (local) {
+    receiver = frame->slots[ip[1]];
+    name = ip[2];
+    ip += 3;
+  } else {
+    receiver = peek(0);
+    name = jitOperand(&ip);
+  }
+  if (!IS_INSTANCE(receiver)) return false;
 
-  ObjString *result = takeString(chars, length);
+  // getProperty() と同じだが, プロパティがなければエラーの報告をインタプリタに任せる
+  ObjInstance *instance = AS_INSTANCE(receiver);
+  ObjString *string = AS_STRING(chunk->constants.values[name]);
+  Value value;
+  int slot = -1;
+  if (instance->shape == NULL) {
+    if (instanceGetField(instance, string, &value)) {
+      slot = 0;
+    } else if (!tableGet(&instance->klass->methods, string, &value)) {
+      return false;
+    }
+  } else {
+    InlineCache *cache = &chunk->caches[(ip[0] << 8) | ip[1]];
+    if (!findProperty(instance, string, cache, &slot, &value)) return false;
+    if (slot >= 0) value = instance->fields[slot];
+  }
+
+  if (local) push(receiver);
+  if (slot >= 0) {
+    vm.stackTop[-1] = value;
+  } else {
+    bindClosure(AS_CLOSURE(value), &vm.stackTop[-1]);
+  }
+  return true;
+}
+
+bool jitSetProperty(uint8_t *ip) {
+  if (!IS_INSTANCE(peek(1))) return false;
+
+  Chunk *chunk = &currentFunction()->chunk;
+  int name = jitOperand(&ip);
+  setProperty(AS_INSTANCE(peek(1)), AS_STRING(chunk->constants.values[name]),
+              &chunk->caches[(ip[0] << 8) | ip[1]], peek(0));
+  Value value = pop();
   pop();
+  push(value);
+  return true;
+}
+
+bool jitSetUpvalue(uint8_t *ip) {
+  int slot = jitOperand(&ip);
+  ObjUpvalue *upvalue = vm.frames[vm.frameCount - 1].closure->upvalues[slot];
+  *upvalue->location = peek(0);
+  writeBarrierValue((Obj *) upvalue, peek(0));
+  return true;
+}
+
+bool jitGetOuter(uint8_t *ip) {
+  int slot = jitOperand(&ip);
+  push(vm.frames[vm.frameCount - 2].slots[slot]);
+  return true;
+}
+
+bool jitSetOuter(uint8_t *ip) {
+  int slot = jitOperand(&ip);
+  vm.frames[vm.frameCount - 2].slots[slot] = peek(0);
+  return true;
+}
+
+bool jitEqual(uint8_t *ip) {
+  if (*ip == OP_EQUAL_CONSTANT) {
+    Value constant = currentFunction()->chunk.constants.values[ip[1]];
+    vm.stackTop[-1] = BOOL_VAL(equalValues(peek(0), constant));
+    return true;
+  }
+  bool equal = equalValues(peek(1), peek(0));
+  vm.stackTop -= 2;
+  push(BOOL_VAL(equal));
+  return true;
+}
+
+// jitAdd は数値でない + のうち, 文字列の連結だけを行う.
+bool jitAdd(uint8_t *ip) {
+  Value *constants = currentFunction()->chunk.constants.values;
+  switch (*ip) {
+    case OP_ADD_CONSTANT:
+      if (!IS_TEXT(peek(0)) || !IS_TEXT(constants[ip[1]])) return false;
+      push(constants[ip[1]]);
+      concatenate();
+      return true;
+    case OP_INCREMENT_LOCAL: {
+      Value *slot = &vm.frames[vm.frameCount - 1].slots[ip[1]];
+      if (!IS_TEXT(*slot) || !IS_TEXT(constants[ip[2]])) return false;
+      push(*slot);
+      push(constants[ip[2]]);
+      concatenate();
+      *slot = pop();
+      return true;
+    }
+    default:
+      if (!IS_TEXT(peek(0)) || !IS_TEXT(peek(1))) return false;
+      concatenate();
+      return true;
+  }
+}
+
+bool jitPrint(uint8_t *ip) {
+  printValue(pop());
+  writeOutput("\n", 1);
+  return true;
+}
+
+bool jitBuildList(uint8_t *ip) {
+  int count = ip[1];
+  ObjList *list = newList(vm.stackTop - count, count);
+  vm.stackTop -= count;
+  push(OBJ_VAL(list));
+  return true;
+}
+
+// jitListSlot は listIndex() と同じ検査をして要素の位置を返す. 不正ならエラーを報告せずに -1 を返す.
+static int jitListSlot(Value list, Value index) {
+  if (!IS_LIST(list) || !IS_NUMBER(index)) return -1;
+  double number = AS_NUMBER(index);
+  if (!(number >= 0 && number < AS_LIST(list)->items.count)) return -1;
+  int slot = (int) number;
+  return slot == number ? slot : -1;
+}
+
+bool jitGetIndex(uint8_t *ip) {
+  int slot = jitListSlot(peek(1), peek(0));
+  if (slot < 0) return false;
+  vm.stackTop[-2] = AS_LIST(peek(1))->items.values[slot];
+  vm.stackTop--;
+  return true;
+}
+
+bool jitSetIndex(uint8_t *ip) {
+  int slot = jitListSlot(peek(2), peek(1));
+  if (slot < 0) return false;
+  listSet(AS_LIST(peek(2)), slot, peek(0));
+  vm.stackTop[-3] = peek(0);
+  vm.stackTop -= 2;
+  return true;
+}
+
+bool jitCloseUpvalue(uint8_t *ip) {
+  closeUpvalues(vm.stackTop - 1);
   pop();
-  push(OBJ_VAL(result));
+  return true;
 }
 
-// run は生成した lox バイトコードを実行する.
-static InterpretResult run() {
+// jitSwitch は先頭の CallFrame を機械語で続けられるならそれを返し, できなければ JIT_SWITCH を返す.
+// 関数の先頭なら呼び出しなので, ENTER_FRAME() と同じく回数を数え, しきい値に達すればコンパイルする.
+static CallFrame *jitSwitch() {
+  if (vm.frameCount == vm.baseFrame) return JIT_SWITCH;
   CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  ObjFunction *function = frame->closure->function;
+  if (function->registers != NULL) return JIT_SWITCH;
+  if (function->jit == NULL &&
+      (frame->ip != function->chunk.code ||
+       ++function->hotness < JIT_THRESHOLD || !jitCompile(function))) {
+    return JIT_SWITCH;
+  }
+  return jitEntry(function, frame->ip) != NULL ? frame : JIT_SWITCH;
+}
 
-#define READ_BYTE() (*frame->ip++)
+// jitCalled は呼び出しの結果から次に実行するものを返す. ネイティブ関数の呼び出しのように
+// 先頭の CallFrame もスタックの位置も変わらなければ, 機械語のまま次の命令へ進める.
+static CallFrame *jitCalled(bool ok, ObjFiber *fiber, Value *stack,
+                            int frameCount) {
+  if (!ok) return JIT_ERROR;
+  if (vm.fiber == fiber && vm.stack == stack && vm.frameCount == frameCount) {
+    return JIT_CONTINUE;
+  }
+  return jitSwitch();
+}
 
-#define READ_SHORT() \
-    (frame->ip += 2, \
-    (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+CallFrame *jitCall(uint8_t *ip) {
+  ObjFiber *fiber = vm.fiber;
+  Value *stack = vm.stack;
+  int frameCount = vm.frameCount;
+  int argCount = ip[1];
+  vm.frames[frameCount - 1].ip = ip + 2;
+  if (*ip == OP_TAIL_CALL) {
+    // 実行中の CallFrame を使い回すので, いつも入り直す
+    return tailCall(peek(argCount), argCount) ? jitSwitch() : JIT_ERROR;
+  }
+  return jitCalled(callValue(peek(argCount), argCount), fiber, stack,
+                   frameCount);
+}
 
-#define READ_CONSTANT() \
-    (frame->closure->function->chunk.constants.values[READ_BYTE()])
+CallFrame *jitInvoke(uint8_t *ip) {
+  ObjFiber *fiber = vm.fiber;
+  Value *stack = vm.stack;
+  int frameCount = vm.frameCount;
+  CallFrame *frame = &vm.frames[frameCount - 1];
+  Chunk *chunk = &frame->closure->function->chunk;
+  bool super = (*ip == OP_WIDE ? ip[1] : *ip) == OP_SUPER_INVOKE;
+  ObjString *name = AS_STRING(chunk->constants.values[jitOperand(&ip)]);
+  int argCount = ip[0];
+  if (super) {
+    frame->ip = ip + 1;
+    return jitCalled(invokeFromClass(AS_CLASS(pop()), name, argCount), fiber,
+                     stack, frameCount);
+  }
 
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-/* A Virtual Machine binary-op < Types of Values binary-op
-#define BINARY_OP(op) \
+  frame->ip = ip + 3;
+  InlineCache *cache = &chunk->caches[(ip[1] << 8) | ip[2]];
+  // OP_INVOKE_METHOD と同じく, 先頭のエントリのメソッドならそのまま呼ぶ.
+  // 空のエントリの shape は NULL なので, 辞書モードのインスタンスと取り違えないようにする.
+  InlineCacheEntry *entry = &cache->entries[0];
+  Value receiver = peek(argCount);
+  bool ok = entry->shape != NULL && IS_INSTANCE(receiver) &&
+                    AS_INSTANCE(receiver)->shape == entry->shape &&
+                    entry->slot < 0
+                ? call(AS_CLOSURE(entry->method), argCount)
+                : invoke(name, argCount, cache);
+  return jitCalled(ok, fiber, stack, frameCount);
+}
+
+CallFrame *jitReturn(uint8_t *ip) {
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  Value result = pop();
+  closeUpvalues(frame->slots);
+  vm.frameCount--;
+  vm.stackTop = frame->slots;
+  push(result);
+  return jitSwitch();
+}
+
+// run は生成した lox バイトコードを実行する. runProfiled はプロファイル中に,
+// runJit は --tier=jit のときに代わりに使う. どれも本体は run.h にある.
+#define RUN_NAME run
+#define RUN_PROFILE false
+#define RUN_JIT false
+#include "run.h"
+
+#define RUN_NAME runProfiled
+#define RUN_PROFILE true
+#define RUN_JIT false
+#include "run.h"
+
+#define RUN_NAME runJit
+#define RUN_PROFILE false
+#define RUN_JIT true
+#include "run.h"
+
+// runRegister はレジスタ層の命令列を実行する. 構成は run() と同じ.
+// レジスタ層のフレームの実行中は vm.stackTop をフレームの末尾 (slots + frameSize) に置いておき,
+// GCがすべてのレジスタを根として辿れるようにする.
+static InterpretResult runRegister() {
+  CallFrame *frame;
+  uint32_t *pc;
+  Value *slots;
+  Value *constants;
+  InlineCache *caches;
+  uint32_t word; // 実行中の命令の 1 語目
+
+// vm.frames の先頭の CallFrame をローカル変数に読み込む.
+// スタックトップより上の値は回収済みのオブジェクトを指しているかもしれないので, 新しく見える範囲は nil で埋める.
+#define LOAD_FRAME() \
     do { \
-      double b = pop(); \
-      double a = pop(); \
-      push(a op b); \
+      frame = &vm.frames[vm.frameCount - 1]; \
+      pc = frame->pc; \
+      slots = frame->slots; \
+      constants = frame->closure->function->chunk.constants.values; \
+      caches = frame->closure->function->chunk.caches; \
+      Value *frameEnd = slots + frame->closure->function->registers->frameSize; \
+      while (vm.stackTop < frameEnd) *vm.stackTop++ = NIL_VAL; \
+      vm.stackTop = frameEnd; \
     } while (false)
-*/
-#define BINARY_OP(valueType, op) \
+
+#define STORE_FRAME() (frame->pc = pc)
+
+// 呼び出しや復帰の後に先頭の CallFrame を読み込む. それがスタック層の関数なら execute() に任せる.
+#define ENTER_FRAME() \
     do { \
-      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-        runtimeError("Operands must be numbers."); \
-        return INTERPRET_RUNTIME_ERROR; \
+      if (vm.frames[vm.frameCount - 1].closure->function->registers == NULL) { \
+        return INTERPRET_SWITCH_TIER; \
       } \
-      double b = AS_NUMBER(pop()); \
-      double a = AS_NUMBER(pop()); \
-      push(valueType(a op b)); \
+      LOAD_FRAME(); \
+    } while (false)
+
+#define RA  slots[REG_A(word)]
+#define RB  slots[REG_B(word)]
+#define RC  slots[REG_C(word)]
+#define KC  constants[REG_C(word)]
+#define KBX constants[REG_BX(word)]
+
+#define READ_WORD() (*pc++)
+#define GLOBAL_NAME(slot) AS_STRING(vm.globalNames.values[slot])->chars
+
+#define RUNTIME_ERROR(...) \
+    do { \
+      STORE_FRAME(); \
+      runtimeError(__VA_ARGS__); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+
+#define BINARY_OP(valueType, op, right) \
+    do { \
+      Value b = RB; \
+      Value c = right; \
+      if (!IS_NUMBER(b) || !IS_NUMBER(c)) { \
+        RUNTIME_ERROR("Operands must be numbers."); \
+      } \
+      RA = valueType(AS_NUMBER(b) op AS_NUMBER(c)); \
+    } while (false)
+
+#define ADD_OP(right) \
+    do { \
+      Value b = RB; \
+      Value c = right; \
+      if (IS_NUMBER(b) && IS_NUMBER(c)) { \
+        RA = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c)); \
+      } else if (IS_TEXT(b) && IS_TEXT(c)) { \
+        RA = concatenateValues(b, c); \
+      } else { \
+        RUNTIME_ERROR("Operands must be two numbers or two strings."); \
+      } \
+    } while (false)
+
+// 比較付きジャンプ. 変位は 2 語目.
+#define JUMP_UNLESS(op, right) \
+    do { \
+      int32_t offset = (int32_t) READ_WORD(); \
+      Value b = RB; \
+      Value c = right; \
+      if (!IS_NUMBER(b) || !IS_NUMBER(c)) { \
+        RUNTIME_ERROR("Operands must be numbers."); \
+      } \
+      if (!(AS_NUMBER(b) op AS_NUMBER(c))) pc += offset; \
     } while (false)
 
-  for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(&frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION() \
+    do { \
+      printf("          "); \
+      for (Value* slot = vm.stack; slot < vm.stackTop; slot++) { \
+        printf("[ "); \
+        printValue(*slot); \
+        printf(" ]"); \
+      } \
+      printf("\n"); \
+      disassembleRegisterInstruction(frame->closure->function, \
+          (int)(pc - frame->closure->function->registers->code)); \
+    } while (false)
+#else
+#define TRACE_INSTRUCTION() do { } while (false)
 #endif
 
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-      case OP_CONSTANT: {
-        Value constant = READ_CONSTANT();
-/* A Virtual Machine op-constant < A Virtual Machine push-constant
-        printValue(constant);
-        printf("\n");
-*/
-        push(constant);
-        break;
-      }
-      case OP_NIL:
-        push(NIL_VAL);
-        break;
-      case OP_TRUE:
-        push(BOOL_VAL(true));
-        break;
-      case OP_FALSE:
-        push(BOOL_VAL(false));
-        break;
-      case OP_POP:
-        pop();
-        break;
-      case OP_GET_LOCAL: {
-        // ローカル変数のロード
-
-        // ローカル変数が存在するスタックidxを1byteオペランドで取る
-        uint8_t slot = READ_BYTE();
-        // 現在CallFrameのslots先頭を経由して相対的にアクセスしてPUSHする.
-        push(frame->slots[slot]);
-        break;
-      }
-      case OP_SET_LOCAL: {
-        // ローカル変数への代入
-        uint8_t slot = READ_BYTE();
-        // スタックの先頭から代入される値を取り出し, ローカル変数に対応するスタック・スロットに保存する.
-        // スタックから値をポップしないことに注意.
-        // 代入は式であり, すべての式は値を返す. よって代入式は代入された値を返すので, VMはスタックに値を残す.
-        frame->slots[slot] = peek(0); // GET_OP_LOCAL 同様 CallFrame の slots 経由でセットする.
-        break;
-      }
-      case OP_GET_GLOBAL: {
-        ObjString *name = READ_STRING();
-        Value value;
-        if (!tableGet(&vm.globals, name, &value)) {
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(value);
-        break;
-      }
-      case OP_DEFINE_GLOBAL: {
-        ObjString *name = READ_STRING();
-        tableSet(&vm.globals, name, peek(0));
-        pop();
-        break;
-      }
-      case OP_SET_GLOBAL: {
-        ObjString *name = READ_STRING();
-        if (tableSet(&vm.globals, name, peek(0))) {
-          tableDelete(&vm.globals, name); // [delete]
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+#ifdef THREADED_DISPATCH
+  static void *dispatchTable[] = {
+#define REGOP(name, length) &&reg_##name,
+#include "regops.h"
+#undef REGOP
+  };
+
+#define INTERPRET_LOOP  DISPATCH();
+#define CASE_CODE(name) reg_##name
+
+#define DISPATCH() \
+    do { \
+      TRACE_INSTRUCTION(); \
+      word = READ_WORD(); \
+      goto *dispatchTable[REG_OP(word)]; \
+    } while (false)
+#else
+#define INTERPRET_LOOP \
+    loop: \
+      TRACE_INSTRUCTION(); \
+      word = READ_WORD(); \
+      switch (REG_OP(word))
+
+#define CASE_CODE(name) case REG_##name
+#define DISPATCH()      goto loop
+#endif
+
+  LOAD_FRAME();
+
+  INTERPRET_LOOP
+  {
+    CASE_CODE(MOVE):
+      RA = RB;
+      DISPATCH();
+    CASE_CODE(LOADK):
+      RA = KBX;
+      DISPATCH();
+    CASE_CODE(LOADNIL):
+      RA = NIL_VAL;
+      DISPATCH();
+    CASE_CODE(LOADTRUE):
+      RA = BOOL_VAL(true);
+      DISPATCH();
+    CASE_CODE(LOADFALSE):
+      RA = BOOL_VAL(false);
+      DISPATCH();
+    CASE_CODE(GET_GLOBAL): {
+      int slot = REG_BX(word);
+      Value value = vm.globalValues.values[slot];
+      if (IS_UNDEFINED(value)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
       }
-      case OP_GET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        push(*frame->closure->upvalues[slot]->location);
-        break;
+      RA = value;
+      DISPATCH();
+    }
+    CASE_CODE(DEFINE_GLOBAL):
+      vm.globalValues.values[REG_BX(word)] = RA;
+      DISPATCH();
+    CASE_CODE(SET_GLOBAL): {
+      int slot = REG_BX(word);
+      if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+        RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot));
       }
-      case OP_SET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(0);
-        break;
+      vm.globalValues.values[slot] = RA;
+      DISPATCH();
+    }
+    CASE_CODE(GET_UPVALUE):
+      RA = *frame->closure->upvalues[REG_BX(word)]->location;
+      DISPATCH();
+    CASE_CODE(SET_UPVALUE): {
+      ObjUpvalue *upvalue = frame->closure->upvalues[REG_BX(word)];
+      *upvalue->location = RA;
+      writeBarrierValue((Obj *) upvalue, RA);
+      DISPATCH();
+    }
+    CASE_CODE(GET_PROPERTY): {
+      uint32_t operand = READ_WORD();
+      Value receiver = RB;
+      if (!IS_INSTANCE(receiver)) {
+        RUNTIME_ERROR("Only instances have properties.");
       }
-      case OP_GET_PROPERTY: {
-        if (!IS_INSTANCE(peek(0))) {
-          runtimeError("Only instances have properties.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
 
-        ObjInstance *instance = AS_INSTANCE(peek(0));
-        ObjString *name = READ_STRING();
-
-        Value value;
-        if (tableGet(&instance->fields, name, &value)) {
-          pop(); // Instance.
-          push(value);
-          break;
-        }
+      ObjInstance *instance = AS_INSTANCE(receiver);
+      InlineCache *cache = &caches[operand >> 16];
+      InlineCacheEntry *entry = cacheFind(cache, instance->shape);
+      if (entry != NULL && entry->slot >= 0) {
+        RA = instance->fields[entry->slot];
+        DISPATCH();
+      }
 
-/* Classes and Instances get-undefined < Methods and Initializers get-method
-        runtimeError("Undefined property '%s'.", name->chars);
+      // 書き込み先のレジスタにレシーバを置いて, その場で結果に置き換える
+      RA = receiver;
+      STORE_FRAME();
+      if (!getProperty(instance, AS_STRING(constants[operand & 0xffff]),
+                       cache, &RA)) {
         return INTERPRET_RUNTIME_ERROR;
-*/
-        if (!bindMethod(instance->klass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
       }
-      case OP_SET_PROPERTY: {
-        if (!IS_INSTANCE(peek(1))) {
-          runtimeError("Only instances have fields.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-
-        ObjInstance *instance = AS_INSTANCE(peek(1));
-        tableSet(&instance->fields, READ_STRING(), peek(0));
-        Value value = pop();
-        pop();
-        push(value);
-        break;
+      DISPATCH();
+    }
+    CASE_CODE(SET_PROPERTY): {
+      uint32_t operand = READ_WORD();
+      if (!IS_INSTANCE(RA)) {
+        RUNTIME_ERROR("Only instances have fields.");
       }
-      case OP_GET_SUPER: {
-        ObjString *name = READ_STRING();
-        ObjClass *superclass = AS_CLASS(pop());
 
-        if (!bindMethod(superclass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
-      }
-      case OP_EQUAL: {
-        Value b = pop();
-        Value a = pop();
-        push(BOOL_VAL(valuesEqual(a, b)));
-        break;
+      ObjInstance *instance = AS_INSTANCE(RA);
+      Value value = RB;
+      InlineCache *cache = &caches[operand >> 16];
+      InlineCacheEntry *entry = cacheFind(cache, instance->shape);
+      if (entry != NULL && entry->transition == NULL) {
+        instance->fields[entry->slot] = value;
+        writeBarrierValue((Obj *) instance, value);
+      } else {
+        setProperty(instance, AS_STRING(constants[operand & 0xffff]), cache,
+                    value);
       }
-      case OP_GREATER:
-        BINARY_OP(BOOL_VAL, >);
-        break;
-      case OP_LESS:
-        BINARY_OP(BOOL_VAL, <);
-        break;
-/* A Virtual Machine op-binary < Types of Values op-arithmetic
-      case OP_ADD:      BINARY_OP(+); break;
-      case OP_SUBTRACT: BINARY_OP(-); break;
-      case OP_MULTIPLY: BINARY_OP(*); break;
-      case OP_DIVIDE:   BINARY_OP(/); break;
-*/
-/* A Virtual Machine op-negate < Types of Values op-negate
-      case OP_NEGATE:   push(-pop()); break;
-*/
-/* Types of Values op-arithmetic < Strings add-strings
-      case OP_ADD:      BINARY_OP(NUMBER_VAL, +); break;
-*/
-      case OP_ADD: {
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-          concatenate();
-        } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-          double b = AS_NUMBER(pop());
-          double a = AS_NUMBER(pop());
-          push(NUMBER_VAL(a + b));
-        } else {
-          runtimeError(
-              "Operands must be two numbers or two strings.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      RA = value;
+      DISPATCH();
+    }
+    CASE_CODE(GET_SUPER): {
+      ObjString *name = AS_STRING(constants[READ_WORD()]);
+      ObjClass *superclass = AS_CLASS(slots[REG_A(word) + 1]);
+      STORE_FRAME();
+      if (!bindMethod(superclass, name, &RA)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_SUBTRACT:
-        BINARY_OP(NUMBER_VAL, -);
-        break;
-      case OP_MULTIPLY:
-        BINARY_OP(NUMBER_VAL, *);
-        break;
-      case OP_DIVIDE:
-        BINARY_OP(NUMBER_VAL, /);
-        break;
-      case OP_NOT:
-        push(BOOL_VAL(isFalsey(pop())));
-        break;
-      case OP_NEGATE:
-        if (!IS_NUMBER(peek(0))) {
-          runtimeError("Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(NUMBER_VAL(-AS_NUMBER(pop())));
-        break;
-      case OP_PRINT: {
-        printValue(pop());
-        printf("\n");
-        break;
+      DISPATCH();
+    }
+    CASE_CODE(EQUAL):
+      RA = BOOL_VAL(equalValues(RB, RC));
+      DISPATCH();
+    CASE_CODE(GREATER):
+      BINARY_OP(BOOL_VAL, >, RC);
+      DISPATCH();
+    CASE_CODE(LESS):
+      BINARY_OP(BOOL_VAL, <, RC);
+      DISPATCH();
+    CASE_CODE(ADD):
+      ADD_OP(RC);
+      DISPATCH();
+    CASE_CODE(SUBTRACT):
+      BINARY_OP(NUMBER_VAL, -, RC);
+      DISPATCH();
+    CASE_CODE(MULTIPLY):
+      BINARY_OP(NUMBER_VAL, *, RC);
+      DISPATCH();
+    CASE_CODE(DIVIDE):
+      BINARY_OP(NUMBER_VAL, /, RC);
+      DISPATCH();
+    CASE_CODE(EQUAL_CONSTANT):
+      RA = BOOL_VAL(equalValues(RB, KC));
+      DISPATCH();
+    CASE_CODE(GREATER_CONSTANT):
+      BINARY_OP(BOOL_VAL, >, KC);
+      DISPATCH();
+    CASE_CODE(LESS_CONSTANT):
+      BINARY_OP(BOOL_VAL, <, KC);
+      DISPATCH();
+    CASE_CODE(ADD_CONSTANT):
+      ADD_OP(KC);
+      DISPATCH();
+    CASE_CODE(SUBTRACT_CONSTANT):
+      BINARY_OP(NUMBER_VAL, -, KC);
+      DISPATCH();
+    CASE_CODE(MULTIPLY_CONSTANT):
+      BINARY_OP(NUMBER_VAL, *, KC);
+      DISPATCH();
+    CASE_CODE(DIVIDE_CONSTANT):
+      BINARY_OP(NUMBER_VAL, /, KC);
+      DISPATCH();
+    CASE_CODE(NOT):
+      RA = BOOL_VAL(isFalsey(RB));
+      DISPATCH();
+    CASE_CODE(NEGATE):
+      if (!IS_NUMBER(RB)) {
+        RUNTIME_ERROR("Operand must be a number.");
       }
-      case OP_JUMP: {
-        uint16_t offset = READ_SHORT();
-/* Jumping Back and Forth op-jump < Calls and Functions jump
-        vm.ip += offset;
-*/
-        frame->ip += offset;
-        break;
+      RA = NUMBER_VAL(-AS_NUMBER(RB));
+      DISPATCH();
+    CASE_CODE(PRINT):
+      printValue(RA);
+      writeOutput("\n", 1);
+      DISPATCH();
+    CASE_CODE(JUMP):
+      pc += REG_SAX(word);
+      DISPATCH();
+    CASE_CODE(JUMP_IF_FALSE):
+      if (isFalsey(RA)) pc += REG_SBX(word);
+      DISPATCH();
+    CASE_CODE(JUMP_IF_NOT_LESS):
+      JUMP_UNLESS(<, RC);
+      DISPATCH();
+    CASE_CODE(JUMP_IF_NOT_LESS_CONSTANT):
+      JUMP_UNLESS(<, KC);
+      DISPATCH();
+    CASE_CODE(JUMP_IF_NOT_GREATER):
+      JUMP_UNLESS(>, RC);
+      DISPATCH();
+    CASE_CODE(JUMP_IF_NOT_GREATER_CONSTANT):
+      JUMP_UNLESS(>, KC);
+      DISPATCH();
+    // 呼び出しの前に, 呼び出し先のフレームが引数の直後から始まるようにスタックトップを下げる.
+    // スタック層の命令と同じ callValue() などをそのまま使える.
+    CASE_CODE(CALL): {
+      int argCount = REG_B(word);
+      STORE_FRAME();
+      vm.stackTop = &RA + argCount + 1;
+      if (!callValue(RA, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_JUMP_IF_FALSE: {
-        uint16_t offset = READ_SHORT();
-        if (isFalsey(peek(0))) frame->ip += offset;
-        break;
+      ENTER_FRAME();
+      DISPATCH();
+    }
+    CASE_CODE(TAIL_CALL): {
+      int argCount = REG_B(word);
+      STORE_FRAME();
+      vm.stackTop = &RA + argCount + 1;
+      if (!tailCall(RA, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_LOOP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip -= offset;
-        break;
+      ENTER_FRAME();
+      DISPATCH();
+    }
+    CASE_CODE(INVOKE): {
+      uint32_t operand = READ_WORD();
+      int argCount = REG_B(word);
+      STORE_FRAME();
+      vm.stackTop = &RA + argCount + 1;
+      if (!invoke(AS_STRING(constants[operand & 0xffff]), argCount,
+                  &caches[operand >> 16])) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      // 関数の呼び出し命令.
-      case OP_CALL: {
-        int argCount = READ_BYTE();
-        // VMのスタックの先頭に引数が積まれているので argCount の数だけ peek した箇所に関数が収められている.
-        // その関数を callValue にわたす.
-        if (!callValue(peek(argCount), argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        // 関数呼び出しに成功した場合VMのスタックに新しいCallFrameが積まれている.
-        // それを現在実行している frame として更新する.
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+      ENTER_FRAME();
+      DISPATCH();
+    }
+    CASE_CODE(SUPER_INVOKE): {
+      ObjString *method = AS_STRING(constants[READ_WORD()]);
+      int argCount = REG_B(word);
+      ObjClass *superclass = AS_CLASS((&RA)[argCount + 1]);
+      STORE_FRAME();
+      vm.stackTop = &RA + argCount + 1;
+      if (!invokeFromClass(superclass, method, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_INVOKE: {
-        ObjString *method = READ_STRING();
-        int argCount = READ_BYTE();
-        if (!invoke(method, argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
+      ENTER_FRAME();
+      DISPATCH();
+    }
+    CASE_CODE(CLOSURE): {
+      ObjClosure *closure = newClosure(AS_FUNCTION(KBX));
+      RA = OBJ_VAL(closure);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        uint32_t capture = READ_WORD();
+        int index = (int) (capture >> 8);
+        if (capture & 0xff) {
+          closure->upvalues[i] = captureUpvalue(slots + index);
+        } else {
+          closure->upvalues[i] = frame->closure->upvalues[index];
         }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
       }
-      case OP_SUPER_INVOKE: {
-        ObjString *method = READ_STRING();
-        int argCount = READ_BYTE();
-        ObjClass *superclass = AS_CLASS(pop());
-        if (!invokeFromClass(superclass, method, argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
+      writeBarrier((Obj *) closure);
+      DISPATCH();
+    }
+    CASE_CODE(CLOSE_UPVALUE):
+      closeUpvalues(&RA);
+      DISPATCH();
+    CASE_CODE(RETURN): {
+      Value result = RA;
+      closeUpvalues(slots);
+      vm.frameCount--;
+      vm.stackTop = slots;
+      push(result);
+      if (vm.frameCount == vm.baseFrame) return INTERPRET_OK;
+
+      ENTER_FRAME();
+      DISPATCH();
+    }
+    CASE_CODE(CLASS):
+      RA = OBJ_VAL(newClass(AS_STRING(KBX)));
+      DISPATCH();
+    CASE_CODE(INHERIT): {
+      Value superclass = RA;
+      if (!IS_CLASS(superclass)) {
+        RUNTIME_ERROR("Superclass must be a class.");
       }
-      case OP_CLOSURE: {
-        ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-        ObjClosure *closure = newClosure(function);
-        push(OBJ_VAL(closure));
-        // upvalueCount のぶんだけオペランドバイトコードを読み込む.
-        for (int i = 0; i < closure->upvalueCount; i++) {
-          uint8_t isLocal = READ_BYTE();
-          uint8_t index = READ_BYTE();
-          if (isLocal) {
-            // isLocal=true ならば「現在実行中のCallFrame」で宣言された関数がそのCallFrameで宣言された変数をキャプチャしているので,
-            // frame->slots+index に位置にある変数をcaptureUpvalueでキャプチャする.
-            closure->upvalues[i] =
-                captureUpvalue(frame->slots + index);
-          } else {
-            // isLocal=falseは更に外部のスコープにある変数キャプチャなのでupvaluesのindexから参照チェーンを取得しておく
-            closure->upvalues[i] = frame->closure->upvalues[index];
-          }
+
+      ObjClass *subclass = AS_CLASS(slots[REG_A(word) + 1]);
+      tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+      writeBarrier((Obj *) subclass);
+      DISPATCH();
+    }
+    CASE_CODE(METHOD): {
+      ObjClass *klass = AS_CLASS(RA);
+      tableSet(&klass->methods, AS_STRING(KBX), slots[REG_A(word) + 1]);
+      writeBarrier((Obj *) klass);
+      DISPATCH();
+    }
+    // frame[-1] は関数を宣言したフレーム (nonEscaping な関数の呼び出し元)
+    CASE_CODE(GET_OUTER):
+      RA = frame[-1].slots[REG_BX(word)];
+      DISPATCH();
+    CASE_CODE(SET_OUTER):
+      frame[-1].slots[REG_BX(word)] = RA;
+      DISPATCH();
+    CASE_CODE(SHARED_CLOSURE):
+      RA = OBJ_VAL(AS_FUNCTION(KBX)->closure);
+      DISPATCH();
+    CASE_CODE(BUILD_LIST): {
+      ObjList *list = newList(&RA, REG_B(word));
+      RA = OBJ_VAL(list);
+      DISPATCH();
+    }
+    CASE_CODE(GET_INDEX): {
+      STORE_FRAME();
+      int slot = listIndex(RB, RC);
+      if (slot < 0) return INTERPRET_RUNTIME_ERROR;
+      RA = AS_LIST(RB)->items.values[slot];
+      DISPATCH();
+    }
+    CASE_CODE(SET_INDEX): {
+      STORE_FRAME();
+      int slot = listIndex(RA, RB);
+      if (slot < 0) return INTERPRET_RUNTIME_ERROR;
+      listSet(AS_LIST(RA), slot, RC);
+      RA = RC;
+      DISPATCH();
+    }
+  }
+
+  // 翻訳器が不正な命令を出力しない限りここには到達しない.
+  return INTERPRET_RUNTIME_ERROR;
+
+#undef LOAD_FRAME
+#undef STORE_FRAME
+#undef ENTER_FRAME
+#undef RA
+#undef RB
+#undef RC
+#undef KC
+#undef KBX
+#undef READ_WORD
+#undef GLOBAL_NAME
+#undef RUNTIME_ERROR
+#undef BINARY_OP
+#undef ADD_OP
+#undef JUMP_UNLESS
+#undef TRACE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE_CODE
+#undef DISPATCH
+}
+
+// execute は先頭の CallFrame の層に合わせて run() か runRegister() を呼び,
+// 層をまたいだ呼び出しや復帰のたびに呼び直す. --tier=jit でコンパイル済みの関数は
+// 機械語で実行し, それが抜けた命令からインタプリタで続ける.
+static InterpretResult execute() {
+  // 機械語を抜けた命令は, そこに入口があってもまずインタプリタで実行する
+  bool exited = false;
+  for (;;) {
+    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    ObjFunction *function = frame->closure->function;
+    if (function->jit != NULL && !exited) {
+      void *entry = jitEntry(function, frame->ip);
+      if (entry != NULL) {
+        uint8_t *exit = jitExecute(frame, entry);
+        if (exit == JIT_EXIT_ERROR) return INTERPRET_RUNTIME_ERROR;
+        if (exit == JIT_EXIT_SWITCH) {
+          // 機械語の中で呼び出しか復帰をして, 続きをインタプリタに任せた
+          if (vm.frameCount == vm.baseFrame) return INTERPRET_OK;
+          continue;
         }
-        break;
+        vm.frames[vm.frameCount - 1].ip = exit;
+        exited = true;
+        continue;
       }
-      // キャプチャされた変数をヒープに退避させる命令.
-      // コンパイラはブロックの終端に達するたび(関数定義除く)そのブロック内のすべてのローカル変数を破棄しクローズされた各ローカル変数に対して,
-      // OP_CLOSE_UPVALUE を出力しなければならない.
-      case OP_CLOSE_UPVALUE:
-        closeUpvalues(vm.stackTop - 1);
-        pop();
-        break;
-      // 関数からの復帰命令
-      case OP_RETURN: {
-        Value result = pop(); // 関数の実行結果を取得
-        closeUpvalues(frame->slots); // 関数内部で定義された変数(引数含む)も正しくCLOSEされなければならない(入れ子関数定義でクロージャにキャプチャされる可能性がある).
-        // CallFrame の破棄
-        vm.frameCount--;
-        if (vm.frameCount == 0) {
-          // トップレベルのCallFrameの終了 = プログラム全体の終了
-          pop();
-          return INTERPRET_OK;
-        }
+    }
+    exited = false;
 
-        // 呼び終わった関数のCallFrame先頭をスタックトップに更新 = CallFrame が積んでいた値を破棄する.
-        vm.stackTop = frame->slots;
-        push(result); // 関数の結果を先頭に積む
-        // 現在実行中の CallFrame を更新する
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
-      }
-      case OP_CLASS:
-        push(OBJ_VAL(newClass(READ_STRING())));
-        break;
-      case OP_INHERIT: {
-        Value superclass = peek(1);
-        if (!IS_CLASS(superclass)) {
-          runtimeError("Superclass must be a class.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
+    InterpretResult result = function->registers != NULL ? runRegister()
+                             : vm.profiling          ? runProfiled()
+                             : vm.tier == TIER_JIT   ? runJit()
+                                                     : run();
+    if (result != INTERPRET_SWITCH_TIER) return result;
+  }
+}
+
+InterpretResult callFunction(Value callee, int argCount, Value *args,
+                             Value *result) {
+  // args はネイティブ関数の引数のようにスタック上を指していてもよいので, 伸ばす前に位置を覚えておく
+  ptrdiff_t onStack = args >= vm.stack && args < vm.stackTop
+                          ? args - vm.stack : -1;
+  size_t needed = (size_t) (vm.stackTop - vm.stack) + argCount + 1;
+  if (vm.stack + needed > vm.stackEnd && !growStack(needed)) {
+    runtimeError("Stack overflow.");
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  if (onStack >= 0) args = vm.stack + onStack;
+
+  push(callee);
+  for (int i = 0; i < argCount; i++) push(args[i]);
+
+  // 実行中のループは呼び出しが vm.baseFrame まで戻ったところで返るので, ここで入れ子に実行できる
+  int baseFrame = vm.baseFrame;
+  int frameCount = vm.frameCount;
+  vm.baseFrame = frameCount;
+  InterpretResult status = INTERPRET_OK;
+  if (!callValue(callee, argCount)) {
+    status = INTERPRET_RUNTIME_ERROR;
+  } else if (vm.frameCount > frameCount) {
+    // クロージャなら CallFrame が積まれている. ネイティブ関数とクラスの結果はもうスタックにある.
+    status = execute();
+  }
+  vm.baseFrame = baseFrame;
+  if (status != INTERPRET_OK) return status;
+
+  *result = pop();
+  return INTERPRET_OK;
+}
+
+// saveFiber は VM にある実行の状態を fiber に退避する.
+static void saveFiber(ObjFiber *fiber) {
+  fiber->frames = vm.frames;
+  fiber->frameCount = vm.frameCount;
+  fiber->frameCapacity = vm.frameCapacity;
+  fiber->baseFrame = vm.baseFrame;
+  fiber->stack = vm.stack;
+  fiber->stackEnd = vm.stackEnd;
+  fiber->stackTop = vm.stackTop;
+  fiber->openUpvalues = vm.openUpvalues;
+  fiber->openSlots = vm.openSlots;
+  // 古い世代や mark 済みのファイバーにスタックの値をまとめて書き込んだことになる
+  writeBarrier((Obj *) fiber);
+}
+
+// loadFiber は fiber の実行の状態を VM に移し, fiber を実行中のファイバーにする.
+static void loadFiber(ObjFiber *fiber) {
+  vm.frames = fiber->frames;
+  vm.frameCount = fiber->frameCount;
+  vm.frameCapacity = fiber->frameCapacity;
+  vm.baseFrame = fiber->baseFrame;
+  vm.stack = fiber->stack;
+  vm.stackEnd = fiber->stackEnd;
+  vm.stackTop = fiber->stackTop;
+  vm.openUpvalues = fiber->openUpvalues;
+  vm.openSlots = fiber->openSlots;
+  // 配列の持ち主は VM になる. ファイバーに残しておくと二重に解放してしまう.
+  fiber->frames = NULL;
+  fiber->stack = NULL;
+  fiber->stackTop = NULL;
+  fiber->openUpvalues = NULL;
+  fiber->openSlots = NULL;
+  vm.fiber = fiber;
+}
 
-        ObjClass *subclass = AS_CLASS(peek(0));
-        tableAddAll(&AS_CLASS(superclass)->methods,
-                    &subclass->methods);
-        pop(); // Subclass.
-        break;
+// unpark は fiber が parkFiber() で止められていれば連結リストから外す.
+static void unpark(ObjFiber *fiber) {
+  ObjFiber *previous = NULL;
+  for (ObjFiber *parked = vm.parked; parked != NULL;
+       parked = parked->nextParked) {
+    if (parked == fiber) {
+      if (previous == NULL) {
+        vm.parked = fiber->nextParked;
+      } else {
+        previous->nextParked = fiber->nextParked;
+        writeBarrier((Obj *) previous);
       }
-      case OP_METHOD:
-        defineMethod(READ_STRING());
-        break;
+      fiber->nextParked = NULL;
+      return;
     }
+    previous = parked;
   }
+}
 
-#undef READ_BYTE
-#undef READ_SHORT
-#undef READ_CONSTANT
-#undef READ_STRING
-#undef BINARY_OP
+InterpretResult resumeFiber(ObjFiber *fiber, Value value, Value *result) {
+  if (fiber->state == FIBER_DONE) {
+    runtimeError("Cannot resume a finished fiber.");
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  if (fiber->state == FIBER_RUNNING) {
+    runtimeError("Cannot resume a running fiber.");
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  unpark(fiber);
+
+  // 実行中のループから入れ子に fiber を実行する. fiber が yield するか終わるとループから戻ってくる.
+  ObjFiber *caller = vm.fiber;
+  saveFiber(caller);
+  loadFiber(fiber);
+  fiber->caller = caller;
+  InterpretResult status = INTERPRET_OK;
+  if (fiber->state == FIBER_NEW) {
+    fiber->state = FIBER_RUNNING;
+    ObjClosure *closure = AS_CLOSURE(vm.stack[0]);
+    int argCount = closure->function->arity == 0 ? 0 : 1;
+    if (argCount == 1) push(value);
+    if (!call(closure, argCount)) status = INTERPRET_RUNTIME_ERROR;
+  } else {
+    // yield の呼び出しの結果. yield した時点で呼び出しの分はスタックから降ろしてある.
+    fiber->state = FIBER_RUNNING;
+    push(value);
+  }
+  if (status == INTERPRET_OK) status = execute();
+
+  if (status == INTERPRET_OK) {
+    *result = pop();
+    fiber->state = FIBER_DONE;
+  } else if (fiber->state == FIBER_SUSPENDED) {
+    *result = fiber->transfer;
+    fiber->transfer = NIL_VAL;
+    status = INTERPRET_OK;
+  } else {
+    fiber->state = FIBER_DONE;
+  }
+
+  saveFiber(fiber);
+  loadFiber(caller);
+  fiber->caller = NULL;
+  if (status != INTERPRET_OK) {
+    // エラーは fiber のトレースまで書いてある. resume した側も続けて打ち切る.
+    abortFiber();
+  } else if (fiber->state == FIBER_DONE) {
+    // 最後のフレームが返ったときに upvalue はすべて閉じているので, スタックはもういらない
+    freeFiberStacks(fiber);
+  }
+  return status;
+}
+
+bool yieldFiber(Value value) {
+  ObjFiber *fiber = vm.fiber;
+  if (fiber->caller == NULL) {
+    return nativeError("Cannot yield from the main fiber.");
+  }
+  // 呼び出したネイティブ関数の C のスタックは捨てられないので, 入れ子の実行の中からは yield できない
+  if (vm.baseFrame != 0) {
+    return nativeError("Cannot yield across a native call.");
+  }
+  fiber->transfer = value;
+  fiber->state = FIBER_SUSPENDED;
+  return false;
+}
+
+ObjFiber *parkFiber() {
+  ObjFiber *fiber = vm.fiber;
+  yieldFiber(NIL_VAL);
+  if (fiber->state != FIBER_SUSPENDED) return NULL;
+  fiber->nextParked = vm.parked;
+  vm.parked = fiber;
+  return fiber;
 }
 
 void hack(bool b) {
@@ -659,14 +1855,39 @@ void hack(bool b) {
   if (b) hack(false);
 }
 
+void printQuickenStats(FILE *out) {
+  static const char *names[QUICKEN_KIND_COUNT] = {
+    [QUICKEN_ADD_NUM]       = "ADD_NUM",
+    [QUICKEN_GET_FIELD]     = "GET_FIELD",
+    [QUICKEN_INVOKE_METHOD] = "INVOKE_METHOD",
+    [QUICKEN_GET_LOCAL_FIELD] = "GET_LOCAL_FIELD",
+  };
+
+  for (int i = 0; i < QUICKEN_KIND_COUNT; i++) {
+    const QuickenStats *stats = &vm.quickenStats[i];
+    // 命令は汎用と特化のどちらかの状態なので, 差がいま特化したままの命令の数になる
+    fprintf(out, "quicken: %s quickened %llu, deoptimized %llu, "
+                 "still specialized %llu\n",
+            names[i], (unsigned long long) stats->quickened,
+            (unsigned long long) stats->deoptimized,
+            (unsigned long long) (stats->quickened - stats->deoptimized));
+  }
+}
+
 // interpret は入力された lox 言語を実行する入り口.
 InterpretResult interpret(const char *source) {
   ObjFunction *function = compile(source);
   if (function == NULL) return INTERPRET_COMPILE_ERROR;
+  return interpretFunction(function);
+}
 
+InterpretResult interpretFunction(ObjFunction *function) {
   // スクリプトをコンパイルするとき, まだRAWの関数オブジェクトを返す
   // NOTE: 関数オブジェクトをわざわざ PUSH/POP しているのはヒープに割り当てられたオブジェクトをGCに認識させるために必要な処理である.
   push(OBJ_VAL(function));
+  // レジスタ層では実行の前にスクリプトの関数をすべて翻訳する. 翻訳できない関数はスタック層で実行する.
+  // プロファイラはスタック層の命令しか数えないので, プロファイル中は翻訳しない.
+  if (vm.tier == TIER_REGISTER && !vm.profiling) translateFunction(function);
 /*
   CallFrame* frame = &vm.frames[vm.frameCount++]; // 先頭の CallFrame[0] を最初の関数に設定.
   frame->function = function;                     // トップレベル関数(暗黙的main)を参照させる.
@@ -685,5 +1906,8 @@ InterpretResult interpret(const char *source) {
   freeChunk(&chunk);
   return result;
 */
-  return run();
+  InterpretResult result = execute();
+  if (result == INTERPRET_OK) pop(); // スクリプトの戻り値 (nil)
+  flushOutput();
+  return result;
 }
@@ -4,27 +4,100 @@
 /* A Virtual Machine vm-h < Calls and Functions vm-include-object
 #include "chunk.h"
 */
+#include <stdio.h>
+
+#include "lox.h"
+#include "memory.h"
 #include "object.h"
+#include "output.h"
 #include "table.h"
 #include "value.h"
 
 /* A Virtual Machine stack-max < Calls and Functions frame-max
 #define STACK_MAX 256
 */
+/* Calls and Functions frame-max < Optimization growable-stack
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+*/
+// CallFrame の配列と値のスタックは足りなくなるたびに倍に伸ばす. 上限を超える深さの呼び出しは Stack overflow.
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL (FRAMES_INITIAL * UINT8_COUNT)
+#define FRAMES_MAX (1 << 18)
+#define STACK_MAX (1 << 22)
 
 // CallFrame は呼び出し中(実行中)の関数を表す構造体 -> 関数呼び出しのたびに一つ生成される.
 // slots -> 関数のローカル変数がスタックのどこから始まるのか.
 // 関数の呼び出し毎にリターンアドレスを追跡していなければならない.
 // - 呼び出されたCallFrameがReturnしたとき, 呼び出した側の CallFrame の *ip から動作を再開すればよい.
 // - よって呼び出し側CFの *ip がリターンアドレスと同じ意味をもつ.
-typedef struct {
+typedef struct CallFrame {
   ObjClosure *closure; // 呼び出されるクロージャ(関数)へのポインタ
   uint8_t *ip;  // 命令ポインタ(現在のバイトコード命令のアドレスを指す) -> 実行中のプログラムの「現在地」とも言える.
   Value *slots; // この関数が使用できる最初のスロット `VM{Value stack[];}` への Valueポインタで指す.
+  uint32_t *pc; // レジスタ層に翻訳された関数のフレームでは ip の代わりにこちらを使う.
 } CallFrame;
 
+// ExecutionTier はバイトコードを実行するインタプリタの層を表す.
+typedef enum {
+  TIER_STACK,    // コンパイラが出力したスタック型のバイトコードをそのまま実行する
+  TIER_REGISTER, // 実行の前に関数をレジスタ型の命令列に翻訳してから実行する (実験的)
+  TIER_JIT,      // スタック層で実行し, よく実行される関数を機械語にコンパイルする (jit.h)
+} ExecutionTier;
+
+// GcMode はGCの方式を表す.
+typedef enum {
+  GC_FULL,         // 毎回ヒープ全体を mark-sweep する
+  GC_GENERATIONAL, // 若い世代だけを回収するマイナーGCと, 全体を回収するメジャーGCを使い分ける
+  GC_INCREMENTAL,  // mark と sweep を小さなステップに分け, 確保のたびに少しずつ進める
+} GcMode;
+
+// GcPhase は逐次GCの進行状況を表す.
+typedef enum {
+  GC_IDLE,     // サイクルの合間
+  GC_MARKING,  // 灰色のオブジェクトを少しずつ黒く塗っている
+  GC_SWEEPING, // vm.objects を少しずつ sweep している
+} GcPhase;
+
+// 停止時間のヒストグラム. GC_PAUSE_LINEAR マイクロ秒未満は 1 マイクロ秒ごとの区間で,
+// それ以上は 2 のべき乗ごとに GC_PAUSE_SUBBUCKETS 等分した対数の区間で数える (誤差は 1/16 以内).
+// 最後の区間は 2^32 マイクロ秒 (約 71 分) 以上をすべて数える.
+#define GC_PAUSE_LINEAR 1024
+#define GC_PAUSE_SUBBUCKETS 16
+#define GC_PAUSE_BUCKETS (GC_PAUSE_LINEAR + (32 - 10) * GC_PAUSE_SUBBUCKETS)
+
+typedef struct {
+  int count;
+  double total; // 秒
+  double max;   // 秒
+} PauseStats;
+
+// GCStats はGCの回数と停止時間の統計.
+typedef struct {
+  PauseStats minor; // 世代別GCのマイナーGC
+  PauseStats major; // ヒープ全体の mark-sweep
+  PauseStats step;  // 逐次GCの一回分のステップ
+  int cycles;       // 逐次GCで完了したサイクルの数
+  size_t bytesFreed; // GCが解放したメモリ量の合計
+  size_t totalAllocated; // 前回のGCまでに確保したメモリ量の合計. 以降の分は allocatedSinceGC にある.
+  size_t peakHeap; // GCを始めた時点の bytesAllocated の最大値
+  int pauseHistogram[GC_PAUSE_BUCKETS]; // すべての停止時間の分布
+} GCStats;
+
+// QuickenKind は quickening で書き換わる特化した命令の種類 (opcodes.h の ADD_NUM 以降).
+typedef enum {
+  QUICKEN_ADD_NUM,
+  QUICKEN_GET_FIELD,
+  QUICKEN_INVOKE_METHOD,
+  QUICKEN_GET_LOCAL_FIELD,
+  QUICKEN_KIND_COUNT
+} QuickenKind;
+
+typedef struct {
+  uint64_t quickened;   // 汎用の命令を特化した命令に書き換えた回数
+  uint64_t deoptimized; // 想定が外れて汎用の命令に書き戻した回数
+} QuickenStats;
+
 // 仮想マシン
 typedef struct {
 /* A Virtual Machine vm-h < Calls and Functions frame-array
@@ -33,31 +106,70 @@ typedef struct {
 /* A Virtual Machine ip < Calls and Functions frame-array
   uint8_t* ip;
 */
-  CallFrame frames[FRAMES_MAX]; // 関数呼び出しは核なので毎回ヒープを確保すると遅いので事前にスタック(配列)として確保しておく.
+  // 関数呼び出しは核なので毎回ヒープを確保すると遅いので事前にスタック(配列)として確保しておく.
+  // 深い再帰では伸ばすので, CallFrame へのポインタを呼び出しをまたいで持ち続けてはならない.
+  CallFrame *frames;
   int frameCount; // CallFrameスタックの現在の高さ(進行中の関数呼び出しの数).
+  int frameCapacity;
+  // 実行中のインタプリタループは frameCount がこの値まで戻ったら返る. トップレベルでは 0 で,
+  // ネイティブ関数が callFunction() で Lox の関数を呼ぶ間はその呼び出しの下の高さになる.
+  int baseFrame;
+
+  // 実行中のファイバー. frames, stack, openUpvalues などの実行の状態はこのファイバーのもので,
+  // 別のファイバーに切り替えるときに ObjFiber の同名のフィールドに退避する.
+  ObjFiber *fiber;
+  ObjFiber *parked; // parkFiber() で止められたファイバーの連結リスト. GCの根.
 
-  Value stack[STACK_MAX]; // デフォルトで (64*(255+1))
+  // 伸ばすとアドレスが変わる. CallFrame の slots と open な upvalue はそのとき付け替える.
+  Value *stack;
+  Value *stackEnd; // 確保したスタックの末尾の次
   Value *stackTop; // スタックポインタ
-  Table globals; // グローバル変数
+  // グローバル変数はコンパイル時に名前ごとのスロット番号へ解決され,
+  // 命令はそのスロット番号で globalValues を直接読み書きする.
+  Table globals;            // グローバル変数名 -> スロット番号(NUMBER_VAL)
+  ValueArray globalValues;  // スロットごとの値. 未定義なら UNDEFINED_VAL.
+  ValueArray globalNames;   // スロットごとの変数名. 実行時エラーの報告に使う.
   Table strings; // 文字列プール
   ObjString *initString;
   ObjUpvalue *openUpvalues; // スタック上の変数を指す,すべてのOpenなクロージャ変数(の連結リストの先頭アドレス)
+  ObjUpvalue **openSlots;   // スタックのスロットごとの, そこを指す open な upvalue. なければ NULL. 大きさは stack と同じ.
 
   size_t bytesAllocated; // 確保したメモリ領域
   size_t nextGC; // 次GCを起動するときのサイズ
-  Obj *objects; // VMに確保されたオブジェクトの連結リストの先頭アドレス
+  Obj *objects; // VMに確保されたオブジェクトの連結リストの先頭アドレス. 世代別GCでは古い世代.
   int grayCount;
   int grayCapacity;
   Obj **grayStack;
-} VM;
 
-typedef enum {
-  INTERPRET_OK,
-  INTERPRET_COMPILE_ERROR,
-  INTERPRET_RUNTIME_ERROR
-} InterpretResult;
+  ExecutionTier tier; // 翻訳済みの関数はどちらの層から呼び出しても翻訳後の命令列を実行する
+  GcMode gcMode; // initVM() より前に設定すること. 途中で切り替えてはならない.
+  bool gcMinor; // マイナーGCの実行中か
+  bool gcStats; // freeVM() でGCの統計を表示するか
+  GCStats stats;
+  bool profiling; // 命令ごとにプロファイラを呼ぶか. startProfiler() が設定する.
+  QuickenStats quickenStats[QUICKEN_KIND_COUNT]; // スタック層の quickening の回数
+  size_t allocatedSinceGC; // 前回のGC(逐次GCではステップ)から確保したメモリ量
+  Obj *youngObjects; // 若い世代のオブジェクトの連結リスト
+  // 記憶集合: 若い世代を参照しているかもしれない古い世代のオブジェクト.
+  // 書き込みバリアが追加し, マイナーGCのルートとして扱う.
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj **remembered;
+
+  GcPhase gcPhase;
+  int gcStepBudget; // 逐次GCの一回のステップにかけてよい時間(マイクロ秒). 0 なら制限しない.
+  Obj *sweepPrevious; // 逐次 sweep で最後に残したオブジェクト
+  Obj *sweepCursor;   // 逐次 sweep で次に調べるオブジェクト
 
-extern VM vm; // グローバル変数vmを参照できるように.
+  Pool pool; // reallocate() が使う小さな領域のプール
+
+  // 出力先. initVM() が stdout と stderr にするので, 変えるならその後で設定する.
+  FILE *out; // print 文の出力
+  FILE *err; // コンパイルエラー, 実行時エラーとGCの統計
+  Output output; // out に書く前の print 文の出力
+} VM;
+
+extern THREAD_LOCAL VM vm; // グローバル変数vmを参照できるように. スレッドごとに別の実体を持つ.
 
 void initVM();
 
@@ -68,6 +180,17 @@ InterpretResult interpret(Chunk* chunk);
 */
 InterpretResult interpret(const char *source);
 
+// interpretFunction はコンパイル済み(あるいはイメージから読み込んだ)スクリプト関数を実行する.
+InterpretResult interpretFunction(ObjFunction *function);
+
+int globalSlot(ObjString *name);
+
+int frameLine(CallFrame *frame);
+
+// printQuickenStats は特化した命令の種類ごとに, 書き換えと書き戻しの回数と,
+// いま特化したままの命令の数を out に書き出す. freeVM() の後に呼んでもよい.
+void printQuickenStats(FILE *out);
+
 void push(Value value);
 
 Value pop();
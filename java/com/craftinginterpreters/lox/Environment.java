@@ -1,6 +1,9 @@
 //> Statements and State environment-class
 package com.craftinginterpreters.lox;
 
+//> Resolving and Binding omit
+import java.util.Arrays;
+//< Resolving and Binding omit
 import java.util.HashMap;
 import java.util.Map;
 
@@ -8,14 +11,33 @@ class Environment {
 //> enclosing-field
   final Environment enclosing;
 //< enclosing-field
+/* Statements and State environment-class < Resolving and Binding omit
   private final Map<String, Object> values = new HashMap<>();
+*/
+//> Resolving and Binding omit
+  // Globals are late bound, so only the global environment keeps its
+  // variables in a map. Every other environment stores its locals in the
+  // slots the Resolver assigned them, in the order they are declared.
+  private final Map<String, Object> values;
+  private String[] names;
+  private Object[] slots;
+  private int count = 0;
+//< Resolving and Binding omit
 //> environment-constructors
   Environment() {
     enclosing = null;
+//> Resolving and Binding omit
+    values = new HashMap<>();
+//< Resolving and Binding omit
   }
 
   Environment(Environment enclosing) {
     this.enclosing = enclosing;
+//> Resolving and Binding omit
+    values = null;
+    names = new String[4];
+    slots = new Object[4];
+//< Resolving and Binding omit
   }
 //< environment-constructors
 //> environment-get
@@ -36,10 +58,27 @@ class Environment {
 //< environment-get
 //> environment-assign
   void assign(Token name, Object value) {
+/* Statements and State environment-assign < Resolving and Binding omit
     if (values.containsKey(name.lexeme)) {
       values.put(name.lexeme, value);
       return;
     }
+*/
+//> Resolving and Binding omit
+    if (values == null) {
+      // A class declaration is the only thing that assigns a local by
+      // name: it defines the name before the class itself exists.
+      for (int i = count - 1; i >= 0; i--) {
+        if (names[i].equals(name.lexeme)) {
+          slots[i] = value;
+          return;
+        }
+      }
+    } else if (values.containsKey(name.lexeme)) {
+      values.put(name.lexeme, value);
+      return;
+    }
+//< Resolving and Binding omit
 
 //> environment-assign-enclosing
     if (enclosing != null) {
@@ -54,7 +93,24 @@ class Environment {
 //< environment-assign
 //> environment-define
   void define(String name, Object value) {
+/* Statements and State environment-define < Resolving and Binding omit
     values.put(name, value);
+*/
+//> Resolving and Binding omit
+    if (values != null) {
+      values.put(name, value);
+      return;
+    }
+
+    // Locals are defined in declaration order, which puts each one in the
+    // slot the Resolver assigned it.
+    if (count == slots.length) {
+      names = Arrays.copyOf(names, count * 2);
+      slots = Arrays.copyOf(slots, count * 2);
+    }
+    names[count] = name;
+    slots[count++] = value;
+//< Resolving and Binding omit
   }
 //< environment-define
 //> Resolving and Binding ancestor
@@ -68,19 +124,48 @@ class Environment {
   }
 //< Resolving and Binding ancestor
 //> Resolving and Binding get-at
+/* Resolving and Binding get-at < Resolving and Binding omit
   Object getAt(int distance, String name) {
     return ancestor(distance).values.get(name);
   }
+*/
+//> Resolving and Binding omit
+  Object getAt(int distance, int slot) {
+    return ancestor(distance).slots[slot];
+  }
+//< Resolving and Binding omit
 //< Resolving and Binding get-at
 //> Resolving and Binding assign-at
+/* Resolving and Binding assign-at < Resolving and Binding omit
   void assignAt(int distance, Token name, Object value) {
     ancestor(distance).values.put(name.lexeme, value);
   }
+*/
+//> Resolving and Binding omit
+  void assignAt(int distance, int slot, Object value) {
+    ancestor(distance).slots[slot] = value;
+  }
+//< Resolving and Binding omit
 //< Resolving and Binding assign-at
 //> omit
   @Override
   public String toString() {
+/* Statements and State omit < Resolving and Binding omit
     String result = values.toString();
+*/
+//> Resolving and Binding omit
+    String result;
+    if (values != null) {
+      result = values.toString();
+    } else {
+      StringBuilder builder = new StringBuilder("{");
+      for (int i = 0; i < count; i++) {
+        if (i > 0) builder.append(", ");
+        builder.append(names[i]).append("=").append(slots[i]);
+      }
+      result = builder.append("}").toString();
+    }
+//< Resolving and Binding omit
     if (enclosing != null) {
       result += " -> " + enclosing.toString();
     }
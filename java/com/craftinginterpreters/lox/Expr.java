@@ -18,6 +18,14 @@ abstract class Expr {
     R visitUnaryExpr(Unary expr);
     R visitVariableExpr(Variable expr);
   }
+//> omit
+
+  // Set by the Resolver on the expressions that name a variable: how
+  // many environments out it lives and its slot in that environment.
+  // A depth of -1 means it is a global and is looked up by name.
+  int depth = -1;
+  int slot;
+//< omit
 
   // Nested Expr classes here...
 //> expr-assign
@@ -29,7 +29,12 @@ class Interpreter implements Expr.Visitor<Object>,
   private Environment environment = globals;
 //< Functions global-environment
 //> Resolving and Binding locals-field
+/* Resolving and Binding locals-field < Resolving and Binding omit
   private final Map<Expr, Integer> locals = new HashMap<>();
+*/
+//> Resolving and Binding omit
+  // The Resolver stores where each local lives on the Expr itself.
+//< Resolving and Binding omit
 //< Resolving and Binding locals-field
 //> Statements and State environment-field
 
@@ -84,8 +89,15 @@ class Interpreter implements Expr.Visitor<Object>,
   }
 //< Statements and State execute
 //> Resolving and Binding resolve
+/* Resolving and Binding resolve < Resolving and Binding omit
   void resolve(Expr expr, int depth) {
     locals.put(expr, depth);
+*/
+//> Resolving and Binding omit
+  void resolve(Expr expr, int depth, int slot) {
+    expr.depth = depth;
+    expr.slot = slot;
+//< Resolving and Binding omit
   }
 //< Resolving and Binding resolve
 //> Statements and State execute-block
@@ -250,9 +262,15 @@ class Interpreter implements Expr.Visitor<Object>,
 */
 //> Resolving and Binding resolved-assign
 
+/* Resolving and Binding resolved-assign < Resolving and Binding omit
     Integer distance = locals.get(expr);
     if (distance != null) {
       environment.assignAt(distance, expr.name, value);
+*/
+//> Resolving and Binding omit
+    if (expr.depth >= 0) {
+      environment.assignAt(expr.depth, expr.slot, value);
+//< Resolving and Binding omit
     } else {
       globals.assign(expr.name, value);
     }
@@ -298,11 +316,21 @@ class Interpreter implements Expr.Visitor<Object>,
 //> check-minus-operand
         checkNumberOperands(expr.operator, left, right);
 //< check-minus-operand
+/* Evaluating Expressions visit-binary < Evaluating Expressions omit
         return (double)left - (double)right;
+*/
+//> Evaluating Expressions omit
+        return number((double)left - (double)right);
+//< Evaluating Expressions omit
 //> binary-plus
       case PLUS:
         if (left instanceof Double && right instanceof Double) {
+/* Evaluating Expressions binary-plus < Evaluating Expressions omit
           return (double)left + (double)right;
+*/
+//> Evaluating Expressions omit
+          return number((double)left + (double)right);
+//< Evaluating Expressions omit
         } // [plus]
 
         if (left instanceof String && right instanceof String) {
@@ -321,12 +349,22 @@ class Interpreter implements Expr.Visitor<Object>,
 //> check-slash-operand
         checkNumberOperands(expr.operator, left, right);
 //< check-slash-operand
+/* Evaluating Expressions visit-binary < Evaluating Expressions omit
         return (double)left / (double)right;
+*/
+//> Evaluating Expressions omit
+        return number((double)left / (double)right);
+//< Evaluating Expressions omit
       case STAR:
 //> check-star-operand
         checkNumberOperands(expr.operator, left, right);
 //< check-star-operand
+/* Evaluating Expressions visit-binary < Evaluating Expressions omit
         return (double)left * (double)right;
+*/
+//> Evaluating Expressions omit
+        return number((double)left * (double)right);
+//< Evaluating Expressions omit
     }
 
     // Unreachable.
@@ -418,13 +456,28 @@ class Interpreter implements Expr.Visitor<Object>,
 //> Inheritance interpreter-visit-super
   @Override
   public Object visitSuperExpr(Expr.Super expr) {
+/* Inheritance interpreter-visit-super < Inheritance omit
     int distance = locals.get(expr);
+*/
     LoxClass superclass = (LoxClass)environment.getAt(
+/* Inheritance interpreter-visit-super < Inheritance omit
         distance, "super");
+*/
+//> Inheritance omit
+        expr.depth, expr.slot);
+//< Inheritance omit
 //> super-find-this
 
+//> Inheritance omit
+    // "this" is always the only variable in the scope inside "super"'s.
+//< Inheritance omit
     LoxInstance object = (LoxInstance)environment.getAt(
+/* Inheritance super-find-this < Inheritance omit
         distance - 1, "this");
+*/
+//> Inheritance omit
+        expr.depth - 1, 0);
+//< Inheritance omit
 //< super-find-this
 //> super-find-method
 
@@ -461,7 +514,12 @@ class Interpreter implements Expr.Visitor<Object>,
 //> check-unary-operand
         checkNumberOperand(expr.operator, right);
 //< check-unary-operand
+/* Evaluating Expressions visit-unary < Evaluating Expressions omit
         return -(double)right;
+*/
+//> Evaluating Expressions omit
+        return number(-(double)right);
+//< Evaluating Expressions omit
     }
 
     // Unreachable.
@@ -480,15 +538,42 @@ class Interpreter implements Expr.Visitor<Object>,
   }
 //> Resolving and Binding look-up-variable
   private Object lookUpVariable(Token name, Expr expr) {
+/* Resolving and Binding look-up-variable < Resolving and Binding omit
     Integer distance = locals.get(expr);
     if (distance != null) {
       return environment.getAt(distance, name.lexeme);
+*/
+//> Resolving and Binding omit
+    if (expr.depth >= 0) {
+      return environment.getAt(expr.depth, expr.slot);
+//< Resolving and Binding omit
     } else {
       return globals.get(name);
     }
   }
 //< Resolving and Binding look-up-variable
 //< Statements and State visit-variable
+//> Evaluating Expressions omit
+  // Arithmetic boxes every result. Loop counters and other small integers
+  // come up over and over, so reuse one Double for each of those.
+  private static final Double[] smallIntegers = new Double[1024];
+  static {
+    for (int i = 0; i < smallIntegers.length; i++) {
+      smallIntegers[i] = (double)i;
+    }
+  }
+
+  // Boxes an arithmetic result, sharing the cached Double for small
+  // integers. -0 is not cached so that it still prints as "-0".
+  private static Double number(double value) {
+    int index = (int)value;
+    if (index == value && index >= 0 && index < smallIntegers.length &&
+        (index != 0 || 1 / value > 0)) {
+      return smallIntegers[index];
+    }
+    return value;
+  }
+//< Evaluating Expressions omit
 //> check-operand
   private void checkNumberOperand(Token operator, Object operand) {
     if (operand instanceof Double) return;
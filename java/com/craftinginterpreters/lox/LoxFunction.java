@@ -75,7 +75,12 @@ class LoxFunction implements LoxCallable {
       interpreter.executeBlock(declaration.body, environment);
     } catch (Return returnValue) {
 //> Classes early-return-this
+/* Classes early-return-this < Classes omit
       if (isInitializer) return closure.getAt(0, "this");
+*/
+//> Classes omit
+      if (isInitializer) return closure.getAt(0, 0);
+//< Classes omit
 
 //< Classes early-return-this
       return returnValue.value;
@@ -83,7 +88,12 @@ class LoxFunction implements LoxCallable {
 //< catch-return
 //> Classes return-this
 
+/* Classes return-this < Classes omit
     if (isInitializer) return closure.getAt(0, "this");
+*/
+//> Classes omit
+    if (isInitializer) return closure.getAt(0, 0);
+//< Classes omit
 //< Classes return-this
     return null;
   }
@@ -9,8 +9,26 @@ import java.util.Stack;
 class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
   private final Interpreter interpreter;
 //> scopes-field
+/* Resolving and Binding scopes-field < Resolving and Binding omit
   private final Stack<Map<String, Boolean>> scopes = new Stack<>();
+*/
+//> Resolving and Binding omit
+  private final Stack<Map<String, Local>> scopes = new Stack<>();
+//< Resolving and Binding omit
 //< scopes-field
+//> Resolving and Binding omit
+  // A local variable in one of the enclosing scopes. Its slot is its
+  // position among the scope's declarations, which is also where the
+  // Interpreter defines it in that scope's Environment.
+  private static class Local {
+    final int slot;
+    boolean defined = false;
+
+    Local(int slot) {
+      this.slot = slot;
+    }
+  }
+//< Resolving and Binding omit
 //> function-type-field
   private FunctionType currentFunction = FunctionType.NONE;
 //< function-type-field
@@ -96,14 +114,24 @@ class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
 
     if (stmt.superclass != null) {
       beginScope();
+/* Inheritance begin-super-scope < Inheritance omit
       scopes.peek().put("super", true);
+*/
+//> Inheritance omit
+      addLocal("super").defined = true;
+//< Inheritance omit
     }
 //< Inheritance begin-super-scope
 //> resolve-methods
 
 //> resolver-begin-this-scope
     beginScope();
+/* Classes resolver-begin-this-scope < Classes omit
     scopes.peek().put("this", true);
+*/
+//> Classes omit
+    addLocal("this").defined = true;
+//< Classes omit
 
 //< resolver-begin-this-scope
     for (Stmt.Function method : stmt.methods) {
@@ -319,10 +347,20 @@ class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
 //> visit-variable-expr
   @Override
   public Void visitVariableExpr(Expr.Variable expr) {
+/* Resolving and Binding visit-variable-expr < Resolving and Binding omit
     if (!scopes.isEmpty() &&
         scopes.peek().get(expr.name.lexeme) == Boolean.FALSE) {
       Lox.error(expr.name,
           "Can't read local variable in its own initializer.");
+*/
+//> Resolving and Binding omit
+    if (!scopes.isEmpty()) {
+      Local local = scopes.peek().get(expr.name.lexeme);
+      if (local != null && !local.defined) {
+        Lox.error(expr.name,
+            "Can't read local variable in its own initializer.");
+      }
+//< Resolving and Binding omit
     }
 
     resolveLocal(expr, expr.name);
@@ -364,7 +402,12 @@ class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
 //< resolve-function
 //> begin-scope
   private void beginScope() {
+/* Resolving and Binding begin-scope < Resolving and Binding omit
     scopes.push(new HashMap<String, Boolean>());
+*/
+//> Resolving and Binding omit
+    scopes.push(new HashMap<String, Local>());
+//< Resolving and Binding omit
   }
 //< begin-scope
 //> end-scope
@@ -376,7 +419,12 @@ class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
   private void declare(Token name) {
     if (scopes.isEmpty()) return;
 
+/* Resolving and Binding declare < Resolving and Binding omit
     Map<String, Boolean> scope = scopes.peek();
+*/
+//> Resolving and Binding omit
+    Map<String, Local> scope = scopes.peek();
+//< Resolving and Binding omit
 //> duplicate-variable
     if (scope.containsKey(name.lexeme)) {
       Lox.error(name,
@@ -384,20 +432,45 @@ class Resolver implements Expr.Visitor<Void>, Stmt.Visitor<Void> {
     }
 
 //< duplicate-variable
+/* Resolving and Binding declare < Resolving and Binding omit
     scope.put(name.lexeme, false);
+*/
+//> Resolving and Binding omit
+    addLocal(name.lexeme);
+//< Resolving and Binding omit
   }
 //< declare
 //> define
   private void define(Token name) {
     if (scopes.isEmpty()) return;
+/* Resolving and Binding define < Resolving and Binding omit
     scopes.peek().put(name.lexeme, true);
+*/
+//> Resolving and Binding omit
+    scopes.peek().get(name.lexeme).defined = true;
+//< Resolving and Binding omit
   }
 //< define
+//> Resolving and Binding omit
+  private Local addLocal(String name) {
+    Map<String, Local> scope = scopes.peek();
+    Local local = new Local(scope.size());
+    scope.put(name, local);
+    return local;
+  }
+//< Resolving and Binding omit
 //> resolve-local
   private void resolveLocal(Expr expr, Token name) {
     for (int i = scopes.size() - 1; i >= 0; i--) {
+/* Resolving and Binding resolve-local < Resolving and Binding omit
       if (scopes.get(i).containsKey(name.lexeme)) {
         interpreter.resolve(expr, scopes.size() - 1 - i);
+*/
+//> Resolving and Binding omit
+      Local local = scopes.get(i).get(name.lexeme);
+      if (local != null) {
+        interpreter.resolve(expr, scopes.size() - 1 - i, local.slot);
+//< Resolving and Binding omit
         return;
       }
     }
@@ -109,6 +109,23 @@ public class GenerateAst {
     defineVisitor(writer, baseName, types);
 
 //< call-define-visitor
+//> Resolving and Binding omit
+    // Expressions that name a variable remember where the resolver found it.
+    // They are tagged omit so that Appendix II still shows the book's code.
+    if (baseName.equals("Expr")) {
+      writer.println("//> omit");
+      writer.println();
+      writer.println("  // Set by the Resolver on the expressions that name" +
+          " a variable: how");
+      writer.println("  // many environments out it lives and its slot in" +
+          " that environment.");
+      writer.println("  // A depth of -1 means it is a global and is looked" +
+          " up by name.");
+      writer.println("  int depth = -1;");
+      writer.println("  int slot;");
+      writer.println("//< omit");
+    }
+//< Resolving and Binding omit
 //> omit
     writer.println();
     writer.println("  // Nested " + baseName + " classes here...");
@@ -0,0 +1,300 @@
+// host.c は clox を組み込むホストの例. lox.h の API だけを使い, 結果を自分で確かめる.
+// make test_embed でビルドして実行する. 確かめたことが一つでも違えば表示して 1 で終わる.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lox.h"
+
+static int failures = 0;
+
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+static void check(bool ok, const char *condition, int line) {
+  if (ok) return;
+  fprintf(stderr, "host.c:%d: check failed: %s\n", line, condition);
+  failures++;
+}
+
+// Capture は setOutput() で受け取った print 文の出力を溜める.
+typedef struct {
+  char chars[4096];
+  size_t length;
+} Capture;
+
+static void captureWrite(const char *chars, size_t length, void *userdata) {
+  Capture *capture = (Capture *) userdata;
+  if (capture->length + length >= sizeof(capture->chars)) {
+    length = sizeof(capture->chars) - capture->length - 1;
+  }
+  memcpy(capture->chars + capture->length, chars, length);
+  capture->length += length;
+  capture->chars[capture->length] = '\0';
+}
+
+static void resetCapture(Capture *capture) {
+  capture->length = 0;
+  capture->chars[0] = '\0';
+}
+
+// Buffer は Lox に渡す数の配列. ObjForeign で包み, Lox からはネイティブ関数でしか触れない.
+static const char BUFFER_TAG[] = "Buffer";
+
+typedef struct {
+  int created;
+  int finalized;
+} BufferStats;
+
+// ファイナライザにはユーザーデータがないので, 数えるのはファイル内の変数にする
+static BufferStats bufferStats;
+
+static void finalizeBuffer(void *data, size_t length) {
+  free(data);
+  bufferStats.finalized++;
+}
+
+static double *asBuffer(Value value, size_t *count) {
+  size_t length;
+  double *numbers = (double *) foreignData(value, BUFFER_TAG, &length);
+  if (numbers != NULL) *count = length / sizeof(double);
+  return numbers;
+}
+
+// newBuffer(n) は 0 で埋めた n 個の数の Buffer を作る
+static bool newBufferNative(int argCount, Value *args, Value *result,
+                            void *userdata) {
+  if (argCount != 1 || !IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0) {
+    return nativeError("Expected a length.");
+  }
+  size_t count = (size_t) AS_NUMBER(args[0]);
+  double *numbers = (double *) calloc(count == 0 ? 1 : count, sizeof(double));
+  *result = OBJ_VAL(newForeign(BUFFER_TAG, numbers, count * sizeof(double),
+                               finalizeBuffer));
+  bufferStats.created++;
+  return true;
+}
+
+static bool bufferIndex(int argCount, Value *args, int expected,
+                        double **numbers, size_t *index) {
+  size_t count;
+  if (argCount != expected || (*numbers = asBuffer(args[0], &count)) == NULL) {
+    return nativeError("Expected a Buffer.");
+  }
+  if (!IS_NUMBER(args[1]) || AS_NUMBER(args[1]) < 0 ||
+      AS_NUMBER(args[1]) >= count) {
+    return nativeError("Buffer index out of bounds.");
+  }
+  *index = (size_t) AS_NUMBER(args[1]);
+  return true;
+}
+
+// bufferGet(buffer, i) は i 番目の数を返す
+static bool bufferGetNative(int argCount, Value *args, Value *result,
+                            void *userdata) {
+  double *numbers;
+  size_t index;
+  if (!bufferIndex(argCount, args, 2, &numbers, &index)) return false;
+  *result = NUMBER_VAL(numbers[index]);
+  return true;
+}
+
+// bufferSet(buffer, i, value) は i 番目に value を書く
+static bool bufferSetNative(int argCount, Value *args, Value *result,
+                            void *userdata) {
+  double *numbers;
+  size_t index;
+  if (!bufferIndex(argCount, args, 3, &numbers, &index)) return false;
+  if (!IS_NUMBER(args[2])) return nativeError("Expected a number.");
+  numbers[index] = AS_NUMBER(args[2]);
+  *result = NIL_VAL;
+  return true;
+}
+
+// bufferMap(buffer, fn) は各要素を fn(x) の結果で置き換える. Lox の関数は callFunction() で入れ子に呼ぶ.
+static bool bufferMapNative(int argCount, Value *args, Value *result,
+                            void *userdata) {
+  size_t count;
+  double *numbers = argCount == 2 ? asBuffer(args[0], &count) : NULL;
+  if (numbers == NULL) return nativeError("Expected a Buffer and a function.");
+
+  // callFunction() の後は args が無効になるので先に取り出しておく. 値はスタックに残っているので回収されない.
+  Value fn = args[1];
+  for (size_t i = 0; i < count; i++) {
+    Value x = NUMBER_VAL(numbers[i]);
+    Value mapped;
+    if (callFunction(fn, 1, &x, &mapped) != INTERPRET_OK) return false;
+    if (!IS_NUMBER(mapped)) return nativeError("Expected fn to return a number.");
+    numbers[i] = AS_NUMBER(mapped);
+  }
+  *result = NIL_VAL;
+  return true;
+}
+
+// counter() は呼ばれるたびに userdata の int を一つ増やして返す
+static bool counterNative(int argCount, Value *args, Value *result,
+                          void *userdata) {
+  int *count = (int *) userdata;
+  *result = NUMBER_VAL(++*count);
+  return true;
+}
+
+// Request は wait() で止めたファイバーと, 完了したときに渡す値.
+// 非同期 I/O の代わりに, ホストのイベントループがまとめて完了させる.
+typedef struct {
+  ObjFiber *fibers[8];
+  double values[8];
+  int count;
+} Requests;
+
+// wait(x) は実行中のファイバーを止める. ホストが後で x * 2 を渡して再開する.
+static bool waitNative(int argCount, Value *args, Value *result,
+                       void *userdata) {
+  Requests *requests = (Requests *) userdata;
+  if (argCount != 1 || !IS_NUMBER(args[0])) {
+    return nativeError("Expected a number.");
+  }
+  if (requests->count == 8) return nativeError("Too many requests.");
+  double value = AS_NUMBER(args[0]);
+  ObjFiber *fiber = parkFiber();
+  if (fiber == NULL) return false;
+  requests->fibers[requests->count] = fiber;
+  requests->values[requests->count] = value;
+  requests->count++;
+  return false;
+}
+
+// ErrorLog は実行時エラーの報告を読むため, stderr を一時ファイルに向けておく.
+typedef struct {
+  FILE *file;
+  int saved;
+  char chars[4096];
+} ErrorLog;
+
+static void beginErrorLog(ErrorLog *log) {
+  fflush(stderr);
+  log->file = tmpfile();
+  log->saved = dup(fileno(stderr));
+  dup2(fileno(log->file), fileno(stderr));
+}
+
+static const char *endErrorLog(ErrorLog *log) {
+  fflush(stderr);
+  dup2(log->saved, fileno(stderr));
+  close(log->saved);
+  rewind(log->file);
+  size_t length = fread(log->chars, 1, sizeof(log->chars) - 1, log->file);
+  log->chars[length] = '\0';
+  fclose(log->file);
+  return log->chars;
+}
+
+static InterpretResult interpretWithErrors(const char *source,
+                                           const char **errors) {
+  static ErrorLog errorLog;
+  beginErrorLog(&errorLog);
+  InterpretResult result = interpret(source);
+  *errors = endErrorLog(&errorLog);
+  return result;
+}
+
+static const char SCRIPT[] =
+    "var buffer = newBuffer(3);\n"
+    "for (var i = 0; i < 3; i = i + 1) bufferSet(buffer, i, i + scale);\n"
+    "fun scaleByCount(x) { return x * counter(); }\n"
+    "bufferMap(buffer, scaleByCount);\n"
+    "print bufferGet(buffer, 0) + bufferGet(buffer, 1) + bufferGet(buffer, 2);\n"
+    "for (var i = 0; i < 100; i = i + 1) newBuffer(1);\n"
+    "fun total(a, b) {\n"
+    "  var sum = 0;\n"
+    "  fun add(x) {\n"
+    "    sum = sum + x;\n"
+    "    return x;\n"
+    "  }\n"
+    "  bufferMap(buffer, add);\n"
+    "  return sum + a + b;\n"
+    "}\n"
+    "fun task(x) {\n"
+    "  var answer = wait(x);\n"
+    "  print answer;\n"
+    "  return answer + 1;\n"
+    "}\n"
+    "resume(fiber(task), 10);\n"
+    "resume(fiber(task), 20);\n"
+    "print \"parked\";\n"
+    "fun outOfBounds(x) { return bufferGet(buffer, 99); }\n"
+    "fun notANumber(x) { return x + \"s\"; }\n";
+
+int main(int argc, const char *argv[]) {
+  int count = 0;
+  Requests requests = {{NULL}, {0}, 0};
+  Capture capture = {{0}, 0};
+
+  initVM();
+  setOutput(captureWrite, &capture);
+  defineNative("newBuffer", newBufferNative, NULL);
+  defineNative("bufferGet", bufferGetNative, NULL);
+  defineNative("bufferSet", bufferSetNative, NULL);
+  defineNative("bufferMap", bufferMapNative, NULL);
+  defineNative("counter", counterNative, &count);
+  defineNative("wait", waitNative, &requests);
+  defineGlobal("scale", NUMBER_VAL(10));
+
+  // (10 * 1) + (11 * 2) + (12 * 3)
+  CHECK(interpret(SCRIPT) == INTERPRET_OK);
+  CHECK(strcmp(capture.chars, "68\nparked\n") == 0);
+  CHECK(count == 3);
+  CHECK(bufferStats.created == 101);
+
+  // ホストから Lox の関数を呼ぶ. total() の中で bufferMap() がさらに Lox の関数を呼ぶ.
+  Value total;
+  CHECK(getGlobal("total", &total));
+  Value args[2] = {NUMBER_VAL(1), NUMBER_VAL(2)};
+  Value result = NIL_VAL;
+  CHECK(callFunction(total, 2, args, &result) == INTERPRET_OK);
+  CHECK(IS_NUMBER(result) && AS_NUMBER(result) == 71);
+  CHECK(!getGlobal("missing", &result));
+
+  // イベントループの代わりに, 止まっているファイバーを完了した順に再開する
+  CHECK(requests.count == 2);
+  resetCapture(&capture);
+  for (int i = requests.count - 1; i >= 0; i--) {
+    CHECK(resumeFiber(requests.fibers[i], NUMBER_VAL(requests.values[i] * 2),
+                      &result) == INTERPRET_OK);
+    CHECK(IS_NUMBER(result) && AS_NUMBER(result) == requests.values[i] * 2 + 1);
+  }
+  flushOutput();
+  CHECK(strcmp(capture.chars, "40\n20\n") == 0);
+
+  // ネイティブ関数のエラーは, 入れ子の呼び出しの中で起きたものも含めて実行全体を打ち切る
+  const char *errors;
+  CHECK(interpretWithErrors("bufferGet(1, 0);", &errors) ==
+        INTERPRET_RUNTIME_ERROR);
+  CHECK(strstr(errors, "Expected a Buffer.") != NULL);
+  CHECK(interpretWithErrors("bufferMap(buffer, outOfBounds);", &errors) ==
+        INTERPRET_RUNTIME_ERROR);
+  CHECK(strstr(errors, "Buffer index out of bounds.") != NULL);
+  CHECK(interpretWithErrors("bufferMap(buffer, notANumber);", &errors) ==
+        INTERPRET_RUNTIME_ERROR);
+  CHECK(strstr(errors, "Operands must be") != NULL);
+  CHECK(interpretWithErrors("wait(1);", &errors) == INTERPRET_RUNTIME_ERROR);
+  CHECK(strstr(errors, "Cannot yield from the main fiber.") != NULL);
+
+  // エラーの後も VM は使える. buffer はエラーの前と変わっていない.
+  resetCapture(&capture);
+  CHECK(interpret("print bufferGet(buffer, 2);") == INTERPRET_OK);
+  CHECK(strcmp(capture.chars, "36\n") == 0);
+
+  // 残っている Buffer は freeVM() がすべてファイナライズする
+  freeVM();
+  CHECK(bufferStats.finalized == bufferStats.created);
+
+  if (failures > 0) {
+    fprintf(stderr, "%d check(s) failed.\n", failures);
+    return 1;
+  }
+  printf("All embedding checks passed.\n");
+  return 0;
+}
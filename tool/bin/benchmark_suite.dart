@@ -0,0 +1,218 @@
+import 'dart:convert';
+import 'dart:io';
+
+import 'package:args/args.dart';
+import 'package:glob/glob.dart';
+import 'package:path/path.dart' as p;
+
+import 'package:tool/src/term.dart' as term;
+
+/// Runs every benchmark in test/benchmark a fixed number of times, records
+/// wall time and memory statistics, and optionally compares the results
+/// against a stored baseline.
+///
+/// Unlike benchmark.dart, which runs a single benchmark forever to find its
+/// best time, this is meant to be run unattended, e.g. before and after a
+/// change, and exits with a non-zero code if anything got slower.
+
+final _minorPattern = RegExp(r"^gc: minor (\d+)", multiLine: true);
+final _majorPattern = RegExp(r"^gc: major (\d+)", multiLine: true);
+final _stepPattern = RegExp(r"^gc: step (\d+)", multiLine: true);
+final _allocatedPattern = RegExp(
+    r"^gc: allocated (\d+) bytes, freed (\d+) bytes, peak heap (\d+) bytes",
+    multiLine: true);
+final _rssPattern = RegExp(r"^gc: peak rss (\d+) KB", multiLine: true);
+
+void main(List<String> arguments) {
+  var parser = ArgParser();
+  parser.addOption("runs",
+      abbr: "n", defaultsTo: "5", help: "Number of runs per benchmark.");
+  parser.addOption("output",
+      abbr: "o", help: "Write the results as JSON to this path.");
+  parser.addOption("baseline",
+      abbr: "b", help: "Compare against the JSON results at this path.");
+  parser.addOption("threshold",
+      abbr: "t",
+      defaultsTo: "5",
+      help: "Percent slowdown or growth that counts as a regression.");
+  parser.addOption("filter",
+      abbr: "f", help: "Only run benchmarks whose name contains this.");
+
+  var options = parser.parse(arguments);
+  if (options.rest.length > 1) {
+    print("Usage: benchmark_suite.dart [options] [interpreter]");
+    print("");
+    print(parser.usage);
+    exit(1);
+  }
+
+  var interpreter = options.rest.isEmpty ? "build/clox" : options.rest[0];
+  var runs = int.parse(options["runs"] as String);
+  var threshold = double.parse(options["threshold"] as String);
+  var filter = options["filter"] as String;
+
+  var paths = Glob("test/benchmark/*.lox")
+      .listSync()
+      .map((entry) => entry.path)
+      .where((path) => filter == null || p.basename(path).contains(filter))
+      .toList()
+    ..sort();
+
+  var results = <String, Object>{};
+  for (var path in paths) {
+    var name = p.basenameWithoutExtension(path);
+    term.writeLine("Running ${term.cyan(name)}...");
+    results[name] = _runBenchmark(interpreter, path, runs);
+  }
+  term.clearLine();
+
+  var report = <String, Object>{
+    "interpreter": interpreter,
+    "runs": runs,
+    "benchmarks": results,
+  };
+
+  var outputPath = options["output"] as String;
+  if (outputPath != null) {
+    File(outputPath).writeAsStringSync(
+        JsonEncoder.withIndent("  ").convert(report) + "\n");
+  }
+
+  Map<String, Object> baseline;
+  var baselinePath = options["baseline"] as String;
+  if (baselinePath != null) {
+    var file = File(baselinePath);
+    if (file.existsSync()) {
+      var json = jsonDecode(file.readAsStringSync()) as Map<String, Object>;
+      baseline = json["benchmarks"] as Map<String, Object>;
+    } else {
+      print("No baseline at $baselinePath, not comparing.");
+    }
+  }
+
+  if (!_printResults(results, baseline, threshold)) exit(1);
+}
+
+/// Runs the benchmark at [path] [runs] times and returns its statistics.
+Map<String, Object> _runBenchmark(String interpreter, String path, int runs) {
+  var times = <double>[];
+  var stats = <String, int>{};
+
+  for (var i = 0; i < runs; i++) {
+    var stopwatch = Stopwatch()..start();
+    var result = Process.runSync(
+        interpreter, ["--no-cache", "--gc-stats", path],
+        stdoutEncoding: utf8, stderrEncoding: utf8);
+    stopwatch.stop();
+
+    if (result.exitCode != 0) {
+      term.clearLine();
+      print("${term.red('FAIL')} $path exited with ${result.exitCode}:");
+      print(result.stderr);
+      exit(1);
+    }
+
+    times.add(stopwatch.elapsedMicroseconds / 1000000.0);
+
+    // The GC counts and allocation totals are deterministic, so any run's
+    // values will do. Peak RSS can vary slightly, so keep the largest.
+    var output = result.stderr as String;
+    stats["minor"] = _match(_minorPattern, output, 1);
+    stats["major"] = _match(_majorPattern, output, 1);
+    stats["steps"] = _match(_stepPattern, output, 1);
+    stats["allocated"] = _match(_allocatedPattern, output, 1);
+    stats["freed"] = _match(_allocatedPattern, output, 2);
+    stats["peakHeap"] = _match(_allocatedPattern, output, 3);
+    var rss = _match(_rssPattern, output, 1);
+    if (stats["peakRss"] == null || rss > stats["peakRss"]) {
+      stats["peakRss"] = rss;
+    }
+  }
+
+  var sorted = times.toList()..sort();
+  return {
+    "wall": times,
+    "best": sorted.first,
+    "median": sorted[sorted.length ~/ 2],
+    "allocated": stats["allocated"],
+    "freed": stats["freed"],
+    "peakHeap": stats["peakHeap"],
+    "peakRss": stats["peakRss"],
+    "gc": {
+      "minor": stats["minor"],
+      "major": stats["major"],
+      "steps": stats["steps"],
+    },
+  };
+}
+
+int _match(RegExp pattern, String output, int group) {
+  var match = pattern.firstMatch(output);
+  if (match == null) return 0;
+  return int.parse(match[group]);
+}
+
+/// Prints a table of [results], comparing each against [baseline] if given.
+///
+/// Returns `false` if any benchmark regressed by more than [threshold]
+/// percent in best time or bytes allocated.
+bool _printResults(Map<String, Object> results, Map<String, Object> baseline,
+    double threshold) {
+  print("${'benchmark'.padRight(20)} ${'best'.padLeft(9)} "
+      "${'median'.padLeft(9)} ${'allocated'.padLeft(14)} "
+      "${'peak rss'.padLeft(10)} ${'gcs'.padLeft(7)}");
+
+  var regressions = 0;
+  results.forEach((name, value) {
+    var result = value as Map<String, Object>;
+    var gc = result["gc"] as Map<String, Object>;
+    var gcs = (gc["minor"] as int) + (gc["major"] as int) +
+        (gc["steps"] as int);
+
+    var line = "${name.padRight(20)} "
+        "${_seconds(result['best']).padLeft(9)} "
+        "${_seconds(result['median']).padLeft(9)} "
+        "${result['allocated'].toString().padLeft(14)} "
+        "${'${result['peakRss']} KB'.padLeft(10)} "
+        "${gcs.toString().padLeft(7)}";
+
+    var old = baseline == null ? null : baseline[name] as Map<String, Object>;
+    if (old != null) {
+      var time = _change(old["best"] as num, result["best"] as num);
+      var bytes = _change(old["allocated"] as num, result["allocated"] as num);
+      line += "  time ${_percent(time)}  bytes ${_percent(bytes)}";
+      if (time > threshold || bytes > threshold) {
+        line += "  ${term.red('REGRESSION')}";
+        regressions++;
+      } else if (time < -threshold) {
+        line += "  ${term.green('improved')}";
+      }
+    }
+
+    print(line);
+  });
+
+  if (baseline != null) {
+    if (regressions == 0) {
+      print("No regressions beyond ${threshold}%.");
+    } else {
+      print("${term.red(regressions)} benchmarks regressed "
+          "beyond ${threshold}%.");
+    }
+  }
+
+  return regressions == 0;
+}
+
+/// The percent change from [before] to [after].
+double _change(num before, num after) {
+  if (before == 0) return after == 0 ? 0.0 : 100.0;
+  return (after - before) * 100.0 / before;
+}
+
+String _seconds(Object value) => "${(value as num).toStringAsFixed(3)}s";
+
+String _percent(double value) {
+  var sign = value >= 0 ? "+" : "";
+  return "$sign${value.toStringAsFixed(1)}%".padLeft(7);
+}
@@ -456,13 +456,28 @@ void _defineTestSuites() {
   // No hardcoded limits in jlox.
   var noJavaLimits = {
     "test/limit/loop_too_large.lox": "skip",
-    "test/limit/no_reuse_constants.lox": "skip",
+    "test/limit/reuse_constants.lox": "skip",
     "test/limit/too_many_constants.lox": "skip",
+    "test/limit/too_many_globals.lox": "skip",
     "test/limit/too_many_locals.lox": "skip",
+    "test/limit/too_many_property_accesses.lox": "skip",
     "test/limit/too_many_upvalues.lox": "skip",
+    "test/limit/wide_constants.lox": "skip",
+    "test/limit/wide_locals.lox": "skip",
+    "test/limit/wide_upvalues.lox": "skip",
 
     // Rely on JVM for stack overflow checking.
     "test/limit/stack_overflow.lox": "skip",
+    "test/limit/tail_call.lox": "skip",
+
+    // Fibers are only in clox.
+    "test/fiber": "skip",
+
+    // Lists are only in clox.
+    "test/list": "skip",
+
+    // jlox formats numbers with Java's Double.toString().
+    "test/number/print_format.lox": "skip",
   };
 
   // No classes in Java yet.
@@ -534,16 +549,25 @@ void _defineTestSuites() {
   var noCFunctions = {
     "test/call": "skip",
     "test/closure": "skip",
+    "test/fiber": "skip",
     "test/for/closure_in_body.lox": "skip",
     "test/for/return_closure.lox": "skip",
     "test/for/return_inside.lox": "skip",
     "test/for/syntax.lox": "skip",
     "test/function": "skip",
-    "test/limit/no_reuse_constants.lox": "skip",
+    "test/limit/reuse_constants.lox": "skip",
     "test/limit/stack_overflow.lox": "skip",
+    "test/limit/tail_call.lox": "skip",
     "test/limit/too_many_constants.lox": "skip",
+    "test/limit/too_many_globals.lox": "skip",
     "test/limit/too_many_locals.lox": "skip",
+    "test/limit/too_many_property_accesses.lox": "skip",
     "test/limit/too_many_upvalues.lox": "skip",
+    "test/limit/wide_constants.lox": "skip",
+    "test/limit/wide_locals.lox": "skip",
+    "test/limit/wide_upvalues.lox": "skip",
+    "test/list": "skip",
+    "test/quickening": "skip",
     "test/regression/40.lox": "skip",
     "test/return": "skip",
     "test/unexpected_character.lox": "skip",
@@ -564,6 +588,7 @@ void _defineTestSuites() {
     "test/constructor": "skip",
     "test/field": "skip",
     "test/inheritance": "skip",
+    "test/limit/too_many_property_accesses.lox": "skip",
     "test/method": "skip",
     "test/number/decimal_point_at_eof.lox": "skip",
     "test/number/trailing_dot.lox": "skip",
@@ -571,6 +596,9 @@ void _defineTestSuites() {
     "test/operator/equals_method.lox": "skip",
     "test/operator/not.lox": "skip",
     "test/operator/not_class.lox": "skip",
+    "test/quickening/get_field.lox": "skip",
+    "test/quickening/get_field_non_instance.lox": "skip",
+    "test/quickening/invoke_method.lox": "skip",
     "test/regression/394.lox": "skip",
     "test/return/in_method.lox": "skip",
     "test/super": "skip",
@@ -762,6 +790,7 @@ void _defineTestSuites() {
     "test/for/return_closure.lox": "skip",
     "test/function/local_recursion.lox": "skip",
     "test/limit/too_many_upvalues.lox": "skip",
+    "test/limit/wide_upvalues.lox": "skip",
     "test/regression/40.lox": "skip",
     "test/while/closure_in_body.lox": "skip",
     "test/while/return_closure.lox": "skip",